@@ -0,0 +1,91 @@
+/**
+  Compares voxel::DescriptorIndex with a brute force search over the
+  same descriptors.  The descriptors are drawn around random cluster
+  centers, the way the descriptors of a building repeat, and are
+  non-negative like SHOT and SIFT descriptors.
+
+  usage: ./descriptorIndexBenchmark [--numFeatures=20000] [--dim=352]
+*/
+#include <DescriptorIndex.hpp>
+#include <scan_gflags.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+#include <set>
+
+DEFINE_int32(numFeatures, 20000, "Number of descriptors in the index");
+DEFINE_int32(numQueries, 500, "Number of queries");
+DEFINE_int32(dim, 352, "Number of dimensions of every descriptor");
+DEFINE_int32(k, 10, "Number of neighbors per query");
+DEFINE_int32(efConstruction, 100, "efConstruction of the index");
+
+static double seconds() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int main(int argc, char **argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  const int n = FLAGS_numFeatures, numQueries = FLAGS_numQueries,
+            dim = FLAGS_dim, k = FLAGS_k;
+
+  std::mt19937 gen(7);
+  std::normal_distribution<float> normal(0, 1);
+  std::vector<Eigen::VectorXf> centers(200, Eigen::VectorXf(dim));
+  for (auto &c : centers)
+    for (int i = 0; i < dim; ++i)
+      c[i] = std::max(0.0f, normal(gen));
+  auto sample = [&]() {
+    Eigen::VectorXf v = centers[gen() % centers.size()];
+    for (int i = 0; i < dim; ++i)
+      v[i] = std::max(0.0f, v[i] + 0.3f * normal(gen));
+    return v;
+  };
+
+  voxel::DescriptorArena<float> descriptors, queries;
+  for (int i = 0; i < n; ++i)
+    descriptors.add(sample(), Eigen::Vector3d::Zero());
+  for (int i = 0; i < numQueries; ++i)
+    queries.add(sample(), Eigen::Vector3d::Zero());
+
+  double start = seconds();
+  voxel::DescriptorIndex<float> index(16, FLAGS_efConstruction);
+  index.build(descriptors);
+  std::cout << n << " descriptors, built in " << seconds() - start << "s"
+            << std::endl;
+
+  // NB: Brute force is one matrix vector product per query
+  std::vector<std::set<int>> truth(numQueries);
+  const Eigen::VectorXf norms = descriptors.matrix().rowwise().squaredNorm();
+  std::vector<int> ids(n);
+  start = seconds();
+  for (int q = 0; q < numQueries; ++q) {
+    const Eigen::VectorXf d = norms - 2 * (descriptors.matrix() * queries[q]);
+    for (int i = 0; i < n; ++i)
+      ids[i] = i;
+    std::partial_sort(ids.begin(), ids.begin() + k, ids.end(),
+                      [&](int a, int b) { return d[a] < d[b]; });
+    truth[q].insert(ids.begin(), ids.begin() + k);
+  }
+  std::cout << "brute force: " << (seconds() - start) / numQueries * 1e3
+            << " ms/query" << std::endl;
+
+  for (int ef : {10, 20, 40, 80, 160}) {
+    Eigen::MatrixXi indices;
+    Eigen::MatrixXf distances;
+    start = seconds();
+    index.search(queries, k, ef, indices, distances);
+    const double elapsed = seconds() - start;
+
+    int found = 0;
+    for (int q = 0; q < numQueries; ++q)
+      for (int j = 0; j < k; ++j)
+        found += truth[q].count(indices(q, j));
+    std::cout << "ef " << ef << ": recall@" << k << " "
+              << static_cast<double>(found) / (numQueries * k) << ", "
+              << elapsed / numQueries * 1e3 << " ms/query" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,176 @@
+/**
+  Times the free space evidence of CloudAnalyzer2D, or of CloudAnalyzer3D
+  with threeD, for every number of threads up to maxThreads.  The scan is
+  synthetic: a scanner in a rectangular room with a pillar, sampled on a
+  grid of directions the way a PTX scan is.  The evidence has to be the
+  same for every number of threads, which is checked too.  The 3D
+  evidence is compared as the voxel grids saveVoxelGrids writes.
+
+  usage: ./freeSpaceBenchmark [--numColumns=2000] [--maxThreads=8]
+                              [--threeD]
+*/
+#include "scanDensity_3DInfo.h"
+#include "scanDensity_scanDensity.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <omp.h>
+
+DEFINE_int32(numColumns, 2000,
+             "Number of columns of the scan.  It has half as many rows");
+DEFINE_int32(maxThreads, 8, "Largest number of threads to time");
+DEFINE_int32(repeats, 3, "Number of times every run is timed");
+DEFINE_bool(threeD, false, "Times CloudAnalyzer3D instead of CloudAnalyzer2D");
+DEFINE_double(angle, 0.3,
+              "Angle in radians between the scan and the Manhattan frame");
+
+static double seconds() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/* Distance from the origin along unit direction d to the first of the
+ * walls of the room or the sides of the pillar, in the frame of the room */
+static double hitRange(const Eigen::Vector3d &d) {
+  const double roomMin[] = {-4, -3, -1.5}, roomMax[] = {6, 5, 1.5};
+  const double pillarMin[] = {2, 1, -1.5}, pillarMax[] = {2.5, 1.5, 1.5};
+
+  double range = std::numeric_limits<double>::max();
+  for (int a = 0; a < 3; ++a)
+    if (d[a] != 0)
+      range = std::min(range, (d[a] > 0 ? roomMax[a] : roomMin[a]) / d[a]);
+
+  double tIn = 0, tOut = std::numeric_limits<double>::max();
+  for (int a = 0; a < 3; ++a) {
+    if (d[a] == 0) {
+      if (pillarMin[a] > 0 || pillarMax[a] < 0)
+        return range;
+      continue;
+    }
+    const double t0 = pillarMin[a] / d[a], t1 = pillarMax[a] / d[a];
+    tIn = std::max(tIn, std::min(t0, t1));
+    tOut = std::min(tOut, std::max(t0, t1));
+  }
+  return tIn <= tOut ? std::min(range, tIn) : range;
+}
+
+/* Runs CloudAnalyzer2D, timing the free space evidence.  Returns whether
+ * the evidence is the same as that of the first run */
+static bool run2D(const DensityMapsManager::PointsPtr &points,
+                  const DensityMapsManager::MatPtr &R, double &elapsed) {
+  static std::vector<cv::Mat> reference;
+  auto doors = std::make_shared<std::vector<place::Door>>();
+  auto bBox = BoundingBox::Create(points, Eigen::Vector3f(9.0, 9.0, 6.0));
+  bBox->run();
+  CloudAnalyzer2D analyzer(points, R, bBox, doors, nullptr);
+  analyzer.initalize(FLAGS_scale);
+
+  const double start = seconds();
+  analyzer.examineFreeSpaceEvidence();
+  elapsed = seconds() - start;
+
+  const std::vector<cv::Mat> &evidence = analyzer.getFreeSpaceEvidence();
+  if (reference.empty())
+    for (auto &m : evidence)
+      reference.push_back(m.clone());
+  bool same = true;
+  for (int r = 0; r < NUM_ROTS; ++r)
+    for (int j = 0; j < evidence[r].rows; ++j)
+      same &= !std::memcmp(evidence[r].ptr<uchar>(j),
+                           reference[r].ptr<uchar>(j), evidence[r].cols);
+  return same;
+}
+
+/* Runs CloudAnalyzer3D, timing run, and saves its voxel grids into a
+ * temporary folder.  Returns whether the grids are the same as those of
+ * the first run */
+static bool run3D(const DensityMapsManager::PointsPtr &points,
+                  const DensityMapsManager::MatPtr &R, double &elapsed) {
+  static std::vector<std::string> reference;
+  auto bBox = BoundingBox::Create(points, Eigen::Vector3f(10.0, 10.0, 6.0));
+  bBox->run();
+  voxel::CloudAnalyzer3D analyzer(points, R, bBox, nullptr);
+
+  const double start = seconds();
+  analyzer.run(20.0, FLAGS_scale);
+  elapsed = seconds() - start;
+
+  const boost::filesystem::path folder =
+      boost::filesystem::temp_directory_path() /
+      boost::filesystem::unique_path();
+  boost::filesystem::create_directory(folder);
+  std::vector<std::string> pointNames, freeNames;
+  for (int r = 0; r < NUM_ROTS; ++r) {
+    pointNames.push_back((folder / ("point" + std::to_string(r))).string());
+    freeNames.push_back((folder / ("free" + std::to_string(r))).string());
+  }
+  analyzer.saveVoxelGrids(pointNames, freeNames,
+                          (folder / "metaData").string());
+
+  std::vector<std::string> contents;
+  for (auto &name : freeNames) {
+    std::ifstream in(name, std::ios::in | std::ios::binary);
+    contents.emplace_back(std::istreambuf_iterator<char>(in),
+                          std::istreambuf_iterator<char>());
+  }
+  boost::filesystem::remove_all(folder);
+  if (reference.empty())
+    reference = contents;
+  return contents == reference;
+}
+
+int main(int argc, char **argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  if (FLAGS_scale == -1)
+    FLAGS_scale = 73.5;
+
+  const Eigen::Matrix3d toRoom =
+      Eigen::AngleAxisd(FLAGS_angle, Eigen::Vector3d::UnitZ()).matrix();
+  const int numColumns = FLAGS_numColumns, numRows = numColumns / 2;
+  auto points = std::make_shared<std::vector<Eigen::Vector3f>>();
+  points->reserve(static_cast<size_t>(numColumns) * numRows);
+  for (int j = 0; j < numRows; ++j) {
+    const double phi = (j + 0.5) * maxPhi / numRows;
+    for (int i = 0; i < numColumns; ++i) {
+      const double theta = (2.0 * i / numColumns - 1) * PI;
+      const Eigen::Vector3d d(std::sin(phi) * std::cos(theta),
+                              std::sin(phi) * std::sin(theta), std::cos(phi));
+      points->push_back((d * hitRange(toRoom * d)).cast<float>());
+    }
+  }
+
+  auto R = std::make_shared<std::vector<Eigen::Matrix3d>>();
+  for (int r = 0; r < NUM_ROTS; ++r)
+    R->push_back(Eigen::AngleAxisd(FLAGS_angle + r * PI / 2,
+                                   Eigen::Vector3d::UnitZ())
+                     .matrix());
+  std::cout << points->size() << " points" << std::endl;
+
+  double oneThread = 0;
+  for (int t = 1; t <= FLAGS_maxThreads; ++t) {
+    omp_set_num_threads(t);
+    double best = std::numeric_limits<double>::max();
+    bool same = true;
+    for (int i = 0; i < FLAGS_repeats; ++i) {
+      double elapsed;
+      same &= FLAGS_threeD ? run3D(points, R, elapsed)
+                           : run2D(points, R, elapsed);
+      best = std::min(best, elapsed);
+    }
+    if (t == 1)
+      oneThread = best;
+
+    std::cout << t << " threads: " << best * 1e3 << " ms, speedup "
+              << oneThread / best << (same ? "" : ", DIFFERENT evidence")
+              << std::endl;
+    if (!same)
+      return 1;
+  }
+  std::cout << "(" << omp_get_num_procs() << " processors available)"
+            << std::endl;
+  return 0;
+}
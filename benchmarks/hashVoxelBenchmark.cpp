@@ -0,0 +1,153 @@
+/**
+  Compares voxel::HashVoxel with the grid it replaced, an unordered_map
+  of shared_ptr values.  The keys are voxels of the walls, floor and
+  ceiling of a room, the way findDoors fills its grid.  Both grids are
+  checked to hold the same voxels, values and bounds.
+
+  usage: ./hashVoxelBenchmark [--numPoints=2000000] [--numQueries=4000000]
+*/
+#include <HashVoxel.hpp>
+#include <scan_gflags.h>
+
+#include <chrono>
+#include <iostream>
+#include <omp.h>
+#include <random>
+#include <unordered_map>
+
+DEFINE_int32(numPoints, 2000000, "Number of points put in the grids");
+DEFINE_int32(numQueries, 4000000, "Number of random lookups");
+DEFINE_int32(roomSize, 800, "Size of the room in voxels");
+
+typedef Eigen::Vector3i Key;
+
+static double seconds() {
+  return std::chrono::duration<double>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int main(int argc, char **argv) {
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  const int half = FLAGS_roomSize / 2, floor = -half / 5, ceiling = half / 8;
+
+  std::mt19937 gen(7);
+  std::uniform_int_distribution<int> u(-half, half), h(floor, ceiling);
+  std::vector<std::pair<Key, double>> points;
+  points.reserve(FLAGS_numPoints);
+  for (int n = 0; n < FLAGS_numPoints; ++n) {
+    switch (n % 4) {
+    case 0:
+      points.emplace_back(Key(u(gen) / 100 * 100, u(gen), h(gen)), 1.0);
+      break;
+    case 1:
+      points.emplace_back(Key(u(gen), u(gen) / 100 * 100, h(gen)), 1.0);
+      break;
+    case 2:
+      points.emplace_back(Key(u(gen), u(gen), floor), 1.0);
+      break;
+    default:
+      points.emplace_back(Key(u(gen), u(gen), ceiling), 1.0);
+    }
+  }
+  std::vector<Key> queries;
+  queries.reserve(FLAGS_numQueries);
+  for (int n = 0; n < FLAGS_numQueries; ++n)
+    queries.emplace_back(u(gen), u(gen), h(gen));
+
+  double start = seconds();
+  std::unordered_map<Key, std::shared_ptr<double>> old;
+  for (auto &p : points) {
+    auto it = old.find(p.first);
+    if (it != old.end())
+      *it->second += p.second;
+    else
+      old.emplace(p.first, std::make_shared<double>(p.second));
+  }
+  const double oldInsert = seconds() - start;
+
+  start = seconds();
+  voxel::HashVoxel<Key, double> grid;
+  for (auto &p : points) {
+    auto v = grid(p.first);
+    if (v)
+      *v += p.second;
+    else
+      grid.insert(p.second, p.first);
+  }
+  const double insert = seconds() - start;
+
+  // NB: Bulk insert keeps the first value of every voxel, so it is timed
+  // but not compared
+  start = seconds();
+  voxel::HashVoxel<Key, double> bulk;
+  bulk.insert(points.begin(), points.end());
+  const double bulkInsert = seconds() - start;
+
+  double oldSum = 0, sum = 0, parallelSum = 0;
+  start = seconds();
+  for (auto &q : queries) {
+    auto it = old.find(q);
+    if (it != old.end())
+      oldSum += *it->second;
+  }
+  const double oldLookup = seconds() - start;
+
+  start = seconds();
+  for (auto &q : queries) {
+    auto v = grid.find(q);
+    if (v)
+      sum += *v;
+  }
+  const double lookup = seconds() - start;
+
+  std::vector<const double *> found(queries.size());
+  start = seconds();
+  grid.find(queries.data(), queries.size(), found.data());
+  for (auto v : found)
+    if (v)
+      parallelSum += *v;
+  const double parallelLookup = seconds() - start;
+
+  double oldIterSum = 0, iterSum = 0;
+  start = seconds();
+  for (auto &pair : old)
+    oldIterSum += *pair.second;
+  const double oldIterate = seconds() - start;
+
+  start = seconds();
+  grid.forEach([&](const Key &, double v) { iterSum += v; });
+  const double iterate = seconds() - start;
+
+  Key min = Key::Constant(1e8), max = Key::Constant(-1e8);
+  bool same = grid.size() == old.size() && bulk.size() == old.size() &&
+              oldSum == sum && sum == parallelSum && oldIterSum == iterSum;
+  for (auto &pair : old) {
+    auto v = grid.find(pair.first);
+    same = same && v && *v == *pair.second;
+    min = min.cwiseMin(pair.first);
+    max = max.cwiseMax(pair.first);
+  }
+  same = same && grid.getMin() == min && grid.getMax() == max;
+
+  uint64_t previous = 0;
+  bool ordered = true;
+  grid.forEach([&](const Key &key, double) {
+    const uint64_t code = voxel::morton::encode(key);
+    ordered = ordered && code >= previous;
+    previous = code;
+  });
+
+  std::cout << grid.size() << " voxels from " << points.size()
+            << " points, " << omp_get_max_threads() << " threads"
+            << std::endl;
+  std::cout << "insert:  old " << oldInsert << "s, new " << insert
+            << "s, bulk " << bulkInsert << "s" << std::endl;
+  std::cout << "lookup:  old " << oldLookup << "s, new " << lookup
+            << "s, parallel " << parallelLookup << "s" << std::endl;
+  std::cout << "iterate: old " << oldIterate << "s, new " << iterate
+            << "s (Morton order)" << std::endl;
+  std::cout << "grids agree: " << (same ? "yes" : "NO")
+            << ", Morton ordered: " << (ordered ? "yes" : "NO") << std::endl;
+  return same && ordered ? 0 : 1;
+}
@@ -0,0 +1,364 @@
+#include "ArtifactStore.hpp"
+#include "scan_gflags.h"
+#include "scan_typedefs.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+constexpr uint64_t scan::ArtifactStoreFooter::kMagic;
+constexpr uint32_t scan::ArtifactStoreFooter::kVersion;
+constexpr uint64_t scan::ArtifactStoreFooter::kAlignment;
+
+scan::ArtifactStore::ArtifactStore(const std::string &name)
+    : name{name}, snapshot{map(name)} {}
+
+scan::ArtifactStore::Ptr
+scan::ArtifactStore::forFolder(const std::string &folder) {
+  static std::mutex storesMutex;
+  static std::unordered_map<std::string, Ptr> stores;
+
+  const std::string storeName = nameForFolder(folder);
+  if (storeName.empty())
+    return nullptr;
+
+  std::lock_guard<std::mutex> lock(storesMutex);
+  auto it = stores.find(storeName);
+  if (it != stores.end())
+    return it->second;
+  // NB: Folders that haven't been packed aren't remembered so that a
+  // store made after the first lookup is still found
+  if (!fexists(storeName))
+    return nullptr;
+
+  Ptr store = std::make_shared<ArtifactStore>(storeName);
+  stores.emplace(storeName, store);
+  return store;
+}
+
+std::string scan::ArtifactStore::nameForFolder(const std::string &folder) {
+  const size_t end = folder.find_last_not_of('/');
+  if (end == std::string::npos)
+    return "";
+  return folder.substr(0, end + 1) + ".pack";
+}
+
+std::vector<std::string> scan::ArtifactStore::keys() const {
+  auto snap = current();
+  std::vector<std::string> out;
+  out.reserve(snap->entries.size());
+  for (auto &e : snap->entries)
+    out.push_back(e.first);
+  std::sort(out.begin(), out.end());
+  return out;
+}
+
+std::shared_ptr<const scan::MappedFile>
+scan::ArtifactStore::read(const std::string &key, const char *&data,
+                          size_t &size) const {
+  auto snap = current();
+  auto it = snap->entries.find(key);
+  if (it == snap->entries.end())
+    return nullptr;
+
+  const Entry &e = it->second;
+  data = snap->file->data() + e.offset;
+  size = e.size;
+  if (fnv1a(data, size) != e.checksum) {
+    std::cout << "[scan::ArtifactStore::read] Checksum mismatch for " << key
+              << " in: " << name << std::endl;
+    exit(1);
+  }
+  return snap->file;
+}
+
+bool scan::ArtifactStore::read(const std::string &key,
+                               std::vector<char> &out) const {
+  const char *data;
+  size_t size;
+  auto mapping = read(key, data, size);
+  if (!mapping)
+    return false;
+  out.assign(data, data + size);
+  return true;
+}
+
+void scan::ArtifactStore::add(const std::string &key, const char *data,
+                              size_t size) {
+  std::vector<char> copy(data, data + size);
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  pending.emplace_back(key, std::move(copy));
+}
+
+bool scan::ArtifactStore::addFile(const std::string &key,
+                                  const std::string &fileName) {
+  std::ifstream in(fileName, std::ios::in | std::ios::binary | std::ios::ate);
+  if (!in.is_open())
+    return false;
+
+  std::vector<char> data(in.tellg());
+  in.seekg(0);
+  in.read(data.data(), data.size());
+  if (!in)
+    return false;
+
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  pending.emplace_back(key, std::move(data));
+  return true;
+}
+
+void scan::ArtifactStore::flush() {
+  typedef ArtifactStoreFooter Footer;
+  static const char zeros[Footer::kAlignment] = {};
+
+  std::lock_guard<std::mutex> lock(pendingMutex);
+  if (pending.empty())
+    return;
+
+  // NB: Only flush changes the snapshot and flushes don't overlap, so the
+  // index can be copied without holding snapshotMutex while writing
+  std::unordered_map<std::string, Entry> entries = current()->entries;
+
+  std::fstream out(name, std::ios::in | std::ios::out | std::ios::binary);
+  if (!out.is_open())
+    out.open(name, std::ios::out | std::ios::binary);
+  if (!out.is_open()) {
+    std::cout << "[scan::ArtifactStore::flush] Could not open: " << name
+              << std::endl;
+    exit(1);
+  }
+  out.seekp(0, std::ios::end);
+  uint64_t offset = out.tellp();
+
+  for (auto &p : pending) {
+    const uint64_t start = Footer::align(offset);
+    out.write(zeros, start - offset);
+    out.write(p.second.data(), p.second.size());
+    entries[p.first] =
+        Entry{start, p.second.size(), fnv1a(p.second.data(), p.second.size())};
+    offset = start + p.second.size();
+  }
+
+  std::vector<std::string> sorted;
+  sorted.reserve(entries.size());
+  for (auto &e : entries)
+    sorted.push_back(e.first);
+  std::sort(sorted.begin(), sorted.end());
+
+  std::vector<char> index;
+  for (auto &key : sorted) {
+    const Entry &e = entries[key];
+    Footer::IndexEntry ie = {e.offset, e.size, e.checksum,
+                             static_cast<uint32_t>(key.size()), 0};
+    const char *iePtr = reinterpret_cast<const char *>(&ie);
+    index.insert(index.end(), iePtr, iePtr + sizeof(ie));
+    index.insert(index.end(), key.begin(), key.end());
+  }
+
+  Footer footer;
+  std::memset(&footer, 0, sizeof(footer));
+  footer.indexOffset = Footer::align(offset);
+  footer.indexSize = index.size();
+  footer.indexChecksum = fnv1a(index.data(), index.size());
+  footer.numEntries = entries.size();
+  footer.version = Footer::kVersion;
+  footer.magic = Footer::kMagic;
+
+  out.write(zeros, footer.indexOffset - offset);
+  out.write(index.data(), index.size());
+  out.write(reinterpret_cast<const char *>(&footer), sizeof(footer));
+  out.close();
+  if (!out) {
+    std::cout << "[scan::ArtifactStore::flush] Could not write: " << name
+              << std::endl;
+    exit(1);
+  }
+  pending.clear();
+
+  // NB: The old mapping is only unmapped once every reader that got a view
+  // of it has let go of it
+  SnapshotPtr next = map(name);
+  std::unique_lock<std::shared_timed_mutex> snapshotLock(snapshotMutex);
+  snapshot = std::move(next);
+}
+
+scan::ArtifactStore::SnapshotPtr
+scan::ArtifactStore::map(const std::string &name) {
+  typedef ArtifactStoreFooter Footer;
+  auto snap = std::make_shared<Snapshot>();
+  auto file = std::make_shared<MappedFile>();
+  snap->file = file;
+  if (!fexists(name) || !file->open(name))
+    return snap;
+
+  const char *base = file->data();
+  // NB: Keys aren't padded, so the footer is copied out rather than read
+  // in place
+  Footer footer;
+  const bool hasFooter = file->size() >= sizeof(Footer);
+  if (hasFooter)
+    std::memcpy(&footer, base + file->size() - sizeof(Footer), sizeof(Footer));
+  if (!hasFooter || footer.magic != Footer::kMagic ||
+      footer.version != Footer::kVersion ||
+      footer.indexOffset > file->size() - sizeof(Footer) ||
+      footer.indexSize > file->size() - sizeof(Footer) - footer.indexOffset ||
+      fnv1a(base + footer.indexOffset, footer.indexSize) !=
+          footer.indexChecksum) {
+    std::cout << "[scan::ArtifactStore::map] Not an artifact store or "
+                 "corrupt: "
+              << name << std::endl;
+    exit(1);
+  }
+
+  // NB: Every entry and key has to be inside the index, and every entry
+  // has to be before it, so that read never hashes memory outside of the
+  // mapping
+  const char *ptr = base + footer.indexOffset,
+             *indexEnd = ptr + footer.indexSize;
+  bool valid =
+      footer.numEntries <= footer.indexSize / sizeof(Footer::IndexEntry);
+  auto &entries = snap->entries;
+  if (valid)
+    entries.reserve(footer.numEntries);
+  for (uint64_t i = 0; valid && i < footer.numEntries; ++i) {
+    Footer::IndexEntry ie;
+    valid = static_cast<size_t>(indexEnd - ptr) >= sizeof(ie);
+    if (!valid)
+      break;
+    std::memcpy(&ie, ptr, sizeof(ie));
+    ptr += sizeof(ie);
+    valid = ie.keyLength <= static_cast<size_t>(indexEnd - ptr) &&
+            ie.offset <= footer.indexOffset &&
+            ie.size <= footer.indexOffset - ie.offset;
+    if (!valid)
+      break;
+    entries.emplace(std::string(ptr, ie.keyLength),
+                    Entry{ie.offset, ie.size, ie.checksum});
+    ptr += ie.keyLength;
+  }
+  if (!valid || ptr != indexEnd) {
+    std::cout << "[scan::ArtifactStore::map] Corrupt index: " << name
+              << std::endl;
+    exit(1);
+  }
+  return snap;
+}
+
+size_t scan::ArtifactStore::importFolder(const std::string &folder) {
+  size_t count = 0;
+  for (auto &file : folderToIterator(folder)) {
+    if (!boost::filesystem::is_regular_file(file.status()))
+      continue;
+    if (addFile(file.path().filename().string(), file.path().string()))
+      ++count;
+  }
+  flush();
+  return count;
+}
+
+size_t scan::ArtifactStore::exportFolder(const std::string &folder) const {
+  size_t count = 0;
+  for (auto &key : keys()) {
+    const char *data;
+    size_t size;
+    auto mapping = read(key, data, size);
+    if (!mapping)
+      continue;
+    std::ofstream out(folder + "/" + key,
+                      std::ios::out | std::ios::binary);
+    out.write(data, size);
+    if (out)
+      ++count;
+  }
+  return count;
+}
+
+std::streambuf::pos_type
+scan::MemoryBuffer::seekoff(off_type off, std::ios_base::seekdir dir,
+                            std::ios_base::openmode which) {
+  char *base = dir == std::ios_base::beg
+                   ? eback()
+                   : dir == std::ios_base::cur ? gptr() : egptr();
+  char *pos = base + off;
+  if (!(which & std::ios_base::in) || pos < eback() || pos > egptr())
+    return pos_type(off_type(-1));
+  setg(eback(), pos, egptr());
+  return pos_type(pos - eback());
+}
+
+std::streambuf::pos_type
+scan::MemoryBuffer::seekpos(pos_type pos, std::ios_base::openmode which) {
+  return seekoff(off_type(pos), std::ios_base::beg, which);
+}
+
+/* The store of the folder path is in, and the key of path in it */
+static scan::ArtifactStore::Ptr storeForPath(const std::string &path,
+                                             std::string &key) {
+  const size_t slash = path.rfind('/');
+  key = path.substr(slash + 1);
+  return scan::ArtifactStore::forFolder(
+      slash == std::string::npos ? "" : path.substr(0, slash + 1));
+}
+
+scan::ArtifactStream::ArtifactStream(const std::string &path)
+    : std::istream(nullptr) {
+  // NB: A loose file comes first, so that an artifact written again after
+  // its folder was packed is read as it was last written
+  if (fileBuffer.open(path, std::ios::in | std::ios::binary)) {
+    rdbuf(&fileBuffer);
+    return;
+  }
+
+  std::string key;
+  const char *data;
+  size_t size;
+  auto store = storeForPath(path, key);
+  if (store)
+    mapping = store->read(key, data, size);
+  if (mapping) {
+    memory.reset(new MemoryBuffer(data, size));
+    rdbuf(memory.get());
+  } else {
+    rdbuf(&fileBuffer);
+    setstate(std::ios::failbit);
+  }
+}
+
+bool scan::artifactExists(const std::string &path) {
+  if (fexists(path))
+    return true;
+  std::string key;
+  auto store = storeForPath(path, key);
+  return store && store->contains(key);
+}
+
+std::shared_ptr<const scan::MappedFile>
+scan::mapArtifact(const std::string &path, const char *&data, size_t &size) {
+  auto file = std::make_shared<MappedFile>();
+  if (file->open(path)) {
+    data = file->data();
+    size = file->size();
+    return file;
+  }
+
+  std::string key;
+  auto store = storeForPath(path, key);
+  return store ? store->read(key, data, size) : nullptr;
+}
+
+cv::Mat scan::readImage(const std::string &path, int flags) {
+  if (fexists(path))
+    return cv::imread(path, flags);
+
+  std::string key;
+  const char *data;
+  size_t size;
+  auto store = storeForPath(path, key);
+  auto mapping = store ? store->read(key, data, size) : nullptr;
+  if (!mapping)
+    return cv::Mat();
+  // NB: imdecode doesn't keep a reference to its input, so a view of the
+  // mapping is enough
+  return cv::imdecode(cv::Mat(1, size, CV_8UC1, const_cast<char *>(data)),
+                      flags);
+}
@@ -0,0 +1,189 @@
+#pragma once
+#ifndef ARTIFACT_STORE_HPP
+#define ARTIFACT_STORE_HPP
+
+#include <MappedFile.hpp>
+
+#include <opencv2/core.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <streambuf>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace scan {
+/**
+  On disk layout of an ArtifactStore.  Entries are appended one after
+  another, each starting on an alignment boundary, and are followed by
+  an index of every entry and a footer that points at the index.
+  Appending writes the new entries and a new index after the old one,
+  so a reader that mapped the file before keeps a consistent view of it.
+  Offsets are from the start of the file
+*/
+struct ArtifactStoreFooter {
+  /* "ARTPACK" */
+  static constexpr uint64_t kMagic = 0x004b434150545241ull;
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint64_t kAlignment = 64;
+
+  /* One per entry in the index, followed by keyLength bytes of key */
+  struct IndexEntry {
+    uint64_t offset, size, checksum;
+    uint32_t keyLength, padding;
+  };
+
+  uint64_t indexOffset, indexSize, indexChecksum, numEntries;
+  uint32_t version, padding;
+  uint64_t magic;
+
+  static uint64_t align(uint64_t offset) {
+    return (offset + kAlignment - 1) / kAlignment * kAlignment;
+  };
+};
+
+/**
+  All of the artifacts of one kind for a building, such as every
+  rotation file or every panorama image, in a single indexed file.
+  An entry is found by key, which is the name the artifact had as a
+  loose file, and checked against its checksum when it is read.
+
+  Reads are const and can be made from any number of threads, also
+  while another thread flushes.  Entries added with add are only
+  written, and visible to reads, after flush.  A flush maps the file
+  again and swaps the new mapping and index in at once, while every view
+  returned by read stays valid for as long as the mapping returned with
+  it is held
+*/
+class ArtifactStore {
+public:
+  typedef std::shared_ptr<ArtifactStore> Ptr;
+
+  struct Entry {
+    uint64_t offset, size, checksum;
+  };
+
+  /* Maps name if it exists, otherwise the store starts out empty and
+   * name is created by the first flush */
+  explicit ArtifactStore(const std::string &name);
+  ArtifactStore(const ArtifactStore &) = delete;
+  ArtifactStore &operator=(const ArtifactStore &) = delete;
+  ~ArtifactStore() { flush(); };
+
+  /* The store that holds the files of folder, shared by every caller.
+   * nullptr if folder hasn't been packed */
+  static Ptr forFolder(const std::string &folder);
+  /* Name of the store that holds the files of folder */
+  static std::string nameForFolder(const std::string &folder);
+
+  const std::string &getName() const { return name; };
+  size_t size() const { return current()->entries.size(); };
+  bool contains(const std::string &key) const {
+    auto snap = current();
+    return snap->entries.find(key) != snap->entries.end();
+  };
+  /* Every key, sorted the same way parseFolder sorts file names */
+  std::vector<std::string> keys() const;
+
+  /* Points data at the bytes of key in the mapping and returns the
+   * mapping, which keeps data valid for as long as it is held.  Exits if
+   * they don't match their checksum.  Returns nullptr if there is no such
+   * key */
+  std::shared_ptr<const MappedFile> read(const std::string &key,
+                                         const char *&data,
+                                         size_t &size) const;
+  bool read(const std::string &key, std::vector<char> &out) const;
+
+  /* Adds or replaces key.  Can be called from many threads at once */
+  void add(const std::string &key, const char *data, size_t size);
+  /* Adds the contents of fileName under key.  Returns false if it can't
+   * be read */
+  bool addFile(const std::string &key, const std::string &fileName);
+  /* Appends everything added since the last flush and a new index */
+  void flush();
+
+  /* Adds every file in folder under its file name.  Returns the number of
+   * files added */
+  size_t importFolder(const std::string &folder);
+  /* Writes every entry to folder as a loose file.  Returns the number of
+   * files written */
+  size_t exportFolder(const std::string &folder) const;
+
+private:
+  /* A mapping of the file and the index of the entries in it */
+  struct Snapshot {
+    std::shared_ptr<const MappedFile> file;
+    std::unordered_map<std::string, Entry> entries;
+  };
+  typedef std::shared_ptr<const Snapshot> SnapshotPtr;
+
+  std::string name;
+  mutable std::shared_timed_mutex snapshotMutex;
+  SnapshotPtr snapshot;
+  /* Also held for all of flush, so only one flush writes at a time */
+  std::mutex pendingMutex;
+  std::vector<std::pair<std::string, std::vector<char>>> pending;
+
+  SnapshotPtr current() const {
+    std::shared_lock<std::shared_timed_mutex> lock(snapshotMutex);
+    return snapshot;
+  };
+  static SnapshotPtr map(const std::string &name);
+};
+
+/* Read only std::streambuf over a block of memory */
+class MemoryBuffer : public std::streambuf {
+public:
+  MemoryBuffer(const char *data, size_t size) {
+    char *begin = const_cast<char *>(data);
+    setg(begin, begin, begin + size);
+  };
+
+protected:
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override;
+  pos_type seekpos(pos_type pos, std::ios_base::openmode which) override;
+};
+
+/**
+  Input stream over an artifact.  path is the name the artifact has as a
+  loose file.  The loose file is opened if there is one, otherwise the
+  artifact is read from the store of its folder
+*/
+class ArtifactStream : public std::istream {
+public:
+  explicit ArtifactStream(const std::string &path);
+
+  bool is_open() const { return memory || fileBuffer.is_open(); };
+  /* True if the artifact is being read from a store */
+  bool packed() const { return memory != nullptr; };
+
+private:
+  // NB: Declared before memory so that the mapping outlives the buffer
+  // over it
+  std::shared_ptr<const MappedFile> mapping;
+  std::unique_ptr<MemoryBuffer> memory;
+  std::filebuf fileBuffer;
+};
+
+/* True if path is a loose file or an entry of the store of its folder */
+bool artifactExists(const std::string &path);
+
+/* Points data at the bytes of the artifact path, from a mapping of the
+ * loose file if there is one, otherwise from the store of its folder.
+ * Returns the mapping, which keeps data valid for as long as it is held, or
+ * nullptr if there is no such artifact */
+std::shared_ptr<const MappedFile>
+mapArtifact(const std::string &path, const char *&data, size_t &size);
+
+/* cv::imread of the artifact path.  An image that is only in the store is
+ * decoded straight from it */
+cv::Mat readImage(const std::string &path, int flags);
+} // scan
+
+#endif // ARTIFACT_STORE_HPP
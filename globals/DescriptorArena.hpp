@@ -0,0 +1,250 @@
+#pragma once
+#ifndef DESCRIPTOR_ARENA_HPP
+#define DESCRIPTOR_ARENA_HPP
+
+#include <MappedFile.hpp>
+#include <eigen3/Eigen/Eigen>
+#include <eigen3/Eigen/Sparse>
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace voxel {
+/**
+  On disk layout of a DescriptorArena.  The descriptors are one row
+  major numFeatures by dim array and the positions a numFeatures by 3
+  array of doubles.  The header starts on an alignment boundary of the
+  file and each array on one after it, so that a memory mapping of the
+  file can be used as is.  Offsets are from the start of the header
+*/
+struct DescriptorArenaHeader {
+  /* "DESCARN" */
+  static constexpr uint64_t kMagic = 0x004e524143534544ull;
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint64_t kAlignment = 64;
+
+  uint64_t magic;
+  uint32_t version, scalarSize;
+  int32_t dim, padding;
+  uint64_t numFeatures, descriptorOffset, positionOffset, size;
+
+  static uint64_t align(uint64_t offset) {
+    return (offset + kAlignment - 1) / kAlignment * kAlignment;
+  };
+};
+
+/**
+  Contiguous store of the feature descriptors of a building.  Every
+  descriptor is a row of one numFeatures by dim array, and its position
+  is the same row of a numFeatures by 3 array, so all of the features
+  can be scanned front to back without chasing pointers.  T can be float
+  or a quantized type such as int8_t.
+
+  An arena loaded with mapFromFile reads the descriptors straight from
+  the memory mapped file.  The first call that modifies it copies them
+  into memory it owns.  Copies of an arena share the mapping
+*/
+template <typename T> class DescriptorArena {
+public:
+  typedef T Scalar;
+  typedef Eigen::Matrix<T, Eigen::Dynamic, 1> VecType;
+  typedef Eigen::Map<VecType> Descriptor;
+  typedef Eigen::Map<const VecType> ConstDescriptor;
+  typedef Eigen::Matrix<T, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
+      MatType;
+  typedef Eigen::Map<const MatType> ConstMatrix;
+  typedef Eigen::Matrix<double, Eigen::Dynamic, 3, Eigen::RowMajor>
+      PositionsType;
+  typedef Eigen::Map<const PositionsType> ConstPositions;
+
+  DescriptorArena(int dim = 0)
+      : _dim{dim}, numFeatures{0}, mappedDescriptors{nullptr},
+        mappedPositions{nullptr} {};
+
+  int dim() const { return _dim; };
+  size_t size() const { return numFeatures; };
+  bool empty() const { return numFeatures == 0; };
+
+  void reserve(size_t n) {
+    detach();
+    ownedDescriptors.reserve(n * _dim);
+    ownedPositions.reserve(3 * n);
+  };
+
+  /* Appends a descriptor and returns its index.  The first descriptor
+   * added to an empty arena sets dim */
+  template <typename Derived>
+  size_t add(const Eigen::MatrixBase<Derived> &descriptor,
+             const Eigen::Vector3d &position) {
+    T *dst = append(descriptor.size(), position);
+    for (int i = 0; i < _dim; ++i)
+      dst[i] = descriptor[i];
+    return numFeatures - 1;
+  };
+  template <typename S>
+  size_t add(const Eigen::SparseVector<S> &descriptor,
+             const Eigen::Vector3d &position) {
+    T *dst = append(descriptor.size(), position);
+    for (typename Eigen::SparseVector<S>::InnerIterator it(descriptor); it;
+         ++it)
+      dst[it.index()] = it.value();
+    return numFeatures - 1;
+  };
+
+  ConstDescriptor operator[](size_t i) const {
+    return ConstDescriptor(descriptors() + i * _dim, _dim);
+  };
+  Descriptor operator[](size_t i) {
+    detach();
+    return Descriptor(ownedDescriptors.data() + i * _dim, _dim);
+  };
+  Eigen::Map<const Eigen::Vector3d> position(size_t i) const {
+    return Eigen::Map<const Eigen::Vector3d>(positions() + 3 * i);
+  };
+
+  /* All of the descriptors, one per row */
+  ConstMatrix matrix() const {
+    return ConstMatrix(descriptors(), numFeatures, _dim);
+  };
+  /* All of the positions, one per row */
+  ConstPositions allPositions() const {
+    return ConstPositions(positions(), numFeatures, 3);
+  };
+
+  const T *descriptors() const {
+    return file ? mappedDescriptors : ownedDescriptors.data();
+  };
+  const double *positions() const {
+    return file ? mappedPositions : ownedPositions.data();
+  };
+
+  void clear() {
+    file.reset();
+    ownedDescriptors.clear();
+    ownedPositions.clear();
+    numFeatures = 0;
+  };
+
+  /* Writes the header and both arrays, padding the stream up to the next
+   * alignment boundary first */
+  void writeToFile(std::ofstream &out) const {
+    const uint64_t start = out.tellp();
+    pad(out, DescriptorArenaHeader::align(start) - start);
+
+    DescriptorArenaHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.magic = DescriptorArenaHeader::kMagic;
+    header.version = DescriptorArenaHeader::kVersion;
+    header.scalarSize = sizeof(T);
+    header.dim = _dim;
+    header.numFeatures = numFeatures;
+    header.descriptorOffset = DescriptorArenaHeader::align(sizeof(header));
+    header.positionOffset = DescriptorArenaHeader::align(
+        header.descriptorOffset + numFeatures * _dim * sizeof(T));
+    header.size = header.positionOffset + numFeatures * 3 * sizeof(double);
+
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    pad(out, header.descriptorOffset - sizeof(header));
+    out.write(reinterpret_cast<const char *>(descriptors()),
+              numFeatures * _dim * sizeof(T));
+    pad(out, header.positionOffset - header.descriptorOffset -
+                 numFeatures * _dim * sizeof(T));
+    out.write(reinterpret_cast<const char *>(positions()),
+              numFeatures * 3 * sizeof(double));
+  };
+
+  /* Maps the arena written at offset in name, or at the next alignment
+   * boundary after it.  Exits if there isn't one there */
+  void mapFromFile(const std::string &name, uint64_t offset = 0) {
+    auto mapping = std::make_shared<scan::MappedFile>();
+    if (!mapping->open(name)) {
+      std::cout << "[voxel::DescriptorArena::mapFromFile] Could not open: "
+                << name << std::endl;
+      exit(1);
+    }
+
+    offset = DescriptorArenaHeader::align(offset);
+    const DescriptorArenaHeader *header = nullptr;
+    if (offset + sizeof(DescriptorArenaHeader) <= mapping->size())
+      header = reinterpret_cast<const DescriptorArenaHeader *>(
+          mapping->data() + offset);
+    check(header, mapping->size() - offset, name);
+
+    mapping->adviseSequential();
+    file = mapping;
+    _dim = header->dim;
+    numFeatures = header->numFeatures;
+    mappedDescriptors = reinterpret_cast<const T *>(
+        mapping->data() + offset + header->descriptorOffset);
+    mappedPositions = reinterpret_cast<const double *>(
+        mapping->data() + offset + header->positionOffset);
+    ownedDescriptors.clear();
+    ownedPositions.clear();
+  };
+
+private:
+  int _dim;
+  size_t numFeatures;
+  std::vector<T> ownedDescriptors;
+  std::vector<double> ownedPositions;
+  std::shared_ptr<const scan::MappedFile> file;
+  const T *mappedDescriptors;
+  const double *mappedPositions;
+
+  /* Copies a mapped arena into owned memory so it can be modified */
+  void detach() {
+    if (!file)
+      return;
+    ownedDescriptors.assign(mappedDescriptors,
+                            mappedDescriptors + numFeatures * _dim);
+    ownedPositions.assign(mappedPositions, mappedPositions + 3 * numFeatures);
+    file.reset();
+  };
+
+  T *append(int dim, const Eigen::Vector3d &position) {
+    detach();
+    if (numFeatures == 0)
+      _dim = dim;
+    if (dim != _dim) {
+      std::cout << "[voxel::DescriptorArena::add] Descriptor has " << dim
+                << " dimensions instead of " << _dim << std::endl;
+      exit(1);
+    }
+
+    ownedDescriptors.resize(ownedDescriptors.size() + _dim, T(0));
+    ownedPositions.insert(ownedPositions.end(), position.data(),
+                          position.data() + 3);
+    ++numFeatures;
+    return ownedDescriptors.data() + (numFeatures - 1) * _dim;
+  };
+
+  static void pad(std::ofstream &out, uint64_t n) {
+    static const char zeros[DescriptorArenaHeader::kAlignment] = {};
+    out.write(zeros, n);
+  };
+
+  static void check(const DescriptorArenaHeader *header, uint64_t available,
+                    const std::string &name) {
+    if (!header || header->magic != DescriptorArenaHeader::kMagic ||
+        header->version != DescriptorArenaHeader::kVersion) {
+      std::cout << "[voxel::DescriptorArena::mapFromFile] No descriptor "
+                   "arena in: "
+                << name << std::endl;
+      exit(1);
+    }
+    if (header->scalarSize != sizeof(T) || header->size > available) {
+      std::cout << "[voxel::DescriptorArena::mapFromFile] Descriptor arena "
+                   "is the wrong type or truncated in: "
+                << name << std::endl;
+      exit(1);
+    }
+  };
+};
+} // voxel
+
+#endif // DESCRIPTOR_ARENA_HPP
@@ -0,0 +1,444 @@
+#pragma once
+#ifndef DESCRIPTOR_INDEX_HPP
+#define DESCRIPTOR_INDEX_HPP
+
+#include <DescriptorArena.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <queue>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <omp.h>
+
+namespace voxel {
+/* On disk layout of a DescriptorIndex.  The header is followed by the
+ * level of every descriptor, the links of layer 0 and then the links of
+ * the upper layers of every descriptor with a level above 0 */
+struct DescriptorIndexHeader {
+  /* "DESCIDX" */
+  static constexpr uint64_t kMagic = 0x0058444943534544ull;
+  static constexpr uint32_t kVersion = 1;
+
+  uint64_t magic;
+  uint32_t version;
+  int32_t size, dim, M, maxM0, efConstruction, entryPoint, maxLevel;
+};
+
+/**
+  Approximate nearest neighbor index over the descriptors of a
+  DescriptorArena, by squared euclidean distance.  The index is a
+  hierarchical navigable small world graph (HNSW): every descriptor is a
+  node of layer 0 and of a random number of sparser layers above it.  A
+  query greedily walks down the layers from a fixed entry point and then
+  does a best first search of layer 0 that keeps the ef closest nodes
+  seen, so a query visits O(log n) nodes instead of all n of them.
+  Larger ef gives better recall for slower queries.
+
+  The index only stores the graph.  It keeps a pointer to the arena it
+  was built over, which must outlive it and must not change.  The graph
+  is built on one thread, in order, so it is the same from run to run.
+  Searches are const and can be made from many threads at once
+*/
+template <typename T> class DescriptorIndex {
+public:
+  typedef DescriptorArena<T> ArenaType;
+  /* Squared distance and index in the arena of a descriptor */
+  typedef std::pair<float, int> Neighbor;
+
+  /* M is the number of links per node in the upper layers, layer 0 has
+   * twice as many */
+  DescriptorIndex(int M = 16, int efConstruction = 100, unsigned seed = 0)
+      : M{M}, maxM0{2 * M}, efConstruction{efConstruction}, seed{seed},
+        descriptors{nullptr}, entryPoint{-1}, maxLevel{-1} {};
+
+  void build(const ArenaType &descriptors) {
+    this->descriptors = &descriptors;
+    const int n = size();
+    links0.assign(static_cast<size_t>(n) * (maxM0 + 1), 0);
+    upper.assign(n, std::vector<int>());
+    levels.resize(n);
+    entryPoint = maxLevel = -1;
+
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    const double levelMult = 1.0 / std::log(M);
+    for (int i = 0; i < n; ++i) {
+      levels[i] = -std::log(1.0 - uniform(gen)) * levelMult;
+      upper[i].assign(levels[i] * (M + 1), 0);
+    }
+
+    Visited visited(n);
+    for (int i = 0; i < n; ++i)
+      insert(i, visited);
+  };
+
+  int size() const { return descriptors ? descriptors->size() : 0; };
+
+  /* The k approximate nearest neighbors of query, closest first */
+  std::vector<Neighbor> search(const T *query, int k, int ef = 64) const {
+    Visited visited(size());
+    return search(query, k, ef, visited);
+  };
+  template <typename Derived>
+  std::vector<Neighbor> search(const Eigen::MatrixBase<Derived> &query, int k,
+                               int ef = 64) const {
+    const typename ArenaType::VecType q = query.template cast<T>();
+    return search(q.data(), k, ef);
+  };
+
+  /* Searches for every descriptor of queries in parallel.  Row i of
+   * indices and distances holds the neighbors of query i, closest first,
+   * padded with -1 and infinity if the index has fewer than k */
+  void search(const ArenaType &queries, int k, int ef,
+              Eigen::MatrixXi &indices, Eigen::MatrixXf &distances) const {
+    const int numQueries = queries.size();
+    indices.setConstant(numQueries, k, -1);
+    distances.setConstant(numQueries, k,
+                          std::numeric_limits<float>::infinity());
+
+#pragma omp parallel
+    {
+      Visited visited(size());
+#pragma omp for schedule(dynamic, 16)
+      for (int i = 0; i < numQueries; ++i) {
+        auto found = search(queries.descriptors() + i * queries.dim(), k, ef,
+                            visited);
+        for (size_t j = 0; j < found.size(); ++j) {
+          distances(i, j) = found[j].first;
+          indices(i, j) = found[j].second;
+        }
+      }
+    }
+  };
+
+  void writeToFile(const std::string &name) const {
+    std::ofstream out(name, std::ios::out | std::ios::binary);
+    writeToFile(out);
+  };
+  /* Writes the graph at the current position of out, so the arena can be
+   * written after it into the same file */
+  void writeToFile(std::ofstream &out) const {
+    DescriptorIndexHeader header;
+    header.magic = DescriptorIndexHeader::kMagic;
+    header.version = DescriptorIndexHeader::kVersion;
+    header.size = size();
+    header.dim = descriptors ? descriptors->dim() : 0;
+    header.M = M;
+    header.maxM0 = maxM0;
+    header.efConstruction = efConstruction;
+    header.entryPoint = entryPoint;
+    header.maxLevel = maxLevel;
+
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char *>(levels.data()),
+              levels.size() * sizeof(int));
+    out.write(reinterpret_cast<const char *>(links0.data()),
+              links0.size() * sizeof(int));
+    for (auto &u : upper)
+      out.write(reinterpret_cast<const char *>(u.data()),
+                u.size() * sizeof(int));
+  };
+
+  /* Loads an index built over descriptors.  Exits if the file isn't an
+   * index or was built over a different number of descriptors */
+  void loadFromFile(const std::string &name, const ArenaType &descriptors) {
+    std::ifstream in(name, std::ios::in | std::ios::binary);
+    loadFromFile(in, name, descriptors);
+  };
+  /* Reads the graph at the current position of in, which is left just
+   * past it.  name is only used in messages */
+  void loadFromFile(std::ifstream &in, const std::string &name,
+                    const ArenaType &descriptors) {
+    DescriptorIndexHeader header;
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    if (!in || header.magic != DescriptorIndexHeader::kMagic ||
+        header.version != DescriptorIndexHeader::kVersion) {
+      std::cout << "[voxel::DescriptorIndex::loadFromFile] Not a descriptor "
+                   "index: "
+                << name << std::endl;
+      exit(1);
+    }
+    if (header.size < 0 ||
+        static_cast<size_t>(header.size) != descriptors.size() ||
+        header.dim != descriptors.dim()) {
+      std::cout << "[voxel::DescriptorIndex::loadFromFile] " << name
+                << " was built over other descriptors" << std::endl;
+      exit(1);
+    }
+
+    // NB: Everything in the graph is used as an index or a size, so a
+    // corrupt value has to be caught here rather than by a search
+    auto corrupt = [&name]() {
+      std::cout << "[voxel::DescriptorIndex::loadFromFile] Corrupt "
+                   "descriptor index: "
+                << name << std::endl;
+      exit(1);
+    };
+    const std::streampos start = in.tellg();
+    in.seekg(0, std::ios::end);
+    const uint64_t words = (in.tellg() - start) / sizeof(int);
+    in.seekg(start);
+    const uint64_t n = header.size;
+    if (header.M < 1 || header.maxM0 < 1 || header.efConstruction < 1 ||
+        n + n * (header.maxM0 + 1ull) > words)
+      corrupt();
+    if (n ? header.entryPoint < 0 || header.entryPoint >= header.size ||
+                header.maxLevel < 0
+          : header.entryPoint != -1 || header.maxLevel != -1)
+      corrupt();
+
+    this->descriptors = &descriptors;
+    M = header.M;
+    maxM0 = header.maxM0;
+    efConstruction = header.efConstruction;
+    entryPoint = header.entryPoint;
+    maxLevel = header.maxLevel;
+
+    levels.resize(n);
+    links0.resize(n * (maxM0 + 1));
+    in.read(reinterpret_cast<char *>(levels.data()),
+            levels.size() * sizeof(int));
+    in.read(reinterpret_cast<char *>(links0.data()),
+            links0.size() * sizeof(int));
+    if (!in || (n && levels[entryPoint] != maxLevel))
+      corrupt();
+    uint64_t upperSize = 0;
+    for (size_t i = 0; i < n; ++i) {
+      if (levels[i] < 0 || levels[i] > maxLevel)
+        corrupt();
+      upperSize += static_cast<uint64_t>(levels[i]) * (M + 1);
+      if (n + links0.size() + upperSize > words)
+        corrupt();
+    }
+
+    upper.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+      upper[i].resize(levels[i] * (M + 1));
+      in.read(reinterpret_cast<char *>(upper[i].data()),
+              upper[i].size() * sizeof(int));
+    }
+    if (!in)
+      corrupt();
+
+    // NB: A link to a node on a layer below the one it is on would read
+    // past the links that node has
+    for (size_t i = 0; i < n; ++i) {
+      for (int level = 0; level <= levels[i]; ++level) {
+        const int *l = links(i, level);
+        if (l[0] < 0 || l[0] > (level ? M : maxM0))
+          corrupt();
+        for (int j = 1; j <= l[0]; ++j)
+          if (l[j] < 0 || l[j] >= header.size || levels[l[j]] < level)
+            corrupt();
+      }
+    }
+  };
+
+private:
+  /* Nodes seen by one search.  Marks are only reset when the tag wraps */
+  struct Visited {
+    std::vector<uint32_t> marks;
+    uint32_t tag;
+
+    Visited(int n) : marks(n, 0), tag{0} {};
+    void next() {
+      if (++tag == 0) {
+        std::fill(marks.begin(), marks.end(), 0);
+        tag = 1;
+      }
+    };
+    /* Marks i and returns whether it already was */
+    bool testAndSet(int i) {
+      if (marks[i] == tag)
+        return true;
+      marks[i] = tag;
+      return false;
+    };
+  };
+
+  typedef std::priority_queue<Neighbor, std::vector<Neighbor>,
+                              std::greater<Neighbor>>
+      MinQueue;
+  typedef std::priority_queue<Neighbor> MaxQueue;
+
+  int M, maxM0, efConstruction;
+  unsigned seed;
+  const ArenaType *descriptors;
+  int entryPoint, maxLevel;
+  std::vector<int> levels;
+  /* Links of every node, as a count followed by the indices */
+  std::vector<int> links0;
+  std::vector<std::vector<int>> upper;
+
+  const T *descriptor(int i) const {
+    return descriptors->descriptors() + static_cast<size_t>(i) * dim();
+  };
+  int dim() const { return descriptors->dim(); };
+
+  float distance(const T *a, const T *b) const {
+    typedef Eigen::Map<const typename ArenaType::VecType> Map;
+    return (Map(a, dim()).template cast<float>() -
+            Map(b, dim()).template cast<float>())
+        .squaredNorm();
+  };
+
+  int *links(int i, int level) {
+    return level ? &upper[i][(level - 1) * (M + 1)]
+                 : &links0[static_cast<size_t>(i) * (maxM0 + 1)];
+  };
+  const int *links(int i, int level) const {
+    return const_cast<DescriptorIndex *>(this)->links(i, level);
+  };
+
+  std::vector<Neighbor> search(const T *query, int k, int ef,
+                               Visited &visited) const {
+    if (entryPoint < 0)
+      return std::vector<Neighbor>();
+
+    std::vector<Neighbor> entries{
+        Neighbor(distance(query, descriptor(entryPoint)), entryPoint)};
+    for (int level = maxLevel; level > 0; --level)
+      entries = searchLayer(query, entries, 1, level, visited);
+    auto found = searchLayer(query, entries, std::max(ef, k), 0, visited);
+    if (found.size() > static_cast<size_t>(k))
+      found.resize(k);
+    return found;
+  };
+
+  /* Best first search of one layer from entries.  Returns the ef closest
+   * nodes found, closest first */
+  std::vector<Neighbor> searchLayer(const T *query,
+                                    const std::vector<Neighbor> &entries,
+                                    int ef, int level,
+                                    Visited &visited) const {
+    const size_t maxResults = ef;
+    visited.next();
+    MinQueue candidates;
+    MaxQueue results;
+    for (auto &e : entries) {
+      visited.testAndSet(e.second);
+      candidates.push(e);
+      results.push(e);
+      if (results.size() > maxResults)
+        results.pop();
+    }
+
+    while (!candidates.empty()) {
+      const Neighbor current = candidates.top();
+      if (results.size() >= maxResults && current.first > results.top().first)
+        break;
+      candidates.pop();
+
+      const int *l = links(current.second, level);
+      for (int j = 1; j <= l[0]; ++j)
+        __builtin_prefetch(descriptor(l[j]));
+      for (int j = 1; j <= l[0]; ++j) {
+        const int id = l[j];
+        if (visited.testAndSet(id))
+          continue;
+        const float d = distance(query, descriptor(id));
+        if (results.size() < maxResults || d < results.top().first) {
+          candidates.emplace(d, id);
+          results.emplace(d, id);
+          if (results.size() > maxResults)
+            results.pop();
+        }
+      }
+    }
+
+    std::vector<Neighbor> found(results.size());
+    for (size_t i = found.size(); i-- > 0;) {
+      found[i] = results.top();
+      results.pop();
+    }
+    return found;
+  };
+
+  /* The HNSW neighbor heuristic.  A candidate is only kept if it is
+   * closer to the node than to every candidate kept so far, which keeps
+   * links pointing in different directions.  candidates must be sorted
+   * closest first */
+  std::vector<Neighbor> selectNeighbors(const std::vector<Neighbor> &candidates,
+                                        int maxLinks) const {
+    std::vector<Neighbor> selected;
+    for (auto &c : candidates) {
+      if (selected.size() >= static_cast<size_t>(maxLinks))
+        break;
+      bool keep = true;
+      for (auto &s : selected) {
+        if (distance(descriptor(c.second), descriptor(s.second)) < c.first) {
+          keep = false;
+          break;
+        }
+      }
+      if (keep)
+        selected.push_back(c);
+    }
+    return selected;
+  };
+
+  void setLinks(int i, int level, const std::vector<Neighbor> &neighbors) {
+    int *l = links(i, level);
+    l[0] = neighbors.size();
+    for (size_t j = 0; j < neighbors.size(); ++j)
+      l[j + 1] = neighbors[j].second;
+  };
+
+  /* Links node to i, pruning the links of node if it has too many */
+  void addLink(int node, int i, float d, int level) {
+    const int maxLinks = level ? M : maxM0;
+    int *l = links(node, level);
+    if (l[0] < maxLinks) {
+      l[++l[0]] = i;
+      return;
+    }
+
+    std::vector<Neighbor> candidates{Neighbor(d, i)};
+    for (int j = 1; j <= l[0]; ++j)
+      candidates.emplace_back(distance(descriptor(node), descriptor(l[j])),
+                              l[j]);
+    std::sort(candidates.begin(), candidates.end());
+    setLinks(node, level, selectNeighbors(candidates, maxLinks));
+  };
+
+  void insert(int i, Visited &visited) {
+    const T *query = descriptor(i);
+    const int level = levels[i];
+    if (entryPoint < 0) {
+      entryPoint = i;
+      maxLevel = level;
+      return;
+    }
+
+    std::vector<Neighbor> entries{
+        Neighbor(distance(query, descriptor(entryPoint)), entryPoint)};
+    for (int l = maxLevel; l > level; --l)
+      entries = searchLayer(query, entries, 1, l, visited);
+
+    for (int l = std::min(level, maxLevel); l >= 0; --l) {
+      auto found = searchLayer(query, entries, efConstruction, l, visited);
+      auto selected = selectNeighbors(found, M);
+      setLinks(i, l, selected);
+      for (auto &s : selected)
+        addLink(s.second, i, s.first, l);
+      entries = std::move(found);
+    }
+
+    if (level > maxLevel) {
+      entryPoint = i;
+      maxLevel = level;
+    }
+  };
+};
+} // voxel
+
+#endif // DESCRIPTOR_INDEX_HPP
@@ -2,59 +2,98 @@
 #ifndef DIRECT_VOXEL_HPP
 #define DIRECT_VOXEL_HPP
 
+#include <cstdint>
 #include <eigen3/Eigen/Eigen>
 #include <memory>
 #include <scan_typedefs.hpp>
 #include <vector>
 
 namespace voxel {
-template <typename V> class DirectVoxel {
+/* Which axis of a DirectVoxel is contiguous in memory.  XFastest keeps
+ * every z slice contiguous, ZFastest keeps every z column contiguous */
+enum class AxisOrder { XFastest, ZFastest };
+
+/* Bounds and indexing shared by every DirectVoxel */
+template <AxisOrder Order> class DirectVoxelBase {
 public:
   typedef Eigen::Vector3i K;
-  typedef std::shared_ptr<DirectVoxel<V>> Ptr;
-  typedef const std::shared_ptr<DirectVoxel<V>> ConstPtr;
-  typedef Eigen::Matrix<V, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Mat;
-  typedef std::vector<Mat> Mem;
 
-  DirectVoxel(K &min, K &max)
+  DirectVoxelBase(const K &min, const K &max)
       : _min{min}, _max{max}, x{max[0] - min[0]}, y{max[1] - min[1]},
-        z{max[2] - min[2]}, mem{static_cast<size_t>(z), Mat::Zero(y, x)} {
+        z{max[2] - min[2]} {
     assert(x >= 0 && y >= 0 && z >= 0);
+    if (Order == AxisOrder::XFastest) {
+      strideX = 1;
+      strideY = x;
+      strideZ = x * y;
+    } else {
+      strideZ = 1;
+      strideX = z;
+      strideY = z * x;
+    }
   };
 
-  DirectVoxel(K &&min, K &&max)
-      : _min{min}, _max{max}, x{max[0] - min[0]}, y{max[1] - min[1]},
-        z{max[2] - min[2]}, mem{static_cast<size_t>(z), Mat::Zero(y, x)} {
-    assert(x >= 0 && y >= 0 && z >= 0);
-  };
+  inline K &max() { return _max; };
+  inline K &min() { return _min; };
+  inline const K &max() const { return _max; };
+  inline const K &min() const { return _min; };
 
-  DirectVoxel(K &min, K &&max)
-      : _min{min}, _max{max}, x{max[0] - min[0]}, y{max[1] - min[1]},
-        z{max[2] - min[2]}, mem{static_cast<size_t>(z), Mat::Zero(y, x)} {
-    assert(x >= 0 && y >= 0 && z >= 0);
+  /* Number of voxels */
+  size_t size() const { return static_cast<size_t>(x) * y * z; };
+
+  /* Offset of key in memory, in voxels */
+  size_t index(const K &key) const {
+    assert(checkBounds(key) && "Not in bounds!");
+    return (key[0] - _min[0]) * strideX + (key[1] - _min[1]) * strideY +
+           (key[2] - _min[2]) * strideZ;
   };
 
-  DirectVoxel(K &&min, K &max)
-      : _min{min}, _max{max}, x{max[0] - min[0]}, y{max[1] - min[1]},
-        z{max[2] - min[2]}, mem{static_cast<size_t>(z), Mat::Zero(y, x)} {
-    assert(x >= 0 && y >= 0 && z >= 0);
+  bool checkBounds(const K &key) const {
+    auto minPtr = _min.data();
+    auto maxPtr = _max.data();
+    auto keyPtr = key.data();
+    for (int i = 0; i < key.size(); ++i)
+      if (*(keyPtr + i) < *(minPtr + i) || *(keyPtr + i) >= *(maxPtr + i))
+        return false;
+
+    return true;
   };
 
+protected:
+  K _min, _max;
+  long x, y, z;
+  long strideX, strideY, strideZ;
+};
+
+/**
+  Dense voxel grid in one contiguous allocation.  The memory layout is
+  chosen by Order: XFastest for work on z slices, ZFastest for work
+  along z columns, such as collapsing the grid to a floor plan
+*/
+template <typename V, AxisOrder Order = AxisOrder::XFastest>
+class DirectVoxel : public DirectVoxelBase<Order> {
+  typedef DirectVoxelBase<Order> Base;
+
+public:
+  typedef Eigen::Vector3i K;
+  typedef std::shared_ptr<DirectVoxel<V, Order>> Ptr;
+  typedef const std::shared_ptr<DirectVoxel<V, Order>> ConstPtr;
+
+  DirectVoxel(const K &min, const K &max)
+      : Base(min, max), mem(Base::size()){};
   DirectVoxel(int x, int y, int z) : DirectVoxel(K::Zero(), K(x, y, z)){};
 
   template <typename... Targs> static inline Ptr Create(Targs &... args) {
-    return std::make_shared<DirectVoxel<V>>(std::forward<Targs>(args)...);
+    return std::make_shared<DirectVoxel<V, Order>>(
+        std::forward<Targs>(args)...);
   };
   template <typename... Targs> static inline Ptr Create(Targs &&... args) {
-    return std::make_shared<DirectVoxel<V>>(std::forward<Targs>(args)...);
+    return std::make_shared<DirectVoxel<V, Order>>(
+        std::forward<Targs>(args)...);
   };
 
-  V &operator()(const K &key) {
-    K index = key - min();
-    assert(checkBounds(key) && "Not in bounds!");
-
-    return mem[index[2]](index[1], index[0]);
-  }
+  V &operator()(const K &key) { return mem[Base::index(key)]; }
+  const V &operator()(const K &key) const { return mem[Base::index(key)]; }
 
   V &operator()(int x, int y, int z) {
     K key(x, y, z);
@@ -63,37 +102,125 @@ public:
   V &at(int x, int y, int z) { return operator()(x, y, z); };
   V &at(const K &key) { return operator()(key); };
 
-  inline K &max() { return _max; };
-  inline K &min() { return _min; };
+  /* The voxels in memory order */
+  V *data() { return mem.data(); };
+  const V *data() const { return mem.data(); };
 
   template <typename PairFunc>
   void update(const DirectVoxel &o, PairFunc updateRule) {
-    assert(min() == o.min() && max() == o.max() && "Grids not the same size!");
-    for (int k = 0; k < z; ++k)
-      for (int j = 0; j < y; ++j)
-        for (int i = 0; i < y; ++i)
-          mem[k](j, i) = updateRule(mem[k](j, i), o.mem[k](j, i));
+    assert(Base::min() == o.min() && Base::max() == o.max() &&
+           "Grids not the same size!");
+    for (size_t i = 0; i < mem.size(); ++i)
+      mem[i] = updateRule(mem[i], o.mem[i]);
   }
 
   void operator+=(const DirectVoxel &o) {
-    update(o, [](V &v1, V &v2) { return v1 + v2; });
+    update(o, [](const V &v1, const V &v2) { return v1 + v2; });
   }
 
-  bool checkBounds(const K &key) {
-    auto minPtr = min().data();
-    auto maxPtr = max().data();
-    auto keyPtr = key.data();
-    for (int i = 0; i < key.size(); ++i)
-      if (*(keyPtr + i) < *(minPtr + i) || *(keyPtr + i) >= *(maxPtr + i))
-        return false;
+private:
+  std::vector<V> mem;
+};
 
-    return true;
+/**
+  Occupancy grid with one bit per voxel.  The accessors return a
+  reference to the bit, which can be assigned to and tested the same
+  way a char occupancy grid can
+*/
+template <AxisOrder Order>
+class DirectVoxel<bool, Order> : public DirectVoxelBase<Order> {
+  typedef DirectVoxelBase<Order> Base;
+
+public:
+  typedef Eigen::Vector3i K;
+  typedef std::shared_ptr<DirectVoxel<bool, Order>> Ptr;
+  typedef const std::shared_ptr<DirectVoxel<bool, Order>> ConstPtr;
+
+  class BitReference {
+  public:
+    BitReference(uint64_t &word, uint64_t mask) : word(word), mask{mask} {};
+    operator bool() const { return word & mask; };
+    BitReference &operator=(bool v) {
+      word = v ? word | mask : word & ~mask;
+      return *this;
+    };
+    BitReference &operator=(const BitReference &o) {
+      return operator=(static_cast<bool>(o));
+    };
+
+  private:
+    uint64_t &word;
+    const uint64_t mask;
   };
 
+  DirectVoxel(const K &min, const K &max)
+      : Base(min, max), mem((Base::size() + 63) / 64){};
+  DirectVoxel(int x, int y, int z) : DirectVoxel(K::Zero(), K(x, y, z)){};
+
+  template <typename... Targs> static inline Ptr Create(Targs &... args) {
+    return std::make_shared<DirectVoxel<bool, Order>>(
+        std::forward<Targs>(args)...);
+  };
+  template <typename... Targs> static inline Ptr Create(Targs &&... args) {
+    return std::make_shared<DirectVoxel<bool, Order>>(
+        std::forward<Targs>(args)...);
+  };
+
+  BitReference operator()(const K &key) {
+    const size_t i = Base::index(key);
+    return BitReference(mem[i / 64], uint64_t(1) << (i % 64));
+  }
+  bool operator()(const K &key) const {
+    const size_t i = Base::index(key);
+    return mem[i / 64] >> (i % 64) & 1;
+  }
+
+  BitReference operator()(int x, int y, int z) {
+    K key(x, y, z);
+    return operator()(key);
+  };
+  BitReference at(int x, int y, int z) { return operator()(x, y, z); };
+  BitReference at(const K &key) { return operator()(key); };
+
+  /* Sets the bit of key.  Can be called from many threads at once */
+  void setAtomic(const K &key) {
+    const size_t i = Base::index(key);
+    const uint64_t mask = uint64_t(1) << (i % 64);
+    // NB: Most bits are set many times, so checking first saves a locked
+    // write to a word other threads are likely using too
+    if (!(__atomic_load_n(&mem[i / 64], __ATOMIC_RELAXED) & mask))
+      __atomic_fetch_or(&mem[i / 64], mask, __ATOMIC_RELAXED);
+  };
+
+  /* The bits in memory order, 64 voxels per word with the first in the
+   * lowest bit */
+  uint64_t *data() { return mem.data(); };
+  const uint64_t *data() const { return mem.data(); };
+
+  /* Number of occupied voxels */
+  size_t count() const {
+    size_t c = 0;
+    for (auto w : mem)
+      c += __builtin_popcountll(w);
+    return c;
+  };
+
+  /* updateRule is applied to 64 voxels at a time */
+  template <typename PairFunc>
+  void update(const DirectVoxel &o, PairFunc updateRule) {
+    assert(Base::min() == o.min() && Base::max() == o.max() &&
+           "Grids not the same size!");
+    for (size_t i = 0; i < mem.size(); ++i)
+      mem[i] = updateRule(mem[i], o.mem[i]);
+  }
+
+  /* Union of the two grids */
+  void operator+=(const DirectVoxel &o) {
+    update(o, [](uint64_t v1, uint64_t v2) { return v1 | v2; });
+  }
+
 private:
-  K _min, _max;
-  long x, y, z;
-  Mem mem;
+  std::vector<uint64_t> mem;
 };
 } // voxel
 
@@ -1,6 +1,7 @@
 #ifndef FEATURE_VOXEL_HPP
 #define FEATURE_VOXEL_HPP
 
+#include <DescriptorArena.hpp>
 #include <fstream>
 #include <iostream>
 #include <memory>
@@ -14,8 +15,8 @@ public:
   typedef T Scalar;
   typedef Eigen::MatrixXi MatType;
   typedef std::vector<MatType> GridType;
-  typedef Eigen::SparseVector<Scalar> DescripType;
-  typedef std::shared_ptr<DescripType> DescripPtr;
+  typedef DescriptorArena<Scalar> ArenaType;
+  typedef typename ArenaType::ConstDescriptor Descriptor;
   FeatureVoxel() : nextID{2}, numNonZeros{0} {};
   FeatureVoxel(const GridType &voxelGrid, int numNonZeros)
       : nextID{2}, voxelGrid{voxelGrid}, numNonZeros{numNonZeros} {};
@@ -25,10 +26,9 @@ public:
   FeatureVoxel(const GridType &&voxelGrid) : nextID{2}, voxelGrid{voxelGrid} {
     updateNumNonZeros();
   };
-  FeatureVoxel(const GridType &&voxelGrid,
-               const std::vector<DescripPtr> &featureVectors)
-      : voxelGrid{voxelGrid}, featureVectors{featureVectors} {
-    this->nextID = featureVectors.size() + 2;
+  FeatureVoxel(const GridType &&voxelGrid, const ArenaType &descriptors)
+      : voxelGrid{voxelGrid}, descriptors{descriptors} {
+    this->nextID = descriptors.size() + 2;
     updateNumNonZeros();
   };
   void setVoxelGrid(const GridType &voxelGrid, int numNonZeros) {
@@ -60,17 +60,14 @@ public:
     for (int k = 0; k < z; ++k)
       saveMatrixAsSparse(this->voxelGrid[k], out);
 
-    int numFeatureVectors = this->featureVectors.size();
-    out.write(reinterpret_cast<const char *>(&numFeatureVectors), sizeof(int));
-
-    for (auto &v : this->featureVectors)
-      saveSpareVector(*v, out);
-
     out.write(reinterpret_cast<const char *>(&nextID), sizeof(nextID));
     out.write(reinterpret_cast<const char *>(&numNonZeros),
               sizeof(numNonZeros));
     out.write(reinterpret_cast<const char *>(zeroZero.data()),
               sizeof(zeroZero));
+
+    // NB: The descriptors go last so they can be mapped from the file
+    descriptors.writeToFile(out);
   };
   void loadFromFile(const std::string &name) {
     clear();
@@ -90,25 +87,24 @@ public:
     for (int k = 0; k < z; ++k)
       loadMatrixFromSparse(this->voxelGrid[k], in);
 
-    int numFeatureVectors;
-    in.read(reinterpret_cast<char *>(&numFeatureVectors), sizeof(int));
-    this->featureVectors.assign(numFeatureVectors,
-                                std::make_shared<DescripType>());
-    for (auto &v : this->featureVectors)
-      loadSparseVetor(*v, in);
-
     in.read(reinterpret_cast<char *>(&nextID), sizeof(nextID));
     in.read(reinterpret_cast<char *>(&numNonZeros), sizeof(numNonZeros));
     in.read(reinterpret_cast<char *>(zeroZero.data()), sizeof(zeroZero));
+
+    const uint64_t offset = in.tellg();
+    in.close();
+    descriptors.mapFromFile(name, offset);
   };
-  int addFeatureVector(int x, int y, int z, const DescripPtr &featureVector) {
+  /* featureVector can be any dense or sparse Eigen vector */
+  template <typename VecType>
+  int addFeatureVector(int x, int y, int z, const VecType &featureVector) {
     this->voxelGrid[z](y, x) = nextID;
-    featureVectors.push_back(featureVector);
+    descriptors.add(featureVector, Eigen::Vector3d(x, y, z));
     return nextID++;
   };
-  void setFeatureVectors(const std::vector<DescripPtr> &featureVectors) {
-    this->featureVectors = featureVectors;
-    this->nextID = featureVectors.size() + 2;
+  void setFeatureVectors(const ArenaType &descriptors) {
+    this->descriptors = descriptors;
+    this->nextID = descriptors.size() + 2;
   }
   void updateNumNonZeros() {
     this->numNonZeros = 0;
@@ -123,40 +119,39 @@ public:
   MatType &operator[](int n) { return this->voxelGrid[n]; };
   void clear() {
     voxelGrid.clear();
-    featureVectors.clear();
+    descriptors.clear();
   };
   const Eigen::Vector3i &getZeroZero() const { return zeroZero; };
-  DescripPtr getFeatureVector(int ID) const {
-    if (ID - 2 >= featureVectors.size() || ID - 2 < 0)
-      return NULL;
+  /* Empty if there is no feature with that ID */
+  Descriptor getFeatureVector(int ID) const {
+    if (ID - 2 >= static_cast<int>(descriptors.size()) || ID - 2 < 0)
+      return Descriptor(nullptr, 0);
     else
-      return this->featureVectors[ID - 2];
+      return this->descriptors[ID - 2];
   };
-  DescripPtr getFeatureVector(int x, int y, int z) const {
+  Descriptor getFeatureVector(int x, int y, int z) const {
     if (x < 0 || x >= getNumX())
-      return NULL;
+      return Descriptor(nullptr, 0);
     if (y < 0 || y >= getNumY())
-      return NULL;
+      return Descriptor(nullptr, 0);
     if (z < 0 || z >= getNumZ())
-      return NULL;
+      return Descriptor(nullptr, 0);
     int ID = this->voxelGrid[z](y, x);
     return this->getFeatureVector(ID);
   };
 
   const MatType &operator[](int n) const { return this->voxelGrid[n]; };
   const GridType &getGrid() const { return this->voxelGrid; };
-  const std::vector<DescripPtr> &getAllFeatureVectors() const {
-    return this->featureVectors;
-  };
+  const ArenaType &getAllFeatureVectors() const { return this->descriptors; };
   int getNumZ() const { return voxelGrid.size(); };
   int getNumY() const { return getNumZ() ? voxelGrid[0].rows() : 0; };
   int getNumX() const { return getNumZ() ? voxelGrid[0].cols() : 0; };
   int getNumNonZeros() const { return numNonZeros; };
-  int getNumFeatures() const { return featureVectors.size(); };
+  int getNumFeatures() const { return descriptors.size(); };
   int getID(int x, int y, int z) const { return voxelGrid[z](y, x); };
 
 private:
-  std::vector<DescripPtr> featureVectors;
+  ArenaType descriptors;
   GridType voxelGrid;
   int nextID;
   int numNonZeros;
@@ -168,8 +163,8 @@ public:
   typedef T Scalar;
   typedef Eigen::SparseMatrix<int> MatType;
   typedef std::vector<MatType> GridType;
-  typedef Eigen::SparseVector<Scalar> DescripType;
-  typedef std::shared_ptr<DescripType> DescripPtr;
+  typedef DescriptorArena<Scalar> ArenaType;
+  typedef typename ArenaType::ConstDescriptor Descriptor;
   SparseFeatureVoxel() : nextID{2}, numNonZeros{0} {};
   SparseFeatureVoxel(const GridType &voxelGrid, int numNonZeros)
       : nextID{2}, voxelGrid{voxelGrid}, numNonZeros{numNonZeros} {};
@@ -182,9 +177,9 @@ public:
     updateNumNonZeros();
   };
   SparseFeatureVoxel(const GridType &&voxelGrid,
-                     const std::vector<DescripPtr> &featureVectors)
-      : voxelGrid{voxelGrid}, featureVectors{featureVectors} {
-    this->nextID = featureVectors.size() + 2;
+                     const ArenaType &descriptors)
+      : voxelGrid{voxelGrid}, descriptors{descriptors} {
+    this->nextID = descriptors.size() + 2;
     updateNumNonZeros();
   };
   void setVoxelGrid(const GridType &voxelGrid, int numNonZeros) {
@@ -216,17 +211,14 @@ public:
     for (int k = 0; k < z; ++k)
       saveSparseMatrix(this->voxelGrid[k], out);
 
-    int numFeatureVectors = this->featureVectors.size();
-    out.write(reinterpret_cast<const char *>(&numFeatureVectors), sizeof(int));
-
-    for (auto &v : this->featureVectors)
-      saveSpareVector(*v, out);
-
     out.write(reinterpret_cast<const char *>(&nextID), sizeof(nextID));
     out.write(reinterpret_cast<const char *>(&numNonZeros),
               sizeof(numNonZeros));
     out.write(reinterpret_cast<const char *>(zeroZero.data()),
               sizeof(zeroZero));
+
+    // NB: The descriptors go last so they can be mapped from the file
+    descriptors.writeToFile(out);
   };
   void loadFromFile(const std::string &name) {
     clear();
@@ -246,25 +238,24 @@ public:
     for (int k = 0; k < z; ++k)
       loadSparseMatrix(this->voxelGrid[k], in);
 
-    int numFeatureVectors;
-    in.read(reinterpret_cast<char *>(&numFeatureVectors), sizeof(int));
-    this->featureVectors.assign(numFeatureVectors,
-                                std::make_shared<DescripType>());
-    for (auto &v : this->featureVectors)
-      loadSparseVetor(*v, in);
-
     in.read(reinterpret_cast<char *>(&nextID), sizeof(nextID));
     in.read(reinterpret_cast<char *>(&numNonZeros), sizeof(numNonZeros));
     in.read(reinterpret_cast<char *>(zeroZero.data()), sizeof(zeroZero));
+
+    const uint64_t offset = in.tellg();
+    in.close();
+    descriptors.mapFromFile(name, offset);
   };
-  int addFeatureVector(int x, int y, int z, const DescripPtr &featureVector) {
+  /* featureVector can be any dense or sparse Eigen vector */
+  template <typename VecType>
+  int addFeatureVector(int x, int y, int z, const VecType &featureVector) {
     this->voxelGrid[z].coeffRef(y, x) = nextID;
-    featureVectors.push_back(featureVector);
+    descriptors.add(featureVector, Eigen::Vector3d(x, y, z));
     return nextID++;
   };
-  void setFeatureVectors(const std::vector<DescripPtr> &featureVectors) {
-    this->featureVectors = featureVectors;
-    this->nextID = featureVectors.size() + 2;
+  void setFeatureVectors(const ArenaType &descriptors) {
+    this->descriptors = descriptors;
+    this->nextID = descriptors.size() + 2;
   }
   void updateNumNonZeros() {
     this->numNonZeros = 0;
@@ -275,29 +266,28 @@ public:
   };
   MatType &operator[](int n) { return this->voxelGrid[n]; };
   const Eigen::Vector3i &getZeroZero() const { return zeroZero; };
-  DescripPtr getFeatureVector(int ID) const {
-    if (ID - 2 >= featureVectors.size() || ID - 2 < 0)
-      return NULL;
+  /* Empty if there is no feature with that ID */
+  Descriptor getFeatureVector(int ID) const {
+    if (ID - 2 >= static_cast<int>(descriptors.size()) || ID - 2 < 0)
+      return Descriptor(nullptr, 0);
     else
-      return this->featureVectors[ID - 2];
+      return this->descriptors[ID - 2];
   };
   const MatType &operator[](int n) const { return this->voxelGrid[n]; };
   const GridType &getGrid() const { return this->voxelGrid; };
-  const std::vector<DescripPtr> &getAllFeatureVectors() const {
-    return this->featureVectors;
-  };
+  const ArenaType &getAllFeatureVectors() const { return this->descriptors; };
   int getNumZ() const { return voxelGrid.size(); };
   int getNumY() const { return getNumZ() ? voxelGrid[0].rows() : 0; };
   int getNumX() const { return getNumZ() ? voxelGrid[0].cols() : 0; };
   int getNumNonZeros() const { return numNonZeros; };
-  int getNumFeatures() const { return featureVectors.size(); };
+  int getNumFeatures() const { return descriptors.size(); };
   void clear() {
     voxelGrid.clear();
-    featureVectors.clear();
+    descriptors.clear();
   }
 
 private:
-  std::vector<DescripPtr> featureVectors;
+  ArenaType descriptors;
   GridType voxelGrid;
   int nextID;
   int numNonZeros;
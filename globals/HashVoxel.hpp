@@ -5,18 +5,81 @@
 #include <eigen3/Eigen/Eigen>
 #include <memory>
 #include <scan_typedefs.hpp>
-#include <unordered_map>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iterator>
+#include <vector>
 
 namespace voxel {
+/* Morton (z-order) codes of up to 3 coordinates in [-2^20, 2^20).  Keys
+ * that are close in space have codes that are close, so sorting by code
+ * gives a spatially coherent order */
+namespace morton {
+constexpr int bits = 21;
+constexpr int64_t offset = int64_t(1) << (bits - 1);
+
+inline uint64_t split(uint64_t a) {
+  a &= 0x1fffff;
+  a = (a | a << 32) & 0x1f00000000ffff;
+  a = (a | a << 16) & 0x1f0000ff0000ff;
+  a = (a | a << 8) & 0x100f00f00f00f00f;
+  a = (a | a << 4) & 0x10c30c30c30c30c3;
+  a = (a | a << 2) & 0x1249249249249249;
+  return a;
+}
+
+inline uint64_t compact(uint64_t a) {
+  a &= 0x1249249249249249;
+  a = (a ^ (a >> 2)) & 0x10c30c30c30c30c3;
+  a = (a ^ (a >> 4)) & 0x100f00f00f00f00f;
+  a = (a ^ (a >> 8)) & 0x1f0000ff0000ff;
+  a = (a ^ (a >> 16)) & 0x1f00000000ffff;
+  a = (a ^ (a >> 32)) & 0x1fffff;
+  return a;
+}
+
+template <typename K> inline uint64_t encode(const K &key) {
+  static_assert(K::SizeAtCompileTime > 0 && K::SizeAtCompileTime <= 3,
+                "Morton codes are only for keys of 1 to 3 coordinates");
+  uint64_t code = 0;
+  for (int i = 0; i < key.size(); ++i) {
+    const int64_t c = static_cast<int64_t>(key[i]) + offset;
+    assert(c >= 0 && c < (int64_t(1) << bits) && "Key out of range!");
+    code |= split(c) << i;
+  }
+  return code;
+}
+
+template <typename K> inline K decode(uint64_t code) {
+  K key;
+  for (int i = 0; i < key.size(); ++i)
+    key[i] = static_cast<int64_t>(compact(code >> i)) - offset;
+  return key;
+}
+} // morton
+
+/**
+  Sparse voxel grid.  Values are stored inline in an open addressing
+  table keyed by the Morton code of the voxel, so a lookup is a hash of
+  one 64 bit integer and a short linear probe over an array of codes.
+
+  Pointers returned by insert and operator() are only valid until the
+  next insert.  Lookups through find are const and can be made from
+  many threads at once as long as nothing is being inserted.
+  Iteration with forEach visits the voxels in Morton order
+*/
 template <typename K, typename V> class HashVoxel {
 public:
-  typedef std::shared_ptr<V> VPtr;
+  typedef V *VPtr;
   typedef std::shared_ptr<HashVoxel<K, V>> Ptr;
   typedef const std::shared_ptr<HashVoxel<K, V>> ConstPtr;
-  typedef std::unordered_map<K, VPtr> Map;
 
-  HashVoxel(K &min, K &max) : _min{min}, _max{max}, check{true} {};
-  HashVoxel(K &&min, K &&max) : _min{min}, _max{max}, check{true} {};
+  HashVoxel(K &min, K &max) : _min{min}, _max{max}, check{true} { clear(); };
+  HashVoxel(K &&min, K &&max) : _min{min}, _max{max}, check{true} {
+    clear();
+  };
   HashVoxel() : check{false} {
     auto minPtr = min().data();
     auto maxPtr = max().data();
@@ -24,6 +87,7 @@ public:
       minPtr[i] = 1e8;
       maxPtr[i] = -1e8;
     }
+    clear();
   };
 
   template <typename... Targs> static inline Ptr Create(Targs &... args) {
@@ -33,38 +97,69 @@ public:
     return std::make_shared<HashVoxel<K, V>>(std::forward<Targs>(args)...);
   };
 
-  VPtr insert(VPtr v, K key) {
+  /* Returns the stored value, or nullptr if key was already in the grid,
+   * in which case its value is left alone */
+  VPtr insert(const V &v, const K &key) {
     if (check)
       checkBounds(key);
     else
       update(key);
-    auto it = map.find(key);
-    if (it == map.cend()) {
-      map.emplace(key, v);
-      return v;
-    } else
-      return nullptr;
+
+    if (2 * (count + 1) > codes.size())
+      rehash(2 * codes.size());
+
+    const uint64_t code = morton::encode(key);
+    size_t i = slot(code);
+    for (; codes[i] != empty; i = (i + 1) & mask)
+      if (codes[i] == code)
+        return nullptr;
+
+    codes[i] = code;
+    values[i] = v;
+    ++count;
+    return &values[i];
   }
 
-  template <typename... Kargs> VPtr insert(VPtr v, Kargs... args) {
+  template <typename... Kargs> VPtr insert(const V &v, Kargs... args) {
     K key(std::forward<Kargs>(args)...);
     return insert(v, key);
   };
 
-  template <typename... Kargs> VPtr insert(const V &v, Kargs... args) {
-    return insert(std::make_shared<V>(v), std::forward<Kargs>(args)...);
-  };
-  template <typename... Kargs> VPtr insert(const V &&v, Kargs... args) {
-    return insert(std::make_shared<V>(v), std::forward<Kargs>(args)...);
-  };
+  /* Inserts every (key, value) pair in [first, last).  The table is
+   * sized once for all of them */
+  template <typename Iterator> void insert(Iterator first, Iterator last) {
+    reserve(count + std::distance(first, last));
+    for (; first != last; ++first)
+      insert(first->second, first->first);
+  }
+
+  void reserve(size_t n) {
+    size_t size = codes.size();
+    while (2 * n > size)
+      size *= 2;
+    if (size != codes.size())
+      rehash(size);
+  }
 
-  VPtr operator()(K &key) {
+  const V *find(const K &key) const {
     assert(checkBounds(key) && "Not in bounds!");
-    auto it = map.find(key);
-    if (it == map.cend())
-      return nullptr;
-    else
-      return it->second;
+    const uint64_t code = morton::encode(key);
+    for (size_t i = slot(code); codes[i] != empty; i = (i + 1) & mask)
+      if (codes[i] == code)
+        return &values[i];
+    return nullptr;
+  }
+
+  /* Looks up n keys at once, spread over the OpenMP threads.  values[i]
+   * is set to the value of keys[i], or nullptr if it isn't in the grid */
+  void find(const K *keys, size_t n, const V **values) const {
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < n; ++i)
+      values[i] = find(keys[i]);
+  }
+
+  VPtr operator()(const K &key) {
+    return const_cast<VPtr>(static_cast<const HashVoxel &>(*this).find(key));
   }
 
   template <typename... Kargs> VPtr operator()(Kargs... args) {
@@ -77,33 +172,48 @@ public:
 
   inline K &max() { return _max; };
   inline K &min() { return _min; };
+  inline const K &getMax() const { return _max; };
+  inline const K &getMin() const { return _min; };
 
-  typename Map::const_iterator begin() const { return map.cbegin(); };
-  typename Map::const_iterator end() const { return map.cend(); };
+  size_t size() const { return count; };
+
+  void clear() {
+    codes.assign(initialSize, empty);
+    values.assign(initialSize, V());
+    mask = initialSize - 1;
+    count = 0;
+  }
+
+  /* Calls func(key, value) for every voxel in Morton order */
+  template <typename Func> void forEach(Func &&func) const {
+    for (size_t i : sortedSlots())
+      func(morton::decode<K>(codes[i]), values[i]);
+  }
+  template <typename Func> void forEach(Func &&func) {
+    for (size_t i : sortedSlots())
+      func(morton::decode<K>(codes[i]), values[i]);
+  }
 
   template <typename PairFunc>
   void update(const HashVoxel &o, PairFunc updateRule) {
-    for (auto &pair : o) {
-      K key;
-      VPtr ov;
-      std::tie(key, ov) = pair;
-
+    reserve(count + o.size());
+    o.forEach([&](const K &key, const V &ov) {
       auto v = operator()(key);
       if (v)
-        *v = updateRule(*v, *ov);
+        *v = updateRule(*v, ov);
       else
         insert(ov, key);
-    }
+    });
   }
 
   void operator+=(const HashVoxel &o) {
-    update(o, [](V &v1, V &v2) { return v1 + v2; });
+    update(o, [](const V &v1, const V &v2) { return v1 + v2; });
   }
 
-  bool checkBounds(const K &key) {
+  bool checkBounds(const K &key) const {
     if (check) {
-      auto minPtr = min().data();
-      auto maxPtr = max().data();
+      auto minPtr = _min.data();
+      auto maxPtr = _max.data();
       auto keyPtr = key.data();
       for (int i = 0; i < key.size(); ++i) {
         if (*(keyPtr + i) < *(minPtr + i) || *(keyPtr + i) >= *(maxPtr + i))
@@ -115,10 +225,56 @@ public:
   };
 
 private:
-  Map map;
+  static constexpr uint64_t empty = ~uint64_t(0);
+  static constexpr size_t initialSize = 16;
+
+  // NB: Codes and values are kept apart so a probe only touches codes
+  std::vector<uint64_t> codes;
+  std::vector<V> values;
+  size_t mask, count;
   K _min, _max;
   const bool check;
 
+  /* Fibonacci hashing.  Morton codes of neighboring voxels differ only
+   * in their low bits, which would all land in the same few slots */
+  size_t slot(uint64_t code) const {
+    return (code * 0x9e3779b97f4a7c15ull) >> 32 & mask;
+  }
+
+  void rehash(size_t size) {
+    std::vector<uint64_t> oldCodes(size, empty);
+    std::vector<V> oldValues(size);
+    oldCodes.swap(codes);
+    oldValues.swap(values);
+    mask = size - 1;
+
+    for (size_t j = 0; j < oldCodes.size(); ++j) {
+      if (oldCodes[j] == empty)
+        continue;
+      size_t i = slot(oldCodes[j]);
+      while (codes[i] != empty)
+        i = (i + 1) & mask;
+      codes[i] = oldCodes[j];
+      values[i] = std::move(oldValues[j]);
+    }
+  }
+
+  std::vector<size_t> sortedSlots() const {
+    // NB: Sorting the codes along with the slots keeps the comparisons
+    // from reading codes all over the table
+    std::vector<std::pair<uint64_t, size_t>> order;
+    order.reserve(count);
+    for (size_t i = 0; i < codes.size(); ++i)
+      if (codes[i] != empty)
+        order.emplace_back(codes[i], i);
+    std::sort(order.begin(), order.end());
+
+    std::vector<size_t> slots(order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+      slots[i] = order[i].second;
+    return slots;
+  }
+
   void update(const K &key) {
     auto minPtr = min().data();
     auto maxPtr = max().data();
@@ -129,6 +285,9 @@ private:
     }
   }
 };
+
+template <typename K, typename V> constexpr uint64_t HashVoxel<K, V>::empty;
+template <typename K, typename V> constexpr size_t HashVoxel<K, V>::initialSize;
 } // voxel
 
-#endif // HASH_VOXEL_HPP
\ No newline at end of file
+#endif // HASH_VOXEL_HPP
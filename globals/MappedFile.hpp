@@ -0,0 +1,97 @@
+#pragma once
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <algorithm>
+#include <fcntl.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace scan {
+/**
+  Read-only memory mapping of an entire file.  The mapping is released
+  when the object goes out of scope
+*/
+class MappedFile {
+public:
+  MappedFile() : ptr{nullptr}, length{0} {};
+  MappedFile(const std::string &name) : MappedFile() { open(name); };
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+  MappedFile(MappedFile &&o) : ptr{o.ptr}, length{o.length} {
+    o.ptr = nullptr;
+    o.length = 0;
+  };
+  MappedFile &operator=(MappedFile &&o) {
+    if (this != &o) {
+      close();
+      ptr = o.ptr;
+      length = o.length;
+      o.ptr = nullptr;
+      o.length = 0;
+    }
+    return *this;
+  };
+  ~MappedFile() { close(); };
+
+  bool open(const std::string &name) {
+    close();
+    int fd = ::open(name.c_str(), O_RDONLY);
+    if (fd == -1)
+      return false;
+
+    struct stat info;
+    if (fstat(fd, &info) == -1 || info.st_size == 0) {
+      ::close(fd);
+      return false;
+    }
+
+    void *mem = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // NB: The mapping keeps its own reference to the file
+    ::close(fd);
+    if (mem == MAP_FAILED)
+      return false;
+
+    ptr = static_cast<char *>(mem);
+    length = info.st_size;
+    return true;
+  };
+
+  void close() {
+    if (ptr)
+      munmap(ptr, length);
+    ptr = nullptr;
+    length = 0;
+  };
+
+  /* Hints to the kernel that the file will be read front to back */
+  void adviseSequential() const {
+    if (ptr)
+      madvise(ptr, length, MADV_SEQUENTIAL);
+  };
+
+  /* Drops the pages in [offset, offset + size) from the mapping.  They will
+   * be faulted back in from the file if touched again */
+  void release(size_t offset, size_t size) const {
+    if (!ptr || offset >= length)
+      return;
+    const size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = (offset + page - 1) / page * page;
+    size_t stop = std::min(offset + size, length) / page * page;
+    if (stop > start)
+      madvise(ptr + start, stop - start, MADV_DONTNEED);
+  };
+
+  bool is_open() const { return ptr != nullptr; };
+  const char *data() const { return ptr; };
+  size_t size() const { return length; };
+
+private:
+  char *ptr;
+  size_t length;
+};
+} // scan
+
+#endif // MAPPED_FILE_HPP
@@ -0,0 +1,590 @@
+#include "ScanFile.hpp"
+#include "ArtifactStore.hpp"
+
+#include <cmath>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <unistd.h>
+
+constexpr char scan::ScanFileHeader::kMagic[8];
+constexpr uint32_t scan::ScanFileHeader::kVersion;
+constexpr uint64_t scan::ScanFileHeader::kAlignment;
+constexpr uint32_t scan::ScanFileHeader::kBlockSize;
+
+namespace {
+// NB: Size of a record written by scan::PointXYZRGBA::writeToFile
+constexpr size_t legacyRecordSize =
+    sizeof(Eigen::Vector3f) + sizeof(float) + 3 * sizeof(char);
+constexpr size_t convertBlockSize = 1 << 20;
+
+uint64_t align(uint64_t offset) {
+  constexpr uint64_t a = scan::ScanFileHeader::kAlignment;
+  return (offset + a - 1) / a * a;
+}
+
+/* Reads a file of scan::PointXYZRGBA::writeToFile records preceded by
+ * columns and rows.  begin(columns, rows) is called once, then
+ * consume(points, first, n) once per block of points */
+template <typename Begin, typename Consume>
+void readLegacy(const std::string &name, Begin &&begin, Consume &&consume) {
+  scan::ArtifactStream in(name);
+  if (!in.is_open()) {
+    std::cout << "[scan::ScanFile] Could not open: " << name << std::endl;
+    exit(1);
+  }
+  in.seekg(0, std::ios::end);
+  const uint64_t fileSize = in.tellg();
+  in.seekg(0);
+
+  int columns = 0, rows = 0;
+  in.read(reinterpret_cast<char *>(&columns), sizeof(columns));
+  in.read(reinterpret_cast<char *>(&rows), sizeof(rows));
+  const size_t total = static_cast<size_t>(std::max(columns, 0)) *
+                       static_cast<size_t>(std::max(rows, 0));
+  // NB: Checked before anything is sized from columns and rows
+  if (!in || columns < 0 || rows < 0 ||
+      (fileSize - 2 * sizeof(int)) / legacyRecordSize < total) {
+    std::cout << "[scan::ScanFile] " << name
+              << " is not a scan or is truncated" << std::endl;
+    exit(1);
+  }
+  begin(columns, rows);
+
+  std::vector<char> buffer;
+  std::vector<scan::PointXYZRGBA> block;
+  for (size_t done = 0; done < total;) {
+    const size_t n = std::min(convertBlockSize, total - done);
+    buffer.resize(n * legacyRecordSize);
+    block.resize(n);
+    in.read(buffer.data(), buffer.size());
+    if (!in) {
+      std::cout << "[scan::ScanFile] " << name << " is truncated" << std::endl;
+      exit(1);
+    }
+
+    const char *src = buffer.data();
+    for (auto &p : block) {
+      std::memcpy(p.point.data(), src, sizeof(Eigen::Vector3f));
+      std::memcpy(&p.intensity, src + sizeof(Eigen::Vector3f), sizeof(float));
+      std::memcpy(p.rgb, src + sizeof(Eigen::Vector3f) + sizeof(float),
+                  3 * sizeof(char));
+      src += legacyRecordSize;
+    }
+    consume(block.data(), done, n);
+    done += n;
+  }
+}
+
+/* Compressed blocks store 7 streams: x, y, z, intensity, r, g and b.
+ * Every stream is quantized to integers, delta coded along the scan order
+ * and zigzag encoded so that small differences of either sign become small
+ * unsigned values.  Those are bit packed in groups of groupSize, each group
+ * using just enough bits for its largest value */
+constexpr size_t groupSize = 128;
+constexpr double intensityScale = 1 << 16;
+constexpr double maxQuantized = 1 << 30;
+
+/* Counts the values that were out of range in clamped */
+inline int32_t quantize(double v, double step, uint64_t &clamped) {
+  const double q = v / step;
+  if (!(std::abs(q) <= maxQuantized)) {
+    ++clamped;
+    return static_cast<int32_t>(q > 0 ? maxQuantized
+                                      : q < 0 ? -maxQuantized : 0);
+  }
+  return static_cast<int32_t>(std::lround(q));
+}
+
+// NB: Deltas are taken modulo 2^32, so that the difference of two values
+// near the clamp of opposite sign wraps around instead of overflowing.
+// Decoding sums them modulo 2^32 as well and gets the values back.  For
+// deltas that fit in an int32 this is the usual zigzag encoding
+inline uint32_t zigzag(uint32_t delta) {
+  return (delta << 1) ^ (0u - (delta >> 31));
+}
+
+inline uint32_t unzigzag(uint32_t v) { return (v >> 1) ^ (0u - (v & 1)); }
+
+void pack(const uint32_t *values, size_t n, std::vector<char> &out) {
+  for (size_t g = 0; g < n; g += groupSize) {
+    const size_t m = std::min(groupSize, n - g);
+    uint32_t all = 0;
+    for (size_t k = 0; k < m; ++k)
+      all |= values[g + k];
+    const int bits = all ? 32 - __builtin_clz(all) : 0;
+    out.push_back(static_cast<char>(bits));
+
+    uint64_t acc = 0;
+    int filled = 0;
+    for (size_t k = 0; k < m; ++k) {
+      acc |= static_cast<uint64_t>(values[g + k]) << filled;
+      for (filled += bits; filled >= 8; filled -= 8, acc >>= 8)
+        out.push_back(static_cast<char>(acc & 0xFF));
+    }
+    if (filled > 0)
+      out.push_back(static_cast<char>(acc & 0xFF));
+  }
+}
+
+/* Returns false, leaving values unfinished, if a group has more than 32
+ * bits per value or doesn't fit before end */
+bool unpack(const char *&cur, const char *end, size_t n, uint32_t *values) {
+  for (size_t g = 0; g < n; g += groupSize) {
+    const size_t m = std::min(groupSize, n - g);
+    if (cur >= end)
+      return false;
+    const int bits = static_cast<uint8_t>(*cur++);
+    if (bits > 32 || static_cast<size_t>(end - cur) < (m * bits + 7) / 8)
+      return false;
+    const uint64_t mask = (1ull << bits) - 1;
+
+    uint64_t acc = 0;
+    int avail = 0;
+    for (size_t k = 0; k < m; ++k) {
+      for (; avail < bits; avail += 8)
+        acc |= static_cast<uint64_t>(static_cast<uint8_t>(*cur++)) << avail;
+      values[g + k] = static_cast<uint32_t>(acc & mask);
+      acc >>= bits;
+      avail -= bits;
+    }
+  }
+  return true;
+}
+
+/* Delta codes and packs n quantized values, get(k) returns the k-th one */
+template <typename Getter>
+void encodeStream(size_t n, Getter &&get, std::vector<uint32_t> &tmp,
+                  std::vector<char> &out) {
+  tmp.resize(n);
+  uint32_t prev = 0;
+  for (size_t k = 0; k < n; ++k) {
+    const uint32_t q = static_cast<uint32_t>(get(k));
+    tmp[k] = zigzag(q - prev);
+    prev = q;
+  }
+  pack(tmp.data(), n, out);
+}
+
+/* Inverse of encodeStream, set(k, q) receives the k-th quantized value.
+ * Returns false if the stream doesn't fit before end */
+template <typename Setter>
+bool decodeStream(const char *&cur, const char *end, size_t n,
+                  std::vector<uint32_t> &tmp, Setter &&set) {
+  tmp.resize(n);
+  if (!unpack(cur, end, n, tmp.data()))
+    return false;
+  uint32_t prev = 0;
+  for (size_t k = 0; k < n; ++k) {
+    prev += unzigzag(tmp[k]);
+    set(k, static_cast<int32_t>(prev));
+  }
+  return true;
+}
+} // namespace
+
+scan::ScanFileHeader::ScanFileHeader(int columns, int rows, double precision)
+    : version{kVersion}, columns{columns}, rows{rows},
+      encoding{precision > 0 ? COMPRESSED : RAW},
+      precision{static_cast<float>(precision)}, blockSize{0}, numBlocks{0},
+      blockIndexOffset{0} {
+  std::memcpy(magic, kMagic, sizeof(magic));
+  for (int i = 0; i < 3; ++i) {
+    min[i] = 1e10;
+    max[i] = -1e10;
+  }
+
+  if (encoding == COMPRESSED) {
+    // NB: The layout of a compressed file is only known once it is written
+    xOffset = yOffset = zOffset = intensityOffset = rgbOffset = 0;
+    fileSize = align(sizeof(ScanFileHeader));
+    blockSize = kBlockSize;
+    return;
+  }
+
+  const uint64_t n = numPoints();
+  xOffset = align(sizeof(ScanFileHeader));
+  yOffset = align(xOffset + n * sizeof(float));
+  zOffset = align(yOffset + n * sizeof(float));
+  intensityOffset = align(zOffset + n * sizeof(float));
+  rgbOffset = align(intensityOffset + n * sizeof(float));
+  fileSize = rgbOffset + 3 * n;
+}
+
+void scan::ScanFileHeader::extendBounds(const scan::PointXYZRGBA *points,
+                                        size_t n) {
+  for (size_t k = 0; k < n; ++k) {
+    auto &point = points[k].point;
+    // NB: Points at the origin are missing returns
+    if (!(point[0] || point[1] || point[2]))
+      continue;
+    for (int i = 0; i < 3; ++i) {
+      min[i] = std::min(min[i], point[i]);
+      max[i] = std::max(max[i], point[i]);
+    }
+  }
+}
+
+scan::ScanFileWriter::ScanFileWriter(const std::string &name, int columns,
+                                     int rows, double precision)
+    : name{name}, out{name, std::ios::out | std::ios::binary},
+      header{columns, rows, precision}, written{0}, clamped{0} {
+  if (!out.is_open()) {
+    std::cout << "[scan::ScanFileWriter] Could not open: " << name
+              << std::endl;
+    exit(1);
+  }
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  if (header.compressed()) {
+    out.seekp(header.fileSize);
+    pending.reserve(header.blockSize);
+  }
+}
+
+scan::ScanFileWriter::~ScanFileWriter() {
+  if (out.is_open())
+    close();
+}
+
+void scan::ScanFileWriter::append(const scan::PointXYZRGBA *points, size_t n) {
+  if (written + n > header.numPoints()) {
+    std::cout << "[scan::ScanFileWriter] Too many points for: " << name
+              << std::endl;
+    exit(1);
+  }
+
+  header.extendBounds(points, n);
+
+  if (!header.compressed()) {
+    appendRaw(points, n);
+    return;
+  }
+
+  for (size_t k = 0; k < n; ++k) {
+    pending.push_back(points[k]);
+    if (pending.size() == header.blockSize)
+      flushBlock();
+  }
+  written += n;
+}
+
+void scan::ScanFileWriter::appendRaw(const scan::PointXYZRGBA *points,
+                                     size_t n) {
+  auto writeArray = [&](uint64_t offset, size_t elemSize, auto &&get) {
+    buffer.resize(n * elemSize);
+    char *dst = buffer.data();
+    for (size_t k = 0; k < n; ++k, dst += elemSize)
+      std::memcpy(dst, get(points[k]), elemSize);
+    out.seekp(offset + written * elemSize);
+    out.write(buffer.data(), buffer.size());
+  };
+
+  for (int i = 0; i < 3; ++i) {
+    const uint64_t offset =
+        i == 0 ? header.xOffset : i == 1 ? header.yOffset : header.zOffset;
+    writeArray(offset, sizeof(float),
+               [i](const scan::PointXYZRGBA &p) { return &p.point[i]; });
+  }
+  writeArray(header.intensityOffset, sizeof(float),
+             [](const scan::PointXYZRGBA &p) { return &p.intensity; });
+  writeArray(header.rgbOffset, 3 * sizeof(char),
+             [](const scan::PointXYZRGBA &p) { return p.rgb; });
+
+  written += n;
+}
+
+void scan::ScanFileWriter::close() {
+  if (written != header.numPoints()) {
+    std::cout << "[scan::ScanFileWriter] Expected " << header.numPoints()
+              << " points but got " << written << " for: " << name
+              << std::endl;
+    exit(1);
+  }
+
+  if (header.min[0] > header.max[0])
+    for (int i = 0; i < 3; ++i)
+      header.min[i] = header.max[i] = 0;
+
+  if (header.compressed()) {
+    if (!pending.empty())
+      flushBlock();
+    if (clamped)
+      std::cout << "[scan::ScanFileWriter] " << clamped
+                << " values were out of range and clamped to +-2^30 "
+                   "steps in: "
+                << name << std::endl;
+    blockOffsets.push_back(header.fileSize);
+
+    // NB: Pad so that the index can be read in place from the mapping
+    header.blockIndexOffset =
+        (header.fileSize + sizeof(uint64_t) - 1) / sizeof(uint64_t) *
+        sizeof(uint64_t);
+    header.numBlocks = blockOffsets.size() - 1;
+    header.fileSize =
+        header.blockIndexOffset + blockOffsets.size() * sizeof(uint64_t);
+
+    out.seekp(header.blockIndexOffset);
+    out.write(reinterpret_cast<const char *>(blockOffsets.data()),
+              blockOffsets.size() * sizeof(uint64_t));
+  }
+
+  out.seekp(0);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.close();
+}
+
+void scan::ScanFileWriter::flushBlock() {
+  const size_t m = pending.size();
+  const double step = header.precision;
+  std::vector<uint32_t> tmp;
+  buffer.clear();
+
+  for (int i = 0; i < 3; ++i)
+    encodeStream(
+        m,
+        [&](size_t k) { return quantize(pending[k].point[i], step, clamped); },
+        tmp, buffer);
+  encodeStream(m,
+               [&](size_t k) {
+                 return quantize(pending[k].intensity, 1 / intensityScale,
+                                 clamped);
+               },
+               tmp, buffer);
+  for (int c = 0; c < 3; ++c)
+    encodeStream(m, [&](size_t k) { return int32_t{pending[k].rgb[c]}; }, tmp,
+                 buffer);
+
+  blockOffsets.push_back(header.fileSize);
+  out.write(buffer.data(), buffer.size());
+  header.fileSize += buffer.size();
+  pending.clear();
+}
+
+void scan::ScanFileWriter::write(
+    const std::string &name, int columns, int rows,
+    const std::vector<scan::PointXYZRGBA> &points, double precision) {
+  ScanFileWriter writer(name, columns, rows, precision);
+  writer.append(points.data(), points.size());
+  writer.close();
+}
+
+void scan::ScanFile::open(const std::string &name) {
+  if (!isScanFile(name)) {
+    loadLegacy(name);
+    return;
+  }
+
+  file = mapArtifact(name, base, length);
+  if (!file) {
+    std::cout << "[scan::ScanFile] Could not open: " << name << std::endl;
+    exit(1);
+  }
+  // NB: Version 1 headers end before precision
+  if (length < offsetof(ScanFileHeader, precision)) {
+    std::cout << "[scan::ScanFile] " << name << " is truncated" << std::endl;
+    exit(1);
+  }
+  header = reinterpret_cast<const ScanFileHeader *>(base);
+
+  if (header->version > ScanFileHeader::kVersion) {
+    std::cout << "[scan::ScanFile] " << name << " has version "
+              << header->version << " but only versions up to "
+              << ScanFileHeader::kVersion << " are supported" << std::endl;
+    exit(1);
+  }
+  if ((header->version >= 2 && length < sizeof(ScanFileHeader)) ||
+      length < header->fileSize) {
+    std::cout << "[scan::ScanFile] " << name << " is truncated" << std::endl;
+    exit(1);
+  }
+  // NB: A packed scan shares its mapping with the rest of the store
+  if (file->data() == base && file->size() == length)
+    file->adviseSequential();
+
+  if (header->compressed()) {
+    decode();
+    if (!xs) {
+      std::cout << "[scan::ScanFile] " << name << " is corrupt" << std::endl;
+      exit(1);
+    }
+  } else {
+    const uint64_t n = header->numPoints();
+    const uint64_t ends[] = {header->xOffset + n * sizeof(float),
+                             header->yOffset + n * sizeof(float),
+                             header->zOffset + n * sizeof(float),
+                             header->intensityOffset + n * sizeof(float),
+                             header->rgbOffset + 3 * n};
+    for (auto end : ends) {
+      if (end > header->fileSize) {
+        std::cout << "[scan::ScanFile] " << name << " is corrupt" << std::endl;
+        exit(1);
+      }
+    }
+    xs = array<float>(header->xOffset);
+    ys = array<float>(header->yOffset);
+    zs = array<float>(header->zOffset);
+    intensities = array<float>(header->intensityOffset);
+    colors = array<unsigned char>(header->rgbOffset);
+  }
+}
+
+void scan::ScanFile::loadLegacy(const std::string &name) {
+  file.reset();
+  base = nullptr;
+  length = 0;
+  size_t n = 0;
+  float *x = nullptr, *y = nullptr, *z = nullptr, *in = nullptr;
+  readLegacy(name,
+             [&](int columns, int rows) {
+               legacyHeader = ScanFileHeader(columns, rows, 0);
+               n = legacyHeader.numPoints();
+               decoded.resize(4 * n);
+               decodedColors.resize(3 * n);
+               x = decoded.data();
+               y = x + n;
+               z = y + n;
+               in = z + n;
+             },
+             [&](const scan::PointXYZRGBA *points, size_t first, size_t m) {
+               legacyHeader.extendBounds(points, m);
+               for (size_t k = 0; k < m; ++k) {
+                 x[first + k] = points[k].point[0];
+                 y[first + k] = points[k].point[1];
+                 z[first + k] = points[k].point[2];
+                 in[first + k] = points[k].intensity;
+                 std::memcpy(&decodedColors[3 * (first + k)], points[k].rgb,
+                             3 * sizeof(char));
+               }
+             });
+  if (legacyHeader.min[0] > legacyHeader.max[0])
+    for (int i = 0; i < 3; ++i)
+      legacyHeader.min[i] = legacyHeader.max[i] = 0;
+
+  header = &legacyHeader;
+  xs = x;
+  ys = y;
+  zs = z;
+  intensities = in;
+  colors = decodedColors.data();
+}
+
+void scan::ScanFile::decode() {
+  const size_t n = size(), blockSize = header->blockSize;
+  const uint64_t numBlocks = header->numBlocks;
+  const double step = header->precision;
+  // NB: Everything the blocks are found with is checked up front, so that
+  // a corrupt file is never read outside of the mapping
+  if (blockSize == 0 || numBlocks != (n + blockSize - 1) / blockSize ||
+      header->blockIndexOffset > header->fileSize ||
+      (header->fileSize - header->blockIndexOffset) / sizeof(uint64_t) <
+          numBlocks + 1)
+    return;
+  const uint64_t *index = array<uint64_t>(header->blockIndexOffset);
+  for (uint64_t b = 0; b <= numBlocks; ++b)
+    if (index[b] < sizeof(ScanFileHeader) || index[b] > header->fileSize ||
+        (b > 0 && index[b] < index[b - 1]))
+      return;
+
+  decoded.resize(4 * n);
+  decodedColors.resize(3 * n);
+  float *x = decoded.data(), *y = x + n, *z = y + n, *in = z + n;
+  float *coords[] = {x, y, z};
+  unsigned char *rgb = decodedColors.data();
+
+  bool corrupt = false;
+#pragma omp parallel reduction(|| : corrupt)
+  {
+    std::vector<uint32_t> tmp;
+#pragma omp for schedule(dynamic)
+    for (int64_t b = 0; b < static_cast<int64_t>(header->numBlocks); ++b) {
+      const size_t first = b * blockSize,
+                   m = std::min(blockSize, n - std::min(n, first));
+      const char *cur = base + index[b], *end = base + index[b + 1];
+
+      bool ok = true;
+      for (int i = 0; i < 3 && ok; ++i) {
+        float *dst = coords[i] + first;
+        ok = decodeStream(cur, end, m, tmp,
+                          [&](size_t k, int32_t q) { dst[k] = q * step; });
+      }
+      ok = ok && decodeStream(cur, end, m, tmp, [&](size_t k, int32_t q) {
+             in[first + k] = q / intensityScale;
+           });
+      for (int c = 0; c < 3 && ok; ++c)
+        ok = decodeStream(cur, end, m, tmp, [&](size_t k, int32_t q) {
+          rgb[3 * (first + k) + c] = static_cast<unsigned char>(q);
+        });
+
+      corrupt = corrupt || !ok || cur != end;
+    }
+  }
+
+  if (corrupt)
+    return;
+
+  xs = x;
+  ys = y;
+  zs = z;
+  intensities = in;
+  colors = rgb;
+}
+
+void scan::ScanFile::toPoints(size_t first, size_t n,
+                              scan::PointXYZRGBA *points) const {
+#pragma omp parallel for schedule(static)
+  for (size_t k = first; k < first + n; ++k) {
+    auto &p = points[k - first];
+    p.point = point(k);
+    p.intensity = intensities[k];
+    std::memcpy(p.rgb, rgb(k), 3 * sizeof(char));
+  }
+}
+
+void scan::ScanFile::toPoints(std::vector<scan::PointXYZRGBA> &points) const {
+  points.resize(size());
+  toPoints(0, size(), points.data());
+}
+
+bool scan::ScanFile::isScanFile(const std::string &name) {
+  ArtifactStream in(name);
+  char magic[sizeof(ScanFileHeader::kMagic)] = {};
+  in.read(magic, sizeof(magic));
+  return in && std::memcmp(magic, ScanFileHeader::kMagic, sizeof(magic)) == 0;
+}
+
+void scan::ScanFile::convertLegacy(const std::string &legacyName,
+                                   const std::string &outName,
+                                   double precision) {
+  // NB: A unique name in the same folder, so that the rename is atomic and
+  // no other process converting the same file writes to it
+  std::string tmpName = outName + ".XXXXXX";
+  const int fd = mkstemp(&tmpName[0]);
+  if (fd == -1) {
+    std::cout << "[scan::ScanFile] Could not create a temporary file for: "
+              << outName << std::endl;
+    exit(1);
+  }
+  ::close(fd);
+
+  std::unique_ptr<ScanFileWriter> writer;
+  readLegacy(legacyName,
+             [&](int columns, int rows) {
+               writer.reset(
+                   new ScanFileWriter(tmpName, columns, rows, precision));
+             },
+             [&](const scan::PointXYZRGBA *points, size_t, size_t n) {
+               writer->append(points, n);
+             });
+  writer->close();
+
+  if (std::rename(tmpName.c_str(), outName.c_str()) != 0) {
+    std::perror(("[scan::ScanFile] Could not rename " + tmpName + " to " +
+                 outName)
+                    .c_str());
+    std::remove(tmpName.c_str());
+    exit(1);
+  }
+}
@@ -0,0 +1,173 @@
+#pragma once
+#ifndef SCAN_FILE_HPP
+#define SCAN_FILE_HPP
+
+#include <MappedFile.hpp>
+#include <eigen3/Eigen/Eigen>
+#include <scan_typedefs.hpp>
+
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace scan {
+/**
+  On disk layout of a binary scan.  Points are stored column major, the
+  same order as the PTX file.
+
+  Raw files have separate x, y, z, intensity and rgb arrays after the
+  header, each one starting on an alignment boundary so that a memory
+  mapping of the file can be used as is.
+
+  Compressed files have independently decodable blocks of blockSize
+  points followed by an index of numBlocks + 1 block offsets.  Version 1
+  files are always raw and don't have the fields after encoding
+*/
+struct ScanFileHeader {
+  static constexpr char kMagic[8] = {'S', 'C', 'A', 'N', 'S', 'O', 'A', '\0'};
+  static constexpr uint32_t kVersion = 2;
+  static constexpr uint64_t kAlignment = 64;
+  static constexpr uint32_t kBlockSize = 1 << 14;
+
+  enum Encoding : uint32_t { RAW = 0, COMPRESSED = 1 };
+
+  char magic[8];
+  uint32_t version;
+  int32_t columns, rows;
+  uint32_t encoding;
+  /* Bounding box of all points that aren't at the origin */
+  float min[3], max[3];
+  uint64_t xOffset, yOffset, zOffset, intensityOffset, rgbOffset, fileSize;
+  /* Only for compressed files */
+  float precision;
+  uint32_t blockSize;
+  uint64_t numBlocks, blockIndexOffset;
+
+  ScanFileHeader() = default;
+  ScanFileHeader(int columns, int rows, double precision);
+
+  uint64_t numPoints() const {
+    return static_cast<uint64_t>(columns) * rows;
+  };
+  /* Grows the bounding box by every point that isn't at the origin */
+  void extendBounds(const scan::PointXYZRGBA *points, size_t n);
+  bool compressed() const { return version >= 2 && encoding == COMPRESSED; };
+};
+
+/**
+  Writes a binary scan.  Points can be appended in any number of blocks.
+  Raw files have each block written directly into its place in every
+  array, compressed files encode every blockSize points as they arrive
+*/
+class ScanFileWriter {
+public:
+  /* precision is the quantization step in meters, 0 writes a raw file */
+  ScanFileWriter(const std::string &name, int columns, int rows,
+                 double precision = 0);
+  ~ScanFileWriter();
+
+  void append(const scan::PointXYZRGBA *points, size_t n);
+  /* Writes the final header.  Exits if fewer than rows * columns
+   * points were appended */
+  void close();
+
+  static void write(const std::string &name, int columns, int rows,
+                    const std::vector<scan::PointXYZRGBA> &points,
+                    double precision = 0);
+
+private:
+  void appendRaw(const scan::PointXYZRGBA *points, size_t n);
+  void flushBlock();
+
+  std::string name;
+  std::ofstream out;
+  ScanFileHeader header;
+  uint64_t written;
+  /* Number of values quantize had to clamp */
+  uint64_t clamped;
+  std::vector<char> buffer;
+  std::vector<scan::PointXYZRGBA> pending;
+  std::vector<uint64_t> blockOffsets;
+};
+
+/**
+  Read only view of a binary scan.  Raw files are memory mapped and the
+  arrays are used directly from the mapping.  Compressed files are
+  decoded, one block per thread, into arrays owned by the ScanFile, and
+  so are files in the old per-point record format.  The file is never
+  written to
+*/
+class ScanFile {
+public:
+  ScanFile()
+      : base{nullptr}, length{0}, header{nullptr}, xs{nullptr}, ys{nullptr},
+        zs{nullptr}, intensities{nullptr}, colors{nullptr} {};
+  ScanFile(const std::string &name) : ScanFile() { open(name); };
+  ScanFile(const ScanFile &) = delete;
+  ScanFile &operator=(const ScanFile &) = delete;
+
+  /* Maps the file, or its entry of the ArtifactStore of its folder if that
+   * has been packed.  Files in the old per-point record format are read
+   * into memory as is.  Exits if the file can't be read */
+  void open(const std::string &name);
+
+  int getColumns() const { return header->columns; };
+  int getRows() const { return header->rows; };
+  size_t size() const { return header->numPoints(); };
+  Eigen::Vector3f getMin() const {
+    return Eigen::Map<const Eigen::Vector3f>(header->min);
+  };
+  Eigen::Vector3f getMax() const {
+    return Eigen::Map<const Eigen::Vector3f>(header->max);
+  };
+
+  const float *x() const { return xs; };
+  const float *y() const { return ys; };
+  const float *z() const { return zs; };
+  const float *intensity() const { return intensities; };
+  /* 3 values per point */
+  const unsigned char *rgb() const { return colors; };
+
+  Eigen::Vector3f point(size_t i) const {
+    return Eigen::Vector3f(xs[i], ys[i], zs[i]);
+  };
+  const unsigned char *rgb(size_t i) const { return colors + 3 * i; };
+  /* Gathers the points in [first, first + n) into AoS form */
+  void toPoints(size_t first, size_t n, scan::PointXYZRGBA *points) const;
+  void toPoints(std::vector<scan::PointXYZRGBA> &points) const;
+
+  /* Checks the magic number of the file */
+  static bool isScanFile(const std::string &name);
+  /* Converts a file of scan::PointXYZRGBA::writeToFile records preceded by
+   * columns and rows into the current format.  The output is compressed,
+   * and so quantized, only if precision > 0.  outName is written under a
+   * unique temporary name first and then renamed, so it may be legacyName */
+  static void convertLegacy(const std::string &legacyName,
+                            const std::string &outName,
+                            double precision = 0);
+
+private:
+  template <typename T> const T *array(uint64_t offset) const {
+    return reinterpret_cast<const T *>(base + offset);
+  };
+  void decode();
+  void loadLegacy(const std::string &name);
+
+  /* The file is the length bytes at base in file, which is the whole store
+   * for a packed scan */
+  std::shared_ptr<const MappedFile> file;
+  const char *base;
+  size_t length;
+  /* Only for files in the old format, which have no header to map */
+  ScanFileHeader legacyHeader;
+  const ScanFileHeader *header;
+  const float *xs, *ys, *zs, *intensities;
+  const unsigned char *colors;
+  std::vector<float> decoded;
+  std::vector<unsigned char> decodedColors;
+};
+} // scan
+
+#endif // SCAN_FILE_HPP
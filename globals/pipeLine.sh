@@ -9,6 +9,7 @@ mkdir -p $1/placementOptions/V1
 mkdir -p $1/placementOptions/V2
 mkdir -p $1/panoramas/images
 mkdir -p $1/panoramas/data
+mkdir -p $1/panoramas/binary
 mkdir -p $1/cloudNormals
 mkdir -p $1/binaryFiles
 mkdir -p $1/densityMaps/R3
@@ -22,6 +23,7 @@ mkdir -p $1/voxelGrids/R0
 mkdir -p $1/voxelGrids/R1
 mkdir -p $1/voxelGrids/R2
 mkdir -p $1/voxelGrids/metaData
+mkdir -p $1/voxelGrids/descriptors
 mkdir -p $1/doors/pointcloud
 mkdir -p $1/doors/floorplan
 
@@ -1,5 +1,7 @@
 #include "scan_gflags.h"
+#include "ArtifactStore.hpp"
 
+#include <algorithm>
 #include <iostream>
 
 DEFINE_bool(
@@ -26,6 +28,34 @@ DEFINE_bool(fe, false, "Tells the program to only examine free space evidence");
 DEFINE_bool(preview, false, "Turns on previews of the output");
 DEFINE_bool(3D, false, "writes out 3D voxelGrids");
 DEFINE_bool(2D, false, "Creates 2D density maps");
+DEFINE_bool(organizedNormals, false,
+            "Estimates normals on the PTX grid instead of with a KdTree.  "
+            "Faster and needs less memory, but the normals differ from the "
+            "KdTree ones, and so do the rotations and doors found from them");
+DEFINE_bool(ransacManhattan, false,
+            "Finds the Manhattan frame with RANSAC instead of with a "
+            "histogram of the normals");
+DEFINE_bool(manhattanDoorGrid, false,
+            "Finds doors in a voxel grid aligned with the Manhattan frame "
+            "of the scan instead of with its axes.  Much faster, but the "
+            "doors found can differ from those of the scan aligned grid");
+DEFINE_bool(weightRays, true,
+            "Weights every free space ray by the number of points in the "
+            "voxel it was cast towards");
+DEFINE_bool(rangeImage, false,
+            "Finds free space evidence with the range map of the panorama "
+            "of the scan instead of by casting rays");
+DEFINE_bool(descriptorIndex, false,
+            "Writes a nearest neighbor index over SIFT descriptors of the "
+            "keypoints of the panorama of every scan");
+DEFINE_bool(convertLegacy, false,
+            "Converts the binary scans in the old per-point record format "
+            "to the current format, in place, and exits.  They are "
+            "compressed if scanPrecision > 0");
+DEFINE_bool(legacyPanoramas, true,
+            "Writes the image and data files of every panorama as well as "
+            "its container.  Only older builds of placeScan and scanDensity "
+            "need them");
 DEFINE_string(floorPlan, "floorPlan.png",
               "Path to the floor plan that the scan should be placed on.  This "
               "will be appended to the dataPath.");
@@ -67,6 +97,25 @@ DEFINE_int32(metricNumber, 3,
 DEFINE_int32(top, -1, "Only shows the top x placements, -1=ALL");
 DEFINE_int32(threads, 0,
              "Number of threads to use.  If 0 OMP runtime will decide");
+DEFINE_int32(blockBudget, 0,
+             "Size in MB of the blocks the preprocessor reads scans in.  If "
+             "0, the whole scan is loaded into memory at once.  This only "
+             "bounds the read buffer: the panoramas and range map take about "
+             "27 bytes per point either way, and the normals need about 15 "
+             "bytes per point with organizedNormals or the whole scan as one "
+             "PCL cloud without it");
+DEFINE_int32(concurrentScans, 1,
+             "Number of scans the preprocessor works on at once");
+DEFINE_int32(memoryBudget, 0,
+             "Memory budget in MB shared by the scans being preprocessed at "
+             "once.  If 0, only concurrentScans limits them");
+DEFINE_int32(freeSpaceBand, 0,
+             "If > 0, the range image only looks for free space within this "
+             "many voxels of a point.  If 0, it looks in every voxel");
+DEFINE_double(scanPrecision, 0,
+              "If > 0, binary scans are written compressed with coordinates "
+              "quantized to this many meters (ie 0.0005 for 0.5mm).  If 0, "
+              "they are written uncompressed");
 DEFINE_double(
     scale, -1,
     "Scale used to size the density maps.  If -1, it will be looked up");
@@ -89,8 +138,20 @@ void prependDataPath() {
 }
 
 void parseFolder(const std::string &name, std::vector<std::string> &out) {
-  for (auto &file : folderToIterator(name))
-    out.push_back(file.path().filename().string());
+  // NB: Artifacts written after a folder was packed are loose files next
+  // to the store.  Both are listed, and a file that is in both is listed
+  // once
+  const size_t first = out.size();
+  auto store = scan::ArtifactStore::forFolder(name);
+  if (store) {
+    auto keys = store->keys();
+    out.insert(out.end(), keys.begin(), keys.end());
+  }
+  if (!store || boost::filesystem::is_directory(name))
+    for (auto &file : folderToIterator(name))
+      out.push_back(file.path().filename().string());
+  std::sort(out.begin() + first, out.end());
+  out.erase(std::unique(out.begin() + first, out.end()), out.end());
   std::sort(out.begin(), out.end());
 }
 
@@ -23,6 +23,14 @@ DECLARE_bool(fe);
 DECLARE_bool(preview);
 DECLARE_bool(3D);
 DECLARE_bool(2D);
+DECLARE_bool(organizedNormals);
+DECLARE_bool(ransacManhattan);
+DECLARE_bool(manhattanDoorGrid);
+DECLARE_bool(weightRays);
+DECLARE_bool(rangeImage);
+DECLARE_bool(descriptorIndex);
+DECLARE_bool(convertLegacy);
+DECLARE_bool(legacyPanoramas);
 DECLARE_string(floorPlan);
 DECLARE_string(binaryFolder);
 DECLARE_string(dmFolder);
@@ -45,7 +53,12 @@ DECLARE_int32(numLevels);
 DECLARE_int32(metricNumber);
 DECLARE_int32(top);
 DECLARE_int32(threads);
+DECLARE_int32(blockBudget);
+DECLARE_int32(concurrentScans);
+DECLARE_int32(memoryBudget);
+DECLARE_int32(freeSpaceBand);
 DECLARE_double(scale);
+DECLARE_double(scanPrecision);
 
 void prependDataPath();
 void parseFolder(const std::string &name, std::vector<std::string> &out);
@@ -53,11 +66,11 @@ boost::filesystem::directory_iterator folderToIterator(const std::string &name);
 template <class UrnaryPredicate>
 void parseFolder(const std::string &name, std::vector<std::string> &out,
                  UrnaryPredicate filter) {
-  for (auto &file : folderToIterator(name)) {
-    const std::string name = file.path().filename().string();
-    if (filter(name))
-      out.push_back(name);
-  }
+  std::vector<std::string> names;
+  parseFolder(name, names);
+  for (auto &n : names)
+    if (filter(n))
+      out.push_back(n);
   std::sort(out.begin(), out.end());
 }
 int numberToIndex(const std::vector<std::string> &names, const int number);
@@ -1,4 +1,5 @@
 #include "scan_typedefs.hpp"
+#include "ArtifactStore.hpp"
 #include <locale>
 #include <opencv2/core.hpp>
 
@@ -81,22 +82,115 @@ void scan::PointXYZRGB::loadFromFile(std::ifstream &in) {
   in.read(reinterpret_cast<char *>(rgb), 3 * sizeof(char));
 }
 
-void place::VoxelGrid::writeToFile(std::ofstream &out) {
-  int numZ = v.size();
-  out.write(reinterpret_cast<const char *>(&numZ), sizeof(numZ));
-  for (int k = 0; k < numZ; ++k) {
-    saveMatrixAsSparse(v[k], out);
+uint64_t fnv1a(const char *data, size_t size, uint64_t hash) {
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+place::VoxelGrid::VoxelGrid(int x, int y, int z)
+    : x{x}, y{y}, z{z}, wordsPerRow{(x + 63) / 64},
+      bits(static_cast<size_t>(z) * y * wordsPerRow, 0), c{0} {}
+
+size_t place::VoxelGrid::count() const {
+  size_t count = 0;
+  for (auto w : bits)
+    count += __builtin_popcountll(w);
+  return count;
+}
+
+size_t place::VoxelGrid::count(int k) const {
+  size_t count = 0;
+  const uint64_t *slice = row(0, k);
+  for (int i = 0; i < y * wordsPerRow; ++i)
+    count += __builtin_popcountll(slice[i]);
+  return count;
+}
+
+size_t place::VoxelGrid::countAnd(const VoxelGrid &o) const {
+  assert(x == o.x && y == o.y && z == o.z && "Grids not the same size!");
+  size_t count = 0;
+  for (size_t i = 0; i < bits.size(); ++i)
+    count += __builtin_popcountll(bits[i] & o.bits[i]);
+  return count;
+}
+
+size_t place::VoxelGrid::countAndNot(const VoxelGrid &o) const {
+  assert(x == o.x && y == o.y && z == o.z && "Grids not the same size!");
+  size_t count = 0;
+  for (size_t i = 0; i < bits.size(); ++i)
+    count += __builtin_popcountll(bits[i] & ~o.bits[i]);
+  return count;
+}
+
+place::VoxelGrid place::VoxelGrid::block(int i, int j, int k, int x, int y,
+                                         int z) const {
+  VoxelGrid out(x, y, z);
+  const uint64_t lastMask =
+      x % 64 ? (uint64_t(1) << (x % 64)) - 1 : ~uint64_t(0);
+  for (int kk = 0; kk < z; ++kk) {
+    for (int jj = 0; jj < y; ++jj) {
+      uint64_t *dst = out.row(jj, kk);
+      for (int w = 0; w < out.wordsPerRow; ++w)
+        dst[w] = word(i + 64 * w, j + jj, k + kk);
+      if (out.wordsPerRow)
+        dst[out.wordsPerRow - 1] &= lastMask;
+    }
   }
+  out.zZ = zZ;
+  out.c = c;
+  return out;
+}
+
+void place::VoxelGrid::writeToFile(std::ofstream &out) {
+  // NB: The older format started with the number of slices, so a
+  // negative marker tells the two apart
+  constexpr int bitPacked = -1;
+  out.write(reinterpret_cast<const char *>(&bitPacked), sizeof(bitPacked));
+  out.write(reinterpret_cast<const char *>(&x), sizeof(x));
+  out.write(reinterpret_cast<const char *>(&y), sizeof(y));
+  out.write(reinterpret_cast<const char *>(&z), sizeof(z));
+  const char *bitsPtr = reinterpret_cast<const char *>(bits.data());
+  const uint64_t checksum = fnv1a(bitsPtr, bits.size() * sizeof(uint64_t));
+  out.write(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+  out.write(bitsPtr, bits.size() * sizeof(uint64_t));
   out.write(reinterpret_cast<const char *>(zZ.data()), sizeof(zZ));
   out.write(reinterpret_cast<const char *>(&c), sizeof(c));
 }
 
-void place::VoxelGrid::loadFromFile(std::ifstream &in) {
-  int numZ;
-  in.read(reinterpret_cast<char *>(&numZ), sizeof(numZ));
-  v.resize(numZ);
-  for (int k = 0; k < numZ; ++k) {
-    loadMatrixFromSparse(v[k], in);
+void place::VoxelGrid::loadFromFile(std::istream &in) {
+  int marker;
+  in.read(reinterpret_cast<char *>(&marker), sizeof(marker));
+  if (marker < 0) {
+    int x, y, z;
+    in.read(reinterpret_cast<char *>(&x), sizeof(x));
+    in.read(reinterpret_cast<char *>(&y), sizeof(y));
+    in.read(reinterpret_cast<char *>(&z), sizeof(z));
+    *this = VoxelGrid(x, y, z);
+    uint64_t checksum;
+    in.read(reinterpret_cast<char *>(&checksum), sizeof(checksum));
+    char *bitsPtr = reinterpret_cast<char *>(bits.data());
+    in.read(bitsPtr, bits.size() * sizeof(uint64_t));
+    if (!in || fnv1a(bitsPtr, bits.size() * sizeof(uint64_t)) != checksum) {
+      std::cout << "[place::VoxelGrid::loadFromFile] Voxel grid is truncated "
+                   "or corrupt"
+                << std::endl;
+      exit(1);
+    }
+  } else {
+    const int numZ = marker;
+    std::vector<Eigen::MatrixXb> v(numZ);
+    for (int k = 0; k < numZ; ++k) {
+      loadMatrixFromSparse(v[k], in);
+    }
+    *this = numZ ? VoxelGrid(v[0].cols(), v[0].rows(), numZ) : VoxelGrid();
+    for (int k = 0; k < numZ; ++k)
+      for (int i = 0; i < x; ++i)
+        for (int j = 0; j < y; ++j)
+          if (v[k](j, i))
+            set(i, j, k);
   }
   in.read(reinterpret_cast<char *>(zZ.data()), sizeof(zZ));
   in.read(reinterpret_cast<char *>(&c), sizeof(c));
@@ -111,7 +205,7 @@ void place::MetaData::writeToFile(std::ofstream &out) {
   out.write(reinterpret_cast<const char *>(&s), sizeof(s));
 }
 
-void place::MetaData::loadFromFile(std::ifstream &in) {
+void place::MetaData::loadFromFile(std::istream &in) {
   in.read(reinterpret_cast<char *>(zZ.data()), sizeof(zZ));
   in.read(reinterpret_cast<char *>(&x), sizeof(x));
   in.read(reinterpret_cast<char *>(&y), sizeof(y));
@@ -120,7 +214,7 @@ void place::MetaData::loadFromFile(std::ifstream &in) {
   in.read(reinterpret_cast<char *>(&s), sizeof(s));
 }
 
-place::Panorama::Panorama() : imgs{20} {};
+place::Panorama::Panorama() : imgs{1} {};
 
 void place::Panorama::writeToFile(const std::string &imgName,
                                   const std::string &dataName) {
@@ -158,10 +252,10 @@ void place::Panorama::writeToFile(const std::string &imgName,
 
 void place::Panorama::loadFromFile(const std::string &imgName,
                                    const std::string &dataName) {
-  imgs[0] = cv::imread(imgName);
+  imgs[0] = scan::readImage(imgName, cv::IMREAD_COLOR);
 
   int rows, cols, numKeypoints;
-  std::ifstream in(dataName, std::ios::in | std::ios::binary);
+  scan::ArtifactStream in(dataName);
   in.read(reinterpret_cast<char *>(&rows), sizeof(rows));
   in.read(reinterpret_cast<char *>(&cols), sizeof(cols));
   rMap.resize(rows, cols);
@@ -174,6 +268,8 @@ void place::Panorama::loadFromFile(const std::string &imgName,
     in.read(reinterpret_cast<char *>(&kp.x), sizeof(float));
     in.read(reinterpret_cast<char *>(&kp.y), sizeof(float));
   }
+  keypointSizes.clear();
+  keypointAngles.clear();
   in.read(reinterpret_cast<char *>(&rows), sizeof(rows));
   in.read(reinterpret_cast<char *>(&cols), sizeof(cols));
   surfaceNormals.resize(rows, cols);
@@ -182,26 +278,177 @@ void place::Panorama::loadFromFile(const std::string &imgName,
     in.read(reinterpret_cast<char *>((nPtr + i)->data()), 3 * sizeof(float));
   }
   in.read(reinterpret_cast<char *>(&floorCoord), sizeof(floorCoord));
-  in.close();
 
   if (floorCoord > -1.5 || floorCoord < -1.7)
     floorCoord = -1.6;
+
+  buildPyramid();
+}
+
+static void padTo(std::ofstream &out, uint64_t offset) {
+  static const char zeros[place::PanoramaHeader::kAlignment] = {};
+  out.write(zeros, offset - out.tellp());
+}
+
+void place::Panorama::writeToFile(const std::string &name) {
+  if (static_cast<int>(imgs.size()) < NumLevels)
+    buildPyramid();
+
+  typedef PanoramaHeader::Section Section;
+  PanoramaHeader header;
+  std::memset(&header, 0, sizeof(header));
+  header.magic = PanoramaHeader::kMagic;
+  header.version = PanoramaHeader::kVersion;
+  header.numLevels = imgs.size();
+  header.imgType = imgs[0].type();
+  header.floorCoord = floorCoord;
+
+  std::vector<Section> levels(imgs.size());
+  uint64_t offset = sizeof(header) + levels.size() * sizeof(Section);
+  auto place = [&offset](Section &section, int rows, int cols,
+                         uint64_t step) {
+    section = Section{rows, cols, step, PanoramaHeader::align(offset)};
+    offset = section.offset + rows * step;
+  };
+  for (size_t n = 0; n < imgs.size(); ++n)
+    place(levels[n], imgs[n].rows, imgs[n].cols,
+          imgs[n].cols * imgs[n].elemSize());
+  place(header.rMap, rMap.rows(), rMap.cols(), rMap.cols() * sizeof(float));
+  place(header.surfaceNormals, surfaceNormals.rows(), surfaceNormals.cols(),
+        surfaceNormals.cols() * sizeof(Eigen::Vector3f));
+  const bool shapes = !keypoints.empty() &&
+                      keypointSizes.size() == keypoints.size() &&
+                      keypointAngles.size() == keypoints.size();
+  const int kpCols = shapes ? 2 : 1;
+  place(header.keypoints, keypoints.size(), kpCols,
+        kpCols * sizeof(cv::Point2f));
+  header.size = offset;
+
+  std::ofstream out(name, std::ios::out | std::ios::binary);
+  out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char *>(levels.data()),
+            levels.size() * sizeof(Section));
+  for (size_t n = 0; n < imgs.size(); ++n) {
+    padTo(out, levels[n].offset);
+    for (int r = 0; r < imgs[n].rows; ++r)
+      out.write(imgs[n].ptr<char>(r), levels[n].step);
+  }
+  padTo(out, header.rMap.offset);
+  out.write(reinterpret_cast<const char *>(rMap.data()),
+            sizeof(float) * rMap.size());
+  padTo(out, header.surfaceNormals.offset);
+  out.write(reinterpret_cast<const char *>(surfaceNormals.data()),
+            sizeof(Eigen::Vector3f) * surfaceNormals.size());
+  padTo(out, header.keypoints.offset);
+  for (size_t i = 0; i < keypoints.size(); ++i) {
+    out.write(reinterpret_cast<const char *>(&keypoints[i]),
+              sizeof(cv::Point2f));
+    if (shapes) {
+      out.write(reinterpret_cast<const char *>(&keypointSizes[i]),
+                sizeof(float));
+      out.write(reinterpret_cast<const char *>(&keypointAngles[i]),
+                sizeof(float));
+    }
+  }
+  out.close();
 }
 
-const cv::Mat &place::Panorama::operator[](int n) {
-  if (imgs.size() <= n || !imgs[n].data) {
-#pragma omp critical
-    {
-      if (imgs.size() <= n || !imgs[n].data) {
-        if (imgs.size() <= n)
-          imgs.resize(n + 1);
+void place::Panorama::loadFromFile(const std::string &name) {
+  const char *base;
+  size_t fileSize;
+  auto mapping = scan::mapArtifact(name, base, fileSize);
+  if (!mapping) {
+    std::cout << "[place::Panorama::loadFromFile] Could not open: " << name
+              << std::endl;
+    exit(1);
+  }
+
+  typedef PanoramaHeader::Section Section;
+  const auto *header = reinterpret_cast<const PanoramaHeader *>(base);
+  const auto *levels =
+      reinterpret_cast<const Section *>(base + sizeof(PanoramaHeader));
+  // NB: A row of elemSize elements has to fit in step, and rows that are
+  // copied out in one go have to be packed
+  auto inFile = [&](const Section &section, size_t elemSize, bool packed) {
+    const uint64_t rowSize = static_cast<uint64_t>(section.cols) * elemSize;
+    return section.rows >= 0 && section.cols >= 0 &&
+           section.step <= header->size && rowSize <= section.step &&
+           (!packed || rowSize == section.step) &&
+           section.offset <= header->size &&
+           section.rows * section.step <= header->size - section.offset;
+  };
+  bool valid =
+      fileSize >= sizeof(PanoramaHeader) &&
+      header->magic == PanoramaHeader::kMagic &&
+      header->version == PanoramaHeader::kVersion &&
+      header->size <= fileSize && header->imgType >= 0 &&
+      header->imgType == CV_MAT_TYPE(header->imgType) &&
+      sizeof(PanoramaHeader) + header->numLevels * sizeof(Section) <=
+          header->size &&
+      inFile(header->rMap, sizeof(float), true) &&
+      inFile(header->surfaceNormals, sizeof(Eigen::Vector3f), true) &&
+      inFile(header->keypoints, sizeof(cv::Point2f), true) &&
+      (header->keypoints.cols == 1 || header->keypoints.cols == 2);
+  for (uint32_t n = 0; valid && n < header->numLevels; ++n)
+    valid = inFile(levels[n], CV_ELEM_SIZE(header->imgType), false);
+  if (!valid) {
+    std::cout << "[place::Panorama::loadFromFile] Not a panorama container: "
+              << name << std::endl;
+    exit(1);
+  }
 
-        const double scale = pow(ScalingFactor, -n);
-        cv::resize(imgs[0], imgs[n], cv::Size(), scale, scale, CV_INTER_AREA);
-      }
+  // NB: The mapping is read only, the images are never copied out of it
+  imgs.resize(header->numLevels);
+  for (uint32_t n = 0; n < header->numLevels; ++n)
+    imgs[n] = cv::Mat(levels[n].rows, levels[n].cols, header->imgType,
+                      const_cast<char *>(base + levels[n].offset),
+                      levels[n].step);
+
+  rMap.resize(header->rMap.rows, header->rMap.cols);
+  std::memcpy(rMap.data(), base + header->rMap.offset,
+              sizeof(float) * rMap.size());
+  surfaceNormals.resize(header->surfaceNormals.rows,
+                        header->surfaceNormals.cols);
+  std::memcpy(reinterpret_cast<char *>(surfaceNormals.data()),
+              base + header->surfaceNormals.offset,
+              sizeof(Eigen::Vector3f) * surfaceNormals.size());
+  const int kpCols = header->keypoints.cols;
+  const auto *kpPtr =
+      reinterpret_cast<const cv::Point2f *>(base + header->keypoints.offset);
+  keypoints.resize(header->keypoints.rows);
+  keypointSizes.clear();
+  keypointAngles.clear();
+  for (int i = 0; i < header->keypoints.rows; ++i) {
+    keypoints[i] = kpPtr[i * kpCols];
+    if (kpCols == 2) {
+      keypointSizes.push_back(kpPtr[i * kpCols + 1].x);
+      keypointAngles.push_back(kpPtr[i * kpCols + 1].y);
     }
   }
-  return imgs[n];
+
+  floorCoord = header->floorCoord;
+  if (floorCoord > -1.5 || floorCoord < -1.7)
+    floorCoord = -1.6;
+  file = mapping;
+}
+
+constexpr int place::Panorama::NumLevels;
+
+void place::Panorama::buildPyramid() {
+  // NB: Levels may be views of a mapped container, so they are replaced
+  // rather than resized into
+  imgs.resize(1);
+  imgs.resize(NumLevels);
+#pragma omp parallel for schedule(dynamic)
+  for (int n = 1; n < NumLevels; ++n) {
+    const double scale = pow(ScalingFactor, -n);
+    cv::resize(imgs[0], imgs[n], cv::Size(), scale, scale, CV_INTER_AREA);
+  }
+}
+
+const cv::Mat &place::Panorama::operator[](int n) const {
+  static const cv::Mat empty;
+  return n < imgs.size() ? imgs[n] : empty;
 }
 
 double place::edge::getWeight() const {
@@ -379,7 +626,7 @@ void place::Door::writeToFile(std::ofstream &out) const {
   out.write(reinterpret_cast<const char *>(&w), sizeof(double));
 }
 
-void place::Door::loadFromFile(std::ifstream &in) {
+void place::Door::loadFromFile(std::istream &in) {
   in.read(reinterpret_cast<char *>(corner.data()), 3 * sizeof(double));
   in.read(reinterpret_cast<char *>(xAxis.data()), 3 * sizeof(double));
   in.read(reinterpret_cast<char *>(zAxis.data()), 3 * sizeof(double));
@@ -2,6 +2,9 @@
 #ifndef SCAN_TYPEDEFS_HPP
 #define SCAN_TYPEDEFS_HPP
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
 #include <eigen3/Eigen/Eigen>
 #include <eigen3/Eigen/Sparse>
 #include <eigen3/Eigen/StdVector>
@@ -11,7 +14,9 @@
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <unordered_map>
+#include <vector>
 
+#include "MappedFile.hpp"
 #include "scan_gflags.h"
 #include <omp.h>
 
@@ -185,13 +190,62 @@ struct ExclusionMap {
   Map &operator[](int r);
 };
 
+/**
+  Occupancy voxel grid with one bit per voxel.  Every row along x starts
+  on a new 64 bit word, with the first voxel in the lowest bit, so rows
+  of two grids can be compared 64 voxels at a time with AND, ANDNOT and
+  popcount.  Bits past the end of a row are always 0
+*/
 struct VoxelGrid {
-  std::vector<Eigen::MatrixXb> v;
+  int x, y, z, wordsPerRow;
+  std::vector<uint64_t> bits;
   Eigen::Vector3i zZ;
   size_t c;
 
+  VoxelGrid() : VoxelGrid(0, 0, 0){};
+  VoxelGrid(int x, int y, int z);
+
+  bool operator()(int i, int j, int k) const {
+    return row(j, k)[i / 64] >> (i % 64) & 1;
+  };
+  void set(int i, int j, int k) {
+    row(j, k)[i / 64] |= uint64_t(1) << (i % 64);
+  };
+
+  const uint64_t *row(int j, int k) const {
+    return &bits[(static_cast<size_t>(k) * y + j) * wordsPerRow];
+  };
+  uint64_t *row(int j, int k) {
+    return &bits[(static_cast<size_t>(k) * y + j) * wordsPerRow];
+  };
+
+  /* The 64 voxels of row (j, k) starting at voxel i, which need not be
+   * word aligned.  Voxels outside of the grid are 0 */
+  uint64_t word(int i, int j, int k) const {
+    if (j < 0 || j >= y || k < 0 || k >= z || i >= x || i <= -64)
+      return 0;
+    const uint64_t *r = row(j, k);
+    const int shift = i & 63, w = (i - shift) / 64;
+    const uint64_t lo = w >= 0 ? r[w] : 0;
+    const uint64_t hi = w + 1 < wordsPerRow ? r[w + 1] : 0;
+    return shift ? lo >> shift | hi << (64 - shift) : lo;
+  };
+
+  /* Number of occupied voxels, in the whole grid or in slice k */
+  size_t count() const;
+  size_t count(int k) const;
+  /* Number of voxels occupied in both grids, and occupied in this grid
+   * but not in o.  The grids must be the same size */
+  size_t countAnd(const VoxelGrid &o) const;
+  size_t countAndNot(const VoxelGrid &o) const;
+
+  /* The x by y by z block starting at voxel (i, j, k) */
+  VoxelGrid block(int i, int j, int k, int x, int y, int z) const;
+
   void writeToFile(std::ofstream &out);
-  void loadFromFile(std::ifstream &in);
+  /* Also reads the older format that stored every slice as a sparse
+   * MatrixXb */
+  void loadFromFile(std::istream &in);
 };
 
 struct moreInfo {
@@ -245,7 +299,7 @@ struct MetaData {
   int x, y, z;
   double vox, s;
   void writeToFile(std::ofstream &out);
-  void loadFromFile(std::ifstream &in);
+  void loadFromFile(std::istream &in);
 };
 
 class cube {
@@ -263,19 +317,75 @@ public:
   friend std::ostream &operator<<(std::ostream &os, const place::cube &print);
 };
 
+/**
+  On disk layout of a Panorama container.  The header is followed by a
+  table of numLevels sections, one for each level of the image pyramid.
+  Every section starts on an alignment boundary so that the images can
+  be used straight from a memory mapping of the file.  Offsets are from
+  the start of the file
+*/
+struct PanoramaHeader {
+  /* "PANORAM" */
+  static constexpr uint64_t kMagic = 0x004d41524f4e4150ull;
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint64_t kAlignment = 64;
+
+  /* rows by cols elements, step bytes apart from one row to the next */
+  struct Section {
+    int32_t rows, cols;
+    uint64_t step, offset;
+  };
+
+  uint64_t magic;
+  uint32_t version, numLevels;
+  int32_t imgType, padding;
+  double floorCoord;
+  /* keypoints has a column of positions, and a column of sizes and
+   * angles if they were saved */
+  Section rMap, surfaceNormals, keypoints;
+  uint64_t size;
+
+  static uint64_t align(uint64_t offset) {
+    return (offset + kAlignment - 1) / kAlignment * kAlignment;
+  };
+};
+
+/**
+  Panorama of a scan along with an image pyramid of it.  Level n of the
+  pyramid is imgs[0] scaled down by ScalingFactor^n.  The pyramid is
+  built once by loadFromFile and is read only after that, so it can be
+  shared by any number of threads
+*/
 struct Panorama {
   static constexpr double ScalingFactor = 1.2599210498948732;
+  /* Enough for one scan to be 100 times further from a point than
+   * another */
+  static constexpr int NumLevels = 20;
 
   double floorCoord;
   std::vector<cv::Mat> imgs;
   Eigen::RowMatrixXf rMap;
   std::vector<cv::Point2f> keypoints;
+  /* The size and angle SIFT found every keypoint at.  Empty for
+   * panoramas saved without them, which the older files always are */
+  std::vector<float> keypointSizes, keypointAngles;
   Eigen::ArrayXV3f surfaceNormals;
   void writeToFile(const std::string &imgName, const std::string &dataName);
   void loadFromFile(const std::string &imgName, const std::string &dataName);
+  /* Writes everything, including the whole pyramid, to one container */
+  void writeToFile(const std::string &name);
+  /* Memory maps a container.  The pyramid is read from the mapping in
+   * place, so it must not be written to */
+  void loadFromFile(const std::string &name);
+  /* Builds every level of the pyramid from imgs[0] */
+  void buildPyramid();
   Panorama();
 
-  const cv::Mat &operator[](int n);
+  /* Level n of the pyramid, or an empty image past the last level */
+  const cv::Mat &operator[](int n) const;
+
+private:
+  std::shared_ptr<const scan::MappedFile> file;
 };
 
 template <class It, class UnaryFunc, class UnaryPredicate>
@@ -327,7 +437,7 @@ struct Door {
       : corner{c}, xAxis{x}, zAxis{z}, h{h}, w{w} {};
 
   void writeToFile(std::ofstream &out) const;
-  void loadFromFile(std::ifstream &in);
+  void loadFromFile(std::istream &in);
 };
 
 } // place
@@ -349,44 +459,252 @@ int rectshow(const std::string &name, const cv::Mat &img);
 int rectshow(const cv::Mat &img);
 } // cv
 
+/* FNV-1a hash of size bytes, continuing from hash.  Used to check data
+ * read back from disk */
+uint64_t fnv1a(const char *data, size_t size,
+               uint64_t hash = 0xcbf29ce484222325ull);
+
+/* Columns per tile of saveMatrixAsSparse, and how a tile is coded */
+constexpr int sparseTileCols = 64;
+constexpr int runLengthTile = 0, bitmapTile = 1;
+
+/**
+  Saves a dense matrix that is mostly zeros.  The matrix is cut into
+  tiles of sparseTileCols columns, and every tile with non-zeros is
+  coded on its own, as whichever is smaller of
+   - runs: the offset in the tile and length of every span of non-zeros,
+     each followed by its values
+   - bitmap: one bit per entry of the tile, then the non-zeros in order
+  The header holds the dimensions, the size of every tile and a checksum
+  of the tiles, so the tiles can be read with one call and decoded in
+  parallel.  Tiles are also coded in parallel
+*/
 template <typename MatrixType>
 void saveMatrixAsSparse(const MatrixType &mat, std::ofstream &out) {
   typedef typename MatrixType::Scalar Scalar;
-  int numNonZeros = 0, rows = mat.rows(), cols = mat.cols();
+  // NB: The older format started with the number of non-zeros, so a
+  // negative marker tells the two apart
+  const int marker = -1, rows = mat.rows(), cols = mat.cols(),
+            numTiles = (cols + sparseTileCols - 1) / sparseTileCols;
   const Scalar *dataPtr = mat.data();
-  for (int i = 0; i < mat.size(); ++i)
-    if (*(dataPtr + i))
-      ++numNonZeros;
-
-  out.write(reinterpret_cast<const char *>(&numNonZeros), sizeof(numNonZeros));
-  out.write(reinterpret_cast<const char *>(&rows), sizeof(rows));
-  out.write(reinterpret_cast<const char *>(&cols), sizeof(cols));
 
-  for (int i = 0; i < mat.size(); ++i) {
-    if (*(dataPtr + i)) {
-      out.write(reinterpret_cast<const char *>(&i), sizeof(i));
-      out.write(reinterpret_cast<const char *>(dataPtr + i), sizeof(Scalar));
+  std::vector<std::vector<char>> tiles(numTiles);
+#pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < numTiles; ++t) {
+    const int begin = t * sparseTileCols * rows,
+              end = std::min(cols, (t + 1) * sparseTileCols) * rows,
+              numWords = (end - begin + 63) / 64;
+    int numNonZeros = 0, numSpans = 0;
+    for (int i = begin; i < end; ++i) {
+      if (dataPtr[i]) {
+        ++numNonZeros;
+        if (i == begin || !dataPtr[i - 1])
+          ++numSpans;
+      }
     }
+    if (numNonZeros == 0)
+      continue;
+
+    const size_t runLengthSize = numSpans * 2 * sizeof(int),
+                 bitmapSize = numWords * sizeof(uint64_t);
+    const int coding =
+        runLengthSize <= bitmapSize ? runLengthTile : bitmapTile;
+    auto &tile = tiles[t];
+    tile.resize(sizeof(coding) + std::min(runLengthSize, bitmapSize) +
+                numNonZeros * sizeof(Scalar));
+    char *dst = tile.data();
+    auto append = [&dst](const void *src, size_t size) {
+      std::memcpy(dst, src, size);
+      dst += size;
+    };
+    append(&coding, sizeof(coding));
+
+    if (coding == runLengthTile) {
+      for (int i = begin; i < end; ++i) {
+        if (!dataPtr[i])
+          continue;
+
+        int length = 1;
+        while (i + length < end && dataPtr[i + length])
+          ++length;
+
+        const int span[] = {i - begin, length};
+        append(span, sizeof(span));
+        append(dataPtr + i, length * sizeof(Scalar));
+        i += length;
+      }
+    } else {
+      std::vector<uint64_t> bitmap(numWords, 0);
+      for (int i = begin; i < end; ++i)
+        if (dataPtr[i])
+          bitmap[(i - begin) / 64] |= uint64_t(1) << ((i - begin) % 64);
+      append(bitmap.data(), bitmapSize);
+      for (int i = begin; i < end; ++i)
+        if (dataPtr[i])
+          append(dataPtr + i, sizeof(Scalar));
+    }
+  }
+
+  std::vector<uint64_t> tileSizes(numTiles);
+  uint64_t checksum = fnv1a(nullptr, 0);
+  for (int t = 0; t < numTiles; ++t) {
+    tileSizes[t] = tiles[t].size();
+    checksum = fnv1a(tiles[t].data(), tiles[t].size(), checksum);
   }
+
+  out.write(reinterpret_cast<const char *>(&marker), sizeof(marker));
+  out.write(reinterpret_cast<const char *>(&rows), sizeof(rows));
+  out.write(reinterpret_cast<const char *>(&cols), sizeof(cols));
+  out.write(reinterpret_cast<const char *>(&checksum), sizeof(checksum));
+  out.write(reinterpret_cast<const char *>(tileSizes.data()),
+            numTiles * sizeof(uint64_t));
+  for (auto &tile : tiles)
+    out.write(tile.data(), tile.size());
 }
 
+/* Loads a matrix saved by saveMatrixAsSparse.  Also reads the older
+ * format of (index, value) pairs */
 template <typename MatrixType>
-void loadMatrixFromSparse(MatrixType &mat, std::ifstream &in) {
+void loadMatrixFromSparse(MatrixType &mat, std::istream &in) {
   typedef typename MatrixType::Scalar Scalar;
-  int numNonZeros, rows, cols;
+  int marker, rows, cols;
 
-  in.read(reinterpret_cast<char *>(&numNonZeros), sizeof(numNonZeros));
+  in.read(reinterpret_cast<char *>(&marker), sizeof(marker));
   in.read(reinterpret_cast<char *>(&rows), sizeof(rows));
   in.read(reinterpret_cast<char *>(&cols), sizeof(cols));
 
   mat = MatrixType::Zero(rows, cols);
   Scalar *dataPtr = mat.data();
 
-  for (int i = 0; i < numNonZeros; ++i) {
-    int index;
-    in.read(reinterpret_cast<char *>(&index), sizeof(index));
-    in.read(reinterpret_cast<char *>(dataPtr + index), sizeof(Scalar));
+  if (marker >= 0) {
+    const int numNonZeros = marker;
+    constexpr size_t pairSize = sizeof(int) + sizeof(Scalar);
+    std::vector<char> pairs(numNonZeros * pairSize);
+    in.read(pairs.data(), pairs.size());
+    for (int i = 0; i < numNonZeros; ++i) {
+      int index;
+      std::memcpy(&index, pairs.data() + i * pairSize, sizeof(index));
+      std::memcpy(dataPtr + index, pairs.data() + i * pairSize + sizeof(index),
+                  sizeof(Scalar));
+    }
+    return;
+  }
+
+  const int numTiles = (cols + sparseTileCols - 1) / sparseTileCols;
+  uint64_t checksum;
+  std::vector<uint64_t> offsets(numTiles + 1, 0);
+  in.read(reinterpret_cast<char *>(&checksum), sizeof(checksum));
+  in.read(reinterpret_cast<char *>(offsets.data() + 1),
+          numTiles * sizeof(uint64_t));
+  for (int t = 0; t < numTiles; ++t)
+    offsets[t + 1] += offsets[t];
+
+  std::vector<char> tiles(offsets[numTiles]);
+  in.read(tiles.data(), tiles.size());
+  if (!in || fnv1a(tiles.data(), tiles.size()) != checksum) {
+    std::cout << "[loadMatrixFromSparse] Matrix is truncated or corrupt"
+              << std::endl;
+    exit(1);
+  }
+
+#pragma omp parallel for schedule(dynamic)
+  for (int t = 0; t < numTiles; ++t) {
+    if (offsets[t] == offsets[t + 1])
+      continue;
+
+    const int begin = t * sparseTileCols * rows,
+              end = std::min(cols, (t + 1) * sparseTileCols) * rows,
+              numWords = (end - begin + 63) / 64;
+    Scalar *tilePtr = dataPtr + begin;
+    const char *src = tiles.data() + offsets[t],
+               *srcEnd = tiles.data() + offsets[t + 1];
+    int coding;
+    std::memcpy(&coding, src, sizeof(coding));
+    src += sizeof(coding);
+
+    if (coding == runLengthTile) {
+      while (src < srcEnd) {
+        int span[2];
+        std::memcpy(span, src, sizeof(span));
+        src += sizeof(span);
+        std::memcpy(tilePtr + span[0], src, span[1] * sizeof(Scalar));
+        src += span[1] * sizeof(Scalar);
+      }
+    } else {
+      const char *values = src + numWords * sizeof(uint64_t);
+      for (int w = 0; w < numWords; ++w) {
+        uint64_t word;
+        std::memcpy(&word, src + w * sizeof(uint64_t), sizeof(word));
+        for (; word; word &= word - 1) {
+          std::memcpy(tilePtr + 64 * w + __builtin_ctzll(word), values,
+                      sizeof(Scalar));
+          values += sizeof(Scalar);
+        }
+      }
+    }
+  }
+}
+
+/**
+  Bulk I/O of the records saveSparseMatrix and saveSpareVector write:
+  a First then a Second, packed with no padding between them.  All of
+  the records go through one buffer and one read or write call instead
+  of two calls per record
+*/
+template <typename First, typename Second>
+void writeRecords(const std::vector<First> &first,
+                  const std::vector<Second> &second, std::ofstream &out) {
+  constexpr size_t recordSize = sizeof(First) + sizeof(Second);
+  std::vector<char> buffer(first.size() * recordSize);
+  for (size_t i = 0; i < first.size(); ++i) {
+    std::memcpy(buffer.data() + i * recordSize, &first[i], sizeof(First));
+    std::memcpy(buffer.data() + i * recordSize + sizeof(First), &second[i],
+                sizeof(Second));
   }
+  out.write(buffer.data(), buffer.size());
+}
+
+template <typename First, typename Second>
+void readRecords(int numRecords, std::vector<First> &first,
+                 std::vector<Second> &second, std::ifstream &in) {
+  constexpr size_t recordSize = sizeof(First) + sizeof(Second);
+  std::vector<char> buffer(numRecords * recordSize);
+  in.read(buffer.data(), buffer.size());
+  first.resize(numRecords);
+  second.resize(numRecords);
+  for (int i = 0; i < numRecords; ++i) {
+    std::memcpy(&first[i], buffer.data() + i * recordSize, sizeof(First));
+    std::memcpy(&second[i], buffer.data() + i * recordSize + sizeof(First),
+                sizeof(Second));
+  }
+}
+
+/* Builds the compressed storage of sparse directly from the entries at
+ * (outer[i], inner[i]), in the storage order of sparse.  Entries are
+ * appended in sorted order, so they are only sorted if the file did not
+ * already have them in order */
+template <typename SparseType>
+void fillSparse(SparseType &sparse, const std::vector<int> &outer,
+                const std::vector<int> &inner,
+                const std::vector<typename SparseType::Scalar> &values) {
+  const int numNonZeros = values.size();
+  auto less = [&](int a, int b) {
+    return outer[a] < outer[b] || (outer[a] == outer[b] && inner[a] < inner[b]);
+  };
+  std::vector<int> order(numNonZeros);
+  for (int i = 0; i < numNonZeros; ++i)
+    order[i] = i;
+  if (!std::is_sorted(order.begin(), order.end(), less))
+    std::sort(order.begin(), order.end(), less);
+
+  sparse.reserve(numNonZeros);
+  auto it = order.begin();
+  for (int j = 0; j < sparse.outerSize(); ++j) {
+    sparse.startVec(j);
+    for (; it != order.end() && outer[*it] == j; ++it)
+      sparse.insertBackByOuterInner(j, inner[*it]) = values[*it];
+  }
+  sparse.finalize();
 }
 
 template <typename SparseMatrixType>
@@ -398,40 +716,41 @@ void saveSparseMatrix(SparseMatrixType &mat, std::ofstream &out) {
   out.write(reinterpret_cast<const char *>(&rows), sizeof(rows));
   out.write(reinterpret_cast<const char *>(&cols), sizeof(cols));
 
+  std::vector<int> indices;
+  std::vector<Scalar> values;
+  indices.reserve(numNonZeros);
+  values.reserve(numNonZeros);
   for (int i = 0; i < mat.outerSize(); ++i) {
     for (typename SparseMatrixType::InnerIterator it(mat, i); it; ++it) {
-      int index = it.col() * rows + it.row();
-      Scalar value = it.value();
-      out.write(reinterpret_cast<const char *>(&index), sizeof(index));
-      out.write(reinterpret_cast<const char *>(&value), sizeof(Scalar));
+      indices.push_back(it.col() * rows + it.row());
+      values.push_back(it.value());
     }
   }
+  writeRecords(indices, values, out);
 }
 
 template <typename SparseMatrixType>
 void loadSparseMatrix(SparseMatrixType &mat, std::ifstream &in) {
   typedef typename SparseMatrixType::Scalar Scalar;
-  typedef Eigen::Triplet<Scalar> TripType;
 
   int rows, cols, numNonZeros;
   in.read(reinterpret_cast<char *>(&numNonZeros), sizeof(numNonZeros));
   in.read(reinterpret_cast<char *>(&rows), sizeof(rows));
   in.read(reinterpret_cast<char *>(&cols), sizeof(cols));
-  mat.resize(rows, cols);
-  mat.reserve(numNonZeros);
-  std::vector<TripType> tripletList;
-  tripletList.reserve(numNonZeros);
 
+  std::vector<int> indices;
+  std::vector<Scalar> values;
+  readRecords(numNonZeros, indices, values, in);
+
+  std::vector<int> outer(numNonZeros), inner(numNonZeros);
   for (int i = 0; i < numNonZeros; ++i) {
-    int index;
-    Scalar value;
-    in.read(reinterpret_cast<char *>(&index), sizeof(index));
-    in.read(reinterpret_cast<char *>(&value), sizeof(Scalar));
-    int col = floor(index / rows);
-    int row = index % rows;
-    tripletList.push_back(TripType(row, col, value));
+    const int col = indices[i] / rows, row = indices[i] % rows;
+    outer[i] = SparseMatrixType::IsRowMajor ? row : col;
+    inner[i] = SparseMatrixType::IsRowMajor ? col : row;
   }
-  mat.setFromTriplets(tripletList.begin(), tripletList.end());
+
+  mat.resize(rows, cols);
+  fillSparse(mat, outer, inner, values);
 }
 
 template <typename SparseVectorType>
@@ -440,14 +759,18 @@ void saveSpareVector(const SparseVectorType &vec, std::ofstream &out) {
   int nonZeros = vec.nonZeros(), size = vec.size();
   out.write(reinterpret_cast<const char *>(&nonZeros), sizeof(nonZeros));
   out.write(reinterpret_cast<const char *>(&size), sizeof(size));
+
+  std::vector<Scalar> values;
+  std::vector<short> rows;
+  values.reserve(nonZeros);
+  rows.reserve(nonZeros);
   for (int i = 0; i < vec.outerSize(); ++i) {
     for (typename SparseVectorType::InnerIterator it(vec, i); it; ++it) {
-      Scalar value = it.value();
-      short row = it.row();
-      out.write(reinterpret_cast<const char *>(&value), sizeof(Scalar));
-      out.write(reinterpret_cast<const char *>(&row), sizeof(row));
+      values.push_back(it.value());
+      rows.push_back(it.row());
     }
   }
+  writeRecords(values, rows, out);
 }
 
 template <typename SparseVectorType>
@@ -456,15 +779,14 @@ void loadSparseVetor(SparseVectorType &vec, std::ifstream &in) {
   int nonZeros, size;
   in.read(reinterpret_cast<char *>(&nonZeros), sizeof(nonZeros));
   in.read(reinterpret_cast<char *>(&size), sizeof(size));
+
+  std::vector<Scalar> values;
+  std::vector<short> rows;
+  readRecords(nonZeros, values, rows, in);
+
   vec.resize(size);
-  vec.reserve(nonZeros);
-  for (int i = 0; i < nonZeros; ++i) {
-    Scalar value;
-    short row;
-    in.read(reinterpret_cast<char *>(&value), sizeof(Scalar));
-    in.read(reinterpret_cast<char *>(&row), sizeof(row));
-    vec.coeffRef(row) = value;
-  }
+  fillSparse(vec, std::vector<int>(nonZeros, 0),
+             std::vector<int>(rows.begin(), rows.end()), values);
 }
 
 inline bool fexists(const std::string &file) {
@@ -7,6 +7,7 @@
 #include <pcl/visualization/keyboard_event.h>
 #include <pcl/visualization/pcl_visualizer.h>
 
+#include <ScanFile.hpp>
 #include <scan_gflags.h>
 #include <scan_typedefs.hpp>
 
@@ -69,7 +70,7 @@ rgbVis(pcl::PointCloud<PointType>::ConstPtr cloud) {
   return (viewer);
 }
 
-void createPCLPointCloud(const std::vector<scan::PointXYZRGBA> &points,
+void createPCLPointCloud(const scan::ScanFile &points,
                          pcl::PointCloud<PointType>::Ptr &cloud,
                          const Eigen::Matrix3d &rotMat,
                          const Eigen::Vector3d &trans);
@@ -122,15 +123,7 @@ int main(int argc, char **argv) {
       std::cout << "Enter: " << binaryFileNames[k] << std::endl;
       if (rotMats[k] == Eigen::Matrix3d::Zero())
         continue;
-      in.open(FLAGS_binaryFolder + binaryFileNames[k],
-              std::ios::in | std::ios::binary);
-      int rows, cols;
-      in.read(reinterpret_cast<char *>(&rows), sizeof(rows));
-      in.read(reinterpret_cast<char *>(&cols), sizeof(cols));
-      std::vector<scan::PointXYZRGBA> points(rows * cols);
-      for (auto &p : points)
-        p.loadFromFile(in);
-      in.close();
+      scan::ScanFile points(FLAGS_binaryFolder + binaryFileNames[k]);
 
       createPCLPointCloud(points, output_cloud, rotMats[k].inverse(),
                           translations[k]);
@@ -166,18 +159,20 @@ int main(int argc, char **argv) {
   }
 }
 
-void boundingBox(const std::vector<scan::PointXYZRGBA> &points,
-                 Eigen::Vector3f &pointMin, Eigen::Vector3f &pointMax) {
+void boundingBox(const scan::ScanFile &points, Eigen::Vector3f &pointMin,
+                 Eigen::Vector3f &pointMax) {
   Eigen::Vector3f average = Eigen::Vector3f::Zero();
   Eigen::Vector3f sigma = Eigen::Vector3f::Zero();
 
-  for (auto &point : points)
-    average += point.point;
+  for (size_t k = 0; k < points.size(); ++k)
+    average += points.point(k);
   average /= points.size();
 
-  for (auto &point : points)
+  for (size_t k = 0; k < points.size(); ++k) {
+    Eigen::Vector3f point = points.point(k);
     for (int i = 0; i < 3; ++i)
-      sigma[i] += (point.point[i] - average[i]) * (point.point[i] - average[i]);
+      sigma[i] += (point[i] - average[i]) * (point[i] - average[i]);
+  }
 
   sigma /= points.size() - 1;
   for (int i = 0; i < 3; ++i)
@@ -192,28 +187,28 @@ void boundingBox(const std::vector<scan::PointXYZRGBA> &points,
   pointMax = average + delta / 2.0;
 }
 
-void createPCLPointCloud(const std::vector<scan::PointXYZRGBA> &points,
+void createPCLPointCloud(const scan::ScanFile &points,
                          pcl::PointCloud<PointType>::Ptr &cloud,
                          const Eigen::Matrix3d &rotMat,
                          const Eigen::Vector3d &trans) {
   Eigen::Vector3f pointMin, pointMax;
   boundingBox(points, pointMin, pointMax);
-  int count = 0;
-  for (auto &p : points) {
+  for (size_t k = 0; k < points.size(); ++k) {
+    Eigen::Vector3f p = points.point(k);
     bool in = true;
     for (int i = 0; i < 3; ++i)
-      if (p.point[i] < pointMin[i] || p.point[i] > pointMax[i])
+      if (p[i] < pointMin[i] || p[i] > pointMax[i])
         in = false;
 
     if (!in)
       continue;
 
-    Eigen::Vector3d point = p.point.cast<double>();
+    Eigen::Vector3d point = p.cast<double>();
     point[1] *= -1;
     point = rotMat * point;
     point += trans;
     point[1] *= -1;
-    auto &rgb = p.rgb;
+    auto rgb = points.rgb(k);
     PointType tmp;
     tmp.x = point[0];
     tmp.y = point[1];
@@ -8,6 +8,8 @@
 
 #include "k4pcs.h"
 
+#include <ScanFile.hpp>
+
 #include <algorithm>
 #include <fstream>
 #include <iostream>
@@ -179,16 +181,10 @@ void convertToBinary(const std::string &fileNameIn, const std::string &outName,
   if (!FLAGS_quietMode)
     std::cout << outName << std::endl;
 
-  std::ifstream in(outName, std::ios::in | std::ios::binary);
-
-  if (!in.is_open() || FLAGS_redo) {
-    in.close();
+  if (!fexists(outName) || FLAGS_redo) {
     std::ifstream scanFile(fileNameIn, std::ios::in);
     int columns, rows;
     scanFile >> columns >> rows;
-    std::ofstream out(outName, std::ios::out | std::ios::binary);
-    out.write(reinterpret_cast<const char *>(&columns), sizeof(columns));
-    out.write(reinterpret_cast<const char *>(&rows), sizeof(rows));
 
     std::string line;
     if (!FLAGS_quietMode)
@@ -210,22 +206,14 @@ void convertToBinary(const std::string &fileNameIn, const std::string &outName,
         tmp.rgb[j] = cv::saturate_cast<uchar>(itmp[j]);
       }
 
-      tmp.writeToFile(out);
       pointCloud.push_back(tmp);
     }
 
-    out.close();
+    scan::ScanFileWriter::write(outName, columns, rows, pointCloud,
+                                FLAGS_scanPrecision);
 
   } else {
-    int columns, rows;
-    in.read(reinterpret_cast<char *>(&columns), sizeof(columns));
-    in.read(reinterpret_cast<char *>(&rows), sizeof(rows));
-
-    pointCloud.resize(columns * rows);
-    for (auto &p : pointCloud)
-      p.loadFromFile(in);
-
-    in.close();
+    scan::ScanFile(outName).toPoints(pointCloud);
   }
 }
 
@@ -0,0 +1,85 @@
+/**
+  Packs the loose files of artifact folders into one ArtifactStore per
+  folder, or writes them back out as loose files.
+
+  usage: ./packer --dataPath=<path> [--unpack] [--keepLoose] <folder> ...
+
+  Folders are relative to dataPath, for example densityMaps/R0/.  Once a
+  folder is packed, parseFolder lists the entries of the store and the
+  readers of the pipeline read them from it.  A loose file that matches
+  its entry is removed, unless keepLoose is given, so a packed folder is
+  left with nothing in it.  An artifact written after packing is a loose
+  file again and is read in place of its entry until the folder is packed
+  again
+*/
+#include <ArtifactStore.hpp>
+#include <scan_gflags.h>
+#include <scan_typedefs.hpp>
+
+#include <boost/filesystem.hpp>
+
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+DEFINE_bool(unpack, false,
+            "Writes the entries of the stores back out as loose files "
+            "instead of packing the folders");
+DEFINE_bool(keepLoose, false,
+            "Keeps the loose files of a folder after packing it");
+
+/* Removes every file in folder that is an entry of store with the same
+ * contents.  Returns the number of files removed */
+static size_t removePacked(const scan::ArtifactStore &store,
+                           const std::string &folder) {
+  // NB: Listed first, so that nothing is removed from under the iterator
+  std::vector<boost::filesystem::path> files;
+  for (auto &file : folderToIterator(folder))
+    if (boost::filesystem::is_regular_file(file.status()))
+      files.push_back(file.path());
+
+  size_t count = 0;
+  std::vector<char> packed, loose;
+  for (auto &file : files) {
+    {
+      std::ifstream in(file.string(), std::ios::in | std::ios::binary);
+      loose.resize(boost::filesystem::file_size(file));
+      in.read(loose.data(), loose.size());
+      if (!in || !store.read(file.filename().string(), packed) ||
+          packed != loose)
+        continue;
+    }
+    boost::filesystem::remove(file);
+    ++count;
+  }
+  return count;
+}
+
+int main(int argc, char **argv) {
+  gflags::SetUsageMessage("[--unpack] [--keepLoose] <folder> ...");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+  for (int i = 1; i < argc; ++i) {
+    const std::string folder = FLAGS_dataPath + "/" + argv[i] + "/";
+    const std::string storeName = scan::ArtifactStore::nameForFolder(folder);
+
+    if (FLAGS_unpack) {
+      if (!fexists(storeName)) {
+        std::cout << "Could not find: " << storeName << std::endl;
+        exit(1);
+      }
+      scan::ArtifactStore store(storeName);
+      std::cout << "Wrote " << store.exportFolder(folder) << " files to "
+                << folder << std::endl;
+    } else {
+      scan::ArtifactStore store(storeName);
+      std::cout << "Packed " << store.importFolder(folder) << " files into "
+                << storeName << std::endl;
+      if (!FLAGS_keepLoose)
+        std::cout << "Removed " << removePacked(store, folder)
+                  << " loose files from " << folder << std::endl;
+    }
+  }
+
+  return 0;
+}
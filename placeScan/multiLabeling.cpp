@@ -2,6 +2,8 @@
 #include "placeScan_multiLabeling.h"
 #include "placeScan_placeScanHelper.h"
 
+#include <ArtifactStore.hpp>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <opencv2/highgui.hpp>
@@ -151,19 +153,12 @@ multi::Labeler::Labeler() {
 
   {
     std::string folder = FLAGS_voxelFolder + "R0/";
-    for (auto &file : folderToIterator(folder)) {
-      std::string fileName = file.path().filename().string();
-      if (fileName != ".." && fileName != "." &&
-          fileName.find("point") != std::string::npos) {
-        pointVoxelFileNames.push_back(fileName);
-      } else if (fileName != ".." && fileName != "." &&
-                 fileName.find("freeSpace") != std::string::npos) {
-        freeVoxelFileNames.push_back(fileName);
-      }
-    }
-
-    std::sort(pointVoxelFileNames.begin(), pointVoxelFileNames.end());
-    std::sort(freeVoxelFileNames.begin(), freeVoxelFileNames.end());
+    parseFolder(folder, pointVoxelFileNames, [](const std::string &s) {
+      return s.find("point") != std::string::npos;
+    });
+    parseFolder(folder, freeVoxelFileNames, [](const std::string &s) {
+      return s.find("freeSpace") != std::string::npos;
+    });
   }
 
   const std::string metaDataFolder = FLAGS_voxelFolder + "metaData/";
@@ -196,29 +191,46 @@ void multi::Labeler::load() {
   const std::string rotFolder = FLAGS_rotFolder;
   parseFolder(rotFolder, rotationsFiles);
 
-  std::string panoImagesFolder = FLAGS_panoFolder + "images/";
-  parseFolder(panoImagesFolder, panoFiles);
-
-  std::vector<std::string> panoDataNames;
-  std::string panoDataFolder = FLAGS_panoFolder + "data/";
-  parseFolder(panoDataFolder, panoDataNames);
-
   rotationMatricies.assign(rotationsFiles.size(),
                            std::vector<Eigen::Matrix3d>(NUM_ROTS));
   for (int j = 0; j < rotationsFiles.size(); ++j) {
     const std::string rotName = FLAGS_rotFolder + rotationsFiles[j];
-    std::ifstream in(rotName, std::ios::binary | std::ios::in);
+    scan::ArtifactStream in(rotName);
     for (int i = 0; i < NUM_ROTS; ++i)
       in.read(reinterpret_cast<char *>(rotationMatricies[j][i].data()),
               sizeof(Eigen::Matrix3d));
-
-    in.close();
   }
+  // NB: Scans preprocessed before panorama containers existed only have
+  // the image and data files, and scans preprocessed without
+  // legacyPanoramas only have the container.  panoFiles holds the name of
+  // every panorama without its extension
+  const std::string panoImagesFolder = FLAGS_panoFolder + "images/",
+                    panoDataFolder = FLAGS_panoFolder + "data/",
+                    panoBinaryFolder = FLAGS_panoFolder + "binary/";
+  for (auto &folder : {panoBinaryFolder, panoImagesFolder}) {
+    if (!boost::filesystem::is_directory(folder) &&
+        !scan::ArtifactStore::forFolder(folder))
+      continue;
+    std::vector<std::string> names;
+    parseFolder(folder, names);
+    for (auto &n : names)
+      panoFiles.push_back(n.substr(0, n.rfind(".")));
+  }
+  std::sort(panoFiles.begin(), panoFiles.end());
+  panoFiles.erase(std::unique(panoFiles.begin(), panoFiles.end()),
+                  panoFiles.end());
+
   panoramas.resize(panoFiles.size());
   for (int i = 0; i < panoFiles.size(); ++i) {
-    const std::string imgName = panoImagesFolder + panoFiles[i];
-    const std::string dataName = panoDataFolder + panoDataNames[i];
-    panoramas[i].loadFromFile(imgName, dataName);
+    const std::string binaryName = panoBinaryFolder + panoFiles[i] + ".dat";
+    if (scan::artifactExists(binaryName)) {
+      panoramas[i].loadFromFile(binaryName);
+      continue;
+    }
+    std::string dataName = panoFiles[i];
+    dataName.replace(dataName.rfind("_panorama_"), 10, "_data_");
+    panoramas[i].loadFromFile(panoImagesFolder + panoFiles[i] + ".png",
+                              panoDataFolder + dataName + ".dat");
   }
 
   const std::string metaDataFolder = FLAGS_voxelFolder + "metaData/";
@@ -226,11 +238,10 @@ void multi::Labeler::load() {
                    std::vector<place::MetaData>(NUM_ROTS));
   for (int i = 0; i < metaDataFiles.size(); ++i) {
     const std::string metaName = metaDataFolder + metaDataFiles[i];
-    std::ifstream in(metaName, std::ios::in | std::ios::binary);
+    scan::ArtifactStream in(metaName);
     for (int j = 0; j < NUM_ROTS; ++j) {
       voxelInfo[i][j].loadFromFile(in);
     }
-    in.close();
   }
 
   loaded = true;
@@ -133,7 +133,8 @@ double NCC(const cv::Mat_<cv::Vec3b> &a, const cv::Mat_<cv::Vec3b> &b) {
 
 #define viz 1
 
-void pano::compareNCC2(place::Panorama &panoA, place::Panorama &panoB,
+void pano::compareNCC2(const place::Panorama &panoA,
+                       const place::Panorama &panoB,
                        const Eigen::Matrix3d &RA, const Eigen::Matrix3d &RB,
                        const Eigen::Vector3d &aToB, const Eigen::Vector3d &bToA,
                        place::edge &e) {
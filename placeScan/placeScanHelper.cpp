@@ -2,6 +2,7 @@
 
 #include <dirent.h>
 
+#include <ArtifactStore.hpp>
 #include <algorithm>
 #include <fstream>
 #include <iostream>
@@ -43,18 +44,16 @@ void place::loadInScans(const std::string &scanName,
                         std::vector<Eigen::Vector2i> &zeroZero) {
 
   zeroZero.resize(NUM_ROTS);
-  std::ifstream binaryReader(zerosFile, std::ios::in | std::ios::binary);
+  scan::ArtifactStream binaryReader(zerosFile);
   for (auto &z : zeroZero)
     binaryReader.read(reinterpret_cast<char *>(z.data()),
                       sizeof(Eigen::Vector2i));
 
-  binaryReader.close();
-
   for (int i = 0; i < NUM_ROTS; ++i) {
     std::string fullScanName =
         FLAGS_dmFolder + "R" + std::to_string(i) + "/" + scanName;
 
-    rotatedScans.push_back(cv::imread(fullScanName, 0));
+    rotatedScans.push_back(scan::readImage(fullScanName, 0));
 
     if (!rotatedScans[i].data) {
       std::cout << "Error reading scan: " << fullScanName << std::endl;
@@ -74,7 +73,7 @@ void place::loadInScans(const std::string &scanName,
     std::string fullScanName =
         FLAGS_dmFolder + "R" + std::to_string(i) + "/" + scanName;
 
-    rotatedScans.push_back(cv::imread(fullScanName, 0));
+    rotatedScans.push_back(scan::readImage(fullScanName, 0));
 
     if (!rotatedScans[i].data) {
       std::cout << "Error reading scan" << std::endl;
@@ -172,7 +171,7 @@ bool place::reshowPlacement(const std::string &scanName,
   const std::string placementName =
       buildName + "_placement_" + scanNumber + ".dat";
 
-  std::ifstream in(preDone + placementName, std::ios::in | std::ios::binary);
+  scan::ArtifactStream in(preDone + placementName);
   if (!in.is_open())
     return false;
   if (!FLAGS_reshow)
@@ -417,7 +416,7 @@ void place::loadInTruePlacement(const std::string &scanName,
   const std::string placementName =
       FLAGS_outputV1 + scanName.substr(scanName.find("_") - 3, 3) +
       "_placement_" + scanName.substr(scanName.find(".") - 3, 3) + ".dat";
-  std::ifstream in(placementName, std::ios::in | std::ios::binary);
+  scan::ArtifactStream in(placementName);
 
   int num;
   in.read(reinterpret_cast<char *>(&num), sizeof(num));
@@ -633,7 +632,7 @@ void place::removeMinimumConnectedComponents(cv::Mat &image) {
 std::vector<std::vector<place::Door>>
 place::loadInDoors(const std::string &name,
                    const std::vector<Eigen::Vector2i> &zeroZero) {
-  std::ifstream in(name, std::ios::in | std::ios::binary);
+  scan::ArtifactStream in(name);
   std::vector<std::vector<place::Door>> tmp(NUM_ROTS);
   for (int r = 0; r < NUM_ROTS; ++r) {
     int num;
@@ -647,7 +646,6 @@ place::loadInDoors(const std::string &name,
       d.w *= buildingScale.getScale();
     }
   }
-  in.close();
 
   return tmp;
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "placeScan_panoramaMatcher.h"
 #include "placeScan_placeScanHelper2.h"
 
+#include <ArtifactStore.hpp>
 #include <fstream>
 #include <iostream>
 
@@ -62,29 +63,14 @@ static void displayCollapsed(T &collapsed, const std::string &windowName) {
   cv::imshow(windowName, heatMap);
 }
 
-template <typename T>
-static void displayVoxelGrid(const T &grid, const std::string &windowName) {
-  Eigen::MatrixXd collapsed =
-      Eigen::MatrixXd::Zero(grid[0].rows(), grid[0].cols());
-
-  for (int k = 0; k < grid.size(); ++k)
-    for (int i = 0; i < grid[0].cols(); ++i)
-      for (int j = 0; j < grid[0].rows(); ++j)
-        collapsed(j, i) += grid[k](j, i) ? 1 : 0;
-
-  displayCollapsed(collapsed, windowName);
-}
-
-template <typename T>
-static void displayVoxelGridS(const T &sparse, const std::string &windowName) {
-  typedef typename T::value_type::InnerIterator InnerIT;
+static void displayVoxelGrid(const place::VoxelGrid &grid,
+                             const std::string &windowName) {
+  Eigen::MatrixXd collapsed = Eigen::MatrixXd::Zero(grid.y, grid.x);
 
-  Eigen::MatrixXd collapsed =
-      Eigen::MatrixXd::Zero(sparse[0].rows(), sparse[0].cols());
-  for (auto &current : sparse)
-    for (int i = 0; i < current.outerSize(); ++i)
-      for (InnerIT it(current, i); it; ++it)
-        collapsed(it.row(), it.col()) += it.value();
+  for (int k = 0; k < grid.z; ++k)
+    for (int i = 0; i < grid.x; ++i)
+      for (int j = 0; j < grid.y; ++j)
+        collapsed(j, i) += grid(i, j, k) ? 1 : 0;
 
   displayCollapsed(collapsed, windowName);
 }
@@ -138,65 +124,26 @@ static void displayCollapsed(const T &collapsedA, const S &collapsedB,
   cv::waitKey(0);
 }
 
-template <typename T, typename S>
-static void displayVoxelGrid(const T &voxelA, const S &voxelB,
+static void displayVoxelGrid(const place::VoxelGrid &voxelA,
+                             const place::VoxelGrid &voxelB,
                              const place::cube &aRect,
                              const place::cube &bRect) {
   const int z = aRect.Z2 - aRect.Z1 + 1;
   const int Xrows = aRect.Y2 - aRect.Y1 + 1;
   const int Xcols = aRect.X2 - aRect.X1 + 1;
+  auto get = [](const place::VoxelGrid &grid, int i, int j, int k) {
+    return grid.word(i, j, k) & 1;
+  };
 
-  Eigen::MatrixXd collapsedA = Eigen::MatrixXd::Zero(Xrows, Xcols);
-  Eigen::MatrixXd collapsedB = Eigen::MatrixXd::Zero(Xrows, Xcols);
-  for (int k = 0; k < z; ++k) {
-    for (int i = 0; i < Xcols; ++i) {
-      for (int j = 0; j < Xrows; ++j) {
-        Eigen::Vector3i APos(i + aRect.X1, j + aRect.Y1, z + aRect.Z1);
-        Eigen::Vector3i BPos(i + bRect.X1, j + bRect.Y1, z + bRect.Z1);
-        collapsedA(j, i) += voxelA[APos[2]](APos[1], APos[0]);
-        collapsedB(j, i) += voxelB[BPos[2]](BPos[1], BPos[0]);
-      }
-    }
-  }
-  displayCollapsed(collapsedA, collapsedB, aRect, bRect);
-}
-
-template <typename TA, typename TB>
-static void displayVoxelGridS(const TA &voxelA, const TB &voxelB,
-                              const place::cube &aRect,
-                              const place::cube &bRect) {
-  typedef typename TA::value_type::InnerIterator InnerITA;
-  typedef typename TB::value_type::InnerIterator InnerITB;
-
-  const int z = aRect.Z2 - aRect.Z1 + 1;
-  const int Xrows = aRect.Y2 - aRect.Y1 + 1;
-  const int Xcols = aRect.X2 - aRect.X1 + 1;
   for (int k = 0; k < z; ++k) {
     Eigen::MatrixXd collapsedA = Eigen::MatrixXd::Zero(Xrows, Xcols);
     Eigen::MatrixXd collapsedB = Eigen::MatrixXd::Zero(Xrows, Xcols);
-
-    auto &currentA = voxelA[k + aRect.Z1];
-    auto &currentB = voxelB[k + bRect.Z1];
-
-    for (int i = 0; i < currentA.outerSize(); ++i) {
-      for (InnerITA it(currentA, i); it; ++it) {
-        Eigen::Vector3i APos(it.col() - aRect.X1, it.row() - aRect.Y1, 0);
-        if (APos[0] < 0 || APos[0] >= Xcols)
-          continue;
-        if (APos[1] < 0 || APos[1] >= Xrows)
-          continue;
-        collapsedA(APos[1], APos[0]) += it.value();
-      }
-    }
-
-    for (int i = 0; i < currentB.outerSize(); ++i) {
-      for (InnerITB it(currentB, i); it; ++it) {
-        Eigen::Vector3i BPos(it.col() - bRect.X1, it.row() - bRect.Y1, 0);
-        if (BPos[0] < 0 || BPos[0] >= Xcols)
-          continue;
-        if (BPos[1] < 0 || BPos[1] >= Xrows)
-          continue;
-        collapsedB(BPos[1], BPos[0]) += it.value();
+    for (int i = 0; i < Xcols; ++i) {
+      for (int j = 0; j < Xrows; ++j) {
+        collapsedA(j, i) +=
+            get(voxelA, i + aRect.X1, j + aRect.Y1, k + aRect.Z1);
+        collapsedB(j, i) +=
+            get(voxelB, i + bRect.X1, j + bRect.Y1, k + bRect.Z1);
       }
     }
     displayCollapsed(collapsedA, collapsedB, aRect, bRect);
@@ -442,11 +389,11 @@ void place::weightEdges(
     if (FLAGS_debugMode) {
       std::cout << "(" << i << "," << j << ")" << std::endl;
       std::cout << weight << std::endl;
-      displayVoxelGridS(aPoint.v, "aPoint");
-      displayVoxelGridS(bPoint.v, "bPoint");
-      displayVoxelGrid(aFree.v, "aFree");
-      displayVoxelGrid(bFree.v, "bFree");
-      displayVoxelGridS(aFree.v, bFree.v, current.crossWRTA, current.crossWRTB);
+      displayVoxelGrid(aPoint, "aPoint");
+      displayVoxelGrid(bPoint, "bPoint");
+      displayVoxelGrid(aFree, "aFree");
+      displayVoxelGrid(bFree, "bFree");
+      displayVoxelGrid(aFree, bFree, current.crossWRTA, current.crossWRTB);
     }
 #endif
 
@@ -471,7 +418,7 @@ void place::loadInPlacementGraph(const std::string &imageName,
   const std::string placementName =
       FLAGS_outputV1 + imageName.substr(imageName.find("_") - 3, 3) +
       "_placement_" + imageName.substr(imageName.find(".") - 3, 3) + ".dat";
-  std::ifstream in(placementName, std::ios::in | std::ios::binary);
+  scan::ArtifactStream in(placementName);
 
   int numToLoad;
   in.read(reinterpret_cast<char *>(&numToLoad), sizeof(numToLoad));
@@ -805,50 +752,58 @@ place::compare3D(const place::VoxelGrid &aPoint, const place::VoxelGrid &bPoint,
 
   double totalPointA = 0, totalPointB = 0, totalCount = 0;
 
+  // NB: The grids are compared one 64 voxel word of a row at a time.
+  // The neighborhood localGroup searched is the OR of the words of the
+  // 5x5 voxels around each voxel
+  constexpr int range = 2;
+  const int numWords = (Xcols + 63) / 64;
+  const uint64_t lastMask =
+      Xcols % 64 ? (uint64_t(1) << (Xcols % 64)) - 1 : ~uint64_t(0);
+  auto neighborhood = [](const place::VoxelGrid &grid, int i, int j, int k) {
+    uint64_t near = 0;
+    for (int dj = -range; dj <= range; ++dj)
+      for (int di = -range; di <= range; ++di)
+        near |= grid.word(i + di, j + dj, k);
+    return near;
+  };
+
 #pragma omp parallel for shared(aPoint, bPoint, aFree, bFree, aRect,           \
                                 bRect) reduction(                              \
     + : pointAgreement, freeSpaceAgreementA, freeSpaceAgreementB, totalPointA, \
     totalPointB, totalCount, freeSpaceCross)
   for (int k = 0; k < z; ++k) {
-    auto &Ap = aPoint.v[k + aRect.Z1];
-    auto &Bp = bPoint.v[k + bRect.Z1];
-    auto &Af = aFree.v[k + aRect.Z1];
-    auto &Bf = bFree.v[k + bRect.Z1];
+    const int kA = k + aRect.Z1, kB = k + bRect.Z1;
 
-    if ((Ap.sum() == 0 && Af.sum() == 0) || (Bp.sum() == 0 && Bf.sum() == 0))
+    if ((aPoint.count(kA) == 0 && aFree.count(kA) == 0) ||
+        (bPoint.count(kB) == 0 && bFree.count(kB) == 0))
       continue;
-    for (int i = 0; i < Xcols; ++i) {
-      for (int j = 0; j < Xrows; ++j) {
-        const Eigen::Vector3i APos(i + aRect.X1, j + aRect.Y1, aRect.Z1 + k);
-        const Eigen::Vector3i BPos(i + bRect.X1, j + bRect.Y1, bRect.Z1 + k);
-
-        if ((localGroup(Ap, APos[1], APos[0], 2) && Bp(BPos[1], BPos[0])) ||
-            (Ap(APos[1], APos[0]) && localGroup(Bp, BPos[1], BPos[0], 2)))
-          ++pointAgreement;
-
-        if (Ap(APos[1], APos[0]) && Bf(BPos[1], BPos[0]))
-          ++freeSpaceAgreementA;
-
-        if (Bp(BPos[1], BPos[0]) && Af(APos[1], APos[0]))
-          ++freeSpaceAgreementB;
-
-        if (Af(APos[1], APos[0]) && Bf(BPos[1], BPos[0]))
-          ++freeSpaceCross;
-
-        if (Ap(APos[1], APos[0])) {
-          ++totalPointA;
-          ++totalCount;
-        }
-
-        if (Bp(BPos[1], BPos[0])) {
-          ++totalPointB;
-          ++totalCount;
-        }
+    for (int j = 0; j < Xrows; ++j) {
+      const int jA = j + aRect.Y1, jB = j + bRect.Y1;
+      for (int w = 0; w < numWords; ++w) {
+        const int iA = aRect.X1 + 64 * w, iB = bRect.X1 + 64 * w;
+        const uint64_t mask = w == numWords - 1 ? lastMask : ~uint64_t(0);
+
+        const uint64_t Ap = aPoint.word(iA, jA, kA) & mask,
+                       Bp = bPoint.word(iB, jB, kB) & mask,
+                       Af = aFree.word(iA, jA, kA) & mask,
+                       Bf = bFree.word(iB, jB, kB) & mask;
+        if (!(Ap | Bp | Af | Bf))
+          continue;
 
-        if (Af(APos[1], APos[0]))
-          ++totalCount;
-        if (Bf(BPos[1], BPos[0]))
-          ++totalCount;
+        if (Ap | Bp)
+          pointAgreement += __builtin_popcountll(
+              (neighborhood(aPoint, iA, jA, kA) & Bp) |
+              (Ap & neighborhood(bPoint, iB, jB, kB)));
+        freeSpaceAgreementA += __builtin_popcountll(Ap & Bf);
+        freeSpaceAgreementB += __builtin_popcountll(Bp & Af);
+        freeSpaceCross += __builtin_popcountll(Af & Bf);
+
+        const int countA = __builtin_popcountll(Ap),
+                  countB = __builtin_popcountll(Bp);
+        totalPointA += countA;
+        totalPointB += countB;
+        totalCount += countA + countB + __builtin_popcountll(Af) +
+                      __builtin_popcountll(Bf);
       }
     }
   }
@@ -885,9 +840,8 @@ inline place::VoxelGrid place::loadInVoxel(const std::string &name) {
 }
 
 inline void place::loadInVoxel(const std::string &name, place::VoxelGrid &dst) {
-  std::ifstream in(name, std::ios::in | std::ios::binary);
+  scan::ArtifactStream in(name);
   dst.loadFromFile(in);
-  in.close();
 }
 
 typedef opengm::DiscreteSpace<> Space;
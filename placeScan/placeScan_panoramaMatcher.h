@@ -11,7 +11,8 @@
 
 namespace pano {
 
-void compareNCC2(place::Panorama &panoA, place::Panorama &panoB,
+void compareNCC2(const place::Panorama &panoA,
+                 const place::Panorama &panoB,
                  const Eigen::Matrix3d &RA, const Eigen::Matrix3d &RB,
                  const Eigen::Vector3d &aToB, const Eigen::Vector3d &bToA,
                  place::edge &e);
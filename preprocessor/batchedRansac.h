@@ -0,0 +1,78 @@
+#pragma once
+#ifndef BATCHED_RANSAC_H
+#define BATCHED_RANSAC_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <omp.h>
+
+/**
+  RANSAC loop that scores a batch of hypotheses per pass over the data
+  instead of one, so there is one parallel region per batch.
+
+  generate() returns the next Hypothesis and is always called from the
+  calling thread, in order.
+
+  kernel(hypotheses, numHypotheses, begin, end, results) adds the score of
+  data [begin, end) for every hypothesis into results[j].  It is called
+  from many threads at once, each with its own results.
+
+  accept(hypothesis, result, K) is called for every hypothesis in the
+  order they were generated, with the final result.  It can lower K to
+  end the loop early once a consensus has been found.  Hypotheses of a
+  batch that come after K is reached are discarded, so this visits the
+  same hypotheses as a one at a time loop would.
+
+  Result must be default constructible to zero and support +=.  Per
+  thread results are merged in thread order so the outcome is the same
+  from run to run for a given number of threads
+*/
+template <typename Hypothesis, typename Result, typename Generate,
+          typename Kernel, typename Accept>
+void batchedRansac(int numData, Generate &&generate, Kernel &&kernel,
+                   Accept &&accept, double K = 1e5, int batchSize = 32) {
+  constexpr int chunkSize = 4096;
+
+  std::vector<Hypothesis> batch;
+  std::vector<Result> results;
+  std::vector<std::vector<Result>> threadResults(omp_get_max_threads());
+
+  for (int k = 0; k < K;) {
+    const int b = std::max(1, std::min<int>(batchSize, std::ceil(K - k)));
+    batch.clear();
+    for (int j = 0; j < b; ++j)
+      batch.push_back(generate());
+
+#pragma omp parallel
+    {
+      auto &privateResults = threadResults[omp_get_thread_num()];
+      privateResults.assign(b, Result());
+#pragma omp for schedule(static)
+      for (int begin = 0; begin < numData; begin += chunkSize)
+        kernel(batch.data(), b, begin, std::min(begin + chunkSize, numData),
+               privateResults.data());
+    }
+
+    results.assign(b, Result());
+    for (auto &privateResults : threadResults)
+      for (int j = 0; j < privateResults.size() && j < b; ++j)
+        results[j] += privateResults[j];
+    for (auto &privateResults : threadResults)
+      privateResults.clear();
+
+    for (int j = 0; j < b && k < K; ++j, ++k)
+      accept(batch[j], results[j], K);
+  }
+}
+
+/* The usual adaptive number of RANSAC iterations for a minimal sample of
+ * size 3 */
+inline double ransacIterations(double numInliers, double numData) {
+  const double w = (numInliers - 3) / numData;
+  const double p = std::max(0.001, std::pow(w, 3));
+  return std::log(1 - 0.999) / std::log(1 - p);
+}
+
+#endif // BATCHED_RANSAC_H
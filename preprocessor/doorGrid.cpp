@@ -0,0 +1,191 @@
+#include "doorGrid.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <omp.h>
+
+DoorGrid::DoorGrid(const pcl::PointCloud<PointType> &pointCloud,
+                   const Eigen::Vector3d &M1, const Eigen::Vector3d &M2,
+                   const Eigen::Vector3d &M3, double voxelsPerMeter)
+    : voxelsPerMeter{voxelsPerMeter}, _min{Eigen::Vector3i::Zero()},
+      _max{Eigen::Vector3i::Zero()} {
+  R.row(0) = M2.transpose();
+  R.row(1) = M3.transpose();
+  R.row(2) = M1.transpose();
+
+  struct Entry {
+    int voxel[3];
+    int index;
+    double depth;
+  };
+  const int numPoints = pointCloud.size();
+  std::vector<Entry> entries(numPoints);
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < numPoints; ++i) {
+    auto &p = pointCloud[i];
+    const Eigen::Vector3d point(p.x, p.y, p.z);
+    const Eigen::Vector3i v =
+        (R * point * voxelsPerMeter).array().round().cast<int>();
+    entries[i] = Entry{{v[0], v[1], v[2]}, i, point.norm()};
+  }
+
+  // NB: Sorted by z, then y, then x, then by the order of the points so
+  // that the depth of a voxel is the same running average of the depths
+  // of its points findDoors has always used
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) {
+              if (a.voxel[2] != b.voxel[2])
+                return a.voxel[2] < b.voxel[2];
+              if (a.voxel[1] != b.voxel[1])
+                return a.voxel[1] < b.voxel[1];
+              if (a.voxel[0] != b.voxel[0])
+                return a.voxel[0] < b.voxel[0];
+              return a.index < b.index;
+            });
+
+  std::vector<Eigen::Vector3i> voxels;
+  std::vector<double> depths;
+  for (int i = 0; i < numPoints; ++i) {
+    const Eigen::Vector3i v(entries[i].voxel[0], entries[i].voxel[1],
+                            entries[i].voxel[2]);
+    if (!voxels.empty() && voxels.back() == v)
+      depths.back() = (depths.back() + entries[i].depth) / 2.0;
+    else {
+      voxels.push_back(v);
+      depths.push_back(entries[i].depth);
+    }
+  }
+
+  if (!voxels.empty()) {
+    _min = _max = voxels.front();
+    for (auto &v : voxels) {
+      _min = _min.cwiseMin(v);
+      _max = _max.cwiseMax(v);
+    }
+  }
+
+  buildLines(lines[0], 0, voxels, depths);
+  buildLines(lines[1], 1, voxels, depths);
+}
+
+/* Counting sort of the voxels into their lines.  voxels is sorted by
+ * z, then y, then x, so the positions in every line come out sorted */
+void DoorGrid::buildLines(Lines &lines, int axis,
+                          const std::vector<Eigen::Vector3i> &voxels,
+                          const std::vector<double> &depths) {
+  lines.axis = axis;
+  lines.other = 1 - axis;
+  const int numZ = _max[2] - _min[2] + 1,
+            numLines = (_max[lines.other] - _min[lines.other] + 1) * numZ;
+  auto lineIndex = [&](const Eigen::Vector3i &v) {
+    return (v[lines.other] - _min[lines.other]) * numZ + v[2] - _min[2];
+  };
+
+  lines.offsets.assign(numLines + 1, 0);
+  for (auto &v : voxels)
+    ++lines.offsets[lineIndex(v) + 1];
+  for (int i = 0; i < numLines; ++i)
+    lines.offsets[i + 1] += lines.offsets[i];
+
+  std::vector<int> next(lines.offsets.begin(), lines.offsets.end() - 1);
+  lines.positions.resize(voxels.size());
+  lines.depths.resize(voxels.size());
+  for (size_t i = 0; i < voxels.size(); ++i) {
+    const int j = next[lineIndex(voxels[i])]++;
+    lines.positions[j] = voxels[i][axis];
+    lines.depths[j] = depths[i];
+  }
+}
+
+int DoorGrid::nearest(const Lines &lines, const Eigen::Vector3i &voxel,
+                      int direction, int maxDistance, double &depth) const {
+  const int other = lines.other;
+  if (maxDistance < 0 || voxel[other] < _min[other] ||
+      voxel[other] > _max[other] || voxel[2] < _min[2] || voxel[2] > _max[2])
+    return -1;
+
+  const int line =
+      (voxel[other] - _min[other]) * (_max[2] - _min[2] + 1) + voxel[2] -
+      _min[2];
+  auto first = lines.positions.begin() + lines.offsets[line],
+       last = lines.positions.begin() + lines.offsets[line + 1];
+  const int p = voxel[lines.axis];
+
+  auto it = last;
+  if (direction > 0) {
+    it = std::lower_bound(first, last, p);
+    if (it == last || *it - p > maxDistance)
+      return -1;
+  } else {
+    it = std::upper_bound(first, last, p);
+    if (it == first || p - *(it - 1) > maxDistance)
+      return -1;
+    --it;
+  }
+
+  depth = lines.depths[it - lines.positions.begin()];
+  return std::abs(*it - p);
+}
+
+/* The axis of the grid closest to v.  The axes findDoors probes along
+ * are the Manhattan axes themselves, so this only removes rounding */
+Eigen::Vector3i DoorGrid::toGridAxis(const Eigen::Vector3d &v) const {
+  const Eigen::Vector3d f = R * v;
+  int axis;
+  f.cwiseAbs().maxCoeff(&axis);
+  Eigen::Vector3i out = Eigen::Vector3i::Zero();
+  out[axis] = f[axis] < 0 ? -1 : 1;
+  return out;
+}
+
+double DoorGrid::getDepth(const Eigen::Vector3d &point,
+                          const Eigen::Vector3d &axis,
+                          const Eigen::Vector3d &zAxis, double xStop,
+                          double yStop, double zStop) const {
+  Eigen::Vector3d a2(axis[1], -axis[0], axis[2]);
+  if (a2.dot(point) < 0.0)
+    a2 *= -1.0;
+
+  const Eigen::Vector3i x = toGridAxis(a2), y = toGridAxis(axis),
+                        z = toGridAxis(zAxis);
+  const Eigen::Vector3i origin = (R * point).array().round().cast<int>();
+  const Lines &l = x[0] ? lines[0] : lines[1];
+  const int direction = x[l.axis];
+
+  // NB: Same bounds the loops over i, j and k always had
+  const int xEnd = std::floor(xStop * voxelsPerMeter),
+            yEnd = std::floor(yStop * voxelsPerMeter),
+            zEnd = std::floor(zStop * voxelsPerMeter),
+            xHalf = std::floor(xStop * voxelsPerMeter / 2.0),
+            yHalf = std::floor(yStop * voxelsPerMeter / 2.0),
+            zHalf = std::floor(zStop * voxelsPerMeter / 2.0);
+
+  // NB: The probes were made in order of i, then j, then k, with the one
+  // ahead before the one behind.  Only a strictly closer voxel can
+  // replace the best so far, which keeps that order for ties
+  int best = xEnd + 1;
+  double depth = 1e10;
+  for (int j = 0; j <= yEnd; ++j) {
+    for (int k = 0; k <= zEnd; ++k) {
+      double d;
+      int i = nearest(l, origin + j * y + k * z, direction,
+                      std::min(xEnd, best - 1), d);
+      if (i >= 0) {
+        best = i;
+        depth = d;
+      }
+
+      if (j <= yHalf && k <= zHalf) {
+        i = nearest(l, origin - j * y - k * z, -direction,
+                    std::min(xHalf, best - 1), d);
+        if (i >= 0) {
+          best = i;
+          depth = d;
+        }
+      }
+    }
+  }
+
+  return depth;
+}
@@ -0,0 +1,68 @@
+#pragma once
+#ifndef DOOR_GRID_H
+#define DOOR_GRID_H
+
+#include "preprocessor.h"
+
+#include <vector>
+
+/**
+  Voxel grid of the depths of the points of a scan, used by findDoors.
+  The grid is axis aligned with the Manhattan frame of the scan, so the
+  probes findDoors makes along a wall or across one all follow lines of
+  voxels.  For every line along the two horizontal axes, the occupied
+  voxels are stored sorted (CSR), so the nearest occupied voxel in a
+  line is found with one short binary search instead of probing it
+  voxel by voxel
+*/
+class DoorGrid {
+public:
+  /* M1 is the vertical axis and M2, M3 the horizontal ones, as given
+   * by getRotations */
+  DoorGrid(const pcl::PointCloud<PointType> &pointCloud,
+           const Eigen::Vector3d &M1, const Eigen::Vector3d &M2,
+           const Eigen::Vector3d &M3, double voxelsPerMeter);
+
+  /* Same as probing the voxels at
+   *  point + i * a2 + j * axis + k * zAxis
+   * for i, j and k up to the stops, in meters, in that order, and also
+   * at point - i * a2 - j * axis - k * zAxis up to half the stops, where
+   * a2 is the horizontal axis perpendicular to axis facing away from the
+   * origin.  Returns the depth of the first occupied voxel, or 1e10.
+   * point is in voxels in the coordinate system of the scan */
+  double getDepth(const Eigen::Vector3d &point, const Eigen::Vector3d &axis,
+                  const Eigen::Vector3d &zAxis, double xStop, double yStop,
+                  double zStop) const;
+
+  /* Bounds of the occupied voxels in the Manhattan frame, ie
+   * (M2, M3, M1) */
+  const Eigen::Vector3i &min() const { return _min; };
+  const Eigen::Vector3i &max() const { return _max; };
+
+private:
+  /* Occupied voxels of every line along one axis.  Lines are indexed
+   * by the voxel's other two coordinates */
+  struct Lines {
+    int axis, other;
+    std::vector<int> offsets;
+    std::vector<int> positions;
+    std::vector<double> depths;
+  };
+
+  void buildLines(Lines &lines, int axis,
+                  const std::vector<Eigen::Vector3i> &voxels,
+                  const std::vector<double> &depths);
+  /* Distance to the nearest occupied voxel from voxel in direction
+   * (+1 or -1) along lines.axis, if it is at most maxDistance.  Returns
+   * -1 otherwise */
+  int nearest(const Lines &lines, const Eigen::Vector3i &voxel, int direction,
+              int maxDistance, double &depth) const;
+  Eigen::Vector3i toGridAxis(const Eigen::Vector3d &v) const;
+
+  const double voxelsPerMeter;
+  Eigen::Matrix3d R;
+  Eigen::Vector3i _min, _max;
+  Lines lines[2];
+};
+
+#endif // DOOR_GRID_H
@@ -6,13 +6,16 @@
 */
 
 #include "getRotations.h"
+#include "batchedRansac.h"
 #include "preprocessor.h"
 
+#include <ArtifactStore.hpp>
 #include <algorithm>
 #include <eigen3/Eigen/Eigen>
 #include <eigen3/Eigen/StdVector>
 #include <fstream>
 #include <iostream>
+#include <numeric>
 #include <random>
 
 #include <omp.h>
@@ -22,6 +25,11 @@ void satoshiRansacManhattan1(const std::vector<Eigen::Vector3d> &,
 void satoshiRansacManhattan2(const std::vector<Eigen::Vector3d> &,
                              const Eigen::Vector3d &, Eigen::Vector3d &,
                              Eigen::Vector3d &);
+void histogramManhattan1(const std::vector<Eigen::Vector3d> &,
+                         Eigen::Vector3d &);
+void histogramManhattan2(const std::vector<Eigen::Vector3d> &,
+                         const Eigen::Vector3d &, Eigen::Vector3d &,
+                         Eigen::Vector3d &);
 void getMajorAngles(const Eigen::Vector3d &, const Eigen::Vector3d &,
                     const Eigen::Vector3d &, std::vector<Eigen::Matrix3d> &);
 
@@ -30,7 +38,7 @@ void getRotations(const pcl::PointCloud<NormalType>::Ptr &cloud_normals,
                   Eigen::Vector3d &M2, Eigen::Vector3d &M3) {
 
   if (!FLAGS_redo) {
-    std::ifstream in(outName, std::ios::in | std::ios::binary);
+    scan::ArtifactStream in(outName);
     if (in.is_open()) {
       std::vector<Eigen::Matrix3d> R(NUM_ROTS);
       std::vector<Eigen::Vector3d> M(3);
@@ -44,8 +52,6 @@ void getRotations(const pcl::PointCloud<NormalType>::Ptr &cloud_normals,
       M2 = M[1];
       M3 = M[2];
 
-      in.close();
-
       return;
     }
   }
@@ -60,7 +66,10 @@ void getRotations(const pcl::PointCloud<NormalType>::Ptr &cloud_normals,
     std::cout << "N size: " << normals.size() << std::endl;
 
   std::vector<Eigen::Vector3d> M(3);
-  satoshiRansacManhattan1(normals, M[0]);
+  if (FLAGS_ransacManhattan)
+    satoshiRansacManhattan1(normals, M[0]);
+  else
+    histogramManhattan1(normals, M[0]);
   if (!FLAGS_quietMode) {
     std::cout << "D1: " << M[0] << std::endl << std::endl;
   }
@@ -75,7 +84,10 @@ void getRotations(const pcl::PointCloud<NormalType>::Ptr &cloud_normals,
   if (!FLAGS_quietMode)
     std::cout << "N2 size: " << N2.size() << std::endl;
 
-  satoshiRansacManhattan2(N2, M[0], M[1], M[2]);
+  if (FLAGS_ransacManhattan)
+    satoshiRansacManhattan2(N2, M[0], M[1], M[2]);
+  else
+    histogramManhattan2(N2, M[0], M[1], M[2]);
 
   if (!FLAGS_quietMode) {
     std::cout << "D2: " << M[1] << std::endl << std::endl;
@@ -125,7 +137,38 @@ void getRotations(const pcl::PointCloud<NormalType>::Ptr &cloud_normals,
   }
 }
 
-#pragma omp declare reduction(+ : Eigen::Vector3d : omp_out += omp_in)
+namespace {
+/* Normals as separate x, y and z arrays so the dot products in the
+ * RANSAC kernels vectorize */
+struct NormalArrays {
+  std::vector<double> x, y, z;
+
+  NormalArrays(const std::vector<Eigen::Vector3d> &N)
+      : x(N.size()), y(N.size()), z(N.size()) {
+    for (int i = 0; i < N.size(); ++i) {
+      x[i] = N[i][0];
+      y[i] = N[i][1];
+      z[i] = N[i][2];
+    }
+  };
+};
+
+/* Inlier count and signed sum of the inliers of one hypothesis */
+struct DirectionVote {
+  double numInliers = 0;
+  double sum[3] = {0, 0, 0};
+
+  DirectionVote &operator+=(const DirectionVote &o) {
+    numInliers += o.numInliers;
+    for (int i = 0; i < 3; ++i)
+      sum[i] += o.sum[i];
+    return *this;
+  };
+  Eigen::Vector3d average() const {
+    return Eigen::Vector3d(sum[0], sum[1], sum[2]);
+  };
+};
+} // namespace
 
 /**
   Gets the first dominate direction.  Dominate direction extraction
@@ -134,65 +177,56 @@ void getRotations(const pcl::PointCloud<NormalType>::Ptr &cloud_normals,
 void satoshiRansacManhattan1(const std::vector<Eigen::Vector3d> &N,
                              Eigen::Vector3d &M) {
   const int m = N.size();
-
-  volatile double maxInliers = 0, K = 1e5;
-  volatile int k = 0;
-
-  static std::random_device seed;
-  static std::mt19937_64 gen(seed());
+  // NB: nest and n are both unit vectors, so |angle| between them is
+  // acos(|nest.dot(n)|) and it is below the threshold exactly when
+  // |nest.dot(n)| is above the cosine of the threshold
+  const double cosInlier = std::cos(0.02);
+  const NormalArrays normals(N);
+  double maxInliers = 0;
+
+  static thread_local std::random_device seed;
+  static thread_local std::mt19937_64 gen(seed());
   std::uniform_int_distribution<int> dist(0, m - 1);
 
-  while (k < K) {
-    // random sampling
-    int randomIndex = dist(gen);
-    // compute the model parameters
-    const Eigen::Vector3d &nest = N[randomIndex];
-
-    // Count the number of inliers
-    double numInliers = 0;
-    Eigen::Vector3d average = Eigen::Vector3d::Zero();
-#pragma omp parallel
-    {
-      double privateInliers = 0;
-      Eigen::Vector3d privateAve = Eigen::Vector3d::Zero();
-#pragma omp for nowait schedule(static)
-      for (int i = 0; i < m; ++i) {
-        auto &n = N[i];
-        // nest and n are both unit vectors, so this is |angle|
-        // between them
-        if (std::acos(std::abs(nest.dot(n))) < 0.02) {
-          ++privateInliers;
-          // NB: All normals that are inliers with the estimate
-          // are averaged together to get the best estimate
-          // of the dominate direction
-          if (nest.dot(n) < 0)
-            privateAve -= n;
-          else
-            privateAve += n;
+  batchedRansac<Eigen::Vector3d, DirectionVote>(
+      m,
+      // random sampling
+      [&] { return N[dist(gen)]; },
+      // Count the number of inliers
+      [&](const Eigen::Vector3d *nests, int numNests, int begin, int end,
+          DirectionVote *votes) {
+        const double *x = normals.x.data(), *y = normals.y.data(),
+                     *z = normals.z.data();
+        for (int j = 0; j < numNests; ++j) {
+          const double nx = nests[j][0], ny = nests[j][1], nz = nests[j][2];
+          double inliers = 0, sx = 0, sy = 0, sz = 0;
+#pragma omp simd reduction(+ : inliers, sx, sy, sz)
+          for (int i = begin; i < end; ++i) {
+            const double d = nx * x[i] + ny * y[i] + nz * z[i];
+            // NB: All normals that are inliers with the estimate
+            // are averaged together to get the best estimate
+            // of the dominate direction
+            const double w = std::abs(d) > cosInlier ? (d < 0 ? -1 : 1) : 0;
+            inliers += w != 0;
+            sx += w * x[i];
+            sy += w * y[i];
+            sz += w * z[i];
+          }
+          votes[j].numInliers += inliers;
+          votes[j].sum[0] += sx;
+          votes[j].sum[1] += sy;
+          votes[j].sum[2] += sz;
         }
-      }
-
-#pragma omp for schedule(static) ordered
-      for (int i = 0; i < omp_get_num_threads(); ++i) {
-#pragma omp ordered
-        {
-          average += privateAve;
-          numInliers += privateInliers;
+      },
+      [&](const Eigen::Vector3d &, const DirectionVote &vote, double &K) {
+        if (vote.numInliers > maxInliers) {
+          maxInliers = vote.numInliers;
+
+          M = vote.average().normalized();
+          // NB: Ransac formula to check for consensus
+          K = ransacIterations(vote.numInliers, m);
         }
-      }
-    }
-
-    if (numInliers > maxInliers) {
-      maxInliers = numInliers;
-
-      M = average / average.norm();
-      // NB: Ransac formula to check for consensus
-      double w = (numInliers - 3) / m;
-      double p = std::max(0.001, std::pow(w, 3));
-      K = log(1 - 0.999) / log(1 - p);
-    }
-    ++k;
-  }
+      });
 }
 
 /**
@@ -205,71 +239,303 @@ void satoshiRansacManhattan2(const std::vector<Eigen::Vector3d> &N,
                              const Eigen::Vector3d &n1, Eigen::Vector3d &M1,
                              Eigen::Vector3d &M2) {
   const int m = N.size();
+  const double cosInlier = std::cos(0.02);
+  const NormalArrays normals(N);
+  double maxInliers = 0;
 
-  volatile double maxInliers = 0, K = 1.0e5;
-  volatile int k = 0;
-
-  static std::random_device seed;
-  static std::mt19937_64 gen(seed());
+  static thread_local std::random_device seed;
+  static thread_local std::mt19937_64 gen(seed());
   std::uniform_int_distribution<int> dist(0, m - 1);
 
-  while (k < K) {
-    // random sampling
-    int randomIndex = dist(gen);
-    // compute the model parameters
-    const Eigen::Vector3d &nest = N[randomIndex];
+  batchedRansac<Eigen::Vector3d, DirectionVote>(
+      m,
+      // random sampling
+      [&] { return N[dist(gen)]; },
+      // counting inliers and outliers
+      [&](const Eigen::Vector3d *nests, int numNests, int begin, int end,
+          DirectionVote *votes) {
+        const double *x = normals.x.data(), *y = normals.y.data(),
+                     *z = normals.z.data();
+        const double ax = n1[0], ay = n1[1], az = n1[2];
+        for (int j = 0; j < numNests; ++j) {
+          const Eigen::Vector3d &nest = nests[j];
+          const Eigen::Vector3d nest2 = nest.cross(n1);
+          const double nx = nest[0], ny = nest[1], nz = nest[2];
+          const double mx = nest2[0], my = nest2[1], mz = nest2[2];
+          double inliers = 0, sx = 0, sy = 0, sz = 0;
+#pragma omp simd reduction(+ : inliers, sx, sy, sz)
+          for (int i = begin; i < end; ++i) {
+            const double d1 = nx * x[i] + ny * y[i] + nz * z[i];
+            const double d2 = mx * x[i] + my * y[i] + mz * z[i];
+            const bool in1 = std::abs(d1) > cosInlier;
+            const bool in2 = std::abs(d2) > cosInlier;
+            // NB: An inlier with nest2 is rotated onto nest by crossing
+            // it with n1
+            const double cx = y[i] * az - z[i] * ay,
+                         cy = z[i] * ax - x[i] * az,
+                         cz = x[i] * ay - y[i] * ax;
+            const double px = in1 ? x[i] : cx, py = in1 ? y[i] : cy,
+                         pz = in1 ? z[i] : cz;
+            const double dot = nx * px + ny * py + nz * pz;
+            const double w = (in1 || in2) ? (dot < 0 ? -1 : 1) : 0;
+            inliers += w != 0;
+            sx += w * px;
+            sy += w * py;
+            sz += w * pz;
+          }
+          votes[j].numInliers += inliers;
+          votes[j].sum[0] += sx;
+          votes[j].sum[1] += sy;
+          votes[j].sum[2] += sz;
+        }
+      },
+      [&](const Eigen::Vector3d &, const DirectionVote &vote, double &K) {
+        if (vote.numInliers > maxInliers) {
+          maxInliers = vote.numInliers;
+
+          Eigen::Vector3d average = vote.average().normalized();
+          M1 = average;
+          M2 = average.cross(n1);
+
+          K = ransacIterations(maxInliers, m);
+        }
+      });
+}
 
-    const Eigen::Vector3d nest2 = nest.cross(n1);
+namespace {
+// NB: Same inlier threshold as the RANSAC versions
+constexpr double inlierAngle = 0.02;
+// NB: Bins are twice as wide as the inlier cone so a cluster of
+// normals lands in at most a few neighboring bins
+constexpr double binWidth = 2 * inlierAngle;
+// NB: Clusters can be split across bins, so the fullest few bins are all
+// refined and the one with the most inliers wins
+constexpr int numCandidates = 8, refineIterations = 5;
 
-    // counting inliers and outliers
-    double numInliers = 0;
+/**
+  Equal-area histogram of the upper hemisphere.  Normals are axial, so
+  n and -n are binned together.  The hemisphere is cut into rings of
+  equal polar angle and every ring is cut into as many bins as it takes
+  to make the bins as close to binWidth x binWidth as possible, so
+  bins have the same area and no bin is degenerate at the pole
+*/
+class SphereHistogram {
+public:
+  SphereHistogram() : numRings{static_cast<int>(std::ceil(PI / 2 / binWidth))} {
+    const double ringWidth = PI / 2 / numRings;
+    ringStart.push_back(0);
+    for (int r = 0; r < numRings; ++r) {
+      const double area =
+          2 * PI * (std::cos(r * ringWidth) - std::cos((r + 1) * ringWidth));
+      ringBins.push_back(std::max(1, static_cast<int>(std::round(
+                                         area / (binWidth * binWidth)))));
+      ringStart.push_back(ringStart.back() + ringBins.back());
+    }
+    counts.assign(ringStart.back(), 0);
+    sums.assign(ringStart.back(), Eigen::Vector3d::Zero());
+  };
+
+  void add(const Eigen::Vector3d &normal) {
+    const Eigen::Vector3d n = normal[2] < 0 ? -normal : normal;
+    const int ring = std::min<int>(
+        numRings - 1, std::acos(std::min(1.0, n[2])) / (PI / 2) * numRings);
+    const double phi = std::atan2(n[1], n[0]) + PI;
+    const int bin = ringStart[ring] +
+                    std::min<int>(ringBins[ring] - 1,
+                                  phi / (2 * PI) * ringBins[ring]);
+    ++counts[bin];
+    sums[bin] += n;
+  };
+
+  void merge(const SphereHistogram &o) {
+    for (int i = 0; i < counts.size(); ++i) {
+      counts[i] += o.counts[i];
+      sums[i] += o.sums[i];
+    }
+  };
+
+  /* Mean direction of each of the k fullest bins */
+  std::vector<Eigen::Vector3d> peaks(int k) const {
+    std::vector<int> order(counts.size());
+    std::iota(order.begin(), order.end(), 0);
+    k = std::min<int>(k, order.size());
+    std::partial_sort(order.begin(), order.begin() + k, order.end(),
+                      [&](int a, int b) { return counts[a] > counts[b]; });
+
+    std::vector<Eigen::Vector3d> out;
+    for (int i = 0; i < k && counts[order[i]] > 0; ++i)
+      if (sums[order[i]].norm() > 0)
+        out.push_back(sums[order[i]].normalized());
+    return out;
+  };
+
+private:
+  int numRings;
+  std::vector<int> ringStart, ringBins;
+  std::vector<int> counts;
+  std::vector<Eigen::Vector3d> sums;
+};
+
+/* Averages the normals that are inliers with M, flipped to agree with it,
+ * until M stops changing.  Returns the number of inliers */
+double refineManhattan1(const std::vector<Eigen::Vector3d> &N,
+                        Eigen::Vector3d &M) {
+  const double cosInlier = std::cos(inlierAngle);
+  double numInliers = 0;
+  for (int iter = 0; iter < refineIterations; ++iter) {
     Eigen::Vector3d average = Eigen::Vector3d::Zero();
+    numInliers = 0;
 #pragma omp parallel
     {
       double privateInliers = 0;
       Eigen::Vector3d privateAve = Eigen::Vector3d::Zero();
-      Eigen::Vector3d x;
-
 #pragma omp for nowait schedule(static)
-      for (int i = 0; i < m; ++i) {
-        auto &n = N[i];
-        if (std::min(std::acos(std::abs(nest.dot(n))),
-                     std::acos(std::abs(nest2.dot(n)))) < 0.02) {
-          if (std::acos(std::abs(nest.dot(n))) < 0.02)
-            x = n;
-          else
-            x = n.cross(n1);
-
-          if (nest.dot(x) < 0)
-            privateAve -= x;
-          else
-            privateAve += x;
-
+      for (int i = 0; i < N.size(); ++i) {
+        const double d = M.dot(N[i]);
+        if (std::abs(d) > cosInlier) {
           ++privateInliers;
+          privateAve += d < 0 ? -N[i] : N[i];
         }
       }
-#pragma omp for schedule(static) ordered
-      for (int i = 0; i < omp_get_num_threads(); ++i) {
-#pragma omp ordered
-        {
-          average += privateAve;
-          numInliers += privateInliers;
-        }
+
+#pragma omp critical
+      {
+        average += privateAve;
+        numInliers += privateInliers;
+      }
+    }
+    if (numInliers == 0)
+      break;
+    M = average.normalized();
+  }
+  return numInliers;
+}
+
+/* Same as refineManhattan1 but for the pair of directions M and M x n1 */
+double refineManhattan2(const std::vector<Eigen::Vector3d> &N,
+                        const Eigen::Vector3d &n1, Eigen::Vector3d &M) {
+  const double cosInlier = std::cos(inlierAngle);
+  double numInliers = 0;
+  for (int iter = 0; iter < refineIterations; ++iter) {
+    const Eigen::Vector3d M2 = M.cross(n1);
+    Eigen::Vector3d average = Eigen::Vector3d::Zero();
+    numInliers = 0;
+#pragma omp parallel
+    {
+      double privateInliers = 0;
+      Eigen::Vector3d privateAve = Eigen::Vector3d::Zero();
+#pragma omp for nowait schedule(static)
+      for (int i = 0; i < N.size(); ++i) {
+        auto &n = N[i];
+        Eigen::Vector3d x;
+        if (std::abs(M.dot(n)) > cosInlier)
+          x = n;
+        else if (std::abs(M2.dot(n)) > cosInlier)
+          x = n.cross(n1);
+        else
+          continue;
+
+        ++privateInliers;
+        privateAve += M.dot(x) < 0 ? -x : x;
+      }
+
+#pragma omp critical
+      {
+        average += privateAve;
+        numInliers += privateInliers;
       }
     }
+    if (numInliers == 0)
+      break;
+    M = average.normalized();
+  }
+  return numInliers;
+}
+} // namespace
+
+/**
+  Gets the first dominate direction by binning all normals into
+  a SphereHistogram once and then refining the fullest bins by
+  averaging their inliers.  Same inputs and output as
+  satoshiRansacManhattan1
+*/
+void histogramManhattan1(const std::vector<Eigen::Vector3d> &N,
+                         Eigen::Vector3d &M) {
+  SphereHistogram histogram;
+#pragma omp parallel
+  {
+    SphereHistogram privateHistogram;
+#pragma omp for nowait schedule(static)
+    for (int i = 0; i < N.size(); ++i)
+      privateHistogram.add(N[i]);
 
+#pragma omp critical
+    histogram.merge(privateHistogram);
+  }
+
+  double maxInliers = -1;
+  for (auto &candidate : histogram.peaks(numCandidates)) {
+    Eigen::Vector3d estimate = candidate;
+    const double numInliers = refineManhattan1(N, estimate);
     if (numInliers > maxInliers) {
       maxInliers = numInliers;
+      M = estimate;
+    }
+  }
+}
 
-      average /= average.norm();
-      M1 = average;
-      M2 = average.cross(n1);
+/**
+  Gets the remaining two dominate directions.  All of N is perpendicular
+  to n1, so the directions are binned by their angle in that plane.
+  That angle is taken modulo PI / 2 so that both directions of a
+  Manhattan pair land in the same bin.  Same inputs and outputs as
+  satoshiRansacManhattan2
+*/
+void histogramManhattan2(const std::vector<Eigen::Vector3d> &N,
+                         const Eigen::Vector3d &n1, Eigen::Vector3d &M1,
+                         Eigen::Vector3d &M2) {
+  // NB: Any orthonormal basis of the plane perpendicular to n1
+  const Eigen::Vector3d e1 =
+      (std::abs(n1[0]) < 0.9 ? Eigen::Vector3d::UnitX()
+                             : Eigen::Vector3d::UnitY())
+          .cross(n1)
+          .normalized();
+  const Eigen::Vector3d e2 = n1.cross(e1);
+
+  const int numBins = std::ceil(PI / 2 / binWidth);
+  std::vector<double> counts(numBins, 0);
+#pragma omp parallel
+  {
+    std::vector<double> privateCounts(numBins, 0);
+#pragma omp for nowait schedule(static)
+    for (int i = 0; i < N.size(); ++i) {
+      double angle = std::fmod(std::atan2(N[i].dot(e2), N[i].dot(e1)) + PI,
+                               PI / 2);
+      ++privateCounts[std::min<int>(numBins - 1,
+                                    angle / (PI / 2) * numBins)];
+    }
 
-      double w = (maxInliers - 3) / m;
-      double p = std::max(0.001, std::pow(w, 3));
-      K = log(1 - 0.999) / log(1 - p);
+#pragma omp critical
+    for (int b = 0; b < numBins; ++b)
+      counts[b] += privateCounts[b];
+  }
+
+  std::vector<int> order(numBins);
+  std::iota(order.begin(), order.end(), 0);
+  const int k = std::min(numCandidates, numBins);
+  std::partial_sort(order.begin(), order.begin() + k, order.end(),
+                    [&](int a, int b) { return counts[a] > counts[b]; });
+
+  double maxInliers = -1;
+  for (int i = 0; i < k; ++i) {
+    const double angle = (order[i] + 0.5) * (PI / 2) / numBins;
+    Eigen::Vector3d estimate = std::cos(angle) * e1 + std::sin(angle) * e2;
+    const double numInliers = refineManhattan2(N, n1, estimate);
+    if (numInliers > maxInliers) {
+      maxInliers = numInliers;
+      M1 = estimate;
+      M2 = estimate.cross(n1);
     }
-    ++k;
   }
 }
 
@@ -0,0 +1,193 @@
+#include "organizedNormals.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <unordered_map>
+
+#include <omp.h>
+
+namespace {
+// NB: Same values getNormals uses for pcl::UniformSampling and
+// pcl::NormalEstimationOMP
+constexpr float leafSize = 0.0085f, searchRadius = 0.03f;
+// NB: Caps the cost of points near the poles of the scan, where columns
+// converge and the window needed to reach the radius becomes huge
+constexpr int maxWindow = 10;
+
+inline uint64_t voxelKey(const Eigen::Vector3i &v) {
+  constexpr uint64_t mask = (1 << 21) - 1;
+  return (static_cast<uint64_t>(v[0]) & mask) |
+         (static_cast<uint64_t>(v[1]) & mask) << 21 |
+         (static_cast<uint64_t>(v[2]) & mask) << 42;
+}
+} // namespace
+
+OrganizedNormals::OrganizedNormals(int rows, int cols)
+    : rows{rows}, cols{cols}, added{0},
+      xs(static_cast<size_t>(rows) * cols,
+         std::numeric_limits<float>::quiet_NaN()),
+      ys(xs.size()), zs(xs.size()), colors(3 * xs.size()) {}
+
+void OrganizedNormals::addPoints(const scan::PointXYZRGBA *points, size_t n) {
+  n = std::min(n, xs.size() - added);
+#pragma omp parallel for schedule(static)
+  for (size_t k = 0; k < n; ++k) {
+    auto &p = points[k];
+    if (p.intensity < 0.01)
+      continue;
+    const size_t i = added + k;
+    xs[i] = p.point[0];
+    ys[i] = p.point[1];
+    zs[i] = p.point[2];
+    std::copy(p.rgb, p.rgb + 3, &colors[3 * i]);
+  }
+  added += n;
+}
+
+void OrganizedNormals::compute(
+    const Eigen::Vector3f &pointMin, const Eigen::Vector3f &pointMax,
+    pcl::PointCloud<NormalType>::Ptr &cloud_normals,
+    pcl::PointCloud<PointType>::Ptr &normals_points) {
+  const int numPoints = xs.size();
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < numPoints; ++i) {
+    const Eigen::Vector3f p(xs[i], ys[i], zs[i]);
+    for (int j = 0; j < 3; ++j)
+      if (p[j] < pointMin[j] || p[j] > pointMax[j])
+        xs[i] = std::numeric_limits<float>::quiet_NaN();
+  }
+
+  std::vector<int> indices;
+  sample(indices);
+
+  std::vector<Eigen::Vector3f> normals(indices.size());
+  std::vector<float> curvatures(indices.size());
+  std::vector<char> found(indices.size());
+#pragma omp parallel for schedule(dynamic, 1024)
+  for (int k = 0; k < indices.size(); ++k)
+    found[k] = estimate(indices[k], normals[k], curvatures[k]);
+
+  for (int k = 0; k < indices.size(); ++k) {
+    if (!found[k])
+      continue;
+    const int i = indices[k];
+
+    NormalType n;
+    n.normal_x = normals[k][0];
+    n.normal_y = normals[k][1];
+    n.normal_z = normals[k][2];
+    n.curvature = curvatures[k];
+    cloud_normals->push_back(n);
+
+    PointType p;
+    p.x = xs[i];
+    p.y = ys[i];
+    p.z = zs[i];
+    p.r = colors[3 * i + 0];
+    p.g = colors[3 * i + 1];
+    p.b = colors[3 * i + 2];
+    normals_points->push_back(p);
+  }
+}
+
+/* Keeps the point closest to the center of every occupied voxel,
+ * as pcl::UniformSampling does.  indices are returned in PTX order */
+void OrganizedNormals::sample(std::vector<int> &indices) const {
+  struct Candidate {
+    int index;
+    float distance;
+  };
+  std::unordered_map<uint64_t, Candidate> voxels;
+  voxels.reserve(xs.size() / 16);
+
+  for (int i = 0; i < xs.size(); ++i) {
+    if (std::isnan(xs[i]))
+      continue;
+    const Eigen::Vector3f p(xs[i], ys[i], zs[i]);
+    const Eigen::Vector3i v = (p / leafSize).array().floor().cast<int>();
+    const Eigen::Vector3f center =
+        (v.cast<float>().array() + 0.5f).matrix() * leafSize;
+    const float distance = (p - center).squaredNorm();
+
+    auto it = voxels.emplace(voxelKey(v), Candidate{i, distance});
+    if (!it.second && distance < it.first->second.distance)
+      it.first->second = Candidate{i, distance};
+  }
+
+  indices.clear();
+  indices.reserve(voxels.size());
+  for (auto &v : voxels)
+    indices.push_back(v.second.index);
+  std::sort(indices.begin(), indices.end());
+}
+
+/* Fits a plane to the neighbors of a point, the same way
+ * pcl::NormalEstimation does, and orients it towards the scanner */
+bool OrganizedNormals::estimate(int index, Eigen::Vector3f &normal,
+                                float &curvature) const {
+  const int col = index / rows, row = index % rows;
+  const float px = xs[index], py = ys[index], pz = zs[index];
+
+  // NB: Angular steps assuming the scan covers the full sphere
+  const float colStep = 2 * M_PI / cols, rowStep = M_PI / rows;
+  const float range = std::sqrt(px * px + py * py + pz * pz);
+  const float horizontal = std::sqrt(px * px + py * py);
+  auto window = [](float spacing) {
+    return static_cast<int>(std::min<float>(
+        maxWindow, std::max(1.0f, std::ceil(searchRadius / spacing))));
+  };
+  const int rowWindow = window(range * rowStep),
+            colWindow = std::min(window(horizontal * colStep), cols / 2);
+  const int firstRow = std::max(0, row - rowWindow),
+            lastRow = std::min(rows - 1, row + rowWindow);
+  constexpr float r2 = searchRadius * searchRadius;
+
+  float n = 0, sx = 0, sy = 0, sz = 0, sxx = 0, sxy = 0, sxz = 0, syy = 0,
+        syz = 0, szz = 0;
+  for (int dc = -colWindow; dc <= colWindow; ++dc) {
+    // NB: Columns wrap around, the first and last are neighbors
+    const int c = (col + dc + cols) % cols;
+    const float *x = &xs[static_cast<size_t>(c) * rows],
+                *y = &ys[static_cast<size_t>(c) * rows],
+                *z = &zs[static_cast<size_t>(c) * rows];
+#pragma omp simd reduction(+ : n, sx, sy, sz, sxx, sxy, sxz, syy, syz, szz)
+    for (int r = firstRow; r <= lastRow; ++r) {
+      float dx = x[r] - px, dy = y[r] - py, dz = z[r] - pz;
+      // NB: NaN fails the comparison, so invalid points are never in
+      const bool in = dx * dx + dy * dy + dz * dz <= r2;
+      dx = in ? dx : 0;
+      dy = in ? dy : 0;
+      dz = in ? dz : 0;
+      n += in ? 1 : 0;
+      sx += dx;
+      sy += dy;
+      sz += dz;
+      sxx += dx * dx;
+      sxy += dx * dy;
+      sxz += dx * dz;
+      syy += dy * dy;
+      syz += dy * dz;
+      szz += dz * dz;
+    }
+  }
+
+  if (n < 3)
+    return false;
+
+  const Eigen::Vector3f mean = Eigen::Vector3f(sx, sy, sz) / n;
+  Eigen::Matrix3f covariance;
+  covariance << sxx, sxy, sxz, sxy, syy, syz, sxz, syz, szz;
+  covariance = covariance / n - mean * mean.transpose();
+
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3f> solver;
+  solver.computeDirect(covariance);
+  normal = solver.eigenvectors().col(0);
+  const float sum = solver.eigenvalues().sum();
+  curvature = sum != 0 ? std::abs(solver.eigenvalues()[0] / sum) : 0;
+
+  if (normal.dot(Eigen::Vector3f(px, py, pz)) > 0)
+    normal = -normal;
+
+  return true;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#ifndef ORGANIZED_NORMALS_H
+#define ORGANIZED_NORMALS_H
+
+#include "preprocessor.h"
+
+#include <vector>
+
+/**
+  Estimates surface normals directly on the rows x cols PTX grid.
+  The neighbors of a point are the points inside a window around it
+  in the grid that are also within the search radius, so no KdTree is
+  needed.  The window is sized from the point's range and the angular
+  resolution of the scan.  Points are uniformly sampled the same way
+  pcl::UniformSampling does before their normals are estimated
+*/
+class OrganizedNormals {
+public:
+  OrganizedNormals(int rows, int cols);
+
+  /* Points must be added in PTX order, but can be added a block at a
+   * time.  Points with low intensity are skipped the same way
+   * createPCLPointCloud skips them */
+  void addPoints(const scan::PointXYZRGBA *points, size_t n);
+
+  /* Only points inside [pointMin, pointMax] are used */
+  void compute(const Eigen::Vector3f &pointMin, const Eigen::Vector3f &pointMax,
+               pcl::PointCloud<NormalType>::Ptr &cloud_normals,
+               pcl::PointCloud<PointType>::Ptr &normals_points);
+
+private:
+  void sample(std::vector<int> &indices) const;
+  bool estimate(int index, Eigen::Vector3f &normal, float &curvature) const;
+
+  int rows, cols;
+  size_t added;
+  // NB: Points are stored as separate arrays in PTX order, which is
+  // column major, so the points of a window in a column are contiguous.
+  // Invalid points are NaN so they fail every radius check
+  std::vector<float> xs, ys, zs;
+  std::vector<unsigned char> colors;
+};
+
+/* Same as the KdTree getNormals, but uses estimator.  The normals
+ * are always recalculated */
+void getNormals(OrganizedNormals &estimator, const Eigen::Vector3f &pointMin,
+                const Eigen::Vector3f &pointMax,
+                pcl::PointCloud<NormalType>::Ptr &cloud_normals,
+                pcl::PointCloud<PointType>::Ptr &normals_points,
+                const std::string &outName);
+
+#endif // ORGANIZED_NORMALS_H
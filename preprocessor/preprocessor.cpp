@@ -6,12 +6,22 @@
   assumption (ie walls should be aligned with the X or Y axis)
 */
 #include "preprocessor.h"
+#include "ArtifactStore.hpp"
 #include "HashVoxel.hpp"
+#include "ScanFile.hpp"
+#include "doorGrid.h"
 #include "getRotations.h"
+#include "organizedNormals.h"
+#include "ptxReader.h"
+#include "scanScheduler.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <random>
 #include <string>
 
@@ -31,6 +41,7 @@
 #include <pcl/visualization/pcl_visualizer.h>
 
 #include <dirent.h>
+#include <omp.h>
 
 pcl::visualization::PCLVisualizer::Ptr
 rgbVis(pcl::PointCloud<PointType>::ConstPtr cloud) {
@@ -49,12 +60,37 @@ rgbVis(pcl::PointCloud<PointType>::ConstPtr cloud) {
   return (viewer);
 }
 
-static int PTXrows, PTXcols;
+// NB: Every scan runs on its own thread, so the size of the scan
+// currently being worked on is per thread
+static thread_local int PTXrows, PTXcols;
+
+/* The files read and written for one scan */
+struct ScanJob {
+  std::string csvFileName, binaryFileName, normalsName, rotName, doorName,
+      panoName, dataName, panoBinaryName;
+};
+
+static void processScan(const ScanJob &job, const ScanScheduler &scheduler,
+                        boost::progress_display *show_progress);
+static void processScanInBlocks(const ScanJob &job,
+                                const ScanScheduler &scheduler,
+                                boost::progress_display *show_progress);
+static size_t estimateFootprint(const std::string &csvFileName);
+static bool panoramaExists(const std::string &panoName,
+                           const std::string &dataName,
+                           const std::string &binaryName);
+static void advance(boost::progress_display *show_progress, int n = 1);
+static void convertLegacyScans();
 
 int main(int argc, char *argv[]) {
   gflags::ParseCommandLineFlags(&argc, &argv, true);
   prependDataPath();
 
+  if (FLAGS_convertLegacy) {
+    convertLegacyScans();
+    return 0;
+  }
+
   std::vector<std::string> csvFileNames;
 
   DIR *dir;
@@ -90,71 +126,49 @@ int main(int argc, char *argv[]) {
   if (FLAGS_quietMode)
     show_progress = new boost::progress_display(FLAGS_numScans * 5);
 
+  ScanScheduler scheduler(omp_get_max_threads(), FLAGS_concurrentScans,
+                          static_cast<size_t>(FLAGS_memoryBudget) * 1024 *
+                              1024);
+
   for (int i = FLAGS_startIndex; i < FLAGS_numScans + FLAGS_startIndex; ++i) {
     const std::string number =
         csvFileNames[i].substr(csvFileNames[i].find(".") - 3, 3);
     const std::string buildName =
         csvFileNames[i].substr(csvFileNames[i].rfind("/") + 1, 3);
-    const std::string csvFileName = FLAGS_PTXFolder + csvFileNames[i];
 
-    const std::string binaryFileName =
+    ScanJob job;
+    job.csvFileName = FLAGS_PTXFolder + csvFileNames[i];
+    job.binaryFileName =
         FLAGS_binaryFolder + buildName + "_binary_" + number + ".dat";
-    const std::string normalsName =
+    job.normalsName =
         FLAGS_normalsFolder + buildName + "_normals_" + number + ".dat";
-    const std::string dataName =
+    job.dataName =
         FLAGS_panoFolder + "data/" + buildName + "_data_" + number + ".dat";
-    const std::string rotName =
+    job.rotName =
         FLAGS_rotFolder + buildName + "_rotations_" + number + ".dat";
-    const std::string panoName = FLAGS_panoFolder + "images/" + buildName +
-                                 "_panorama_" + number + ".png";
-    const std::string doorName = FLAGS_doorsFolder + "pointcloud/" + buildName +
-                                 "_doors_" + number + ".dat";
+    job.panoName = FLAGS_panoFolder + "images/" + buildName + "_panorama_" +
+                   number + ".png";
+    job.panoBinaryName = FLAGS_panoFolder + "binary/" + buildName +
+                         "_panorama_" + number + ".dat";
+    job.doorName = FLAGS_doorsFolder + "pointcloud/" + buildName + "_doors_" +
+                   number + ".dat";
 
     if (FLAGS_redo ||
-        !(fexists(binaryFileName) && fexists(normalsName) &&
-          fexists(dataName) && fexists(rotName) && fexists(panoName) &&
-          fexists(doorName))) {
-      std::vector<scan::PointXYZRGBA> pointCloud;
-      convertToBinary(csvFileName, binaryFileName, pointCloud);
-      if (show_progress)
-        ++(*show_progress);
-
-      pcl::PointCloud<PointType>::Ptr cloud(new pcl::PointCloud<PointType>);
-      createPCLPointCloud(pointCloud, cloud);
-      if (show_progress)
-        ++(*show_progress);
-
-      if (!FLAGS_quietMode)
-        std::cout << "Calculating Normals" << std::endl;
-
-      pcl::PointCloud<NormalType>::Ptr cloud_normals(
-          new pcl::PointCloud<NormalType>);
-      pcl::PointCloud<PointType>::Ptr normals_points(
-          new pcl::PointCloud<PointType>);
-      getNormals(cloud, cloud_normals, normals_points, normalsName);
-
-      if (show_progress)
-        ++(*show_progress);
-
-      Eigen::Vector3d M1, M2, M3;
-      getRotations(cloud_normals, rotName, M1, M2, M3);
-
-      findDoors(normals_points, M1, M2, M3, doorName);
-
-      if (show_progress)
-        ++(*show_progress);
-
-      if (!FLAGS_quietMode)
-        std::cout << "Creating Panorama" << std::endl;
-
-      createPanorama(pointCloud, cloud_normals, normals_points, panoName,
-                     dataName);
-
-      if (show_progress)
-        ++(*show_progress);
-    } else if (show_progress)
-      *show_progress += 5;
+        !(scan::artifactExists(job.binaryFileName) &&
+          scan::artifactExists(job.normalsName) &&
+          panoramaExists(job.panoName, job.dataName, job.panoBinaryName) &&
+          scan::artifactExists(job.rotName) &&
+          scan::artifactExists(job.doorName))) {
+      scheduler.add(estimateFootprint(job.csvFileName), [&, job] {
+        if (FLAGS_blockBudget > 0)
+          processScanInBlocks(job, scheduler, show_progress);
+        else
+          processScan(job, scheduler, show_progress);
+      });
+    } else
+      advance(show_progress, 5);
   }
+  scheduler.wait();
 
   if (show_progress)
     delete show_progress;
@@ -163,79 +177,134 @@ int main(int argc, char *argv[]) {
   return 0;
 }
 
-static double ransacZ(const std::vector<double> &Z) {
-  const int m = Z.size();
+static void advance(boost::progress_display *show_progress, int n) {
+  static std::mutex progressMutex;
+  if (show_progress) {
+    std::lock_guard<std::mutex> lock(progressMutex);
+    *show_progress += n;
+  }
+}
 
-  double maxInliers = 0, K = 1e5;
-  int k = 0;
+/* Whether the panorama of a scan has already been written: the container,
+ * and the image and data files too if they are being written */
+static bool panoramaExists(const std::string &panoName,
+                           const std::string &dataName,
+                           const std::string &binaryName) {
+  return scan::artifactExists(binaryName) &&
+         (!FLAGS_legacyPanoramas || (scan::artifactExists(panoName) &&
+                                     scan::artifactExists(dataName)));
+}
 
-  static std::random_device seed;
-  static std::mt19937_64 gen(seed());
-  std::uniform_int_distribution<int> dist(0, m - 1);
-  double domz = 0;
+/* Rewrites every binary scan that is still in the old per-point record
+ * format in the current one.  The converted file is written loose, so it
+ * is read in place of a packed one */
+static void convertLegacyScans() {
+  std::vector<std::string> names;
+  parseFolder(FLAGS_binaryFolder, names);
+  int converted = 0;
+  for (auto &n : names) {
+    const std::string name = FLAGS_binaryFolder + n;
+    if (scan::ScanFile::isScanFile(name))
+      continue;
+    if (!FLAGS_quietMode)
+      std::cout << "Converting " << name << std::endl;
+    scan::ScanFile::convertLegacy(name, name, FLAGS_scanPrecision);
+    ++converted;
+  }
+  std::cout << "Converted " << converted << " of " << names.size()
+            << " binary scans" << std::endl;
+}
 
-  while (k < K) {
-    // random sampling
-    int randomIndex = dist(gen);
-    // compute the model parameters
-    auto zest = Z[randomIndex];
+/* Rough peak memory use of a scan in bytes.  Only the header of the
+ * PTX file is read */
+static size_t estimateFootprint(const std::string &csvFileName) {
+  // NB: Per pixel of the PTX grid, however the scan is read: the two
+  // panoramas and the range map of PanoramaRasterizer and the surface
+  // normals and hasNormal of createPanorama
+  constexpr size_t rasterBytes =
+      3 + 3 + sizeof(double) + sizeof(Eigen::Vector3f) + 1;
+  // NB: Per point for the normals: the grid of OrganizedNormals, or every
+  // point that passes the filter in one PCL cloud and its normals for the
+  // KdTree.  Both are needed whether or not the scan is read in blocks
+  constexpr size_t organizedBytes = 3 * sizeof(float) + 3;
+  constexpr size_t kdTreeBytes = sizeof(PointType) + sizeof(NormalType);
+  const size_t normalsBytes =
+      FLAGS_organizedNormals ? organizedBytes : kdTreeBytes;
+
+  std::ifstream scanFile(csvFileName, std::ios::in);
+  size_t columns = 0, rows = 0;
+  scanFile >> columns >> rows;
+  const size_t numPoints = columns * rows;
+
+  // NB: Read at once, the scan is also kept as scan::PointXYZRGBA
+  if (FLAGS_blockBudget > 0)
+    return static_cast<size_t>(FLAGS_blockBudget) * 1024 * 1024 +
+           numPoints * (rasterBytes + normalsBytes);
+  else
+    return numPoints *
+           (rasterBytes + normalsBytes + sizeof(scan::PointXYZRGBA));
+}
 
-    // Count the number of inliers
-    double numInliers = 0;
-    double average = 0;
-#pragma omp parallel
-    {
-      double privateInliers = 0;
-      double privateAve = 0;
-#pragma omp for nowait schedule(static)
-      for (int i = 0; i < m; ++i) {
-        auto &z = Z[i];
-        if (std::abs(z - zest) < 0.03) {
-          ++privateInliers;
-          privateAve += z;
-        }
-      }
+static void processScan(const ScanJob &job, const ScanScheduler &scheduler,
+                        boost::progress_display *show_progress) {
+  scheduler.beginStage();
+  std::vector<scan::PointXYZRGBA> pointCloud;
+  convertToBinary(job.csvFileName, job.binaryFileName, pointCloud);
+  ZPlaneFinder zPlanes;
+  zPlanes.addPoints(pointCloud.data(), pointCloud.size());
+  advance(show_progress);
+
+  pcl::PointCloud<NormalType>::Ptr cloud_normals(
+      new pcl::PointCloud<NormalType>);
+  pcl::PointCloud<PointType>::Ptr normals_points(
+      new pcl::PointCloud<PointType>);
+  if (FLAGS_organizedNormals) {
+    advance(show_progress);
 
-#pragma omp for schedule(static) ordered
-      for (int i = 0; i < omp_get_num_threads(); ++i) {
-#pragma omp ordered
-        {
-          average += privateAve;
-          numInliers += privateInliers;
-        }
-      }
+    if (!FLAGS_quietMode)
+      std::cout << "Calculating Normals" << std::endl;
+
+    scheduler.beginStage();
+    if (FLAGS_redo ||
+        !reloadNormals(cloud_normals, normals_points, job.normalsName)) {
+      Eigen::Vector3f pointMin, pointMax;
+      boundingBox(pointCloud, pointMin, pointMax);
+
+      OrganizedNormals estimator(PTXrows, PTXcols);
+      estimator.addPoints(pointCloud.data(), pointCloud.size());
+      getNormals(estimator, pointMin, pointMax, cloud_normals, normals_points,
+                 job.normalsName);
     }
+  } else {
+    pcl::PointCloud<PointType>::Ptr cloud(new pcl::PointCloud<PointType>);
+    createPCLPointCloud(pointCloud, cloud);
+    advance(show_progress);
 
-    if (numInliers > maxInliers) {
-      maxInliers = numInliers;
+    if (!FLAGS_quietMode)
+      std::cout << "Calculating Normals" << std::endl;
 
-      domz = average / numInliers;
-      // NB: Ransac formula to check for consensus
-      double w = (numInliers - 3) / m;
-      double p = std::max(0.001, std::pow(w, 3));
-      K = log(1 - 0.999) / log(1 - p);
-    }
-    ++k;
+    scheduler.beginStage();
+    getNormals(cloud, cloud_normals, normals_points, job.normalsName);
   }
 
-  return domz;
-}
+  advance(show_progress);
 
-static Eigen::VectorXd getZPlanes(const std::vector<double> &z) {
-  std::vector<double> zCoords(z.begin(), z.end());
-  Eigen::VectorXd domZs = Eigen::VectorXd::Zero(20);
-  int count = 0;
-  do {
-    double z0 = ransacZ(zCoords);
+  scheduler.beginStage();
+  Eigen::Vector3d M1, M2, M3;
+  getRotations(cloud_normals, job.rotName, M1, M2, M3);
 
-    zCoords.erase(
-        std::remove_if(zCoords.begin(), zCoords.end(),
-                       [&z0](auto &z) { return std::abs(z - z0) < 0.05; }),
-        zCoords.end());
+  findDoors(normals_points, M1, M2, M3, zPlanes, job.doorName);
 
-    domZs[count++] = z0;
-  } while (domZs.minCoeff() >= -1.5 || count < 2);
-  return domZs;
+  advance(show_progress);
+
+  if (!FLAGS_quietMode)
+    std::cout << "Creating Panorama" << std::endl;
+
+  scheduler.beginStage();
+  createPanorama(pointCloud, zPlanes, cloud_normals, normals_points,
+                 job.panoName, job.dataName, job.panoBinaryName);
+
+  advance(show_progress);
 }
 
 static void dispDepthMap(const Eigen::RowMatrixXd &dm) {
@@ -314,58 +383,188 @@ void convertToBinary(const std::string &fileNameIn, const std::string &outName,
   if (!FLAGS_quietMode)
     std::cout << outName << std::endl;
 
-  std::ifstream in(outName, std::ios::in | std::ios::binary);
-
-  if (!in.is_open() || FLAGS_redo) {
-    in.close();
-    std::ifstream scanFile(fileNameIn, std::ios::in);
-    int columns, rows;
-    scanFile >> columns >> rows;
-    std::ofstream out(outName, std::ios::out | std::ios::binary);
-    out.write(reinterpret_cast<const char *>(&columns), sizeof(columns));
-    out.write(reinterpret_cast<const char *>(&rows), sizeof(rows));
+  if (!scan::artifactExists(outName) || FLAGS_redo) {
+    scan::PTXReader reader(fileNameIn);
+    const int columns = reader.getColumns(), rows = reader.getRows();
     PTXcols = columns;
     PTXrows = rows;
-    std::string line;
     if (!FLAGS_quietMode)
       std::cout << rows << "   " << columns << std::endl;
-    pointCloud.reserve(columns * rows);
-    for (int i = 0; i < 9; ++i) {
-      getline(scanFile, line);
-    }
 
-    for (int k = 0; k < columns * rows; ++k) {
-      scan::PointXYZRGBA tmp;
-      scanFile >> tmp.point[0] >> tmp.point[1] >> tmp.point[2];
+    reader.readAll(pointCloud);
 
-      scanFile >> tmp.intensity;
+    if (!FLAGS_quietMode)
+      std::cout << "Parsed PTX at " << reader.getThroughput() << " MB/s"
+                << std::endl;
 
-      double itmp[3];
-      for (int j = 0; j < 3; ++j) {
-        scanFile >> itmp[j];
-        tmp.rgb[j] = cv::saturate_cast<uchar>(itmp[j]);
-      }
+    scan::ScanFileWriter::write(outName, columns, rows, pointCloud,
+                                FLAGS_scanPrecision);
 
-      tmp.writeToFile(out);
-      pointCloud.push_back(tmp);
-    }
+  } else {
+    scan::ScanFile scanFile(outName);
+    PTXcols = scanFile.getColumns();
+    PTXrows = scanFile.getRows();
 
-    out.close();
+    scanFile.toPoints(pointCloud);
+  }
+}
 
-  } else {
-    int columns, rows;
-    in.read(reinterpret_cast<char *>(&columns), sizeof(columns));
-    in.read(reinterpret_cast<char *>(&rows), sizeof(rows));
+/* Number of points per block: whole columns that fit in half of
+ * FLAGS_blockBudget, the other half is left to the consumers */
+static size_t blockSize(int rows) {
+  const size_t budget =
+      static_cast<size_t>(FLAGS_blockBudget) * 1024 * 1024 / 2;
+  constexpr size_t bytesPerPoint =
+      sizeof(scan::PointXYZRGBA) + sizeof(float) + sizeof(const char *);
+  return std::max<size_t>(1, budget / (bytesPerPoint * rows)) * rows;
+}
 
-    PTXcols = columns;
-    PTXrows = rows;
+static void readBinaryInBlocks(const std::string &binaryName,
+                               const BlockConsumer &consumer) {
+  scan::ScanFile scanFile(binaryName);
+  PTXcols = scanFile.getColumns();
+  PTXrows = scanFile.getRows();
+
+  const size_t total = scanFile.size();
+  std::vector<scan::PointXYZRGBA> block(std::min(total, blockSize(PTXrows)));
+  for (size_t done = 0; done < total;) {
+    const size_t n = std::min(block.size(), total - done);
+    scanFile.toPoints(done, n, block.data());
+    consumer(block.data(), n);
+    done += n;
+  }
+}
 
-    pointCloud.resize(columns * rows);
-    for (auto &p : pointCloud)
-      p.loadFromFile(in);
+void readScanInBlocks(const std::string &fileNameIn,
+                      const std::string &outName,
+                      const BlockConsumer &consumer) {
+  if (!FLAGS_quietMode)
+    std::cout << outName << std::endl;
+
+  if (!FLAGS_redo && scan::artifactExists(outName)) {
+    readBinaryInBlocks(outName, consumer);
+    return;
+  }
 
-    in.close();
+  scan::PTXReader reader(fileNameIn);
+  const int columns = reader.getColumns(), rows = reader.getRows();
+  PTXcols = columns;
+  PTXrows = rows;
+  if (!FLAGS_quietMode)
+    std::cout << rows << "   " << columns << std::endl;
+
+  scan::ScanFileWriter out(outName, columns, rows, FLAGS_scanPrecision);
+  std::vector<scan::PointXYZRGBA> block;
+  size_t n;
+  while ((n = reader.readBlock(block, blockSize(rows))) > 0) {
+    out.append(block.data(), n);
+    consumer(block.data(), n);
   }
+  out.close();
+
+  if (!FLAGS_quietMode)
+    std::cout << "Parsed PTX at " << reader.getThroughput() << " MB/s"
+              << std::endl;
+}
+
+/**
+  Same as processScan, but the scan is read in blocks of at most
+  FLAGS_blockBudget instead of as one array of scan::PointXYZRGBA.  It is
+  read once to build the panorama, the histogram of the z-coordinates
+  and the bounding box, and, if the normals need to be calculated with
+  the KdTree, a second time from the binary file to build the PCL cloud.
+  Only the read buffer is bounded: the rasters are still rows x cols and
+  the PCL cloud still holds every point that passes the filter, see
+  estimateFootprint
+*/
+static void processScanInBlocks(const ScanJob &job,
+                                const ScanScheduler &scheduler,
+                                boost::progress_display *show_progress) {
+  const bool needPanorama =
+      FLAGS_redo ||
+      !panoramaExists(job.panoName, job.dataName, job.panoBinaryName);
+  std::unique_ptr<PanoramaRasterizer> raster;
+  ZPlaneFinder zPlanes;
+  BoundingBoxStats stats;
+
+  pcl::PointCloud<NormalType>::Ptr cloud_normals(
+      new pcl::PointCloud<NormalType>);
+  pcl::PointCloud<PointType>::Ptr normals_points(
+      new pcl::PointCloud<PointType>);
+  const bool needNormals =
+      FLAGS_redo ||
+      !reloadNormals(cloud_normals, normals_points, job.normalsName);
+  // NB: The organized estimator only needs the grid, so it is filled in
+  // the same pass instead of building a PCL cloud in a second one
+  std::unique_ptr<OrganizedNormals> estimator;
+
+  scheduler.beginStage();
+  readScanInBlocks(job.csvFileName, job.binaryFileName,
+                   [&](const scan::PointXYZRGBA *points, size_t n) {
+                     if (needPanorama && !raster)
+                       raster.reset(new PanoramaRasterizer(PTXrows, PTXcols));
+                     if (needNormals && FLAGS_organizedNormals && !estimator)
+                       estimator.reset(new OrganizedNormals(PTXrows, PTXcols));
+                     if (raster)
+                       raster->addPoints(points, n);
+                     if (estimator)
+                       estimator->addPoints(points, n);
+                     zPlanes.addPoints(points, n);
+                     stats.addPoints(points, n);
+                   });
+  advance(show_progress);
+
+  if (estimator) {
+    Eigen::Vector3f pointMin, pointMax;
+    stats.getBoundingBox(pointMin, pointMax);
+    advance(show_progress);
+
+    if (!FLAGS_quietMode)
+      std::cout << "Calculating Normals" << std::endl;
+
+    scheduler.beginStage();
+    getNormals(*estimator, pointMin, pointMax, cloud_normals, normals_points,
+               job.normalsName);
+    estimator.reset();
+  } else if (needNormals) {
+    Eigen::Vector3f pointMin, pointMax;
+    stats.getBoundingBox(pointMin, pointMax);
+
+    pcl::PointCloud<PointType>::Ptr cloud(new pcl::PointCloud<PointType>);
+    readBinaryInBlocks(job.binaryFileName,
+                       [&](const scan::PointXYZRGBA *points, size_t n) {
+                         createPCLPointCloud(points, n, pointMin, pointMax,
+                                             cloud);
+                       });
+    advance(show_progress);
+
+    if (!FLAGS_quietMode)
+      std::cout << "Calculating Normals" << std::endl;
+
+    scheduler.beginStage();
+    getNormals(cloud, cloud_normals, normals_points, job.normalsName);
+  } else
+    advance(show_progress);
+
+  advance(show_progress);
+
+  scheduler.beginStage();
+  Eigen::Vector3d M1, M2, M3;
+  getRotations(cloud_normals, job.rotName, M1, M2, M3);
+
+  findDoors(normals_points, M1, M2, M3, zPlanes, job.doorName);
+
+  advance(show_progress);
+
+  if (!FLAGS_quietMode)
+    std::cout << "Creating Panorama" << std::endl;
+
+  scheduler.beginStage();
+  if (raster)
+    createPanorama(*raster, zPlanes, cloud_normals, normals_points,
+                   job.panoName, job.dataName, job.panoBinaryName);
+
+  advance(show_progress);
 }
 
 std::string type2str(int type) {
@@ -514,38 +713,28 @@ template <class T1, class T2> void fillGaps(T1 &mat, T2 &mask) {
   }
 }
 
-void createPanorama(const std::vector<scan::PointXYZRGBA> &pointCloud,
-                    pcl::PointCloud<NormalType>::Ptr &cloud_normals,
-                    pcl::PointCloud<PointType>::Ptr &normals_points,
-                    const std::string &panoName, const std::string &dataName) {
-  if (!FLAGS_redo && fexists(panoName) && fexists(dataName))
-    return;
-  cv::Mat trackingPanorama(PTXrows, PTXcols, CV_8UC3, cv::Scalar(0, 0, 0));
-  cv::Mat_<cv::Vec3b> _trackingPanorama = trackingPanorama;
+PanoramaRasterizer::PanoramaRasterizer(int rows, int cols)
+    : trackingPanorama{rows, cols, CV_8UC3, cv::Scalar(0, 0, 0)},
+      PTXPanorama{rows, cols, CV_8UC3},
+      rMap{Eigen::RowMatrixXd::Zero(rows, cols)}, rows{rows}, cols{cols},
+      row{rows - 1}, col{static_cast<int>(0.995 * (cols - 1) / 2.0)} {}
 
-  cv::Mat PTXPanorama(PTXrows, PTXcols, CV_8UC3);
+void PanoramaRasterizer::addPoints(const scan::PointXYZRGBA *points,
+                                   size_t n) {
+  cv::Mat_<cv::Vec3b> _trackingPanorama = trackingPanorama;
   cv::Mat_<cv::Vec3b> _PTXPanorama = PTXPanorama;
-  Eigen::RowMatrixXd rMap = Eigen::RowMatrixXd::Zero(PTXrows, PTXcols);
 
-  Eigen::RowMatrixXb hasNormal = Eigen::RowMatrixXb::Zero(PTXrows, PTXcols);
-  Eigen::ArrayXV3f surfaceNormals(PTXrows, PTXcols);
-
-  int row = PTXrows - 1;
-  int col = 0.995 * (PTXcols - 1) / 2.0;
-  Eigen::RowMatrixXb touched = Eigen::RowMatrixXb::Zero(PTXrows, PTXcols);
-  std::vector<double> zCoords;
-  for (auto &element : pointCloud) {
+  for (const scan::PointXYZRGBA *end = points + n; points != end; ++points) {
+    auto &element = *points;
     assert(row >= 0 && row < PTXPanorama.rows);
     assert(col >= 0 && col < PTXPanorama.cols);
     _PTXPanorama(row, col)[0] = element.rgb[2];
     _PTXPanorama(row, col)[1] = element.rgb[1];
     _PTXPanorama(row, col)[2] = element.rgb[0];
 
-    zCoords.push_back(element.point[2]);
-
     if (row == 0) {
-      row = PTXrows - 1;
-      col = col == 0 ? PTXcols - 1 : col - 1;
+      row = rows - 1;
+      col = col == 0 ? cols - 1 : col - 1;
     } else
       --row;
 
@@ -566,11 +755,188 @@ void createPanorama(const std::vector<scan::PointXYZRGBA> &pointCloud,
     _trackingPanorama(trackedRow, trackedCol)[1] = element.rgb[1];
     _trackingPanorama(trackedRow, trackedCol)[2] = element.rgb[0];
 
-    touched(trackedRow, trackedCol) = 1;
     rMap(trackedRow, trackedCol) = r;
   }
+}
+
+namespace {
+// NB: 1mm bins over +-32.768m.  Points outside of that are far from any
+// floor or ceiling and are ignored
+constexpr double zBinSize = 0.001, zRange = 32.768;
+constexpr int numZBins = 2 * zRange / zBinSize + 0.5;
+// NB: Same distances ransacZ used for inliers and for removing a plane
+// before looking for the next one
+constexpr double zInlierDistance = 0.03, zRemoveDistance = 0.05;
+constexpr int maxZPlanes = 20;
+
+inline int zBin(double z) {
+  return std::floor((z + zRange) / zBinSize);
+}
+} // namespace
+
+ZPlaneFinder::ZPlaneFinder()
+    : threadHistograms(omp_get_max_threads()),
+      domZs{Eigen::VectorXd::Zero(maxZPlanes)}, found{false} {}
+
+void ZPlaneFinder::addPoints(const scan::PointXYZRGBA *points, size_t n) {
+  const size_t numThreads = omp_get_max_threads();
+  if (threadHistograms.size() < numThreads)
+    threadHistograms.resize(numThreads);
+
+#pragma omp parallel
+  {
+    auto &hist = threadHistograms[omp_get_thread_num()];
+    if (hist.counts.empty()) {
+      hist.counts.assign(numZBins, 0);
+      hist.sums.assign(numZBins, 0);
+    }
+#pragma omp for schedule(static)
+    for (size_t i = 0; i < n; ++i) {
+      const double z = points[i].point[2];
+      if (!(z >= -zRange && z < zRange))
+        continue;
+      const int bin = std::min(zBin(z), numZBins - 1);
+      ++hist.counts[bin];
+      hist.sums[bin] += z;
+    }
+  }
+}
+
+const Eigen::VectorXd &ZPlaneFinder::getZPlanes() {
+  if (!found)
+    findPlanes();
+  return domZs;
+}
+
+/* Same search getZPlanes did with ransacZ, but on the histogram.  The
+ * best hypothesis is the bin with the most points within the inlier
+ * distance, found with a prefix sum, and is then refined to the mean of
+ * its inliers using the exact sums of the bins */
+void ZPlaneFinder::findPlanes() {
+  std::vector<double> counts(numZBins, 0), sums(numZBins, 0);
+  for (auto &hist : threadHistograms) {
+    if (hist.counts.empty())
+      continue;
+    for (int i = 0; i < numZBins; ++i) {
+      counts[i] += hist.counts[i];
+      sums[i] += hist.sums[i];
+    }
+  }
+  threadHistograms.clear();
+
+  const int window = std::round(zInlierDistance / zBinSize);
+  std::vector<double> prefix(numZBins + 1);
+  auto inliers = [&](double z, double &count, double &sum) {
+    const int first = std::max(0, zBin(z - zInlierDistance)),
+              last = std::min(numZBins - 1, zBin(z + zInlierDistance));
+    count = sum = 0;
+    for (int i = first; i <= last; ++i) {
+      count += counts[i];
+      sum += sums[i];
+    }
+  };
+
+  int count = 0;
+  do {
+    prefix[0] = 0;
+    for (int i = 0; i < numZBins; ++i)
+      prefix[i + 1] = prefix[i] + counts[i];
+
+    int best = -1;
+    double bestCount = 0;
+    for (int i = 0; i < numZBins; ++i) {
+      const double c = prefix[std::min(numZBins, i + window + 1)] -
+                       prefix[std::max(0, i - window)];
+      if (c > bestCount) {
+        bestCount = c;
+        best = i;
+      }
+    }
+    // NB: Every point has been removed
+    if (best < 0)
+      break;
+
+    double z0 = (best + 0.5) * zBinSize - zRange;
+    // NB: A few mean shift steps move z0 off the bin grid and onto the
+    // center of the plane
+    for (int k = 0; k < 5; ++k) {
+      double c, sum;
+      inliers(z0, c, sum);
+      if (!c)
+        break;
+      const double z1 = sum / c;
+      const bool converged = std::abs(z1 - z0) < 1e-5;
+      z0 = z1;
+      if (converged)
+        break;
+    }
+
+    const int first = std::max(0, zBin(z0 - zRemoveDistance)),
+              last = std::min(numZBins - 1, zBin(z0 + zRemoveDistance));
+    std::fill(counts.begin() + first, counts.begin() + last + 1, 0);
+    std::fill(sums.begin() + first, sums.begin() + last + 1, 0);
+
+    domZs[count++] = z0;
+  } while ((domZs.minCoeff() >= -1.5 || count < 2) && count < maxZPlanes);
+
+  found = true;
+}
+
+void BoundingBoxStats::addPoints(const scan::PointXYZRGBA *points, size_t n) {
+  for (size_t i = 0; i < n; ++i) {
+    Eigen::Vector3d p = points[i].point.cast<double>();
+    sum += p;
+    sumSq += p.cwiseProduct(p);
+  }
+  count += n;
+}
+
+void BoundingBoxStats::getBoundingBox(Eigen::Vector3f &pointMin,
+                                      Eigen::Vector3f &pointMax) {
+  Eigen::Vector3d average = sum / count;
+  Eigen::Vector3d sigma =
+      ((sumSq - count * average.cwiseProduct(average)) / (count - 1))
+          .cwiseMax(0)
+          .cwiseSqrt();
+
+  Eigen::Vector3d range(10, 10, 6);
+  Eigen::Vector3d delta = 1.1 * sigma.cwiseProduct(range);
+
+  pointMin = (average - delta / 2.0).cast<float>();
+  pointMax = (average + delta / 2.0).cast<float>();
+}
+
+void createPanorama(const std::vector<scan::PointXYZRGBA> &pointCloud,
+                    ZPlaneFinder &zPlanes,
+                    pcl::PointCloud<NormalType>::Ptr &cloud_normals,
+                    pcl::PointCloud<PointType>::Ptr &normals_points,
+                    const std::string &panoName, const std::string &dataName,
+                    const std::string &binaryName) {
+  if (!FLAGS_redo && panoramaExists(panoName, dataName, binaryName))
+    return;
+
+  PanoramaRasterizer raster(PTXrows, PTXcols);
+  raster.addPoints(pointCloud.data(), pointCloud.size());
+
+  createPanorama(raster, zPlanes, cloud_normals, normals_points, panoName,
+                 dataName, binaryName);
+}
+
+void createPanorama(PanoramaRasterizer &raster, ZPlaneFinder &zPlanes,
+                    pcl::PointCloud<NormalType>::Ptr &cloud_normals,
+                    pcl::PointCloud<PointType>::Ptr &normals_points,
+                    const std::string &panoName, const std::string &dataName,
+                    const std::string &binaryName) {
+  if (!FLAGS_redo && panoramaExists(panoName, dataName, binaryName))
+    return;
+  const cv::Mat &trackingPanorama = raster.trackingPanorama;
+  const cv::Mat &PTXPanorama = raster.PTXPanorama;
+  Eigen::RowMatrixXd &rMap = raster.rMap;
+
+  Eigen::RowMatrixXb hasNormal = Eigen::RowMatrixXb::Zero(PTXrows, PTXcols);
+  Eigen::ArrayXV3f surfaceNormals(PTXrows, PTXcols);
 
-  for (int i = 0; i < cloud_normals->size(); ++i) {
+  for (size_t i = 0; i < cloud_normals->size(); ++i) {
     auto &p = normals_points->at(i);
     auto &n = cloud_normals->at(i);
     Eigen::Vector3f coord(p.x, p.y, p.z);
@@ -646,7 +1012,7 @@ void createPanorama(const std::vector<scan::PointXYZRGBA> &pointCloud,
   std::vector<cv::KeyPoint> keypoints;
   cv::Ptr<cv::Feature2D> SIFT = cv::xfeatures2d::SIFT::create();
 
-  auto domZs = getZPlanes(zCoords);
+  const Eigen::VectorXd &domZs = zPlanes.getZPlanes();
 
   place::Panorama pano;
   pano.imgs.resize(1);
@@ -667,24 +1033,28 @@ void createPanorama(const std::vector<scan::PointXYZRGBA> &pointCloud,
   keypoints.erase(keypoints.begin() + 0.7 * keypoints.size() + 1,
                   keypoints.end());
 
-  cv::KeyPoint::convert(keypoints, pano.keypoints);
-
-  double startSize = pano.keypoints.size();
-  pano.keypoints.erase(
-      std::remove_if(pano.keypoints.begin(), pano.keypoints.end(),
-                     [&pano](const auto &kp) {
-                       return !pano.rMap(kp.y, kp.x) ||
-                              pano.surfaceNormals(kp.y, kp.x) ==
-                                  Eigen::Vector3f::Zero();
-                     }),
-      pano.keypoints.end());
+  double startSize = keypoints.size();
+  for (auto &kp : keypoints) {
+    const int row = kp.pt.y, col = kp.pt.x;
+    if (!pano.rMap(row, col) ||
+        pano.surfaceNormals(row, col) == Eigen::Vector3f::Zero())
+      continue;
+    // NB: The size and angle are kept so that the keypoints can be
+    // described the way SIFT found them
+    pano.keypoints.push_back(kp.pt);
+    pano.keypointSizes.push_back(kp.size);
+    pano.keypointAngles.push_back(kp.angle);
+  }
 
   // pano.imgs[0] =
   //     cv::Mat(scaledPTX.size(), scaledPTX.type(), cv::Scalar::all(0));
   // GaussianBlur(scaledPTX, pano.imgs[0], cv::Size(5, 5), 0);
 
-  if (FLAGS_save)
-    pano.writeToFile(panoName, dataName);
+  if (FLAGS_save) {
+    if (FLAGS_legacyPanoramas)
+      pano.writeToFile(panoName, dataName);
+    pano.writeToFile(binaryName);
+  }
 
   if (FLAGS_preview) {
     std::cout << "Well formed kps: " << pano.keypoints.size() / startSize * 100
@@ -712,7 +1082,15 @@ void createPCLPointCloud(const std::vector<scan::PointXYZRGBA> &points,
   Eigen::Vector3f pointMin, pointMax;
   boundingBox(points, pointMin, pointMax);
 
-  for (auto &p : points) {
+  createPCLPointCloud(points.data(), points.size(), pointMin, pointMax, cloud);
+}
+
+void createPCLPointCloud(const scan::PointXYZRGBA *points, size_t n,
+                         const Eigen::Vector3f &pointMin,
+                         const Eigen::Vector3f &pointMax,
+                         pcl::PointCloud<PointType>::Ptr &cloud) {
+  for (const scan::PointXYZRGBA *end = points + n; points != end; ++points) {
+    auto &p = *points;
     bool in = true;
     for (int i = 0; i < 3; ++i)
       if (p.point[i] < pointMin[i] || p.point[i] > pointMax[i])
@@ -739,7 +1117,7 @@ void createPCLPointCloud(const std::vector<scan::PointXYZRGBA> &points,
 bool reloadNormals(pcl::PointCloud<NormalType>::Ptr &cloud_normals,
                    pcl::PointCloud<PointType>::Ptr &normals_points,
                    const std::string &outName) {
-  std::ifstream in(outName, std::ios::in | std::ios::binary);
+  scan::ArtifactStream in(outName);
   if (!in.is_open())
     return false;
 
@@ -749,7 +1127,7 @@ bool reloadNormals(pcl::PointCloud<NormalType>::Ptr &cloud_normals,
   cloud_normals->resize(size);
   normals_points->resize(size);
 
-  for (int i = 0; i < size; ++i) {
+  for (size_t i = 0; i < size; ++i) {
     in.read(reinterpret_cast<char *>(&cloud_normals->at(i)),
             sizeof(NormalType));
     in.read(reinterpret_cast<char *>(&normals_points->at(i)),
@@ -788,6 +1166,7 @@ void getNormals(const pcl::PointCloud<PointType>::Ptr &cloud,
   norm_est.setSearchSurface(cloud);
   norm_est.setSearchMethod(tree);
   norm_est.setRadiusSearch(0.03);
+  norm_est.setNumberOfThreads(omp_get_max_threads());
   norm_est.compute(*cloud_normals);
 
   std::vector<int> indices;
@@ -798,6 +1177,17 @@ void getNormals(const pcl::PointCloud<PointType>::Ptr &cloud,
     saveNormals(cloud_normals, normals_points, outName);
 }
 
+void getNormals(OrganizedNormals &estimator, const Eigen::Vector3f &pointMin,
+                const Eigen::Vector3f &pointMax,
+                pcl::PointCloud<NormalType>::Ptr &cloud_normals,
+                pcl::PointCloud<PointType>::Ptr &normals_points,
+                const std::string &outName) {
+  estimator.compute(pointMin, pointMax, cloud_normals, normals_points);
+
+  if (FLAGS_save)
+    saveNormals(cloud_normals, normals_points, outName);
+}
+
 void saveNormals(const pcl::PointCloud<NormalType>::Ptr &cloud_normals,
                  pcl::PointCloud<PointType>::Ptr &normals_points,
                  const std::string &outName) {
@@ -807,7 +1197,7 @@ void saveNormals(const pcl::PointCloud<NormalType>::Ptr &cloud_normals,
   size_t size = cloud_normals->points.size();
   out.write(reinterpret_cast<const char *>(&size), sizeof(size_t));
 
-  for (int i = 0; i < size; ++i) {
+  for (size_t i = 0; i < size; ++i) {
     out.write(reinterpret_cast<const char *>(&cloud_normals->at(i)),
               sizeof(NormalType));
     out.write(reinterpret_cast<const char *>(&normals_points->at(i)),
@@ -844,30 +1234,40 @@ void boundingBox(const std::vector<scan::PointXYZRGBA> &points,
 
 void findDoors(pcl::PointCloud<PointType>::Ptr &pointCloud,
                const Eigen::Vector3d &M1, const Eigen::Vector3d &M2,
-               const Eigen::Vector3d &M3, const std::string &outName) {
-  if (!FLAGS_redo && fexists(outName))
+               const Eigen::Vector3d &M3, ZPlaneFinder &zPlanes,
+               const std::string &outName) {
+  if (!FLAGS_redo && scan::artifactExists(outName))
     return;
 
   constexpr double voxelsPerMeter = 50, gradCutoff = 2.0,
                    wMin = 0.4 * voxelsPerMeter, wMax = 2.5 * voxelsPerMeter;
 
+  // NB: The Manhattan aligned grid voxelizes in the Manhattan frame and
+  // probes along its axes, so the doors it finds can differ from those of
+  // the scan aligned grid
+  std::unique_ptr<DoorGrid> doorGrid;
   voxel::HashVoxel<Eigen::Vector3i, double> grid;
-  std::vector<double> zCoords;
-
-  for (auto &point : *pointCloud) {
-    const double depth = Eigen::Vector3d(point.x, point.y, point.z).norm();
-    auto voxel = grid(point.x * voxelsPerMeter, point.y * voxelsPerMeter,
-                      point.z * voxelsPerMeter);
-    if (voxel)
-      *voxel = (*voxel + depth) / 2.0;
-    else
-      grid.insert(depth, point.x * voxelsPerMeter, point.y * voxelsPerMeter,
-                  point.z * voxelsPerMeter);
-
-    zCoords.emplace_back(point.z);
+  Eigen::Vector3i min, max;
+  if (FLAGS_manhattanDoorGrid) {
+    doorGrid.reset(new DoorGrid(*pointCloud, M1, M2, M3, voxelsPerMeter));
+    min = doorGrid->min();
+    max = doorGrid->max();
+  } else {
+    for (auto &point : *pointCloud) {
+      const double depth = Eigen::Vector3d(point.x, point.y, point.z).norm();
+      auto voxel = grid(point.x * voxelsPerMeter, point.y * voxelsPerMeter,
+                        point.z * voxelsPerMeter);
+      if (voxel)
+        *voxel = (*voxel + depth) / 2.0;
+      else
+        grid.insert(depth, point.x * voxelsPerMeter, point.y * voxelsPerMeter,
+                    point.z * voxelsPerMeter);
+    }
+    min = grid.getMin();
+    max = grid.getMax();
   }
 
-  auto domZs = getZPlanes(zCoords);
+  const Eigen::VectorXd &domZs = zPlanes.getZPlanes();
 
   const double hMax =
       std::max(2.1, std::min(2.6, 0.9 * std::abs(domZs.maxCoeff() -
@@ -895,9 +1295,14 @@ void findDoors(pcl::PointCloud<PointType>::Ptr &pointCloud,
     return std::round(v);
   };
 
-  auto getdepth = [&grid, &r](
+  // NB: Only const lookups are made on the grids from here on, so they can
+  // be shared by the threads of the sweep
+  auto getdepth = [&doorGrid, &grid, &r](
       const Eigen::Vector3d &point, const Eigen::Vector3d &axis,
       const Eigen::Vector3d &zAxis, double xStop, double yStop, double zStop) {
+    if (doorGrid)
+      return doorGrid->getDepth(point, axis, zAxis, xStop, yStop, zStop);
+
     Eigen::Vector3d a2(axis[1], -axis[0], axis[2]);
     if (a2.dot(point) < 0.0)
       a2 *= -1.0;
@@ -907,7 +1312,7 @@ void findDoors(pcl::PointCloud<PointType>::Ptr &pointCloud,
         for (int k = 0; k <= zStop * voxelsPerMeter; ++k) {
           Eigen::Vector3i cur =
               (point + i * a2 + j * axis + k * zAxis).unaryExpr(r).cast<int>();
-          auto v = grid(cur);
+          auto v = grid.find(cur);
           if (v)
             return *v;
 
@@ -917,7 +1322,7 @@ void findDoors(pcl::PointCloud<PointType>::Ptr &pointCloud,
             cur = (point - i * a2 - j * axis - k * zAxis)
                       .unaryExpr(r)
                       .cast<int>();
-            v = grid(cur);
+            v = grid.find(cur);
             if (v)
               return *v;
           }
@@ -934,8 +1339,8 @@ void findDoors(pcl::PointCloud<PointType>::Ptr &pointCloud,
                                                                omp_in.end()))
 
 #pragma omp parallel for reduction(merge : doors)
-  for (int j = grid.min()[1]; j < grid.max()[1]; ++j) {
-    for (int i = grid.min()[0]; i < grid.max()[0]; ++i) {
+  for (int j = min[1]; j < max[1]; ++j) {
+    for (int i = min[0]; i < max[0]; ++i) {
       Eigen::Vector3d current = traverse(M2, i, M3, j);
       current[2] += z0Index;
 
@@ -5,6 +5,9 @@
 #include <scan_gflags.h>
 #include <scan_typedefs.hpp>
 
+#include <functional>
+#include <vector>
+
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 
@@ -13,16 +16,96 @@ typedef pcl::Normal NormalType;
 typedef pcl::ReferenceFrame RFType;
 typedef pcl::SHOT352 DescriptorType;
 
+/**
+  Rasterizes the points of a scan into the PTX panorama, the
+  tracking panorama and the range map.  Points must be added in
+  PTX order, but can be added a block at a time
+*/
+class PanoramaRasterizer {
+public:
+  PanoramaRasterizer(int rows, int cols);
+  void addPoints(const scan::PointXYZRGBA *points, size_t n);
+
+  cv::Mat trackingPanorama, PTXPanorama;
+  Eigen::RowMatrixXd rMap;
+
+private:
+  int rows, cols, row, col;
+};
+
+/**
+  Finds the dominant horizontal planes of a scan, ie the floor and
+  ceiling, from a histogram of the z-coordinates of its points.  Points
+  can be added a block at a time.  The planes are found the first time
+  they are asked for and then kept, so every stage of a scan shares them
+*/
+class ZPlaneFinder {
+public:
+  ZPlaneFinder();
+  void addPoints(const scan::PointXYZRGBA *points, size_t n);
+
+  /* Same layout getZPlanes always had: up to 20 planes in the order they
+   * were found, with the unused entries 0 */
+  const Eigen::VectorXd &getZPlanes();
+
+private:
+  struct Histogram {
+    std::vector<uint32_t> counts;
+    std::vector<double> sums;
+  };
+  void findPlanes();
+
+  // NB: One histogram per thread so points can be added in parallel.
+  // They are merged when the planes are found
+  std::vector<Histogram> threadHistograms;
+  Eigen::VectorXd domZs;
+  bool found;
+};
+
+/**
+  Running statistics of the point positions used to compute
+  the same bounding box as boundingBox without keeping the points
+*/
+struct BoundingBoxStats {
+  Eigen::Vector3d sum = Eigen::Vector3d::Zero();
+  Eigen::Vector3d sumSq = Eigen::Vector3d::Zero();
+  size_t count = 0;
+  void addPoints(const scan::PointXYZRGBA *points, size_t n);
+  void getBoundingBox(Eigen::Vector3f &pointMin, Eigen::Vector3f &pointMax);
+};
+
+typedef std::function<void(const scan::PointXYZRGBA *, size_t)> BlockConsumer;
+
 void convertToBinary(const std::string &fileNameIn, const std::string &,
                      std::vector<scan::PointXYZRGBA> &pointCloud);
+/* Passes the scan to consumer in blocks of whole columns that fit in
+ * FLAGS_blockBudget.  Reads the binary file if it exists, otherwise
+ * parses the PTX file and writes the binary file as it goes */
+void readScanInBlocks(const std::string &fileNameIn,
+                      const std::string &outName,
+                      const BlockConsumer &consumer);
 void createPanorama(const std::vector<scan::PointXYZRGBA> &pointCloud,
+                    ZPlaneFinder &zPlanes,
                     pcl::PointCloud<NormalType>::Ptr &cloud_normals,
                     pcl::PointCloud<PointType>::Ptr &normals_points,
-                    const std::string &panoName, const std::string &dataName);
+                    const std::string &panoName, const std::string &dataName,
+                    const std::string &binaryName);
+void createPanorama(PanoramaRasterizer &raster, ZPlaneFinder &zPlanes,
+                    pcl::PointCloud<NormalType>::Ptr &cloud_normals,
+                    pcl::PointCloud<PointType>::Ptr &normals_points,
+                    const std::string &panoName, const std::string &dataName,
+                    const std::string &binaryName);
 void boundingBox(const std::vector<scan::PointXYZRGBA> &points,
                  Eigen::Vector3f &pointMin, Eigen::Vector3f &pointMax);
 void createPCLPointCloud(const std::vector<scan::PointXYZRGBA> &points,
                          pcl::PointCloud<PointType>::Ptr &cloud);
+void createPCLPointCloud(const scan::PointXYZRGBA *points, size_t n,
+                         const Eigen::Vector3f &pointMin,
+                         const Eigen::Vector3f &pointMax,
+                         pcl::PointCloud<PointType>::Ptr &cloud);
+bool reloadNormals(pcl::PointCloud<NormalType>::Ptr &cloud_normals,
+                   pcl::PointCloud<PointType>::Ptr &normals_points,
+                   const std::string &outName);
 void getNormals(const pcl::PointCloud<PointType>::Ptr &cloud,
                 pcl::PointCloud<NormalType>::Ptr &cloud_normals,
                 pcl::PointCloud<PointType>::Ptr &normals_points,
@@ -33,6 +116,7 @@ void saveNormals(const pcl::PointCloud<NormalType>::Ptr &cloud_normals,
 
 void findDoors(pcl::PointCloud<PointType>::Ptr &pointCloud,
                const Eigen::Vector3d &M1, const Eigen::Vector3d &M2,
-               const Eigen::Vector3d &M3, const std::string &outName);
+               const Eigen::Vector3d &M3, ZPlaneFinder &zPlanes,
+               const std::string &outName);
 
 #endif // PREPROCESSOR_H
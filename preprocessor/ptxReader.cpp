@@ -0,0 +1,304 @@
+/**
+  Implements the PTXReader.  A PTX file is 10 header lines followed
+  by one "x y z intensity r g b" line per point.  The data section
+  is split into line aligned chunks which are first counted and then
+  parsed in parallel directly into their final place in the output
+*/
+
+#include "ptxReader.h"
+
+#include <chrono>
+#include <clocale>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <locale.h>
+
+#include <omp.h>
+#include <opencv2/core.hpp>
+
+namespace {
+constexpr size_t targetChunkSize = 16 * 1024 * 1024;
+constexpr double exactPowers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                  1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                  1e18, 1e19, 1e20, 1e21, 1e22};
+
+/* The "C" locale used by the slow paths so that parsing never
+ * depends on the user's locale */
+locale_t cLocale() {
+  static locale_t loc = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+  return loc;
+}
+
+inline bool isBlank(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+inline const char *skipBlanks(const char *cur, const char *end) {
+  while (cur < end && isBlank(*cur))
+    ++cur;
+  return cur;
+}
+
+inline const char *tokenEnd(const char *cur, const char *end) {
+  while (cur < end && !isBlank(*cur) && *cur != '\n')
+    ++cur;
+  return cur;
+}
+
+/* Splits a decimal token into an integer mantissa and a power of ten.
+ * Returns false if the token isn't a plain decimal number that fits */
+inline bool decompose(const char *cur, const char *end, bool &negative,
+                      uint64_t &mantissa, int &exponent, int &digits) {
+  negative = false;
+  if (cur < end && (*cur == '-' || *cur == '+'))
+    negative = *cur++ == '-';
+
+  mantissa = 0;
+  exponent = 0;
+  digits = 0;
+  bool any = false;
+  for (; cur < end && isDigit(*cur); ++cur, any = true) {
+    if (mantissa || *cur != '0')
+      ++digits;
+    mantissa = mantissa * 10 + (*cur - '0');
+  }
+  if (cur < end && *cur == '.') {
+    for (++cur; cur < end && isDigit(*cur); ++cur, any = true) {
+      if (mantissa || *cur != '0')
+        ++digits;
+      mantissa = mantissa * 10 + (*cur - '0');
+      --exponent;
+    }
+  }
+  if (cur < end && (*cur == 'e' || *cur == 'E')) {
+    ++cur;
+    bool negExp = false;
+    if (cur < end && (*cur == '-' || *cur == '+'))
+      negExp = *cur++ == '-';
+    int e = 0;
+    for (; cur < end && isDigit(*cur) && e < 1000; ++cur)
+      e = e * 10 + (*cur - '0');
+    exponent += negExp ? -e : e;
+  }
+  return any && cur == end && digits <= 18;
+}
+
+/* Clinger's fast path: when the mantissa and the power of ten are both
+ * exact doubles, a single multiply or divide is correctly rounded */
+inline bool fastPath(const char *cur, const char *end, double &v) {
+  bool negative;
+  uint64_t mantissa;
+  int exponent, digits;
+  if (!decompose(cur, end, negative, mantissa, exponent, digits) ||
+      mantissa >= (1ull << 53) || exponent < -22 || exponent > 22)
+    return false;
+
+  v = static_cast<double>(mantissa);
+  v = exponent < 0 ? v / exactPowers[-exponent] : v * exactPowers[exponent];
+  if (negative)
+    v = -v;
+  return true;
+}
+
+/* Locale free float parsing that gives the same result as strtof.
+ * Rounding the correctly rounded double to float is only wrong when the
+ * double lands exactly halfway between two floats, so that case (and
+ * anything that isn't a plain decimal) goes through strtof_l */
+inline float parseFloat(const char *cur, const char *end) {
+  double v;
+  if (fastPath(cur, end, v) &&
+      (v == 0 || (std::abs(v) > 1e-37 && std::abs(v) < 1e37))) {
+    uint64_t bits;
+    std::memcpy(&bits, &v, sizeof(bits));
+    if ((bits & 0x1FFFFFFF) != 0x10000000)
+      return static_cast<float>(v);
+  }
+  std::string token(cur, end);
+  return strtof_l(token.c_str(), nullptr, cLocale());
+}
+
+inline double parseDouble(const char *cur, const char *end) {
+  double v;
+  if (fastPath(cur, end, v))
+    return v;
+  std::string token(cur, end);
+  return strtod_l(token.c_str(), nullptr, cLocale());
+}
+
+/* Number of lines in [cur, end) that contain a point */
+size_t countPoints(const char *cur, const char *end) {
+  size_t count = 0;
+  bool content = false;
+  for (; cur < end; ++cur) {
+    if (*cur == '\n') {
+      count += content;
+      content = false;
+    } else if (!content && !isBlank(*cur))
+      content = true;
+  }
+  return count + content;
+}
+
+/* Parses one point line.  cur is left at the start of the next line */
+bool parsePoint(const char *&cur, const char *end, scan::PointXYZRGBA &p) {
+  const char *tokens[7][2];
+  for (int t = 0; t < 7; ++t) {
+    cur = skipBlanks(cur, end);
+    if (cur == end || *cur == '\n')
+      return false;
+    tokens[t][0] = cur;
+    cur = tokenEnd(cur, end);
+    tokens[t][1] = cur;
+  }
+  while (cur < end && *cur++ != '\n')
+    ;
+
+  for (int i = 0; i < 3; ++i)
+    p.point[i] = parseFloat(tokens[i][0], tokens[i][1]);
+  p.intensity = parseFloat(tokens[3][0], tokens[3][1]);
+  for (int i = 0; i < 3; ++i)
+    p.rgb[i] = cv::saturate_cast<uchar>(
+        parseDouble(tokens[4 + i][0], tokens[4 + i][1]));
+  return true;
+}
+
+const char *nextLine(const char *cur, const char *end) {
+  auto newLine = static_cast<const char *>(std::memchr(cur, '\n', end - cur));
+  return newLine ? newLine + 1 : end;
+}
+} // namespace
+
+scan::PTXReader::PTXReader(const std::string &fileName)
+    : pointsRead{0}, released{0}, columns{0}, rows{0}, throughput{0},
+      bytesRead{0}, secondsReading{0} {
+  if (!file.open(fileName)) {
+    std::cout << "[scan::PTXReader] Could not open: " << fileName << std::endl;
+    exit(1);
+  }
+  file.adviseSequential();
+
+  const char *cur = file.data();
+  fileEnd = file.data() + file.size();
+
+  // NB: Mirror "scanFile >> columns >> rows" followed by 9 getlines
+  char *next;
+  columns = strtol(cur, &next, 10);
+  rows = strtol(next, &next, 10);
+  cur = next;
+  for (int i = 0; i < 9; ++i)
+    cur = nextLine(cur, fileEnd);
+  dataStart = cursor = cur;
+
+  if (columns <= 0 || rows <= 0) {
+    std::cout << "[scan::PTXReader] Malformed header in: " << fileName
+              << std::endl;
+    exit(1);
+  }
+}
+
+void scan::PTXReader::readAll(std::vector<scan::PointXYZRGBA> &pointCloud) {
+  auto start = std::chrono::steady_clock::now();
+  const size_t total = numPoints();
+  pointCloud.resize(total);
+
+  // NB: Chunk boundaries are moved forward to the start of the next line
+  // so that no point is split across chunks
+  const size_t dataSize = fileEnd - dataStart;
+  const int numChunks =
+      std::max<size_t>(omp_get_max_threads(),
+                       (dataSize + targetChunkSize - 1) / targetChunkSize);
+  std::vector<const char *> bounds(numChunks + 1);
+  bounds[0] = dataStart;
+  bounds[numChunks] = fileEnd;
+  for (int c = 1; c < numChunks; ++c)
+    bounds[c] = std::max(
+        bounds[c - 1],
+        nextLine(dataStart + dataSize / numChunks * c - 1, fileEnd));
+
+  std::vector<size_t> offsets(numChunks + 1, 0);
+#pragma omp parallel for schedule(dynamic)
+  for (int c = 0; c < numChunks; ++c)
+    offsets[c + 1] = countPoints(bounds[c], bounds[c + 1]);
+
+  for (int c = 0; c < numChunks; ++c)
+    offsets[c + 1] += offsets[c];
+
+  if (offsets[numChunks] < total) {
+    std::cout << "[scan::PTXReader] Expected " << total << " points but found "
+              << offsets[numChunks] << std::endl;
+    exit(1);
+  }
+
+  bool malformed = false;
+#pragma omp parallel for schedule(dynamic) reduction(|| : malformed)
+  for (int c = 0; c < numChunks; ++c) {
+    const char *cur = bounds[c];
+    for (size_t i = offsets[c]; i < std::min(offsets[c + 1], total);) {
+      cur = skipBlanks(cur, bounds[c + 1]);
+      if (cur < bounds[c + 1] && *cur == '\n') {
+        ++cur;
+        continue;
+      }
+      if (!parsePoint(cur, bounds[c + 1], pointCloud[i++])) {
+        malformed = true;
+        break;
+      }
+    }
+  }
+
+  if (malformed) {
+    std::cout << "[scan::PTXReader] Found a line without 7 values"
+              << std::endl;
+    exit(1);
+  }
+
+  const double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  throughput = (fileEnd - file.data()) / (1024.0 * 1024.0) / seconds;
+}
+
+size_t scan::PTXReader::readBlock(std::vector<scan::PointXYZRGBA> &block,
+                                  size_t maxPoints) {
+  auto start = std::chrono::steady_clock::now();
+  const char *blockStart = cursor;
+  maxPoints = std::min(maxPoints, numPoints() - pointsRead);
+
+  lineStarts.clear();
+  while (lineStarts.size() < maxPoints && cursor < fileEnd) {
+    const char *cur = skipBlanks(cursor, fileEnd);
+    if (cur < fileEnd && *cur != '\n')
+      lineStarts.push_back(cur);
+    cursor = nextLine(cur, fileEnd);
+  }
+
+  const size_t n = lineStarts.size();
+  block.resize(n);
+  bool malformed = false;
+#pragma omp parallel for schedule(static) reduction(|| : malformed)
+  for (size_t i = 0; i < n; ++i) {
+    const char *cur = lineStarts[i];
+    malformed = !parsePoint(cur, fileEnd, block[i]) || malformed;
+  }
+
+  if (malformed) {
+    std::cout << "[scan::PTXReader] Found a line without 7 values"
+              << std::endl;
+    exit(1);
+  }
+
+  pointsRead += n;
+  const size_t consumed = cursor - file.data();
+  file.release(released, consumed - released);
+  released = consumed - consumed % sysconf(_SC_PAGESIZE);
+
+  bytesRead += cursor - blockStart;
+  secondsReading +=
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+  throughput = bytesRead / (1024.0 * 1024.0) / secondsReading;
+  return n;
+}
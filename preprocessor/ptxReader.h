@@ -0,0 +1,45 @@
+#pragma once
+#ifndef PTX_READER_H
+#define PTX_READER_H
+
+#include <MappedFile.hpp>
+#include <scan_typedefs.hpp>
+
+#include <string>
+#include <vector>
+
+namespace scan {
+/**
+  Reads a PTX file by memory mapping it and parsing line aligned
+  chunks of it in parallel.  Produces exactly the same points
+  as reading the file with std::ifstream
+*/
+class PTXReader {
+public:
+  PTXReader(const std::string &fileName);
+
+  /* Parses every point in the file into pointCloud, which is resized
+   * to rows * columns */
+  void readAll(std::vector<scan::PointXYZRGBA> &pointCloud);
+  /* Parses the next (at most) maxPoints points into block and returns how
+   * many were read.  Pages of the file that have been consumed are dropped
+   * from the mapping so memory use stays bounded by the block size */
+  size_t readBlock(std::vector<scan::PointXYZRGBA> &block, size_t maxPoints);
+
+  int getColumns() const { return columns; };
+  int getRows() const { return rows; };
+  size_t numPoints() const { return static_cast<size_t>(columns) * rows; };
+  /* MB/s of the last parse */
+  double getThroughput() const { return throughput; };
+
+private:
+  MappedFile file;
+  const char *dataStart, *fileEnd, *cursor;
+  std::vector<const char *> lineStarts;
+  size_t pointsRead, released;
+  int columns, rows;
+  double throughput, bytesRead, secondsReading;
+};
+} // scan
+
+#endif // PTX_READER_H
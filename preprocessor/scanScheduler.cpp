@@ -0,0 +1,52 @@
+#include "scanScheduler.h"
+
+#include <algorithm>
+
+#include <omp.h>
+
+ScanScheduler::ScanScheduler(int numThreads, int maxConcurrent,
+                             size_t memoryBudget)
+    : numThreads{std::max(1, numThreads)},
+      maxConcurrent{std::max(1, maxConcurrent)}, memoryBudget{memoryBudget},
+      running{0}, used{0} {}
+
+ScanScheduler::~ScanScheduler() { wait(); }
+
+void ScanScheduler::add(size_t footprint, const std::function<void()> &job) {
+  std::unique_lock<std::mutex> lock(mutex);
+  // NB: A scan that is larger than the whole budget is still run, but
+  // only once it has the machine to itself
+  finished.wait(lock, [&] {
+    return running == 0 ||
+           (running < maxConcurrent &&
+            (!memoryBudget || used + footprint <= memoryBudget));
+  });
+  ++running;
+  used += footprint;
+
+  workers.emplace_back([this, footprint, job] {
+    job();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      --running;
+      used -= footprint;
+    }
+    finished.notify_all();
+  });
+}
+
+void ScanScheduler::wait() {
+  for (auto &w : workers)
+    if (w.joinable())
+      w.join();
+  workers.clear();
+}
+
+void ScanScheduler::beginStage() const {
+  int share;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    share = numThreads / std::max(1, running);
+  }
+  omp_set_num_threads(std::max(1, share));
+}
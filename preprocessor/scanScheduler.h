@@ -0,0 +1,45 @@
+#pragma once
+#ifndef SCAN_SCHEDULER_H
+#define SCAN_SCHEDULER_H
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+  Runs several scans at once.  A scan is only started once its
+  estimated memory footprint fits in the budget alongside the scans
+  that are already running.  The thread pool is shared between the
+  running scans and is re-divided at the start of every stage, so
+  scans get more threads as others finish
+*/
+class ScanScheduler {
+public:
+  /* memoryBudget is in bytes, 0 means unlimited */
+  ScanScheduler(int numThreads, int maxConcurrent, size_t memoryBudget);
+  ~ScanScheduler();
+
+  /* Blocks until the scan can be admitted and then starts it on its
+   * own thread.  Scans are started in the order they are added */
+  void add(size_t footprint, const std::function<void()> &job);
+  /* Blocks until all scans have finished */
+  void wait();
+
+  /* Called from within a job at the start of each stage.  Sets the
+   * number of OpenMP threads for the calling scan to its share of the
+   * pool */
+  void beginStage() const;
+
+private:
+  const int numThreads, maxConcurrent;
+  const size_t memoryBudget;
+  int running;
+  size_t used;
+  mutable std::mutex mutex;
+  std::condition_variable finished;
+  std::vector<std::thread> workers;
+};
+
+#endif // SCAN_SCHEDULER_H
@@ -6,11 +6,417 @@
 
 #include "scanDensity_3DInfo.h"
 
+#include <algorithm>
+#include <limits>
+#include <omp.h>
+
 voxel::CloudAnalyzer3D::CloudAnalyzer3D(
     const std::shared_ptr<const std::vector<Eigen::Vector3f>> &points,
     const std::shared_ptr<const std::vector<Eigen::Matrix3d>> &R,
-    const std::shared_ptr<const BoundingBox> &bBox)
-    : points{points}, R{R}, bBox{bBox} {}
+    const std::shared_ptr<const BoundingBox> &bBox,
+    const RangeImage::ConstPtr &rangeImage)
+    : points{points}, R{R}, bBox{bBox}, rangeImage{rangeImage} {}
+
+namespace {
+/* The segment origin + t * unitRay, t in [0, end], in voxels.  Where it
+ * crosses the boundary of a cell of cellSize voxels is computed from the
+ * integer coordinate of the boundary alone, the same way for every cell
+ * size, so a tile boundary is crossed at exactly the t at which the
+ * boundary of the voxels on either side of it is */
+struct Segment {
+  Eigen::Vector3d origin, unitRay, inverse;
+  Eigen::Vector3i step;
+  double end;
+
+  Segment(const Eigen::Vector3d &origin, const Eigen::Vector3d &unitRay,
+          double end)
+      : origin{origin}, unitRay{unitRay}, end{end} {
+    for (int a = 0; a < 3; ++a) {
+      step[a] = unitRay[a] > 0 ? 1 : unitRay[a] < 0 ? -1 : 0;
+      inverse[a] = step[a] ? 1 / unitRay[a] : 0;
+    }
+  }
+
+  /* t at which the segment enters cell v along axis a */
+  double enter(int a, int v, int cellSize) const {
+    return ((v + (step[a] < 0)) * cellSize - origin[a]) * inverse[a];
+  }
+
+  /* Clips the segment to the cells in [lo, hi).  Returns false if it
+   * misses them */
+  bool clip(const Eigen::Vector3i &cellSize, const Eigen::Vector3i &lo,
+            const Eigen::Vector3i &hi, double &tMin, double &tMax) const {
+    tMin = 0;
+    tMax = end;
+    for (int a = 0; a < 3; ++a) {
+      if (step[a] == 0) {
+        if (origin[a] < lo[a] * cellSize[a] ||
+            origin[a] >= hi[a] * cellSize[a])
+          return false;
+        continue;
+      }
+      const int in = step[a] > 0 ? lo[a] : hi[a] - 1,
+                out = step[a] > 0 ? hi[a] : lo[a] - 1;
+      tMin = std::max(tMin, enter(a, in, cellSize[a]));
+      tMax = std::min(tMax, enter(a, out, cellSize[a]));
+    }
+    return tMin <= tMax;
+  }
+};
+} // namespace
+
+/* Amanatides-Woo traversal of the cells in [lo, hi) that segment passes
+ * through.  visit(cell) is called for each of them in order.  Where the
+ * segment leaves cell through an edge or a corner, or starts or ends on
+ * its boundary, it touches cells next to cell that it doesn't pass
+ * through, and touch(cell) is called.
+ *
+ * Every crossing is a function of the cell being entered alone, so a
+ * traversal clipped to part of the grid visits the cells that a whole
+ * traversal would in that part.  It also visits the ones there that the
+ * whole traversal only touches */
+template <typename VisitFunc, typename TouchFunc>
+static void traverse(const Segment &segment, const Eigen::Vector3i &cellSize,
+                     const Eigen::Vector3i &lo, const Eigen::Vector3i &hi,
+                     VisitFunc &&visit, TouchFunc &&touch) {
+  double tMin, tMax;
+  if (!segment.clip(cellSize, lo, hi, tMin, tMax))
+    return;
+
+  const Eigen::Vector3i &step = segment.step;
+  auto enter = [&](int a, int v) { return segment.enter(a, v, cellSize[a]); };
+
+  Eigen::Vector3i cell;
+  Eigen::Vector3d next;
+  bool touching = false;
+  for (int a = 0; a < 3; ++a) {
+    if (step[a] == 0) {
+      const int v = std::floor(segment.origin[a]);
+      cell[a] = lo[a] + (v - lo[a] * cellSize[a]) / cellSize[a];
+      next[a] = std::numeric_limits<double>::infinity();
+      continue;
+    }
+    const int first = step[a] > 0 ? lo[a] : hi[a] - 1;
+    const int last = step[a] > 0 ? hi[a] - 1 : lo[a];
+    int v = std::floor((segment.origin[a] + tMin * segment.unitRay[a]) /
+                       cellSize[a]);
+    v = std::min(std::max(v, lo[a]), hi[a] - 1);
+    // NB: Rounding can put the start a cell off of where the crossings
+    // say it is
+    while (v != last && enter(a, v + step[a]) <= tMin)
+      v += step[a];
+    while (v != first && enter(a, v) > tMin)
+      v -= step[a];
+    cell[a] = v;
+    next[a] = enter(a, v + step[a]);
+    touching = touching || (v != first && enter(a, v) == tMin);
+  }
+  if (touching)
+    touch(cell);
+
+  // NB: tMax is the crossing out of [lo, hi) when the segment leaves it,
+  // so stopping at tMax keeps every step inside
+  while (true) {
+    visit(cell);
+    int a = next[1] < next[0];
+    a = next[2] < next[a] ? 2 : a;
+    if (next[a] == tMax || next[a] == next[(a + 1) % 3] ||
+        next[a] == next[(a + 2) % 3])
+      touch(cell);
+    if (next[a] >= tMax)
+      return;
+    cell[a] += step[a];
+    next[a] = enter(a, cell[a] + step[a]);
+  }
+}
+
+void voxel::CloudAnalyzer3D::castFreeSpaceRays() {
+  const int numZ = pointsPerVoxel.size(), numY = pointsPerVoxel[0].rows(),
+            numX = pointsPerVoxel[0].cols();
+  const double zScale = voxelsPerMeter;
+
+  float cameraCenter[3];
+  cameraCenter[0] = -1 * pointMin[0];
+  cameraCenter[1] = -1 * pointMin[1];
+  cameraCenter[2] = -1 * pointMin[2];
+  const Eigen::Vector3d origin(cameraCenter[0] * voxelsPerMeter,
+                               cameraCenter[1] * voxelsPerMeter,
+                               cameraCenter[2] * zScale);
+
+  /* A ray from the scanner towards an occupied voxel.  It stops short of
+   * the voxel so that it doesn't clear the surface that was seen */
+  struct Ray {
+    Eigen::Vector3d unitRay;
+    double end;
+    int weight;
+  };
+
+  // NB: The rays of every slice are gathered on their own and then put
+  // together in order, so rays is in the same order for any number of
+  // threads
+  std::vector<std::vector<Ray>> raysPerSlice(numZ);
+#pragma omp parallel for schedule(dynamic)
+  for (int k = 0; k < numZ; ++k) {
+    for (int i = 0; i < numX; ++i) {
+      for (int j = 0; j < numY; ++j) {
+        if (!pointsPerVoxel[k](j, i))
+          continue;
+
+        const Eigen::Vector3d ray = Eigen::Vector3d(i, j, k) - origin;
+        const double length = ray.norm();
+        const int stop = floor(0.85 * length - 3);
+        if (stop < 1)
+          continue;
+
+        raysPerSlice[k].push_back(
+            {ray / length, stop - 1.0,
+             FLAGS_weightRays ? pointsPerVoxel[k](j, i) : 1});
+      }
+    }
+  }
+
+  size_t numRays = 0;
+  for (auto &slice : raysPerSlice)
+    numRays += slice.size();
+  std::vector<Ray> rays;
+  rays.reserve(numRays);
+  for (auto &slice : raysPerSlice) {
+    rays.insert(rays.end(), slice.begin(), slice.end());
+    std::vector<Ray>().swap(slice);
+  }
+
+  // NB: The grid is split into tiles and every ray is binned into the
+  // tiles it reaches, so a tile only traverses the part of the rays that
+  // reach it.  The tile around the scanner is reached by every ray, so
+  // the rays of a tile are split up further.  Every piece of work counts
+  // into its own copy of the tile, which is then added to numTimesSeen.
+  // The counts are integers, so the result doesn't depend on the number
+  // of threads or the order of the work
+  constexpr int tileXY = 64, tileZ = 16;
+  constexpr size_t raysPerItem = 1 << 13;
+  const Eigen::Vector3i ones = Eigen::Vector3i::Ones(),
+                        tileSize(tileXY, tileXY, tileZ),
+                        gridSize(numX, numY, numZ);
+  const Eigen::Vector3i numTiles((numX + tileXY - 1) / tileXY,
+                                 (numY + tileXY - 1) / tileXY,
+                                 (numZ + tileZ - 1) / tileZ);
+  const size_t totalTiles = numTiles.prod();
+  auto tileIndex = [&](const Eigen::Vector3i &t) {
+    return (static_cast<size_t>(t[2]) * numTiles[1] + t[1]) * numTiles[0] +
+           t[0];
+  };
+  auto tileBox = [&](size_t t, Eigen::Vector3i &lo, Eigen::Vector3i &hi) {
+    const Eigen::Vector3i tile(t % numTiles[0], t / numTiles[0] % numTiles[1],
+                               t / numTiles[0] / numTiles[1]);
+    lo = tile.cwiseProduct(tileSize);
+    hi = (lo + tileSize).cwiseMin(gridSize);
+  };
+
+  /* Fills tiles with the tiles a ray reaches, that is the ones its
+   * traversal clipped to them visits a voxel of.  A walk over the tiles
+   * finds them, but for the ones it only touches, which are looked for
+   * around where it touches them */
+  auto tilesOf = [&](const Ray &r, std::vector<size_t> &tiles) {
+    const Segment segment(origin, r.unitRay, r.end);
+    tiles.clear();
+    bool touched = false;
+    traverse(segment, tileSize, Eigen::Vector3i::Zero(), numTiles,
+             [&](const Eigen::Vector3i &t) { tiles.push_back(tileIndex(t)); },
+             [&](const Eigen::Vector3i &t) {
+               touched = true;
+               const Eigen::Vector3i lo = (t - ones).cwiseMax(0),
+                                     hi = (t + ones).cwiseMin(numTiles - ones);
+               for (int z = lo[2]; z <= hi[2]; ++z)
+                 for (int y = lo[1]; y <= hi[1]; ++y)
+                   for (int x = lo[0]; x <= hi[0]; ++x)
+                     tiles.push_back(tileIndex(Eigen::Vector3i(x, y, z)));
+             });
+    // NB: The walk visits every tile once
+    if (touched) {
+      std::sort(tiles.begin(), tiles.end());
+      tiles.erase(std::unique(tiles.begin(), tiles.end()), tiles.end());
+    }
+
+    double tMin, tMax;
+    Eigen::Vector3i lo, hi;
+    tiles.erase(std::remove_if(tiles.begin(), tiles.end(),
+                               [&](size_t t) {
+                                 tileBox(t, lo, hi);
+                                 return !segment.clip(ones, lo, hi, tMin,
+                                                      tMax);
+                               }),
+                tiles.end());
+  };
+
+  /* The rays of tile t are raysPerTile[offsets[t]] to
+   * raysPerTile[offsets[t + 1]].  Every thread finds the tiles of its
+   * part of rays and counts them, and then fills its rays in after the
+   * rays of the threads before it, so the rays of a tile are in order */
+  std::vector<size_t> offsets(totalTiles + 1, 0);
+  std::vector<int> raysPerTile;
+  std::vector<size_t> threadOffsets;
+#pragma omp parallel
+  {
+    const int thread = omp_get_thread_num(),
+              numThreads = omp_get_num_threads();
+    std::vector<size_t> tiles;
+    // NB: The number of tiles of every ray followed by the tiles
+    std::vector<int> tilesOfRays;
+#pragma omp single
+    threadOffsets.assign(numThreads * totalTiles, 0);
+    size_t *counts = threadOffsets.data() + thread * totalTiles;
+
+    size_t first = rays.size(), last = 0;
+#pragma omp for schedule(static)
+    for (size_t r = 0; r < rays.size(); ++r) {
+      first = std::min(first, r);
+      last = r + 1;
+      tilesOf(rays[r], tiles);
+      tilesOfRays.push_back(tiles.size());
+      for (size_t t : tiles) {
+        tilesOfRays.push_back(t);
+        ++counts[t];
+      }
+    }
+
+#pragma omp single
+    {
+      size_t start = 0;
+      for (size_t t = 0; t < totalTiles; ++t) {
+        offsets[t] = start;
+        for (int i = 0; i < numThreads; ++i) {
+          const size_t count = threadOffsets[i * totalTiles + t];
+          threadOffsets[i * totalTiles + t] = start;
+          start += count;
+        }
+      }
+      offsets[totalTiles] = start;
+      raysPerTile.resize(start);
+    }
+
+    auto cur = tilesOfRays.cbegin();
+    for (size_t r = first; r < last; ++r)
+      for (int n = *cur++; n > 0; --n)
+        raysPerTile[counts[*cur++]++] = r;
+  }
+
+  /* Rays [first, end) of raysPerTile, which all belong to tile */
+  struct WorkItem {
+    size_t tile, first, end;
+  };
+  std::vector<WorkItem> items;
+  std::vector<int> itemsPerTile(totalTiles, 0);
+  for (size_t t = 0; t < totalTiles; ++t)
+    for (size_t f = offsets[t]; f < offsets[t + 1]; f += raysPerItem) {
+      items.push_back({t, f, std::min(offsets[t + 1], f + raysPerItem)});
+      ++itemsPerTile[t];
+    }
+
+  std::vector<int *> slices(numZ);
+  for (int k = 0; k < numZ; ++k)
+    slices[k] = numTimesSeen[k].data();
+
+#pragma omp parallel
+  {
+    std::vector<int> counts(tileSize.prod());
+#pragma omp for schedule(dynamic)
+    for (size_t w = 0; w < items.size(); ++w) {
+      const WorkItem &item = items[w];
+      Eigen::Vector3i lo, hi;
+      tileBox(item.tile, lo, hi);
+
+      // NB: y is fastest in counts, as it is in numTimesSeen
+      std::fill(counts.begin(), counts.end(), 0);
+      for (size_t f = item.first; f < item.end; ++f) {
+        const Ray &r = rays[raysPerTile[f]];
+        traverse(Segment(origin, r.unitRay, r.end), ones, lo, hi,
+                 [&](const Eigen::Vector3i &v) {
+                   const Eigen::Vector3i d = v - lo;
+                   counts[(d[2] * tileXY + d[0]) * tileXY + d[1]] += r.weight;
+                 },
+                 [](const Eigen::Vector3i &) {});
+      }
+
+      const bool shared = itemsPerTile[item.tile] > 1;
+      for (int k = lo[2]; k < hi[2]; ++k)
+        for (int i = lo[0]; i < hi[0]; ++i)
+          for (int j = lo[1]; j < hi[1]; ++j) {
+            const int c =
+                counts[((k - lo[2]) * tileXY + i - lo[0]) * tileXY + j - lo[1]];
+            if (!c)
+              continue;
+            int &dst = slices[k][j + i * numY];
+            if (shared)
+              __atomic_fetch_add(&dst, c, __ATOMIC_RELAXED);
+            else
+              dst += c;
+          }
+    }
+  }
+}
+
+void voxel::CloudAnalyzer3D::lookUpFreeSpace() {
+  const int numZ = pointsPerVoxel.size(), numY = pointsPerVoxel[0].rows(),
+            numX = pointsPerVoxel[0].cols();
+
+  // NB: The band is made an x slice at a time, since y is fastest in every
+  // z slice of pointsPerVoxel and numTimesSeen.  Threads take chunks of
+  // slices and make the band of their own
+  constexpr int slicesPerChunk = 32;
+  const int numChunks = (numX + slicesPerChunk - 1) / slicesPerChunk;
+  auto occupiedSlice = [&](int i, uint8_t *mask) {
+    for (int k = 0; k < numZ; ++k) {
+      const int *src = pointsPerVoxel[k].col(i).data();
+      uint8_t *dst = mask + static_cast<size_t>(k) * numY;
+      for (int j = 0; j < numY; ++j)
+        dst[j] = src[j] > 0;
+    }
+  };
+
+  // NB: A voxel is free if it is as far short of the return in its
+  // direction as a ray would stop short of the voxel it was cast towards.
+  // It is weighted by the points around the return like the ray would be
+#pragma omp parallel for schedule(dynamic)
+  for (int c = 0; c < numChunks; ++c) {
+    std::unique_ptr<NarrowBand> band;
+    if (FLAGS_freeSpaceBand > 0)
+      band.reset(new NarrowBand(numY, numZ, numX, FLAGS_freeSpaceBand,
+                                occupiedSlice));
+
+    for (int i = c * slicesPerChunk;
+         i < std::min(numX, (c + 1) * slicesPerChunk); ++i) {
+      const uint8_t *inBand = band ? band->slice(i) : nullptr;
+      for (int k = 0; k < numZ; ++k) {
+        for (int j = 0; j < numY; ++j) {
+          if (inBand && !inBand[static_cast<size_t>(k) * numY + j])
+            continue;
+
+          const Eigen::Vector3d point(
+              (i + 0.5) / voxelsPerMeter + pointMin[0],
+              (j + 0.5) / voxelsPerMeter + pointMin[1],
+              (k + 0.5) / voxelsPerMeter + pointMin[2]);
+          const double length = point.norm(),
+                       depth = rangeImage->depth(point);
+          // NB: Rays end a voxel before they stop
+          if (length > 0.85 * depth - 4 / voxelsPerMeter)
+            continue;
+
+          int weight = 1;
+          if (FLAGS_weightRays) {
+            const Eigen::Vector3d hit = point * depth / length;
+            const int x = voxelsPerMeter * (hit[0] - pointMin[0]),
+                      y = voxelsPerMeter * (hit[1] - pointMin[1]),
+                      z = voxelsPerMeter * (hit[2] - pointMin[2]);
+            if (x >= 0 && x < numX && y >= 0 && y < numY && z >= 0 &&
+                z < numZ)
+              weight = std::max(1, pointsPerVoxel[z](y, x));
+          }
+          numTimesSeen[k](j, i) = weight;
+        }
+      }
+    }
+  }
+}
 
 void voxel::CloudAnalyzer3D::run(double voxelsPerMeter, double pixelsPerMeter) {
   bBox->getBoundingBox(pointMin, pointMax);
@@ -42,47 +448,11 @@ void voxel::CloudAnalyzer3D::run(double voxelsPerMeter, double pixelsPerMeter) {
 
   // Free space evidence
 
-  float cameraCenter[3];
-  cameraCenter[0] = -1 * pointMin[0];
-  cameraCenter[1] = -1 * pointMin[1];
-  cameraCenter[2] = -1 * pointMin[2];
   numTimesSeen.assign(numZ, Eigen::MatrixXi::Zero(numY, numX));
-
-  for (int k = 0; k < numZ; ++k) {
-    for (int i = 0; i < numX; ++i) {
-      for (int j = 0; j < numY; ++j) {
-        if (!pointsPerVoxel[k](j, i))
-          continue;
-
-        Eigen::Vector3d ray;
-        ray[0] = i - cameraCenter[0] * voxelsPerMeter;
-        ray[1] = j - cameraCenter[1] * voxelsPerMeter;
-        ray[2] = k - cameraCenter[2] * zScale;
-        double length = ray.norm();
-        Eigen::Vector3d unitRay = ray / length;
-
-        int stop = floor(0.85 * length - 3);
-        Eigen::Vector3i voxelHit;
-        for (int a = 0; a < stop; ++a) {
-          voxelHit[0] =
-              floor(cameraCenter[0] * voxelsPerMeter + a * unitRay[0]);
-          voxelHit[1] =
-              floor(cameraCenter[1] * voxelsPerMeter + a * unitRay[1]);
-          voxelHit[2] = floor(cameraCenter[2] * zScale + a * unitRay[2]);
-
-          if (voxelHit[0] < 0 || voxelHit[0] >= numX)
-            continue;
-          if (voxelHit[1] < 0 || voxelHit[1] >= numY)
-            continue;
-          if (voxelHit[2] < 0 || voxelHit[2] >= numZ)
-            continue;
-
-          numTimesSeen[voxelHit[2]](voxelHit[1], voxelHit[0]) +=
-              pointsPerVoxel[k](j, i);
-        }
-      }
-    }
-  }
+  if (rangeImage)
+    lookUpFreeSpace();
+  else
+    castFreeSpaceRays();
 
   zeroZeroD =
       Eigen::Vector3d(-pointMin[0] * voxelsPerMeter,
@@ -91,14 +461,13 @@ void voxel::CloudAnalyzer3D::run(double voxelsPerMeter, double pixelsPerMeter) {
       Eigen::Vector3i(-pointMin[0] * voxelsPerMeter,
                       -pointMin[1] * voxelsPerMeter, -pointMin[2] * zScale);
 }
-template <typename T> static void displayVoxelGrid(const T &voxelB) {
-  Eigen::MatrixXd collapsed =
-      Eigen::MatrixXd::Zero(voxelB.v[0].rows(), voxelB.v[0].cols());
+static void displayVoxelGrid(const place::VoxelGrid &voxelB) {
+  Eigen::MatrixXd collapsed = Eigen::MatrixXd::Zero(voxelB.y, voxelB.x);
 
-  for (int k = 0; k < voxelB.v.size(); ++k)
-    for (int i = 0; i < voxelB.v[0].cols(); ++i)
-      for (int j = 0; j < voxelB.v[0].rows(); ++j)
-        collapsed(j, i) += voxelB.v[k](j, i) ? 1 : 0;
+  for (int k = 0; k < voxelB.z; ++k)
+    for (int i = 0; i < voxelB.x; ++i)
+      for (int j = 0; j < voxelB.y; ++j)
+        collapsed(j, i) += voxelB(i, j, k) ? 1 : 0;
 
   double average, sigma;
   average = sigma = 0;
@@ -197,27 +566,29 @@ void voxel::CloudAnalyzer3D::saveVoxelGrids(
   sigmaF /= countF - 1;
   sigmaF = sqrt(sigmaF);
 
-  std::vector<Eigen::MatrixXb> threshHoldedPoint(z,
-                                                 Eigen::MatrixXb::Zero(y, x));
-  std::vector<Eigen::MatrixXb> threshHoldedFree(z, Eigen::MatrixXb::Zero(y, x));
+  place::VoxelGrid threshHoldedPoint(x, y, z), threshHoldedFree(x, y, z);
   size_t numNonZeros = 0, nonZeroPoint = 0;
+  Eigen::Vector3i occupiedMin(x, y, z), occupiedMax(-1, -1, -1);
   for (int k = 0; k < z; ++k) {
-    const auto *pointSrc = pointGrid[k].data();
-    auto *pointDst = threshHoldedPoint[k].data();
-
-    const auto *freeSrc = freeSpace[k].data();
-    char *freeDst = threshHoldedFree[k].data();
-    for (int i = 0; i < x * y; ++i) {
-      if (*(pointSrc + i)) {
-        double normalized = (*(pointSrc + i) - averageP) / sigmaP;
-        *(pointDst + i) = normalized > -1.0 ? 1 : 0;
-        nonZeroPoint += normalized > -1.0 ? 1 : 0;
-      }
+    for (int i = 0; i < x; ++i) {
+      for (int j = 0; j < y; ++j) {
+        if (pointGrid[k](j, i)) {
+          double normalized = (pointGrid[k](j, i) - averageP) / sigmaP;
+          if (normalized > -1.0) {
+            threshHoldedPoint.set(i, j, k);
+            ++nonZeroPoint;
+            occupiedMin = occupiedMin.cwiseMin(Eigen::Vector3i(i, j, k));
+            occupiedMax = occupiedMax.cwiseMax(Eigen::Vector3i(i, j, k));
+          }
+        }
 
-      if (*(freeSrc + i)) {
-        double normalized = (*(freeSrc + i) - averageP) / sigmaP;
-        *(freeDst + i) = normalized > -1.0 ? 1 : 0;
-        numNonZeros += normalized > -1.0 ? 1 : 0;
+        if (freeSpace[k](j, i)) {
+          double normalized = (freeSpace[k](j, i) - averageP) / sigmaP;
+          if (normalized > -1.0) {
+            threshHoldedFree.set(i, j, k);
+            ++numNonZeros;
+          }
+        }
       }
     }
   }
@@ -234,19 +605,68 @@ void voxel::CloudAnalyzer3D::saveVoxelGrids(
 
   std::ofstream metaDataWriter(metaData, std::ios::out | std::ios::binary);
   for (int r = 0; r < NUM_ROTS; ++r) {
-    place::VoxelGrid rotatedFree, rotatedPoint;
-    rotatedFree.v = std::vector<Eigen::MatrixXb>(
-        z, Eigen::MatrixXb::Zero(newRows, newCols));
-    rotatedFree.c = numNonZeros;
+    const Eigen::Matrix3d &rot = R->at(r);
+    const Eigen::Matrix3d inverse = rot.inverse();
+
+    // NB: The trimmed grid is the box around the rotated point voxels,
+    // which is inside of the box around the rotated corners of the box
+    // around the point voxels.  Only that box, with a voxel of slack for
+    // rounding, is resampled
+    Eigen::Vector3d cornerMin =
+        Eigen::Vector3d::Constant(std::numeric_limits<double>::max());
+    Eigen::Vector3d cornerMax = -cornerMin;
+    for (int c = 0; c < 8; ++c) {
+      const Eigen::Vector3d corner(
+          c & 1 ? occupiedMax[0] + 1 : occupiedMin[0],
+          c & 2 ? occupiedMax[1] + 1 : occupiedMin[1],
+          c & 4 ? occupiedMax[2] + 1 : occupiedMin[2]);
+      const Eigen::Vector3d dst = inverse * (corner - zeroZeroD) + newZZ;
+      cornerMin = cornerMin.cwiseMin(dst);
+      cornerMax = cornerMax.cwiseMax(dst);
+    }
+    const Eigen::Vector3i rotatedSize(newCols, newRows, z),
+        sourceSize(x, y, z);
+    Eigen::Vector3i lo, hi;
+    for (int a = 0; a < 3; ++a) {
+      lo[a] = std::max(0, static_cast<int>(std::floor(cornerMin[a])) - 1);
+      hi[a] = std::max(
+          lo[a], std::min(rotatedSize[a],
+                          static_cast<int>(std::floor(cornerMax[a])) + 2));
+    }
 
-    rotatedPoint.v = std::vector<Eigen::MatrixXb>(
-        z, Eigen::MatrixXb::Zero(newRows, newCols));
+    place::VoxelGrid rotatedFree(hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]),
+        rotatedPoint(hi[0] - lo[0], hi[1] - lo[1], hi[2] - lo[2]);
+    rotatedFree.c = numNonZeros;
     rotatedPoint.c = nonZeroPoint;
-    for (int k = 0; k < z; ++k) {
-      for (int i = 0; i < newCols; ++i) {
-        for (int j = 0; j < newRows; ++j) {
-          Eigen::Vector3d point(i, j, k);
-          Eigen::Vector3d src = R->at(r) * (point - newZZ) + zeroZeroD;
+
+    // NB: Along a row the source moves by the first column of the rotation
+    // for every voxel, so only the start of the row needs the full
+    // transform and the part of the row that lands in the source grid is
+    // found up front
+    const Eigen::Vector3d step = rot.col(0);
+#pragma omp parallel for schedule(static)
+    for (int k = lo[2]; k < hi[2]; ++k) {
+      for (int j = lo[1]; j < hi[1]; ++j) {
+        const Eigen::Vector3d start =
+            rot * (Eigen::Vector3d(0, j, k) - newZZ) + zeroZeroD;
+
+        double iMin = lo[0], iMax = hi[0];
+        for (int a = 0; a < 3; ++a) {
+          if (step[a] == 0) {
+            if (start[a] < 0 || start[a] >= sourceSize[a])
+              iMax = iMin;
+            continue;
+          }
+          double t0 = -start[a] / step[a],
+                 t1 = (sourceSize[a] - start[a]) / step[a];
+          if (t0 > t1)
+            std::swap(t0, t1);
+          iMin = std::max(iMin, std::floor(t0));
+          iMax = std::min(iMax, std::ceil(t1) + 1);
+        }
+
+        for (int i = iMin; i < iMax; ++i) {
+          const Eigen::Vector3d src = start + i * step;
 
           if (src[0] < 0 || src[0] >= x)
             continue;
@@ -255,8 +675,11 @@ void voxel::CloudAnalyzer3D::saveVoxelGrids(
           if (src[2] < 0 || src[2] >= z)
             continue;
 
-          rotatedFree.v[k](j, i) = threshHoldedFree[src[2]](src[1], src[0]);
-          rotatedPoint.v[k](j, i) = threshHoldedPoint[src[2]](src[1], src[0]);
+          const Eigen::Vector3i s = src.cast<int>();
+          if (threshHoldedFree(s[0], s[1], s[2]))
+            rotatedFree.set(i - lo[0], j - lo[1], k - lo[2]);
+          if (threshHoldedPoint(s[0], s[1], s[2]))
+            rotatedPoint.set(i - lo[0], j - lo[1], k - lo[2]);
         }
       }
     }
@@ -267,19 +690,21 @@ void voxel::CloudAnalyzer3D::saveVoxelGrids(
     int maxRow = 0;
     int minZ = z;
     int maxZ = 0;
-    for (int k = 0; k < z; ++k) {
-      for (int i = 0; i < newCols; ++i) {
-        for (int j = 0; j < newRows; ++j) {
-          if (rotatedPoint.v[k](j, i)) {
-            minCol = std::min(minCol, i);
-            maxCol = std::max(maxCol, i);
-
-            minRow = std::min(minRow, j);
-            maxRow = std::max(maxRow, j);
-
-            minZ = std::min(minZ, k);
-            maxZ = std::max(maxZ, k);
-          }
+    for (int k = 0; k < rotatedPoint.z; ++k) {
+      for (int j = 0; j < rotatedPoint.y; ++j) {
+        const uint64_t *row = rotatedPoint.row(j, k);
+        for (int w = 0; w < rotatedPoint.wordsPerRow; ++w) {
+          if (!row[w])
+            continue;
+          minCol = std::min(minCol, lo[0] + w * 64 + __builtin_ctzll(row[w]));
+          maxCol = std::max(maxCol,
+                            lo[0] + w * 64 + 63 - __builtin_clzll(row[w]));
+
+          minRow = std::min(minRow, lo[1] + j);
+          maxRow = std::max(maxRow, lo[1] + j);
+
+          minZ = std::min(minZ, lo[2] + k);
+          maxZ = std::max(maxZ, lo[2] + k);
         }
       }
     }
@@ -288,21 +713,12 @@ void voxel::CloudAnalyzer3D::saveVoxelGrids(
     const int newY = maxRow - minRow + 1;
     const int newX = maxCol - minCol + 1;
 
-    place::VoxelGrid trimmedFree, trimmedPoint;
-    trimmedFree.v = std::vector<Eigen::MatrixXb>(newZ);
-    trimmedFree.c = rotatedFree.c;
-
-    trimmedPoint.v = std::vector<Eigen::MatrixXb>(newZ);
-    trimmedPoint.c = rotatedPoint.c;
-
-    for (int k = 0; k < newZ; ++k) {
-      trimmedFree.v[k] =
-          rotatedFree.v[k + minZ].block(minRow, minCol, newY, newX);
-      trimmedPoint.v[k] =
-          rotatedPoint.v[k + minZ].block(minRow, minCol, newY, newX);
-    }
-    rotatedFree.v.clear();
-    rotatedPoint.v.clear();
+    place::VoxelGrid trimmedFree = rotatedFree.block(
+        minCol - lo[0], minRow - lo[1], minZ - lo[2], newX, newY, newZ);
+    place::VoxelGrid trimmedPoint = rotatedPoint.block(
+        minCol - lo[0], minRow - lo[1], minZ - lo[2], newX, newY, newZ);
+    rotatedFree = place::VoxelGrid();
+    rotatedPoint = place::VoxelGrid();
 
     if (FLAGS_visulization) {
       displayVoxelGrid(trimmedPoint);
@@ -48,6 +48,7 @@ int main(int argc, char *argv[]) {
     auto $2DPoints = manager.getPointsNoCenter();
     auto R = manager.getR();
     auto doors = manager.getDoors();
+    auto rangeImage = manager.getRangeImage();
     manager.get2DPointNames(*$2DPointNames);
     manager.get2DFreeNames(*$2DFreeNames);
     manager.get3DPointNames(*$3DPointNames);
@@ -73,7 +74,7 @@ int main(int argc, char *argv[]) {
         auto bBox2D =
             BoundingBox::Create($2DPoints, Eigen::Vector3f(9.0, 9.0, 6.0));
         bBox2D->run();
-        CloudAnalyzer2D analyzer2D($3DPoints, R, bBox2D, doors);
+        CloudAnalyzer2D analyzer2D($3DPoints, R, bBox2D, doors, rangeImage);
         analyzer2D.initalize(scale);
 
         if (runDoors) {
@@ -112,7 +113,7 @@ int main(int argc, char *argv[]) {
         Eigen::Vector3f pointMin, pointMax;
         bBox3D->getBoundingBox(pointMin, pointMax);
 
-        voxel::CloudAnalyzer3D analyzer3D($3DPoints, R, bBox3D);
+        voxel::CloudAnalyzer3D analyzer3D($3DPoints, R, bBox3D, rangeImage);
         analyzer3D.run(voxelsPerMeter, scale);
 
         if (FLAGS_save)
@@ -0,0 +1,133 @@
+/**
+  Implements RangeImage, which finds free space evidence by looking up
+  voxels in the range map of the panorama of a scan
+*/
+
+#include "scanDensity_rangeImage.h"
+
+#include <algorithm>
+#include <cmath>
+
+RangeImage::RangeImage(const Eigen::RowMatrixXf &rMap)
+    : nearest(rMap.rows(), rMap.cols()) {
+  const int rows = rMap.rows(), cols = rMap.cols();
+  // NB: Every pixel is replaced with the smallest range around it so that
+  // a voxel on the edge of a surface isn't cleared by the background
+  // behind it.  Pixels without a return stay 0
+#pragma omp parallel for schedule(static)
+  for (int j = 0; j < rows; ++j) {
+    for (int i = 0; i < cols; ++i) {
+      float d = rMap(j, i);
+      if (d > 0) {
+        for (int y = std::max(0, j - 1); y <= std::min(rows - 1, j + 1); ++y) {
+          for (int x = i - 1; x <= i + 1; ++x) {
+            const float v = rMap(y, x < 0 ? cols - 1 : x == cols ? 0 : x);
+            if (v > 0)
+              d = std::min(d, v);
+          }
+        }
+      }
+      nearest(j, i) = d;
+    }
+  }
+}
+
+double RangeImage::depth(const Eigen::Vector3d &point) const {
+  // NB: DensityMapsManager flips y when it loads points while the
+  // panorama was made from the scan as is
+  const double r = point.norm();
+  if (r == 0)
+    return 0;
+  const double theta = std::atan2(-point[1], point[0]),
+               phi = std::acos(point[2] / r);
+
+  const int col = (theta / PI + 1.0) * (nearest.cols() - 1) / 2.0;
+  const int row = phi * (nearest.rows() - 1) / maxPhi;
+  return row < nearest.rows() ? nearest(row, col) : 0;
+}
+
+NarrowBand::NarrowBand(int numA, int numB, int numSlices, int radius,
+                       const SliceFunc &occupied)
+    : numA{numA}, numB{numB}, numSlices{numSlices}, radius{radius},
+      sliceSize{static_cast<size_t>(numA) * numB}, occupied{occupied},
+      ring((2 * radius + 1) * sliceSize), scratch(2 * sliceSize),
+      band(sliceSize), counts(sliceSize), lineCounts(numA),
+      current{-radius - 2} {}
+
+void NarrowBand::dilateSlice(int t, uint8_t *dst) {
+  uint8_t *voxels = scratch.data(), *alongA = voxels + sliceSize;
+  std::fill(voxels, voxels + sliceSize, 0);
+  occupied(t, voxels);
+
+  // NB: The closest set voxel at or before and at or after every voxel
+  // of a line along a are found in two sweeps, so this is linear in numA
+  for (int b = 0; b < numB; ++b) {
+    const uint8_t *src = voxels + static_cast<size_t>(b) * numA;
+    uint8_t *out = alongA + static_cast<size_t>(b) * numA;
+    int last = -radius - 1;
+    for (int a = 0; a < numA; ++a) {
+      if (src[a])
+        last = a;
+      out[a] = a - last <= radius;
+    }
+    int next = numA + radius;
+    for (int a = numA - 1; a >= 0; --a) {
+      if (src[a])
+        next = a;
+      out[a] |= next - a <= radius;
+    }
+  }
+
+  // NB: A count of the set voxels in a window of lines slides along b, so
+  // every pass reads the slice front to back
+  std::fill(lineCounts.begin(), lineCounts.end(), 0);
+  for (int b = 0; b < std::min(radius, numB); ++b)
+    for (int a = 0; a < numA; ++a)
+      lineCounts[a] += alongA[static_cast<size_t>(b) * numA + a];
+  for (int b = 0; b < numB; ++b) {
+    if (b + radius < numB)
+      for (int a = 0; a < numA; ++a)
+        lineCounts[a] += alongA[static_cast<size_t>(b + radius) * numA + a];
+    if (b - radius - 1 >= 0)
+      for (int a = 0; a < numA; ++a)
+        lineCounts[a] -=
+            alongA[static_cast<size_t>(b - radius - 1) * numA + a];
+    for (int a = 0; a < numA; ++a)
+      dst[static_cast<size_t>(b) * numA + a] = lineCounts[a] > 0;
+  }
+}
+
+void NarrowBand::count(int t, int sign) {
+  if (t < 0 || t >= numSlices)
+    return;
+  const uint8_t *src = ring.data() + t % (2 * radius + 1) * sliceSize;
+  for (size_t v = 0; v < sliceSize; ++v)
+    counts[v] += sign * src[v];
+}
+
+const uint8_t *NarrowBand::slice(int s) {
+  // NB: Dilating along one axis at a time gives the same box of radius
+  // around every occupied voxel as dilating along all three at once.
+  // The window of slices slides along, so every slice is dilated once
+  // when they are asked for in order
+  if (s != current + 1) {
+    std::fill(counts.begin(), counts.end(), 0);
+    for (int t = std::max(0, s - radius);
+         t < std::min(numSlices, s + radius); ++t) {
+      dilateSlice(t, ring.data() + t % (2 * radius + 1) * sliceSize);
+      count(t, 1);
+    }
+  } else {
+    count(s - radius - 1, -1);
+  }
+  if (s + radius < numSlices) {
+    const int t = s + radius;
+    dilateSlice(t, ring.data() + t % (2 * radius + 1) * sliceSize);
+    count(t, 1);
+  }
+  current = s;
+
+  for (size_t v = 0; v < sliceSize; ++v)
+    band[v] = counts[v] > 0;
+  return band.data();
+}
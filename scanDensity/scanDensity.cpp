@@ -12,10 +12,19 @@
 
 #include "scanDensity_scanDensity.h"
 
+#include <ArtifactStore.hpp>
+#include <DescriptorIndex.hpp>
+#include <ScanFile.hpp>
+
+#include <algorithm>
 #include <locale>
 #include <sstream>
 
 #include <omp.h>
+#include <opencv2/xfeatures2d.hpp>
+
+static void saveDescriptorIndex(const place::Panorama &pano,
+                                const std::string &name);
 
 DensityMapsManager::DensityMapsManager(const std::string &commandLine)
     : R{NULL}, pointsWithCenter{NULL}, pointsNoCenter{NULL} {
@@ -90,41 +99,59 @@ void DensityMapsManager::run() {
   if (!FLAGS_quietMode)
     std::cout << scanNumber << std::endl;
 
-  std::ifstream binaryReader(rotationFile, std::ios::in | std::ios::binary);
-  R = std::make_shared<std::vector<Eigen::Matrix3d>>(4);
-  for (int i = 0; i < R->size(); ++i) {
-    binaryReader.read(reinterpret_cast<char *>(R->at(i).data()),
-                      sizeof(Eigen::Matrix3d));
+  {
+    scan::ArtifactStream binaryReader(rotationFile);
+    R = std::make_shared<std::vector<Eigen::Matrix3d>>(4);
+    for (int i = 0; i < R->size(); ++i) {
+      binaryReader.read(reinterpret_cast<char *>(R->at(i).data()),
+                        sizeof(Eigen::Matrix3d));
+    }
   }
-  binaryReader.close();
 
-  binaryReader.open(doorName, std::ios::in | std::ios::binary);
-  int num;
-  binaryReader.read(reinterpret_cast<char *>(&num), sizeof(num));
-  doors = std::make_shared<std::vector<place::Door>>(num);
-  for (auto &d : *doors)
-    d.loadFromFile(binaryReader);
-  binaryReader.close();
+  {
+    scan::ArtifactStream binaryReader(doorName);
+    int num;
+    binaryReader.read(reinterpret_cast<char *>(&num), sizeof(num));
+    doors = std::make_shared<std::vector<place::Door>>(num);
+    for (auto &d : *doors)
+      d.loadFromFile(binaryReader);
+  }
 
-  binaryReader.open(fileName, std::ios::in | std::ios::binary);
+  rangeImage = nullptr;
+  const bool buildIndex =
+      FLAGS_descriptorIndex && FLAGS_save &&
+      (FLAGS_redo || !scan::artifactExists(getDescriptorIndexName()));
+  if ((FLAGS_rangeImage && FLAGS_fe) || buildIndex) {
+    const std::string binaryName = FLAGS_panoFolder + "binary/" + buildName +
+                                   "_panorama_" + scanNumber + ".dat";
+    place::Panorama pano;
+    if (scan::artifactExists(binaryName))
+      pano.loadFromFile(binaryName);
+    else
+      pano.loadFromFile(FLAGS_panoFolder + "images/" + buildName +
+                            "_panorama_" + scanNumber + ".png",
+                        FLAGS_panoFolder + "data/" + buildName + "_data_" +
+                            scanNumber + ".dat");
+    if (FLAGS_rangeImage && FLAGS_fe)
+      rangeImage = std::make_shared<const RangeImage>(pano.rMap);
+    if (buildIndex)
+      saveDescriptorIndex(pano, getDescriptorIndexName());
+  }
 
-  int columns, rows;
-  binaryReader.read(reinterpret_cast<char *>(&columns), sizeof(int));
-  binaryReader.read(reinterpret_cast<char *>(&rows), sizeof(int));
+  scan::ScanFile scanFile(fileName);
+  const size_t numPoints = scanFile.size();
+  const float *xs = scanFile.x(), *ys = scanFile.y(), *zs = scanFile.z(),
+              *intensity = scanFile.intensity();
 
   pointsWithCenter = std::make_shared<std::vector<Eigen::Vector3f>>();
-  pointsWithCenter->reserve(columns * rows);
+  pointsWithCenter->reserve(numPoints);
   pointsNoCenter = std::make_shared<std::vector<Eigen::Vector3f>>();
-  pointsNoCenter->reserve(columns * rows);
+  pointsNoCenter->reserve(numPoints);
 
-  for (int k = 0; k < columns * rows; ++k) {
-    scan::PointXYZRGBA tmp;
-    tmp.loadFromFile(binaryReader);
-    auto &point = tmp.point;
+  for (size_t k = 0; k < numPoints; ++k) {
+    Eigen::Vector3f point(xs[k], -ys[k], zs[k]);
 
-    point[1] *= -1.0;
-
-    if (!(point[0] || point[1] || point[2]) || tmp.intensity < 0.01)
+    if (!(point[0] || point[1] || point[2]) || intensity[k] < 0.01)
       continue;
 
     pointsWithCenter->push_back(point);
@@ -132,7 +159,6 @@ void DensityMapsManager::run() {
     if (point[0] * point[0] + point[1] * point[1] > 1)
       pointsNoCenter->push_back(point);
   }
-  binaryReader.close();
 }
 
 bool DensityMapsManager::hasNext() {
@@ -183,6 +209,55 @@ std::string DensityMapsManager::getMetaDataName() {
          scanNumber + ".dat";
 }
 
+std::string DensityMapsManager::getDescriptorIndexName() {
+  return FLAGS_voxelFolder + "descriptors/" + buildName + "_descriptorIndex_" +
+         scanNumber + ".dat";
+}
+
+/* Describes every keypoint of pano with SIFT, positioned at the point of
+ * the scan it is on, and writes a voxel::DescriptorIndex over them and
+ * then the descriptors to name */
+static void saveDescriptorIndex(const place::Panorama &pano,
+                                const std::string &name) {
+  // NB: Panoramas saved without the sizes and angles SIFT found the
+  // keypoints at have every keypoint described at the same scale, upright
+  constexpr float keypointSize = 8.0;
+  const bool shapes = pano.keypointSizes.size() == pano.keypoints.size();
+  std::vector<cv::KeyPoint> keypoints;
+  for (size_t i = 0; i < pano.keypoints.size(); ++i)
+    keypoints.emplace_back(pano.keypoints[i],
+                           shapes ? pano.keypointSizes[i] : keypointSize,
+                           shapes ? pano.keypointAngles[i] : -1);
+
+  cv::Mat descriptors;
+  if (!keypoints.empty())
+    cv::xfeatures2d::SIFT::create()->compute(pano.imgs[0], keypoints,
+                                             descriptors);
+
+  voxel::DescriptorArena<float> arena(descriptors.cols);
+  arena.reserve(descriptors.rows);
+  const double width = pano.rMap.cols(), height = pano.rMap.rows();
+  for (int i = 0; i < descriptors.rows; ++i) {
+    // NB: Inverse of the projection the preprocessor made the panorama with
+    const cv::Point2f &p = keypoints[i].pt;
+    const double r = pano.rMap(static_cast<int>(p.y), static_cast<int>(p.x)),
+                 theta = (2.0 * p.x / (width - 1.0) - 1.0) * PI,
+                 phi = p.y * maxPhi / (height - 1.0);
+    const Eigen::Vector3d position(r * std::cos(theta) * std::sin(phi),
+                                   r * std::sin(theta) * std::sin(phi),
+                                   r * std::cos(phi));
+    arena.add(Eigen::Map<const Eigen::VectorXf>(descriptors.ptr<float>(i),
+                                                descriptors.cols),
+              position);
+  }
+
+  voxel::DescriptorIndex<float> index;
+  index.build(arena);
+  std::ofstream out(name, std::ios::out | std::ios::binary);
+  index.writeToFile(out);
+  arena.writeToFile(out);
+}
+
 bool DensityMapsManager::exists2D() {
   std::vector<std::string> names;
   if (FLAGS_pe)
@@ -190,7 +265,7 @@ bool DensityMapsManager::exists2D() {
   if (FLAGS_fe)
     get2DFreeNames(names);
   for (auto &n : names)
-    if (!fexists(n))
+    if (!scan::artifactExists(n))
       return false;
   return true;
 }
@@ -203,12 +278,14 @@ bool DensityMapsManager::exists3D() {
     get3DFreeNames(names);
 
   for (auto &n : names)
-    if (!fexists(n))
+    if (!scan::artifactExists(n))
       return false;
   return true;
 }
 
-bool DensityMapsManager::existsDoors() { return fexists(getDoorsName()); }
+bool DensityMapsManager::existsDoors() {
+  return scan::artifactExists(getDoorsName());
+}
 
 BoundingBox::BoundingBox(
     const std::shared_ptr<const std::vector<Eigen::Vector3f>> &points,
@@ -256,8 +333,10 @@ CloudAnalyzer2D::CloudAnalyzer2D(
     const std::shared_ptr<const std::vector<Eigen::Vector3f>> &points,
     const std::shared_ptr<const std::vector<Eigen::Matrix3d>> &R,
     const std::shared_ptr<const BoundingBox> &bBox,
-    const DensityMapsManager::DoorsPtr &doors)
-    : points{points}, R{R}, bBox{bBox}, doors{doors} {}
+    const DensityMapsManager::DoorsPtr &doors,
+    const RangeImage::ConstPtr &rangeImage)
+    : points{points}, R{R}, bBox{bBox}, doors{doors},
+      rangeImage{rangeImage} {}
 
 void CloudAnalyzer2D::initalize(double scale) {
   bBox->getBoundingBox(pointMin, pointMax);
@@ -267,7 +346,7 @@ void CloudAnalyzer2D::initalize(double scale) {
   numX = scale * (pointMax[0] - pointMin[0]);
   numY = scale * (pointMax[1] - pointMin[1]);
 
-  pointInVoxel = voxel::DirectVoxel<char>::Create(numX, numY, numZ);
+  pointInVoxel = Occupancy::Create(numX, numY, numZ);
 
   for (auto &point : *points) {
     const int x = scale * (point[0] - pointMin[0]);
@@ -297,31 +376,76 @@ void CloudAnalyzer2D::initalize(double scale) {
   imageZeroZero = Eigen::Vector2i(newZZ[0], newZZ[1]);
 }
 
-void CloudAnalyzer2D::examinePointEvidence() {
-  pointEvidence.clear();
+Eigen::MatrixXf CloudAnalyzer2D::collapse(const Occupancy &grid) const {
+  Eigen::MatrixXf counts(numY, numX);
+  const uint64_t *words = grid.data();
 
-  for (int r = 0; r < R->size(); ++r) {
-    Eigen::MatrixXf total = Eigen::MatrixXf::Zero(newRows, newCols);
+  // NB: Every z column is numZ bits in a row, so it is counted a word at
+  // a time
+#pragma omp parallel for schedule(static)
+  for (int j = 0; j < numY; ++j) {
+    for (int i = 0; i < numX; ++i) {
+      size_t begin = (static_cast<size_t>(j) * numX + i) * numZ;
+      const size_t end = begin + numZ;
+      int count = 0;
+      while (begin < end) {
+        const size_t offset = begin % 64,
+                     n = std::min<size_t>(64 - offset, end - begin);
+        uint64_t bits = words[begin / 64] >> offset;
+        if (n < 64)
+          bits &= (uint64_t(1) << n) - 1;
+        count += __builtin_popcountll(bits);
+        begin += n;
+      }
+      counts(j, i) = count;
+    }
+  }
+  return counts;
+}
 
+Eigen::MatrixXf CloudAnalyzer2D::rotate(const Eigen::MatrixXf &counts,
+                                        int r) const {
+  const Eigen::Matrix2d A = R->at(r).topLeftCorner<2, 2>();
+  const Eigen::Vector2d b = zeroZero.head<2>() - A * newZZ.head<2>();
+  Eigen::MatrixXf out = Eigen::MatrixXf::Zero(newRows, newCols);
+
+  // NB: When the rotation is a multiple of 90 degrees every pixel maps to
+  // exactly one pixel, so the counts are only transposed and flipped
+  if ((A.array() == A.array().round()).all()) {
+    const Eigen::Matrix2i Ai = A.cast<int>();
+    const Eigen::Vector2i bi =
+        b.unaryExpr([](double v) { return std::round(v); }).cast<int>();
 #pragma omp parallel for schedule(static)
-    for (int i = 0; i < total.cols(); ++i) {
-      for (int j = 0; j < total.rows(); ++j) {
-        for (int k = 0; k < numZ; ++k) {
-          const Eigen::Vector3d coord(i, j, k);
-          const Eigen::Vector3i src =
-              (R->at(r) * (coord - newZZ) + zeroZero)
-                  .unaryExpr([](auto v) { return std::round(v); })
-                  .cast<int>();
-
-          if (src[0] < 0 || src[0] >= numX || src[1] < 0 || src[1] >= numY ||
-              src[2] < 0 || src[2] >= numZ)
-            continue;
+    for (int i = 0; i < newCols; ++i) {
+      Eigen::Vector2i src = Ai.col(0) * i + bi;
+      for (int j = 0; j < newRows; ++j, src += Ai.col(1))
+        if (src[0] >= 0 && src[0] < numX && src[1] >= 0 && src[1] < numY)
+          out(j, i) = counts(src[1], src[0]);
+    }
+    return out;
+  }
 
-          if (pointInVoxel->at(src))
-            ++total(j, i);
-        }
-      }
+#pragma omp parallel for schedule(static)
+  for (int i = 0; i < newCols; ++i) {
+    for (int j = 0; j < newRows; ++j) {
+      const Eigen::Vector2i src = (A * Eigen::Vector2d(i, j) + b)
+                                      .unaryExpr([](double v) {
+                                        return std::round(v);
+                                      })
+                                      .cast<int>();
+      if (src[0] >= 0 && src[0] < numX && src[1] >= 0 && src[1] < numY)
+        out(j, i) = counts(src[1], src[0]);
     }
+  }
+  return out;
+}
+
+void CloudAnalyzer2D::examinePointEvidence() {
+  pointEvidence.clear();
+
+  const Eigen::MatrixXf counts = collapse(*pointInVoxel);
+  for (int r = 0; r < R->size(); ++r) {
+    const Eigen::MatrixXf total = rotate(counts, r);
 
     double average, sigma;
     const float *dataPtr = total.data();
@@ -387,67 +511,226 @@ void CloudAnalyzer2D::examinePointEvidence() {
   }
 }
 
-void CloudAnalyzer2D::examineFreeSpaceEvidence() {
-  freeSpaceEvidence.clear();
-  Eigen::Vector3f cameraCenter = -1.0 * pointMin;
-
-  voxel::DirectVoxel<char> freeSpace(numX, numY, numZ);
-
-  for (int k = 0; k < numZ; ++k) {
-    for (int j = 0; j < numY; ++j) {
-      for (int i = 0; i < numX; ++i) {
+/* Smallest number of y rows that is a whole number of words of an
+ * Occupancy grid with numX * numZ voxels in every row.  Threads that
+ * write to different slabs of that many rows never write to the same
+ * word */
+static int wordAlignedRows(int numX, int numZ) {
+  int rows = 1;
+  while ((static_cast<size_t>(rows) * numX * numZ) % 64)
+    rows *= 2;
+  return rows;
+}
 
+void CloudAnalyzer2D::castFreeSpaceRays(Occupancy &freeSpace) const {
+  const Eigen::Vector3d origin(-pointMin[0] * FLAGS_scale,
+                               -pointMin[1] * FLAGS_scale,
+                               -pointMin[2] * zScale);
+
+  /* A ray from the scanner to an occupied voxel in row y.  It is sampled
+   * once per voxel of length, up to and including last */
+  struct Ray {
+    Eigen::Vector3d unitRay;
+    int last, y;
+  };
+  std::vector<std::vector<Ray>> raysPerRow(numY);
+#pragma omp parallel for schedule(dynamic)
+  for (int j = 0; j < numY; ++j) {
+    for (int i = 0; i < numX; ++i) {
+      for (int k = 0; k < numZ; ++k) {
         if (!pointInVoxel->at(i, j, k))
           continue;
 
-        Eigen::Vector3d ray(i, j, k);
-        ray[0] -= cameraCenter[0] * FLAGS_scale;
-        ray[1] -= cameraCenter[1] * FLAGS_scale;
-        ray[2] -= cameraCenter[2] * zScale;
-        double length = ray.norm();
-        Eigen::Vector3d unitRay = ray / length;
+        const Eigen::Vector3d ray = Eigen::Vector3d(i, j, k) - origin;
+        const double length = ray.norm();
+        if (length == 0)
+          continue;
+        raysPerRow[j].push_back(
+            {ray / length, static_cast<int>(std::ceil(length)), j});
+      }
+    }
+  }
+  std::vector<Ray> rays;
+  for (auto &row : raysPerRow)
+    rays.insert(rays.end(), row.begin(), row.end());
+
+  // NB: Work is split into slabs of y rows and every thread samples the
+  // part of some rays inside of one.  A ray moves away from the scanner,
+  // so a slab to one side of it is only reached by rays to voxels in or
+  // past it, which are a range of rays since they are sorted by y.  The
+  // slab around the scanner is reached by every ray, so the rays of a
+  // slab are split up further.  Slabs are a whole number of words, so the
+  // bits of a slab are private to whoever samples it
+  const size_t rowSize = static_cast<size_t>(numX) * numZ;
+  const int alignedRows = wordAlignedRows(numX, numZ);
+  const int slabSize = alignedRows * std::max(1, 8 / alignedRows);
+  constexpr size_t raysPerItem = 1 << 14;
+  /* Rays [first, end) in the slab of rows [y0, y1) */
+  struct WorkItem {
+    int y0, y1;
+    size_t first, end;
+  };
+  std::vector<WorkItem> whole, split;
+  const int cameraY = std::floor(origin[1]);
+  const auto byY = [](const Ray &r, int y) { return r.y < y; };
+  for (int y0 = 0; y0 < numY; y0 += slabSize) {
+    const int y1 = std::min(numY, y0 + slabSize);
+    auto first = rays.cbegin(), end = rays.cend();
+    if (y0 > cameraY)
+      first = std::lower_bound(first, end, y0 - 1, byY);
+    else if (y1 <= cameraY)
+      end = std::lower_bound(first, end, y1 + 1, byY);
+
+    const size_t f = first - rays.cbegin(), e = end - rays.cbegin();
+    if (e - f <= raysPerItem) {
+      whole.push_back({y0, y1, f, e});
+      continue;
+    }
+    for (size_t r = f; r < e; r += raysPerItem)
+      split.push_back({y0, y1, r, std::min(e, r + raysPerItem)});
+  }
 
-        Eigen::Vector3i voxelHit;
-        for (int a = 0; a <= ceil(length); ++a) {
-          voxelHit[0] = floor(cameraCenter[0] * FLAGS_scale + a * unitRay[0]);
-          voxelHit[1] = floor(cameraCenter[1] * FLAGS_scale + a * unitRay[1]);
-          voxelHit[2] = floor(cameraCenter[2] * zScale + a * unitRay[2]);
+  /* Sets the bits the rays of item sample in the slab starting at words */
+  auto sample = [&](const WorkItem &item, uint64_t *words) {
+    const int y0 = item.y0, y1 = item.y1;
+    for (size_t r = item.first; r < item.end; ++r) {
+      const Eigen::Vector3d &unitRay = rays[r].unitRay;
+      double aMin = 0, aMax = rays[r].last;
+      if (unitRay[1] != 0) {
+        double t0 = (y0 - origin[1]) / unitRay[1],
+               t1 = (y1 - origin[1]) / unitRay[1];
+        if (t0 > t1)
+          std::swap(t0, t1);
+        aMin = std::max(aMin, std::floor(t0) - 1);
+        aMax = std::min(aMax, std::ceil(t1) + 1);
+      }
 
-          if (voxelHit[0] < 0 || voxelHit[0] >= numX)
-            continue;
-          if (voxelHit[1] < 0 || voxelHit[1] >= numY)
-            continue;
-          if (voxelHit[2] < 0 || voxelHit[2] >= numZ)
-            continue;
+      for (int a = aMin; a <= aMax; ++a) {
+        const int x = floor(origin[0] + a * unitRay[0]),
+                  y = floor(origin[1] + a * unitRay[1]),
+                  z = floor(origin[2] + a * unitRay[2]);
 
-          freeSpace(voxelHit) = 1;
-        }
+        if (x < 0 || x >= numX)
+          continue;
+        if (y < y0 || y >= y1)
+          continue;
+        if (z < 0 || z >= numZ)
+          continue;
+
+        const size_t index =
+            (y - y0) * rowSize + static_cast<size_t>(x) * numZ + z;
+        words[index / 64] |= uint64_t(1) << (index % 64);
+      }
+    }
+  };
+
+  uint64_t *free = freeSpace.data();
+#pragma omp parallel for schedule(dynamic)
+  for (size_t w = 0; w < whole.size(); ++w)
+    sample(whole[w], free + whole[w].y0 * rowSize / 64);
+
+  // NB: Every thread samples the split slabs into a tile of its own.  The
+  // tiles are then ORed together a range of words at a time, so the
+  // reduction needs no atomics and its result doesn't depend on which
+  // thread sampled what
+  const int numThreads = omp_get_max_threads();
+  std::vector<std::vector<uint64_t>> tiles(numThreads);
+  for (size_t first = 0; first < split.size();) {
+    const int y0 = split[first].y0;
+    size_t end = first;
+    while (end < split.size() && split[end].y0 == y0)
+      ++end;
+    const size_t numWords = ((split[first].y1 - y0) * rowSize + 63) / 64;
+
+#pragma omp parallel num_threads(numThreads)
+    {
+      std::vector<uint64_t> &tile = tiles[omp_get_thread_num()];
+      tile.assign(numWords, 0);
+#pragma omp for schedule(dynamic)
+      for (size_t w = first; w < end; ++w)
+        sample(split[w], tile.data());
+
+      const int numTiles = omp_get_num_threads();
+#pragma omp for schedule(static)
+      for (size_t i = 0; i < numWords; ++i) {
+        uint64_t bits = 0;
+        for (int t = 0; t < numTiles; ++t)
+          bits |= tiles[t][i];
+        free[y0 * rowSize / 64 + i] |= bits;
       }
     }
+    first = end;
   }
+}
 
-  for (int r = 0; r < R->size(); ++r) {
-    Eigen::MatrixXd collapsedCount = Eigen::MatrixXd::Zero(newRows, newCols);
-
-#pragma omp parallel for schedule(static)
-    for (int i = 0; i < collapsedCount.cols(); ++i) {
-      for (int j = 0; j < collapsedCount.rows(); ++j) {
+void CloudAnalyzer2D::lookUpFreeSpace(Occupancy &freeSpace) const {
+  // NB: Every y row of the grids is numX z columns of numZ bits.  Threads
+  // take chunks of rows that are a whole number of words, so they never
+  // write to the same word, and make the band a row at a time from the
+  // words of pointInVoxel
+  const size_t rowSize = static_cast<size_t>(numX) * numZ;
+  const int alignedRows = wordAlignedRows(numX, numZ);
+  const int rowsPerChunk = alignedRows * std::max(1, 32 / alignedRows);
+  const int numChunks = (numY + rowsPerChunk - 1) / rowsPerChunk;
+  const uint64_t *occupied = pointInVoxel->data();
+  uint64_t *free = freeSpace.data();
+
+  auto occupiedRow = [&](int j, uint8_t *mask) {
+    const size_t first = j * rowSize, end = first + rowSize;
+    for (size_t w = first / 64; w < (end + 63) / 64; ++w) {
+      uint64_t bits = occupied[w];
+      for (; bits; bits &= bits - 1) {
+        const size_t v = w * 64 + __builtin_ctzll(bits);
+        if (v >= first && v < end)
+          mask[v - first] = 1;
+      }
+    }
+  };
+
+  // NB: A voxel is free if the scanner saw past its center.  That is the
+  // same test the rays make, which run all the way to the point they
+  // were cast towards
+#pragma omp parallel for schedule(dynamic)
+  for (int c = 0; c < numChunks; ++c) {
+    std::unique_ptr<NarrowBand> band;
+    if (FLAGS_freeSpaceBand > 0)
+      band.reset(new NarrowBand(numZ, numX, numY, FLAGS_freeSpaceBand,
+                                occupiedRow));
+
+    for (int j = c * rowsPerChunk; j < std::min(numY, (c + 1) * rowsPerChunk);
+         ++j) {
+      const uint8_t *inBand = band ? band->slice(j) : nullptr;
+      for (int i = 0; i < numX; ++i) {
         for (int k = 0; k < numZ; ++k) {
-          const Eigen::Vector3d coord(i, j, k);
-          const Eigen::Vector3i src =
-              (R->at(r) * (coord - newZZ) + zeroZero)
-                  .unaryExpr([](auto v) { return std::round(v); })
-                  .cast<int>();
-
-          if (src[0] < 0 || src[0] >= numX || src[1] < 0 || src[1] >= numY ||
-              src[2] < 0 || src[2] >= numZ)
+          const size_t v = static_cast<size_t>(i) * numZ + k;
+          if (inBand && !inBand[v])
             continue;
 
-          if (freeSpace(src))
-            ++collapsedCount(j, i);
+          const Eigen::Vector3d point((i + 0.5) / FLAGS_scale + pointMin[0],
+                                      (j + 0.5) / FLAGS_scale + pointMin[1],
+                                      (k + 0.5) / zScale + pointMin[2]);
+          if (point.norm() <= rangeImage->depth(point)) {
+            const size_t index = j * rowSize + v;
+            free[index / 64] |= uint64_t(1) << (index % 64);
+          }
         }
       }
     }
+  }
+}
+
+void CloudAnalyzer2D::examineFreeSpaceEvidence() {
+  freeSpaceEvidence.clear();
+
+  Occupancy freeSpace(numX, numY, numZ);
+  if (rangeImage)
+    lookUpFreeSpace(freeSpace);
+  else
+    castFreeSpaceRays(freeSpace);
+
+  const Eigen::MatrixXf counts = collapse(freeSpace);
+  for (int r = 0; r < R->size(); ++r) {
+    const Eigen::MatrixXd collapsedCount = rotate(counts, r).cast<double>();
 
     double average, sigma;
     const double *vPtr = collapsedCount.data();
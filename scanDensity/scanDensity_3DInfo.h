@@ -13,20 +13,27 @@ private:
   DensityMapsManager::PointsPtr points;
   DensityMapsManager::MatPtr R;
   BoundingBox::ConstPtr bBox;
+  RangeImage::ConstPtr rangeImage;
   DensityMapsManager::FeaturePtr featureVectors;
-  std::unordered_map<Eigen::Vector3i, FeatureVoxel<float>::DescripPtr>
-      xyzToSHOT;
+  /* Index of the descriptor in a FeatureVoxel<float>::ArenaType */
+  std::unordered_map<Eigen::Vector3i, int> xyzToSHOT;
   std::vector<Eigen::MatrixXi> pointsPerVoxel, numTimesSeen;
   Eigen::Vector3f pointMin, pointMax;
   double voxelsPerMeter, pixelsPerMeter;
   Eigen::Vector3d zeroZeroD;
   Eigen::Vector3i zeroZero;
 
+  /* Free space evidence from a ray cast to every occupied voxel */
+  void castFreeSpaceRays();
+  /* Free space evidence from the range image, voxel by voxel */
+  void lookUpFreeSpace();
+
 public:
   typedef std::shared_ptr<voxel::CloudAnalyzer3D> Ptr;
   CloudAnalyzer3D(const DensityMapsManager::PointsPtr &points,
                   const DensityMapsManager::MatPtr &R,
-                  const BoundingBox::ConstPtr &bBox);
+                  const BoundingBox::ConstPtr &bBox,
+                  const RangeImage::ConstPtr &rangeImage);
   void run(double voxelsPerMeter, double pixelsPerMeter);
   void saveVoxelGrids(const std::vector<std::string> &pointNames,
                       const std::vector<std::string> &freeNames,
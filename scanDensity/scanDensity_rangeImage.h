@@ -0,0 +1,72 @@
+#ifndef SCAN_DENSITY_RANGE_IMAGE_H
+#define SCAN_DENSITY_RANGE_IMAGE_H
+
+#include <eigen3/Eigen/Dense>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <scan_typedefs.hpp>
+
+/**
+  Free space evidence from the range map of the panorama of a scan.  A
+  point is seen empty if the scanner measured a return further away than
+  it in its direction.  Every point is classified on its own, so this
+  is O(voxels) and can be done in parallel, unlike casting a ray to
+  every occupied voxel
+*/
+class RangeImage {
+public:
+  typedef std::shared_ptr<const RangeImage> ConstPtr;
+
+  RangeImage(const Eigen::RowMatrixXf &rMap);
+
+  /* Smallest range measured around the direction of point, 0 if nothing
+   * was.  point is in the frame DensityMapsManager loads points in */
+  double depth(const Eigen::Vector3d &point) const;
+
+private:
+  /* The range map with every pixel replaced by the smallest range around
+   * it */
+  Eigen::RowMatrixXf nearest;
+};
+
+/**
+  The voxels within radius voxels of an occupied voxel along every axis,
+  one slice of a grid at a time.  Only the slices within radius of the
+  last one asked for are kept, so the band of a grid of any size needs
+  memory for 2 * radius + 6 slices.  A slice has numA * numB voxels with
+  a fastest
+*/
+class NarrowBand {
+public:
+  /* occupied(s, mask) sets mask[b * numA + a] for every occupied voxel
+   * (a, b) of slice s.  mask is zeroed beforehand */
+  typedef std::function<void(int, uint8_t *)> SliceFunc;
+
+  NarrowBand(int numA, int numB, int numSlices, int radius,
+             const SliceFunc &occupied);
+
+  /* Which voxels of slice s are in the band, in the layout of occupied.
+   * Valid until the next call.  Asking for the slices in order makes
+   * every one of them in O(voxels of a slice) */
+  const uint8_t *slice(int s);
+
+private:
+  const int numA, numB, numSlices, radius;
+  const size_t sliceSize;
+  SliceFunc occupied;
+  /* Slices dilated along a and b, slice t in ring[t % (2 * radius + 1)] */
+  std::vector<uint8_t> ring, scratch, band;
+  /* Number of the slices within radius of current set at every voxel */
+  std::vector<uint16_t> counts;
+  std::vector<int> lineCounts;
+  int current;
+
+  /* Dilates slice t along a and b into dst */
+  void dilateSlice(int t, uint8_t *dst);
+  /* Adds (sign 1) or removes (sign -1) slice t from counts */
+  void count(int t, int sign);
+};
+
+#endif // SCAN_DENSITY_RANGE_IMAGE_H
@@ -15,6 +15,8 @@
 #include <string>
 #include <time.h>
 
+#include "scanDensity_rangeImage.h"
+
 #include <DirectVoxel.hpp>
 #include <scan_gflags.h>
 #include <scan_typedefs.hpp>
@@ -43,11 +45,16 @@ public:
   void get3DFreeNames(std::vector<std::string> &names);
   std::string getZerosName();
   std::string getMetaDataName();
+  /* Where the voxel::DescriptorIndex over the SIFT descriptors of the
+   * panorama of the scan goes, followed by the descriptors themselves */
+  std::string getDescriptorIndexName();
   std::string getDoorsName();
   PointsPtr getPointsWithCenter() { return pointsWithCenter; };
   PointsPtr getPointsNoCenter() { return pointsNoCenter; };
   MatPtr getR() { return R; };
   DoorsPtr getDoors() { return doors; };
+  /* nullptr unless free space is found with a range image */
+  RangeImage::ConstPtr getRangeImage() { return rangeImage; };
   void setScale(double newScale) { FLAGS_scale = newScale; };
   double getScale() { return FLAGS_scale; };
 
@@ -58,6 +65,7 @@ private:
   std::shared_ptr<std::vector<Eigen::Vector3f>> pointsNoCenter;
   std::shared_ptr<std::vector<Eigen::Matrix3d>> R;
   std::shared_ptr<std::vector<place::Door>> doors;
+  RangeImage::ConstPtr rangeImage;
   std::string rotationFile, fileName, scanNumber, buildName, featName, doorName;
   int current;
 };
@@ -85,11 +93,16 @@ public:
 
 class CloudAnalyzer2D {
 private:
+  // NB: One bit per voxel, stored by z column since every use collapses
+  // the grid along z
+  typedef voxel::DirectVoxel<bool, voxel::AxisOrder::ZFastest> Occupancy;
+
   BoundingBox::ConstPtr bBox;
   DensityMapsManager::PointsPtr points;
   DensityMapsManager::MatPtr R;
   DensityMapsManager::DoorsPtr doors;
-  voxel::DirectVoxel<char>::Ptr pointInVoxel;
+  RangeImage::ConstPtr rangeImage;
+  Occupancy::Ptr pointInVoxel;
   std::vector<cv::Mat> pointEvidence, freeSpaceEvidence;
   std::vector<std::vector<place::Door>> rotatedDoors;
   Eigen::Vector3f pointMin, pointMax;
@@ -99,12 +112,24 @@ private:
   int numY, numX, newRows, newCols;
   float zScale, scale;
 
+  /* Number of voxels set in every z column of grid, indexed (y, x) */
+  Eigen::MatrixXf collapse(const Occupancy &grid) const;
+  /* counts resampled into the frame of the maps of rotation r.  The
+   * Manhattan frame is taken to share its z axis with the scan, so that
+   * only the counts have to be rotated instead of the voxels */
+  Eigen::MatrixXf rotate(const Eigen::MatrixXf &counts, int r) const;
+  /* Free space evidence from a ray cast to every occupied voxel */
+  void castFreeSpaceRays(Occupancy &freeSpace) const;
+  /* Free space evidence from the range image, voxel by voxel */
+  void lookUpFreeSpace(Occupancy &freeSpace) const;
+
 public:
   typedef std::shared_ptr<CloudAnalyzer2D> Ptr;
   CloudAnalyzer2D(const DensityMapsManager::PointsPtr &points,
                   const DensityMapsManager::MatPtr &R,
                   const BoundingBox::ConstPtr &bBox,
-                  const DensityMapsManager::DoorsPtr &doors);
+                  const DensityMapsManager::DoorsPtr &doors,
+                  const RangeImage::ConstPtr &rangeImage);
   void initalize(double scale);
   void examinePointEvidence();
   void examineFreeSpaceEvidence();
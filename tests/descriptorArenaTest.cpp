@@ -0,0 +1,134 @@
+/**
+  Round trips voxel::DescriptorArena through a file, including one that
+  doesn't start on an alignment boundary, and checks that a file without
+  a valid arena is rejected.  Does the same for a voxel::DescriptorIndex
+  over an arena
+*/
+#include "testing.hpp"
+
+#include <DescriptorArena.hpp>
+#include <DescriptorIndex.hpp>
+
+#include <cstddef>
+#include <random>
+
+template <typename T>
+static voxel::DescriptorArena<T> makeArena(int n, int dim, int seed) {
+  std::mt19937 gen(seed);
+  voxel::DescriptorArena<T> arena;
+  for (int i = 0; i < n; ++i) {
+    Eigen::Matrix<T, Eigen::Dynamic, 1> d(dim);
+    for (int j = 0; j < dim; ++j)
+      d[j] = static_cast<T>(gen() % 200) - 100;
+    arena.add(d, Eigen::Vector3d(i, -i, 0.5 * i));
+  }
+  return arena;
+}
+
+template <typename T>
+static bool sameArena(const voxel::DescriptorArena<T> &a,
+                      const voxel::DescriptorArena<T> &b) {
+  return a.size() == b.size() && a.dim() == b.dim() &&
+         a.matrix() == b.matrix() && a.allPositions() == b.allPositions();
+}
+
+template <typename T> static void roundTrip(int n, int dim) {
+  const auto arena = makeArena<T>(n, dim, n + dim);
+
+  // NB: Something else is written first, so the arena has to pad up to
+  // the next alignment boundary
+  const std::string name = testing::tempName();
+  std::ofstream out(name, std::ios::out | std::ios::binary);
+  const char prefix[] = "prefix";
+  out.write(prefix, sizeof(prefix));
+  arena.writeToFile(out);
+  out.close();
+
+  voxel::DescriptorArena<T> mapped;
+  mapped.mapFromFile(name, sizeof(prefix));
+  CHECK(sameArena(arena, mapped));
+
+  // NB: Modifying a mapped arena copies it out of the mapping first
+  if (n > 0) {
+    mapped.add(arena[0], Eigen::Vector3d::Ones());
+    CHECK(mapped.size() == arena.size() + 1);
+    CHECK(mapped.matrix().row(n) == arena.matrix().row(0));
+    CHECK(mapped.matrix().topRows(n) == arena.matrix());
+  }
+  boost::filesystem::remove(name);
+}
+
+static void checkIndex() {
+  const int n = 300, dim = 16;
+  const auto arena = makeArena<float>(n, dim, 5);
+  voxel::DescriptorIndex<float> index;
+  index.build(arena);
+
+  const std::string name = testing::tempName();
+  index.writeToFile(name);
+  voxel::DescriptorIndex<float> loaded;
+  loaded.loadFromFile(name, arena);
+  bool same = true;
+  for (int i = 0; i < n; i += 7)
+    same &= index.search(arena[i], 5) == loaded.search(arena[i], 5);
+  CHECK(same);
+
+  auto load = [&] {
+    voxel::DescriptorIndex<float> corrupt;
+    corrupt.loadFromFile(name, arena);
+  };
+  CHECK(testing::exitsWithError([&] {
+    voxel::DescriptorIndex<float> other;
+    other.loadFromFile(name, makeArena<float>(n + 1, dim, 5));
+  }));
+
+  // NB: The high byte of a value makes it negative.  The first link of
+  // the first node comes after the level of every node and its count
+  typedef voxel::DescriptorIndexHeader Header;
+  const size_t firstLink =
+      sizeof(Header) + (n + 1) * sizeof(int) + sizeof(int) - 1;
+  for (size_t offset :
+       {offsetof(Header, M) + 3, offsetof(Header, maxM0) + 3,
+        offsetof(Header, entryPoint) + 3, offsetof(Header, maxLevel) + 3,
+        sizeof(Header) + 3, firstLink}) {
+    index.writeToFile(name);
+    testing::flipByte(name, offset);
+    CHECK(testing::exitsWithError(load));
+  }
+  index.writeToFile(name);
+  boost::filesystem::resize_file(name, testing::fileSize(name) - 1);
+  CHECK(testing::exitsWithError(load));
+  boost::filesystem::remove(name);
+}
+
+int main() {
+  roundTrip<float>(100, 352);
+  roundTrip<int8_t>(37, 33);
+  roundTrip<float>(0, 0);
+
+  const auto arena = makeArena<float>(10, 16, 0);
+  const std::string name = testing::tempName();
+  auto write = [&] {
+    std::ofstream out(name, std::ios::out | std::ios::binary);
+    arena.writeToFile(out);
+  };
+  auto load = [&] {
+    voxel::DescriptorArena<float> loaded;
+    loaded.mapFromFile(name);
+  };
+  write();
+  CHECK(testing::exitsWithError([&] {
+    voxel::DescriptorArena<int8_t> wrongType;
+    wrongType.mapFromFile(name);
+  }));
+  boost::filesystem::resize_file(name, testing::fileSize(name) - 1);
+  CHECK(testing::exitsWithError(load));
+  // NB: The arena has no checksum, so only its header can be checked
+  write();
+  testing::flipByte(name, 0);
+  CHECK(testing::exitsWithError(load));
+  boost::filesystem::remove(name);
+
+  checkIndex();
+  return testing::failures();
+}
@@ -0,0 +1,134 @@
+/**
+  Round trips place::Panorama through the container, with and without the
+  sizes and angles of the keypoints, and through the older image and data
+  files, and checks that a file that isn't a container is rejected
+*/
+#include "testing.hpp"
+
+#include <scan_typedefs.hpp>
+
+#include <cstddef>
+#include <cstring>
+#include <random>
+
+static place::Panorama makePanorama() {
+  std::mt19937 gen(7);
+  place::Panorama pano;
+  const int rows = 120, cols = 250;
+  // NB: imread returns three channels, so the image has three to make
+  // the older files round trip exactly
+  pano.imgs[0] = cv::Mat(rows, cols, CV_8UC3, cv::Scalar::all(0));
+  for (int j = 0; j < rows; ++j) {
+    uchar *dst = pano.imgs[0].ptr<uchar>(j);
+    for (int i = 0; i < 3 * cols; ++i)
+      dst[i] = gen() % 256;
+  }
+  pano.rMap = Eigen::RowMatrixXf::Random(rows, cols);
+  pano.surfaceNormals.resize(rows, cols);
+  for (int i = 0; i < pano.surfaceNormals.size(); ++i)
+    pano.surfaceNormals.data()[i] = Eigen::Vector3f::Random();
+  for (int i = 0; i < 50; ++i) {
+    pano.keypoints.emplace_back(gen() % cols, gen() % rows);
+    pano.keypointSizes.push_back(1.5f + gen() % 20);
+    pano.keypointAngles.push_back(gen() % 3600 / 10.0f);
+  }
+  pano.floorCoord = -1.55;
+  return pano;
+}
+
+static bool sameImage(const cv::Mat &a, const cv::Mat &b) {
+  if (a.rows != b.rows || a.cols != b.cols || a.type() != b.type())
+    return false;
+  for (int j = 0; j < a.rows; ++j)
+    if (std::memcmp(a.ptr<uchar>(j), b.ptr<uchar>(j), a.cols * a.elemSize()))
+      return false;
+  return true;
+}
+
+static bool sameKeypoints(const std::vector<cv::Point2f> &a,
+                          const std::vector<cv::Point2f> &b) {
+  if (a.size() != b.size())
+    return false;
+  for (size_t i = 0; i < a.size(); ++i)
+    if (a[i].x != b[i].x || a[i].y != b[i].y)
+      return false;
+  return true;
+}
+
+static bool sameData(const place::Panorama &a, const place::Panorama &b) {
+  return a.rMap == b.rMap &&
+         (a.surfaceNormals.rows() == b.surfaceNormals.rows() &&
+          a.surfaceNormals.cols() == b.surfaceNormals.cols() &&
+          std::memcmp(a.surfaceNormals.data(), b.surfaceNormals.data(),
+                      sizeof(Eigen::Vector3f) * a.surfaceNormals.size()) ==
+              0) &&
+         sameKeypoints(a.keypoints, b.keypoints) &&
+         a.floorCoord == b.floorCoord;
+}
+
+int main() {
+  place::Panorama pano = makePanorama();
+
+  const std::string name = testing::tempName() + ".dat";
+  pano.writeToFile(name);
+  place::Panorama container;
+  container.loadFromFile(name);
+  CHECK(sameData(pano, container));
+  CHECK(container.keypointSizes == pano.keypointSizes &&
+        container.keypointAngles == pano.keypointAngles);
+  CHECK(static_cast<int>(container.imgs.size()) == place::Panorama::NumLevels);
+  bool sameLevels = container.imgs.size() == pano.imgs.size();
+  for (int n = 0; sameLevels && n < place::Panorama::NumLevels; ++n)
+    sameLevels = sameImage(pano[n], container[n]);
+  CHECK(sameLevels);
+  CHECK(container[place::Panorama::NumLevels].empty());
+
+  const std::string imgName = testing::tempName() + ".png",
+                    dataName = testing::tempName() + ".dat";
+  pano.writeToFile(imgName, dataName);
+  place::Panorama legacy;
+  legacy.loadFromFile(imgName, dataName);
+  CHECK(sameData(pano, legacy));
+  CHECK(legacy.keypointSizes.empty() && legacy.keypointAngles.empty());
+  CHECK(sameImage(pano[0], legacy[0]));
+  CHECK(static_cast<int>(legacy.imgs.size()) == place::Panorama::NumLevels);
+
+  // NB: Containers saved before the sizes and angles still load
+  place::Panorama positions = pano;
+  positions.keypointSizes.clear();
+  positions.keypointAngles.clear();
+  positions.writeToFile(name);
+  container.loadFromFile(name);
+  CHECK(sameData(pano, container));
+  CHECK(container.keypointSizes.empty() && container.keypointAngles.empty());
+
+  // NB: The container has no checksum, so only its header can be checked
+  testing::flipByte(name, 0);
+  CHECK(testing::exitsWithError([&] {
+    place::Panorama loaded;
+    loaded.loadFromFile(name);
+  }));
+  pano.writeToFile(name);
+  boost::filesystem::resize_file(name, testing::fileSize(name) - 1);
+  CHECK(testing::exitsWithError([&] {
+    place::Panorama loaded;
+    loaded.loadFromFile(name);
+  }));
+
+  // NB: The second byte of cols makes a row longer than its step, for a
+  // level of the pyramid and for rMap
+  typedef place::PanoramaHeader::Section Section;
+  for (auto offset : {sizeof(place::PanoramaHeader),
+                      offsetof(place::PanoramaHeader, rMap)}) {
+    pano.writeToFile(name);
+    testing::flipByte(name, offset + offsetof(Section, cols) + 1);
+    CHECK(testing::exitsWithError([&] {
+      place::Panorama loaded;
+      loaded.loadFromFile(name);
+    }));
+  }
+
+  for (auto &n : {name, imgName, dataName})
+    boost::filesystem::remove(n);
+  return testing::failures();
+}
@@ -0,0 +1,202 @@
+/**
+  Round trips scan::ScanFileWriter and scan::ScanFile, raw and compressed,
+  reads and converts the older per-point record format, and checks that a
+  truncated or corrupt scan is rejected
+*/
+#include "testing.hpp"
+
+#include <ScanFile.hpp>
+
+#include <cmath>
+#include <random>
+
+/* Points of a columns by rows scan.  Every seventh one is at the origin,
+ * which is how a missing return is stored */
+static std::vector<scan::PointXYZRGBA> makePoints(int columns, int rows,
+                                                  int seed) {
+  std::mt19937 gen(seed);
+  std::uniform_real_distribution<float> coord(-20, 20), unit(0, 1);
+  std::vector<scan::PointXYZRGBA> points(columns * rows);
+  for (size_t k = 0; k < points.size(); ++k) {
+    auto &p = points[k];
+    p.point = k % 7 ? Eigen::Vector3f(coord(gen), coord(gen), coord(gen))
+                    : Eigen::Vector3f::Zero();
+    p.intensity = unit(gen);
+    for (auto &c : p.rgb)
+      c = gen() % 256;
+  }
+  return points;
+}
+
+/* The format binary scans were written in before ScanFile */
+static void writeLegacy(const std::string &name, int columns, int rows,
+                        std::vector<scan::PointXYZRGBA> &points) {
+  std::ofstream out(name, std::ios::out | std::ios::binary);
+  out.write(reinterpret_cast<const char *>(&columns), sizeof(columns));
+  out.write(reinterpret_cast<const char *>(&rows), sizeof(rows));
+  for (auto &p : points)
+    p.writeToFile(out);
+}
+
+static bool sameBounds(const scan::ScanFile &file,
+                       const std::vector<scan::PointXYZRGBA> &points) {
+  Eigen::Vector3f min = Eigen::Vector3f::Constant(1e10),
+                  max = Eigen::Vector3f::Constant(-1e10);
+  for (auto &p : points) {
+    if (p.point.isZero())
+      continue;
+    min = min.cwiseMin(p.point);
+    max = max.cwiseMax(p.point);
+  }
+  return file.getMin() == min && file.getMax() == max;
+}
+
+/* Whether file holds points exactly */
+static bool samePoints(const scan::ScanFile &file, int columns, int rows,
+                       const std::vector<scan::PointXYZRGBA> &points) {
+  if (file.getColumns() != columns || file.getRows() != rows ||
+      file.size() != points.size() || !sameBounds(file, points))
+    return false;
+  for (size_t k = 0; k < points.size(); ++k)
+    if (file.point(k) != points[k].point ||
+        file.intensity()[k] != points[k].intensity ||
+        std::memcmp(file.rgb(k), points[k].rgb, 3))
+      return false;
+
+  // NB: The AoS gather has to agree with the arrays
+  std::vector<scan::PointXYZRGBA> gathered;
+  file.toPoints(gathered);
+  for (size_t k = 0; k < points.size(); ++k)
+    if (gathered[k].point != points[k].point ||
+        gathered[k].intensity != points[k].intensity)
+      return false;
+  return true;
+}
+
+static void checkRaw() {
+  const int columns = 37, rows = 211;
+  auto points = makePoints(columns, rows, 1);
+
+  const std::string name = testing::tempName();
+  scan::ScanFileWriter::write(name, columns, rows, points);
+  CHECK(scan::ScanFile::isScanFile(name));
+  CHECK(samePoints(scan::ScanFile(name), columns, rows, points));
+
+  // NB: Appended in uneven blocks, the way the preprocessor streams a scan
+  {
+    scan::ScanFileWriter writer(name, columns, rows);
+    for (size_t first = 0; first < points.size(); first += 1000)
+      writer.append(points.data() + first,
+                    std::min<size_t>(1000, points.size() - first));
+    writer.close();
+  }
+  CHECK(samePoints(scan::ScanFile(name), columns, rows, points));
+
+  boost::filesystem::resize_file(name, testing::fileSize(name) - 1);
+  CHECK(testing::exitsWithError([&] { scan::ScanFile file(name); }));
+  boost::filesystem::remove(name);
+}
+
+/* Whether file holds points to within half a quantization step.  Colours
+ * aren't quantized */
+static bool closePoints(const scan::ScanFile &file, int columns, int rows,
+                        const std::vector<scan::PointXYZRGBA> &points,
+                        double precision) {
+  if (file.getColumns() != columns || file.getRows() != rows ||
+      file.size() != points.size() || !sameBounds(file, points))
+    return false;
+  for (size_t k = 0; k < points.size(); ++k)
+    if ((file.point(k) - points[k].point).cwiseAbs().maxCoeff() >
+            0.5 * precision + 1e-5 ||
+        std::abs(file.intensity()[k] - points[k].intensity) > 1e-5 ||
+        std::memcmp(file.rgb(k), points[k].rgb, 3))
+      return false;
+  return true;
+}
+
+static void checkCompressed() {
+  // NB: 2.5 blocks, so the last block is partial
+  const int columns = 101,
+            rows = 5 * scan::ScanFileHeader::kBlockSize / (2 * columns);
+  const double precision = 0.0005;
+  auto points = makePoints(columns, rows, 3);
+
+  const std::string name = testing::tempName();
+  scan::ScanFileWriter::write(name, columns, rows, points, precision);
+  CHECK(closePoints(scan::ScanFile(name), columns, rows, points, precision));
+
+  // NB: Past 2^30 steps either way, next to each other so that the delta
+  // between them wraps around
+  const double limit = static_cast<float>(precision) * (1 << 30);
+  points[1].point = Eigen::Vector3f(2 * limit, -2 * limit, 1);
+  points[2].point = Eigen::Vector3f(-2 * limit, 2 * limit, 1);
+  points[3].point = Eigen::Vector3f(NAN, 0.25, 1);
+  scan::ScanFileWriter::write(name, columns, rows, points, precision);
+  {
+    scan::ScanFile file(name);
+    const float hi = limit, lo = -limit;
+    CHECK(file.point(1) == Eigen::Vector3f(hi, lo, 1));
+    CHECK(file.point(2) == Eigen::Vector3f(lo, hi, 1));
+    CHECK(file.point(3)[0] == 0);
+    // NB: Everything after the clamped values is still right
+    bool same = true;
+    for (size_t k = 4; k < points.size(); ++k)
+      same &= (file.point(k) - points[k].point).cwiseAbs().maxCoeff() <=
+              0.5 * precision + 1e-5;
+    CHECK(same);
+  }
+
+  points = makePoints(columns, rows, 4);
+  scan::ScanFileWriter::write(name, columns, rows, points, precision);
+  scan::ScanFileHeader header;
+  uint64_t firstBlock;
+  {
+    std::ifstream in(name, std::ios::in | std::ios::binary);
+    in.read(reinterpret_cast<char *>(&header), sizeof(header));
+    in.seekg(header.blockIndexOffset);
+    in.read(reinterpret_cast<char *>(&firstBlock), sizeof(firstBlock));
+  }
+  CHECK(header.compressed() && header.numBlocks == 3);
+
+  // NB: The high byte of the offset of the second block puts it far past
+  // the end of the file
+  testing::flipByte(name, header.blockIndexOffset + 2 * sizeof(uint64_t) - 1);
+  CHECK(testing::exitsWithError([&] { scan::ScanFile file(name); }));
+
+  scan::ScanFileWriter::write(name, columns, rows, points, precision);
+  // NB: The bits per value of the first group of the first block, which
+  // goes over 32
+  testing::flipByte(name, firstBlock);
+  CHECK(testing::exitsWithError([&] { scan::ScanFile file(name); }));
+
+  scan::ScanFileWriter::write(name, columns, rows, points, precision);
+  boost::filesystem::resize_file(name, testing::fileSize(name) - 1);
+  CHECK(testing::exitsWithError([&] { scan::ScanFile file(name); }));
+  boost::filesystem::remove(name);
+}
+
+static void checkLegacy() {
+  const int columns = 50, rows = 31;
+  auto points = makePoints(columns, rows, 2);
+
+  const std::string name = testing::tempName();
+  writeLegacy(name, columns, rows, points);
+  CHECK(!scan::ScanFile::isScanFile(name));
+  CHECK(samePoints(scan::ScanFile(name), columns, rows, points));
+
+  scan::ScanFile::convertLegacy(name, name);
+  CHECK(scan::ScanFile::isScanFile(name));
+  CHECK(samePoints(scan::ScanFile(name), columns, rows, points));
+
+  writeLegacy(name, columns, rows, points);
+  boost::filesystem::resize_file(name, testing::fileSize(name) - 1);
+  CHECK(testing::exitsWithError([&] { scan::ScanFile file(name); }));
+  boost::filesystem::remove(name);
+}
+
+int main() {
+  checkRaw();
+  checkCompressed();
+  checkLegacy();
+  return testing::failures();
+}
@@ -0,0 +1,99 @@
+/**
+  Round trips saveMatrixAsSparse and loadMatrixFromSparse, reads the
+  older format of (index, value) pairs, and checks that a corrupt matrix
+  is rejected
+*/
+#include "testing.hpp"
+
+#include <scan_typedefs.hpp>
+
+#include <random>
+
+/* The format saveMatrixAsSparse wrote before matrices were tiled */
+template <typename MatrixType>
+static void saveOldFormat(const MatrixType &mat, std::ofstream &out) {
+  typedef typename MatrixType::Scalar Scalar;
+  int numNonZeros = 0, rows = mat.rows(), cols = mat.cols();
+  const Scalar *dataPtr = mat.data();
+  for (int i = 0; i < mat.size(); ++i)
+    if (dataPtr[i])
+      ++numNonZeros;
+
+  out.write(reinterpret_cast<const char *>(&numNonZeros), sizeof(numNonZeros));
+  out.write(reinterpret_cast<const char *>(&rows), sizeof(rows));
+  out.write(reinterpret_cast<const char *>(&cols), sizeof(cols));
+  for (int i = 0; i < mat.size(); ++i) {
+    if (dataPtr[i]) {
+      out.write(reinterpret_cast<const char *>(&i), sizeof(i));
+      out.write(reinterpret_cast<const char *>(dataPtr + i), sizeof(Scalar));
+    }
+  }
+}
+
+/* A matrix with long runs in some tiles, scattered entries in others and
+ * empty tiles, so that both codings are used.  cols isn't a multiple of
+ * sparseTileCols */
+template <typename MatrixType> static MatrixType makeMatrix(int seed) {
+  typedef typename MatrixType::Scalar Scalar;
+  std::mt19937 gen(seed);
+  const int rows = 37, cols = 3 * sparseTileCols + 11;
+  MatrixType mat = MatrixType::Zero(rows, cols);
+  for (int i = 0; i < sparseTileCols; ++i)
+    for (int j = 5; j < 30; ++j)
+      mat(j, i) = static_cast<Scalar>(1 + gen() % 100);
+  for (int n = 0; n < 400; ++n) {
+    const int j = gen() % rows,
+              i = 2 * sparseTileCols + gen() % (cols - 2 * sparseTileCols);
+    mat(j, i) = static_cast<Scalar>(1 + gen() % 100);
+  }
+  return mat;
+}
+
+template <typename MatrixType>
+static void roundTrip(const MatrixType &mat, bool oldFormat) {
+  const std::string name = testing::tempName();
+  std::ofstream out(name, std::ios::out | std::ios::binary);
+  if (oldFormat)
+    saveOldFormat(mat, out);
+  else
+    saveMatrixAsSparse(mat, out);
+  // NB: Two in a row, to check that the first stops where it should
+  saveMatrixAsSparse(mat, out);
+  out.close();
+
+  MatrixType first, second;
+  std::ifstream in(name, std::ios::in | std::ios::binary);
+  loadMatrixFromSparse(first, in);
+  loadMatrixFromSparse(second, in);
+  CHECK(first == mat);
+  CHECK(second == mat);
+  CHECK(in.peek() == EOF);
+  in.close();
+  boost::filesystem::remove(name);
+}
+
+int main() {
+  roundTrip(makeMatrix<Eigen::MatrixXb>(1), false);
+  roundTrip(makeMatrix<Eigen::MatrixXi>(2), false);
+  roundTrip(makeMatrix<Eigen::MatrixXf>(3), false);
+  roundTrip(makeMatrix<Eigen::MatrixXb>(4), true);
+  roundTrip(makeMatrix<Eigen::MatrixXi>(5), true);
+  roundTrip(Eigen::MatrixXi::Zero(10, 10).eval(), false);
+  roundTrip(Eigen::MatrixXi::Ones(3, 200).eval(), false);
+
+  // NB: The last byte is always a value of the last tile
+  const Eigen::MatrixXi mat = makeMatrix<Eigen::MatrixXi>(6);
+  const std::string name = testing::tempName();
+  std::ofstream out(name, std::ios::out | std::ios::binary);
+  saveMatrixAsSparse(mat, out);
+  out.close();
+  testing::flipByte(name, testing::fileSize(name) - 1);
+  CHECK(testing::exitsWithError([&] {
+    Eigen::MatrixXi loaded;
+    std::ifstream in(name, std::ios::in | std::ios::binary);
+    loadMatrixFromSparse(loaded, in);
+  }));
+  boost::filesystem::remove(name);
+
+  return testing::failures();
+}
@@ -0,0 +1,73 @@
+#pragma once
+#ifndef TESTING_HPP
+#define TESTING_HPP
+
+#include <boost/filesystem.hpp>
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/**
+  What the tests have in common.  A failed CHECK is reported and counted,
+  and main returns the number of failures, so ctest sees any of them
+*/
+namespace testing {
+inline int &failures() {
+  static int count = 0;
+  return count;
+}
+
+/* A name in the temporary folder that no other file has */
+inline std::string tempName() {
+  return (boost::filesystem::temp_directory_path() /
+          boost::filesystem::unique_path())
+      .string();
+}
+
+/* Whether func exits with status 1 in a child process, which is how a
+ * loader rejects a file */
+template <typename Func> bool exitsWithError(Func func) {
+  std::cout.flush();
+  const pid_t pid = fork();
+  if (pid == 0) {
+    // NB: Whatever the loader prints about the file is expected
+    if (!std::freopen("/dev/null", "w", stdout))
+      _exit(2);
+    func();
+    _exit(0);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 1;
+}
+
+/* Flips every bit of the byte at offset in name */
+inline void flipByte(const std::string &name, std::streamoff offset) {
+  std::fstream file(name, std::ios::in | std::ios::out | std::ios::binary);
+  file.seekg(offset);
+  char c;
+  file.read(&c, 1);
+  c = ~c;
+  file.seekp(offset);
+  file.write(&c, 1);
+}
+
+inline std::streamoff fileSize(const std::string &name) {
+  return boost::filesystem::file_size(name);
+}
+} // testing
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      std::cout << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed"  \
+                << std::endl;                                                  \
+      ++testing::failures();                                                   \
+    }                                                                          \
+  } while (0)
+
+#endif // TESTING_HPP
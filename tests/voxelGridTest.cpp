@@ -0,0 +1,144 @@
+/**
+  Checks the bit operations of place::VoxelGrid against a voxel by voxel
+  reference, round trips it through both file formats, and checks that a
+  corrupt grid is rejected
+*/
+#include "testing.hpp"
+
+#include <scan_typedefs.hpp>
+
+#include <random>
+
+/* Voxel by voxel copy of grid, one byte per voxel as slices of (y, x) */
+static std::vector<Eigen::MatrixXb> toSlices(const place::VoxelGrid &grid) {
+  std::vector<Eigen::MatrixXb> slices(grid.z,
+                                      Eigen::MatrixXb::Zero(grid.y, grid.x));
+  for (int k = 0; k < grid.z; ++k)
+    for (int j = 0; j < grid.y; ++j)
+      for (int i = 0; i < grid.x; ++i)
+        slices[k](j, i) = grid(i, j, k);
+  return slices;
+}
+
+static place::VoxelGrid makeGrid(int x, int y, int z, double density,
+                                 int seed) {
+  std::mt19937 gen(seed);
+  std::bernoulli_distribution occupied(density);
+  place::VoxelGrid grid(x, y, z);
+  for (int k = 0; k < z; ++k)
+    for (int j = 0; j < y; ++j)
+      for (int i = 0; i < x; ++i)
+        if (occupied(gen))
+          grid.set(i, j, k);
+  grid.zZ = Eigen::Vector3i(3, -4, 5);
+  grid.c = grid.count();
+  return grid;
+}
+
+static bool sameGrid(const place::VoxelGrid &a, const place::VoxelGrid &b) {
+  return a.x == b.x && a.y == b.y && a.z == b.z && a.bits == b.bits &&
+         a.zZ == b.zZ && a.c == b.c;
+}
+
+static void checkBits() {
+  // NB: 130 voxels along x leaves part of the last word of every row unused
+  const place::VoxelGrid a = makeGrid(130, 7, 5, 0.3, 1),
+                         b = makeGrid(130, 7, 5, 0.5, 2);
+  const auto sa = toSlices(a), sb = toSlices(b);
+
+  size_t count = 0, both = 0, onlyA = 0;
+  for (int k = 0; k < a.z; ++k) {
+    size_t slice = 0;
+    for (int j = 0; j < a.y; ++j)
+      for (int i = 0; i < a.x; ++i) {
+        slice += sa[k](j, i);
+        both += sa[k](j, i) && sb[k](j, i);
+        onlyA += sa[k](j, i) && !sb[k](j, i);
+      }
+    CHECK(a.count(k) == slice);
+    count += slice;
+  }
+  CHECK(a.count() == count);
+  CHECK(a.countAnd(b) == both);
+  CHECK(a.countAndNot(b) == onlyA);
+
+  for (int i : {-70, -64, -5, 0, 1, 63, 64, 100, 129, 130}) {
+    uint64_t expected = 0;
+    for (int bit = 0; bit < 64; ++bit)
+      if (i + bit >= 0 && i + bit < a.x && sa[2](3, i + bit))
+        expected |= uint64_t(1) << bit;
+    CHECK(a.word(i, 3, 2) == expected);
+  }
+  CHECK(a.word(0, -1, 0) == 0);
+  CHECK(a.word(0, 0, a.z) == 0);
+
+  // NB: The second block runs past the end of the grid along every axis
+  for (auto &box : {Eigen::Vector3i(60, 2, 1), Eigen::Vector3i(100, 5, 3)}) {
+    const place::VoxelGrid block = a.block(box[0], box[1], box[2], 50, 4, 3);
+    CHECK(block.x == 50 && block.y == 4 && block.z == 3);
+    bool same = true;
+    for (int k = 0; k < block.z; ++k)
+      for (int j = 0; j < block.y; ++j)
+        for (int i = 0; i < block.x; ++i) {
+          const Eigen::Vector3i v = box + Eigen::Vector3i(i, j, k);
+          const bool inside = v[0] < a.x && v[1] < a.y && v[2] < a.z;
+          same &= block(i, j, k) == (inside && a(v[0], v[1], v[2]));
+        }
+    CHECK(same);
+  }
+}
+
+static void checkFiles() {
+  const place::VoxelGrid grid = makeGrid(100, 20, 6, 0.2, 3);
+
+  const std::string name = testing::tempName();
+  std::ofstream out(name, std::ios::out | std::ios::binary);
+  place::VoxelGrid(grid).writeToFile(out);
+  // NB: The older format: the number of slices, every slice as a sparse
+  // matrix, then zZ and c
+  const auto slices = toSlices(grid);
+  const int numZ = slices.size();
+  out.write(reinterpret_cast<const char *>(&numZ), sizeof(numZ));
+  for (auto &s : slices) {
+    int numNonZeros = 0, rows = s.rows(), cols = s.cols();
+    for (int i = 0; i < s.size(); ++i)
+      numNonZeros += s.data()[i] != 0;
+    out.write(reinterpret_cast<const char *>(&numNonZeros),
+              sizeof(numNonZeros));
+    out.write(reinterpret_cast<const char *>(&rows), sizeof(rows));
+    out.write(reinterpret_cast<const char *>(&cols), sizeof(cols));
+    for (int i = 0; i < s.size(); ++i) {
+      if (s.data()[i]) {
+        out.write(reinterpret_cast<const char *>(&i), sizeof(i));
+        out.write(s.data() + i, 1);
+      }
+    }
+  }
+  out.write(reinterpret_cast<const char *>(grid.zZ.data()), sizeof(grid.zZ));
+  out.write(reinterpret_cast<const char *>(&grid.c), sizeof(grid.c));
+  out.close();
+
+  place::VoxelGrid current, old;
+  std::ifstream in(name, std::ios::in | std::ios::binary);
+  current.loadFromFile(in);
+  old.loadFromFile(in);
+  CHECK(sameGrid(current, grid));
+  CHECK(sameGrid(old, grid));
+  CHECK(in.peek() == EOF);
+  in.close();
+
+  // NB: The bits start after the marker, the dimensions and the checksum
+  testing::flipByte(name, 4 * sizeof(int) + sizeof(uint64_t) + 10);
+  CHECK(testing::exitsWithError([&] {
+    place::VoxelGrid loaded;
+    std::ifstream in(name, std::ios::in | std::ios::binary);
+    loaded.loadFromFile(in);
+  }));
+  boost::filesystem::remove(name);
+}
+
+int main() {
+  checkBits();
+  checkFiles();
+  return testing::failures();
+}